@@ -29,60 +29,55 @@
 #include "ship.h"
 #include "ship_packets.h"
 #include "utils.h"
+#include "gcindex.h"
+
+/* The state of a /refresh quests running in the background. Only one of them
+   is allowed at a time. */
+static pthread_mutex_t qrefresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t qrefresh_thd;
+static int qrefresh_running = 0;
+static int qrefresh_joinable = 0;
+
+typedef struct qrefresh_req {
+    uint32_t guildcard;
+    msgfunc f;
+} qrefresh_req_t;
 
 int kill_guildcard(ship_client_t *c, uint32_t gc, const char *reason) {
-    block_t *b;
     ship_client_t *i;
-    int j;
 
     /* Make sure we don't have anyone trying to escalate their privileges. */
     if(!LOCAL_GM(c)) {
         return -1;
     }
 
-    /* Look through all the blocks for the requested user, and kick the first
-       instance we happen to find (there shouldn't be more than one). */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        b = ship->blocks[j];
-
-        if(b && b->run) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            /* Look for the requested user */
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                pthread_mutex_lock(&i->mutex);
-
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(c->privilege <= i->privilege) {
-                        pthread_mutex_unlock(&i->mutex);
-                        pthread_rwlock_unlock(&b->lock);
-                        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
-                    }
-
-                    if(reason) {
-                        send_message_box(i, "%s\n\n%s\n%s",
-                                         __(i, "\tEYou have been kicked by a "
-                                            "GM."),
-                                         __(i, "Reason:"), reason);
-                    }
-                    else {
-                        send_message_box(i, "%s",
-                                         __(i, "\tEYou have been kicked by a "
-                                            "GM."));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                    pthread_mutex_unlock(&i->mutex);
-                    pthread_rwlock_unlock(&b->lock);
-                    return 0;
-                }
+    /* Look for the requested user, and kick them if they're on the ship. */
+    if((i = gcindex_find(gc))) {
+        pthread_mutex_lock(&i->mutex);
 
-                pthread_mutex_unlock(&i->mutex);
-            }
+        if(c->privilege <= i->privilege) {
+            pthread_mutex_unlock(&i->mutex);
+            gcindex_release(gc);
+            return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+        }
 
-            pthread_rwlock_unlock(&b->lock);
+        if(reason) {
+            send_message_box(i, "%s\n\n%s\n%s",
+                             __(i, "\tEYou have been kicked by a "
+                                "GM."),
+                             __(i, "Reason:"), reason);
+        }
+        else {
+            send_message_box(i, "%s",
+                             __(i, "\tEYou have been kicked by a "
+                                "GM."));
         }
+
+        i->flags |= CLIENT_FLAG_DISCONNECTED;
+        block_wake(i->cur_block);
+        pthread_mutex_unlock(&i->mutex);
+        gcindex_release(gc);
+        return 0;
     }
 
     /* If the requester is a global GM, forward the request to the shipgate,
@@ -100,7 +95,7 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
     int i, j;
     char fn[512];
 
-    TAILQ_INIT(&qmap);
+    quest_map_init(&qmap);
 
     /* Read the quest files in... */
     if(cfg->quests_dir && cfg->quests_dir[0]) {
@@ -122,6 +117,12 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
             }
         }
 
+        /* Build the map cache before taking the lock, since it's by far the
+           slowest part of this and nobody can be looking at the new lists
+           yet anyway. */
+        if(quest_cache_maps(&qmap, qlist, cfg->quests_dir))
+            debug(DBG_WARN, "Unable to build quest map cache!\n");
+
         /* Lock the mutex to prevent anyone from trying anything funny. */
         pthread_rwlock_wrlock(&s->qlock);
 
@@ -147,10 +148,6 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
 
         s->qmap = qmap;
 
-        /* XXXX: Hopefully this doesn't fail... >_> */
-        if(quest_cache_maps(s, &s->qmap, cfg->quests_dir))
-            debug(DBG_WARN, "Unable to build quest map cache!\n");
-
         /* Unlock the lock, we're done. */
         pthread_rwlock_unlock(&s->qlock);
 
@@ -165,6 +162,17 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
 void clean_quests(ship_t *s) {
     int i, j;
 
+    /* Don't pull the lists out from under a refresh that's still going. */
+    pthread_mutex_lock(&qrefresh_lock);
+
+    if(qrefresh_joinable) {
+        pthread_join(qrefresh_thd, NULL);
+        qrefresh_joinable = 0;
+        qrefresh_running = 0;
+    }
+
+    pthread_mutex_unlock(&qrefresh_lock);
+
     for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
         for(j = 0; j < CLIENT_LANG_COUNT; ++j) {
             sylverant_quests_destroy(&s->qlist[i][j]);
@@ -174,15 +182,82 @@ void clean_quests(ship_t *s) {
     quest_cleanup(&s->qmap);
 }
 
+static void *qrefresh_thd_func(void *d) {
+    qrefresh_req_t *req = (qrefresh_req_t *)d;
+    ship_client_t *c;
+    int rv;
+
+    rv = load_quests(ship, ship->cfg, 0);
+
+    /* Let the GM that asked for this know how it went, if they're still
+       around to hear about it. */
+    if((c = gcindex_find(req->guildcard))) {
+        pthread_mutex_lock(&c->mutex);
+
+        if(!rv)
+            req->f(c, "%s", __(c, "\tE\tC7Updated quests."));
+        else
+            req->f(c, "%s", __(c, "\tE\tC7No quests configured."));
+
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(req->guildcard);
+    }
+
+    free(req);
+
+    pthread_mutex_lock(&qrefresh_lock);
+    qrefresh_running = 0;
+    pthread_mutex_unlock(&qrefresh_lock);
+
+    return NULL;
+}
+
 int refresh_quests(ship_client_t *c, msgfunc f) {
+    qrefresh_req_t *req;
+
     /* Make sure we don't have anyone trying to escalate their privileges. */
     if(!LOCAL_GM(c))
         return -1;
 
-    if(!load_quests(ship, ship->cfg, 0))
-        return f(c, "%s", __(c, "\tE\tC7Updated quests."));
-    else
-        return f(c, "%s", __(c, "\tE\tC7No quests configured."));
+    pthread_mutex_lock(&qrefresh_lock);
+
+    if(qrefresh_running) {
+        pthread_mutex_unlock(&qrefresh_lock);
+        return f(c, "%s", __(c, "\tE\tC7Quests are already being "
+                             "refreshed."));
+    }
+
+    /* Clean up after the last refresh, if there was one. */
+    if(qrefresh_joinable) {
+        pthread_join(qrefresh_thd, NULL);
+        qrefresh_joinable = 0;
+    }
+
+    if(!(req = (qrefresh_req_t *)malloc(sizeof(qrefresh_req_t)))) {
+        pthread_mutex_unlock(&qrefresh_lock);
+        debug(DBG_ERROR, "Cannot allocate quest refresh: %s\n",
+              strerror(errno));
+        return f(c, "%s", __(c, "\tE\tC7Couldn't refresh quests."));
+    }
+
+    req->guildcard = c->guildcard;
+    req->f = f;
+
+    /* Reading the quests and rebuilding the map cache can take a while, so do
+       it in the background. The new lists are swapped in once they're ready,
+       and the old ones stay in use until then. */
+    if(pthread_create(&qrefresh_thd, NULL, &qrefresh_thd_func, req)) {
+        pthread_mutex_unlock(&qrefresh_lock);
+        debug(DBG_ERROR, "Cannot start quest refresh thread\n");
+        free(req);
+        return f(c, "%s", __(c, "\tE\tC7Couldn't refresh quests."));
+    }
+
+    qrefresh_running = 1;
+    qrefresh_joinable = 1;
+    pthread_mutex_unlock(&qrefresh_lock);
+
+    return f(c, "%s", __(c, "\tE\tC7Refreshing quests..."));
 }
 
 int refresh_gms(ship_client_t *c, msgfunc f) {
@@ -395,9 +470,7 @@ int schedule_shutdown(ship_client_t *c, uint32_t when, int restart, msgfunc f) {
 
 int global_ban(ship_client_t *c, uint32_t gc, uint32_t l, const char *reason) {
     const char *len = NULL;
-    block_t *b;
     ship_client_t *i;
-    int j;
 
     /* Make sure we don't have anyone trying to escalate their privileges. */
     if(!GLOBAL_GM(c)) {
@@ -410,86 +483,71 @@ int global_ban(ship_client_t *c, uint32_t gc, uint32_t l, const char *reason) {
         return send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
     }
 
-    /* Look through all the blocks for the requested user, and kick the first
-       instance we happen to find, if any (there shouldn't be more than one). */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        b = ship->blocks[j];
-
-        if(b && b->run) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    pthread_mutex_lock(&i->mutex);
-
-                    /* Make sure we're not trying something dirty (the gate
-                       should also have blocked the ban if this happens, in
-                       most cases anyway) */
-                    if(c->privilege <= i->privilege) {
-                        pthread_mutex_unlock(&i->mutex);
-                        pthread_rwlock_unlock(&b->lock);
-                        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
-                    }
-
-                    /* Handle the common cases... */
-                    switch(l) {
-                        case 0xFFFFFFFF:
-                            len = __(i, "Forever");
-                            break;
-
-                        case 2592000:
-                            len = __(i, "30 days");
-                            break;
+    /* Look for the requested user, and kick them if they're on the ship. */
+    if((i = gcindex_find(gc))) {
+        pthread_mutex_lock(&i->mutex);
+
+        /* Make sure we're not trying something dirty (the gate
+           should also have blocked the ban if this happens, in
+           most cases anyway) */
+        if(c->privilege <= i->privilege) {
+            pthread_mutex_unlock(&i->mutex);
+            gcindex_release(gc);
+            return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+        }
 
-                        case 604800:
-                            len = __(i, "1 week");
-                            break;
+        /* Handle the common cases... */
+        switch(l) {
+            case 0xFFFFFFFF:
+                len = __(i, "Forever");
+                break;
 
-                        case 86400:
-                            len = __(i, "1 day");
-                            break;
+            case 2592000:
+                len = __(i, "30 days");
+                break;
 
-                        /* Other cases just don't have a length on them... */
-                    }
+            case 604800:
+                len = __(i, "1 week");
+                break;
 
-                    /* Send the user a message telling them they're banned. */
-                    if(reason && len) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Ban Length:"),
-                                         len, __(i, "Reason:"), reason);
-                    }
-                    else if(len) {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Ban Length:"),
-                                         len);
-                    }
-                    else if(reason) {
-                        send_message_box(i, "%s\n%s\n%s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Reason:"), reason);
-                    }
-                    else {
-                        send_message_box(i, "%s", __(i, "\tEYou have been "
-                                                     "banned by a GM."));
-                    }
+            case 86400:
+                len = __(i, "1 day");
+                break;
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
+            /* Other cases just don't have a length on them... */
+        }
 
-                    /* The ban setter will get a message telling them the ban has been
-                       set (or an error happened). */
-                    pthread_mutex_unlock(&i->mutex);
-                    pthread_rwlock_unlock(&b->lock);
-                    return 0;
-                }
+        /* Send the user a message telling them they're banned. */
+        if(reason && len) {
+            send_message_box(i, "%s\n%s %s\n%s\n%s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Ban Length:"),
+                             len, __(i, "Reason:"), reason);
+        }
+        else if(len) {
+            send_message_box(i, "%s\n%s %s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Ban Length:"),
+                             len);
+        }
+        else if(reason) {
+            send_message_box(i, "%s\n%s\n%s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Reason:"), reason);
+        }
+        else {
+            send_message_box(i, "%s", __(i, "\tEYou have been "
+                                         "banned by a GM."));
+        }
 
-                pthread_mutex_unlock(&i->mutex);
-            }
+        i->flags |= CLIENT_FLAG_DISCONNECTED;
+        block_wake(i->cur_block);
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+        /* The ban setter will get a message telling them the ban has been
+           set (or an error happened). */
+        pthread_mutex_unlock(&i->mutex);
+        gcindex_release(gc);
+        return 0;
     }
 
     /* Since the requester is a global GM, forward the kick request to the
@@ -15,11 +15,14 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 
 #include <sys/socket.h>
 
@@ -51,34 +54,350 @@ static inline int eq_ip6(const struct sockaddr_in6 *ip1, const uint32_t ip2[4],
     return 0;
 }
 
-static int write_bans_list(ship_t *s) {
+struct ban_trie_node {
+    ban_trie_node_t *child[2];
+    ip_ban_t *bans;
+};
+
+static inline uint32_t gcban_hash(uint32_t gc) {
+    gc ^= gc >> 16;
+    gc *= 0x45D9F3B;
+    gc ^= gc >> 16;
+    return gc & (GCBAN_BUCKETS - 1);
+}
+
+static inline int addr_bit(const uint8_t *addr, int i) {
+    return (addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* Figure out how many leading bits a netmask covers, or return -1 if it has
+   holes in it. */
+static int mask_prefix(const uint8_t *mask, int bits) {
+    int i, len;
+
+    for(len = 0; len < bits && addr_bit(mask, len); ++len) {
+    }
+
+    for(i = len; i < bits; ++i) {
+        if(addr_bit(mask, i))
+            return -1;
+    }
+
+    return len;
+}
+
+static void heap_set(ban_index_t *x, int i, ban_expiry_t *e) {
+    x->heap[i] = *e;
+
+    if(e->ip)
+        ((ip_ban_t *)e->ban)->heap_idx = i;
+    else
+        ((guildcard_ban_t *)e->ban)->heap_idx = i;
+}
+
+static void heap_sift(ban_index_t *x, int i) {
+    ban_expiry_t e = x->heap[i];
+    int p, c;
+
+    /* Move it up as far as it needs to go... */
+    while(i > 0) {
+        p = (i - 1) >> 1;
+
+        if(x->heap[p].end_time <= e.end_time)
+            break;
+
+        heap_set(x, i, &x->heap[p]);
+        i = p;
+    }
+
+    /* ...and then down, if it didn't go anywhere. */
+    while((c = (i << 1) + 1) < x->heap_count) {
+        if(c + 1 < x->heap_count &&
+           x->heap[c + 1].end_time < x->heap[c].end_time)
+            ++c;
+
+        if(e.end_time <= x->heap[c].end_time)
+            break;
+
+        heap_set(x, i, &x->heap[c]);
+        i = c;
+    }
+
+    heap_set(x, i, &e);
+}
+
+static int heap_push(ban_index_t *x, time_t end_time, int ip, void *ban) {
+    ban_expiry_t e = { end_time, ip, ban };
+    ban_expiry_t *tmp;
+    int size;
+
+    if(x->heap_count == x->heap_size) {
+        size = x->heap_size ? x->heap_size * 2 : 64;
+
+        if(!(tmp = (ban_expiry_t *)realloc(x->heap,
+                                           size * sizeof(ban_expiry_t))))
+            return -1;
+
+        x->heap = tmp;
+        x->heap_size = size;
+    }
+
+    heap_set(x, x->heap_count++, &e);
+    heap_sift(x, x->heap_count - 1);
+    return 0;
+}
+
+static void heap_remove(ban_index_t *x, int i) {
+    if(i < 0)
+        return;
+
+    if(i != --x->heap_count) {
+        heap_set(x, i, &x->heap[x->heap_count]);
+        heap_sift(x, i);
+    }
+}
+
+static int trie_insert(ban_trie_node_t **root, ip_ban_t *ban) {
+    const uint8_t *addr = (const uint8_t *)ban->ip_addr;
+    ban_trie_node_t **n = root;
+    int i;
+
+    for(i = 0; ; ++i) {
+        if(!*n) {
+            if(!(*n = (ban_trie_node_t *)calloc(1, sizeof(ban_trie_node_t))))
+                return -1;
+        }
+
+        if(i == ban->prefix)
+            break;
+
+        n = &(*n)->child[addr_bit(addr, i)];
+    }
+
+    ban->tnext = (*n)->bans;
+    (*n)->bans = ban;
+    return 0;
+}
+
+static void trie_remove(ban_trie_node_t **root, ip_ban_t *ban) {
+    const uint8_t *addr = (const uint8_t *)ban->ip_addr;
+    ban_trie_node_t **path[129];
+    ban_trie_node_t **n = root;
+    ip_ban_t **j;
+    int i;
+
+    for(i = 0; *n; ++i) {
+        path[i] = n;
+
+        if(i == ban->prefix)
+            break;
+
+        n = &(*n)->child[addr_bit(addr, i)];
+    }
+
+    if(!*n)
+        return;
+
+    for(j = &(*n)->bans; *j; j = &(*j)->tnext) {
+        if(*j == ban) {
+            *j = ban->tnext;
+            break;
+        }
+    }
+
+    /* Get rid of any nodes that don't lead anywhere anymore. */
+    for(; i >= 0; --i) {
+        n = path[i];
+
+        if((*n)->bans || (*n)->child[0] || (*n)->child[1])
+            break;
+
+        free(*n);
+        *n = NULL;
+    }
+}
+
+static void trie_free(ban_trie_node_t *n) {
+    if(!n)
+        return;
+
+    trie_free(n->child[0]);
+    trie_free(n->child[1]);
+    free(n);
+}
+
+/* Find the most specific ban that's still in effect for the address. */
+static ip_ban_t *trie_lookup(ban_trie_node_t *n, const uint8_t *addr, int bits,
+                             time_t now) {
+    ip_ban_t *rv = NULL, *j;
+    int i;
+
+    for(i = 0; n; ++i) {
+        for(j = n->bans; j; j = j->tnext) {
+            if(j->end_time >= now || j->end_time == (time_t)-1) {
+                rv = j;
+                break;
+            }
+        }
+
+        if(i == bits)
+            break;
+
+        n = n->child[addr_bit(addr, i)];
+    }
+
+    return rv;
+}
+
+static int index_gc_ban(ban_index_t *x, guildcard_ban_t *ban) {
+    uint32_t h = gcban_hash(ban->banned_gc);
+
+    ban->heap_idx = -1;
+
+    if(ban->end_time != (time_t)-1 && heap_push(x, ban->end_time, 0, ban))
+        return -1;
+
+    ban->hnext = x->gc_hash[h];
+    x->gc_hash[h] = ban;
+    return 0;
+}
+
+static void unindex_gc_ban(ban_index_t *x, guildcard_ban_t *ban) {
+    guildcard_ban_t **j = &x->gc_hash[gcban_hash(ban->banned_gc)];
+
+    for(; *j; j = &(*j)->hnext) {
+        if(*j == ban) {
+            *j = ban->hnext;
+            break;
+        }
+    }
+
+    heap_remove(x, ban->heap_idx);
+}
+
+static int index_ip_ban(ban_index_t *x, ip_ban_t *ban) {
+    ban->heap_idx = -1;
+    ban->prefix = mask_prefix((const uint8_t *)ban->netmask,
+                              ban->ipv6 ? 128 : 32);
+
+    if(ban->end_time != (time_t)-1 && heap_push(x, ban->end_time, 1, ban))
+        return -1;
+
+    if(ban->prefix < 0) {
+        ban->tnext = x->ip_other;
+        x->ip_other = ban;
+    }
+    else if(trie_insert(ban->ipv6 ? &x->ip6_root : &x->ip4_root, ban)) {
+        heap_remove(x, ban->heap_idx);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void unindex_ip_ban(ban_index_t *x, ip_ban_t *ban) {
+    ip_ban_t **j;
+
+    if(ban->prefix < 0) {
+        for(j = &x->ip_other; *j; j = &(*j)->tnext) {
+            if(*j == ban) {
+                *j = ban->tnext;
+                break;
+            }
+        }
+    }
+    else {
+        trie_remove(ban->ipv6 ? &x->ip6_root : &x->ip4_root, ban);
+    }
+
+    heap_remove(x, ban->heap_idx);
+}
+
+/* These must be called with the banlock held for writing. */
+static void drop_gc_ban(ship_t *s, guildcard_ban_t *ban) {
+    unindex_gc_ban(&s->ban_idx, ban);
+    TAILQ_REMOVE(&s->guildcard_bans, ban, qentry);
+    free(ban->reason);
+    free(ban);
+}
+
+static void drop_ip_ban(ship_t *s, ip_ban_t *ban) {
+    unindex_ip_ban(&s->ban_idx, ban);
+    TAILQ_REMOVE(&s->ip_bans, ban, qentry);
+    free(ban->reason);
+    free(ban);
+}
+
+/* Get rid of every ban that has run out. Returns how many there were. */
+static int drop_expired(ship_t *s, time_t now) {
+    ban_index_t *x = &s->ban_idx;
+    int rv = 0;
+
+    while(x->heap_count && x->heap[0].end_time < now) {
+        if(x->heap[0].ip)
+            drop_ip_ban(s, (ip_ban_t *)x->heap[0].ban);
+        else
+            drop_gc_ban(s, (guildcard_ban_t *)x->heap[0].ban);
+
+        ++rv;
+    }
+
+    return rv;
+}
+
+/* How often the bans file gets rewritten from the journal, in seconds, and how
+   many changes can pile up in the journal before it gets done early. */
+#define BANS_WRITE_INTERVAL     60
+#define BANS_JOURNAL_MAX        256
+
+/* Changes to the bans are appended to a journal next to the bans file as they
+   happen, and a background thread folds them into the bans file every so
+   often. The journal is only appended to with the banlock held for writing,
+   so anyone holding it for reading sees the journal and the lists agree. */
+static pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jcond = PTHREAD_COND_INITIALIZER;
+static pthread_t jthd;
+static int jfd = -1;
+static int jpending = 0;
+static int jrunning = 0;
+
+static void ip_to_str(const uint32_t ip[4], int ipv6,
+                      char str[INET6_ADDRSTRLEN]) {
+    struct sockaddr_storage addr;
+    struct sockaddr_in6 *ip6 = (struct sockaddr_in6 *)&addr;
+    struct sockaddr_in *ip4 = (struct sockaddr_in *)&addr;
+
+    if(ipv6) {
+        ip6->sin6_family = AF_INET6;
+        memcpy(ip6->sin6_addr.s6_addr, ip, 16);
+    }
+    else {
+        ip4->sin_family = AF_INET;
+        ip4->sin_addr.s_addr = ip[0];
+    }
+
+    my_ntop(&addr, str);
+}
+
+/* Build the whole bans file. The banlock must be held. */
+static xmlDoc *build_bans_doc(ship_t *s) {
     xmlDoc *doc;
     xmlNode *root;
     xmlDtd *dtd;
     xmlNode *node;
     guildcard_ban_t *i;
     ip_ban_t *j;
-    int rv = 0;
     time_t now = time(NULL);
     char tmp_str[64];
-    struct sockaddr_storage addr;
-    struct sockaddr_in6 *ip6 = (struct sockaddr_in6 *)&addr;
-    struct sockaddr_in *ip4 = (struct sockaddr_in *)&addr;
-
-    /* Make sure the file exists and can be read, otherwise quietly bail out */
-    if(!s->cfg->bans_file[0]) {
-        return -1;
-    }
 
     /* Create the new document */
     doc = xmlNewDoc(XC"1.0");
     if(!doc) {
-        return -2;
+        return NULL;
     }
 
     root = xmlNewNode(NULL, XC"bans");
     if(!root) {
-        rv = -3;
         goto err_doc;
     }
 
@@ -90,13 +409,10 @@ static int write_bans_list(ship_t *s) {
                              XC"-//Sylverant//DTD Ban Configuration 1.1//EN",
                              XC"http://dtd.sylverant.net/bans1.1/bans.dtd");
     if(!dtd) {
-        rv = -4;
         goto err_doc;
     }
 
     /* Add in all the elements we need as we go through the list */
-    pthread_rwlock_rdlock(&s->banlock);
-
     TAILQ_FOREACH(i, &s->guildcard_bans, qentry) {
         /* Ignore bans that are over already */
         if(i->end_time != -1 && i->end_time < now) {
@@ -106,7 +422,6 @@ static int write_bans_list(ship_t *s) {
         /* Create the node for this entry, and fill it in. */
         node = xmlNewChild(root, NULL, XC"ban", NULL);
         if(!node) {
-            rv = -5;
             goto err_doc;
         }
 
@@ -134,67 +449,325 @@ static int write_bans_list(ship_t *s) {
         /* Create the node for this entry, and fill it in. */
         node = xmlNewChild(root, NULL, XC"ipban", NULL);
         if(!node) {
-            rv = -5;
             goto err_doc;
         }
 
         sprintf(tmp_str, "%lu", (unsigned long)j->set_by);
         xmlNewProp(node, XC"set_by", XC tmp_str);
 
-        const void *my_ntop(struct sockaddr_storage *addr, char str[INET6_ADDRSTRLEN]);
+        xmlNewProp(node, XC"ipv6", j->ipv6 ? XC"true" : XC"false");
+
+        ip_to_str(j->ip_addr, j->ipv6, tmp_str);
+        xmlNewProp(node, XC"ip", XC tmp_str);
+
+        ip_to_str(j->netmask, j->ipv6, tmp_str);
+        xmlNewProp(node, XC"netmask", XC tmp_str);
+
+        sprintf(tmp_str, "%lld", (long long)j->start_time);
+        xmlNewProp(node, XC"start", XC tmp_str);
+
+        sprintf(tmp_str, "%lld", (long long)j->end_time);
+        xmlNewProp(node, XC"end", XC tmp_str);
+
+        xmlNewProp(node, XC"reason", XC j->reason);
+    }
+
+    return doc;
+
+err_doc:
+    xmlFreeDoc(doc);
+    return NULL;
+}
+
+/* Throw away the first len bytes of the journal, since they've made it into
+   the bans file. */
+static void journal_trim(const char *fn, off_t len) {
+    size_t flen = strlen(fn);
+    char jfn[flen + 10], tfn[flen + 15];
+    off_t end, pos;
+    ssize_t amt;
+    uint8_t buf[4096];
+    int fd;
+
+    pthread_mutex_lock(&jlock);
+
+    if(jfd < 0 || (end = lseek(jfd, 0, SEEK_END)) < 0)
+        goto out;
+
+    /* The usual case is that nothing happened while the file was being
+       written, so the whole thing can go. */
+    if(end == len) {
+        if(ftruncate(jfd, 0))
+            debug(DBG_WARN, "Cannot truncate bans journal: %s\n",
+                  strerror(errno));
+        goto out;
+    }
+
+    /* Otherwise, copy whatever came in since into a new journal. */
+    sprintf(jfn, "%s.journal", fn);
+    sprintf(tfn, "%s.journal.tmp", fn);
+
+    if((fd = open(tfn, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        debug(DBG_WARN, "Cannot create \"%s\": %s\n", tfn, strerror(errno));
+        goto out;
+    }
+
+    for(pos = len; pos < end; pos += amt) {
+        if((amt = pread(jfd, buf, sizeof(buf), pos)) <= 0 ||
+           write(fd, buf, (size_t)amt) != amt) {
+            debug(DBG_WARN, "Cannot copy bans journal: %s\n", strerror(errno));
+            close(fd);
+            unlink(tfn);
+            goto out;
+        }
+    }
+
+    if(rename(tfn, jfn)) {
+        debug(DBG_WARN, "Cannot replace bans journal: %s\n", strerror(errno));
+        close(fd);
+        unlink(tfn);
+        goto out;
+    }
+
+    close(jfd);
+    close(fd);
+    jfd = open(jfn, O_WRONLY | O_APPEND);
+
+out:
+    pthread_mutex_unlock(&jlock);
+}
+
+static int write_bans_list(ship_t *s) {
+    const char *fn = s->cfg->bans_file;
+    char tfn[strlen(fn) + 5];
+    xmlDoc *doc;
+    off_t jlen = 0;
+    int covered = 0;
+
+    /* Grab a consistent picture of the bans, and note how much of the journal
+       it covers. */
+    pthread_rwlock_rdlock(&s->banlock);
+    doc = build_bans_doc(s);
+
+    pthread_mutex_lock(&jlock);
+    if(doc) {
+        jlen = jfd >= 0 ? lseek(jfd, 0, SEEK_END) : 0;
+        covered = jpending;
+    }
+    pthread_mutex_unlock(&jlock);
+
+    pthread_rwlock_unlock(&s->banlock);
+
+    if(!doc) {
+        return -2;
+    }
+
+    /* Save the file out, replacing the old one only once the new one is all
+       there. */
+    sprintf(tfn, "%s.tmp", fn);
+
+    if(xmlSaveFormatFileEnc(tfn, doc, "UTF-8", 1) < 0 || rename(tfn, fn)) {
+        debug(DBG_WARN, "Cannot write bans file \"%s\"\n", fn);
+        unlink(tfn);
+        xmlFreeDoc(doc);
+        return -3;
+    }
+
+    xmlFreeDoc(doc);
+
+    /* Only now are the changes in the journal safely in the file. Anything
+       that came in while it was being written is still pending. */
+    pthread_mutex_lock(&jlock);
+    jpending -= covered;
+    pthread_mutex_unlock(&jlock);
+
+    if(jlen > 0)
+        journal_trim(fn, jlen);
+
+    return 0;
+}
+
+static void *ban_writer_thd(void *d) {
+    ship_t *s = (ship_t *)d;
+    struct timespec ts;
+    int run, pending, failed = 0;
+
+    pthread_mutex_lock(&jlock);
+
+    for(;;) {
+        /* If the last write failed, the changes are still pending, but give
+           it a while before trying again. */
+        if(jrunning && (failed || jpending < BANS_JOURNAL_MAX)) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += BANS_WRITE_INTERVAL;
+            pthread_cond_timedwait(&jcond, &jlock, &ts);
+        }
+
+        run = jrunning;
+        pending = jpending;
+        pthread_mutex_unlock(&jlock);
+
+        failed = 0;
+
+        if(pending && write_bans_list(s)) {
+            debug(DBG_WARN, "Couldn't save bans list\n");
+            failed = 1;
+        }
+
+        if(!run)
+            break;
+
+        pthread_mutex_lock(&jlock);
+    }
+
+    return NULL;
+}
+
+int ban_writer_start(ship_t *s) {
+    const char *fn = s->cfg->bans_file;
+    char jfn[(fn ? strlen(fn) : 0) + 10];
+
+    if(!fn || !fn[0])
+        return -1;
+
+    sprintf(jfn, "%s.journal", fn);
+
+    pthread_mutex_lock(&jlock);
+
+    if((jfd = open(jfn, O_WRONLY | O_APPEND | O_CREAT, 0600)) < 0) {
+        pthread_mutex_unlock(&jlock);
+        debug(DBG_WARN, "Cannot open bans journal \"%s\": %s\n", jfn,
+              strerror(errno));
+        return -1;
+    }
+
+    jrunning = 1;
+
+    if(pthread_create(&jthd, NULL, &ban_writer_thd, s)) {
+        debug(DBG_WARN, "Cannot start bans writer thread\n");
+        jrunning = 0;
+        close(jfd);
+        jfd = -1;
+        pthread_mutex_unlock(&jlock);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&jlock);
+    return 0;
+}
+
+void ban_writer_stop(ship_t *s) {
+    pthread_mutex_lock(&jlock);
+
+    if(!jrunning) {
+        pthread_mutex_unlock(&jlock);
+        return;
+    }
+
+    /* The thread writes out anything still pending on its way out. */
+    jrunning = 0;
+    pthread_cond_signal(&jcond);
+    pthread_mutex_unlock(&jlock);
+
+    pthread_join(jthd, NULL);
 
-        if(j->ipv6) {
-            xmlNewProp(node, XC"ipv6", XC"true");
-            ip6->sin6_family = AF_INET6;
-            memcpy(ip6->sin6_addr.s6_addr, j->ip_addr, 16);
+    pthread_mutex_lock(&jlock);
+    close(jfd);
+    jfd = -1;
+    pthread_mutex_unlock(&jlock);
+}
+
+/* Add a line to the journal. The banlock must be held for writing. */
+static int journal_append(const char *line) {
+    size_t len = strlen(line);
+    int rv = 0;
+
+    pthread_mutex_lock(&jlock);
+
+    if(jfd < 0 || write(jfd, line, len) != (ssize_t)len) {
+        rv = -1;
+    }
+    else if(++jpending >= BANS_JOURNAL_MAX) {
+        pthread_cond_signal(&jcond);
+    }
 
+    pthread_mutex_unlock(&jlock);
+
+    return rv;
+}
+
+/* Reasons go at the end of the line, with any newlines escaped. */
+static void escape_reason(char *dst, const char *src) {
+    for(; *src; ++src) {
+        if(*src == '\\') {
+            *dst++ = '\\';
+            *dst++ = '\\';
+        }
+        else if(*src == '\n') {
+            *dst++ = '\\';
+            *dst++ = 'n';
         }
         else {
-            xmlNewProp(node, XC"ipv6", XC"false");
-            ip4->sin_family = AF_INET;
-            ip4->sin_addr.s_addr = j->ip_addr[0];
+            *dst++ = *src;
         }
+    }
 
-        my_ntop(&addr, tmp_str);
-        xmlNewProp(node, XC"netmask", XC tmp_str);
+    *dst = '\0';
+}
 
-        if(j->ipv6) {
-            ip6->sin6_family = AF_INET6;
-            memcpy(ip6->sin6_addr.s6_addr, j->netmask, 16);
+static void unescape_reason(char *str) {
+    char *dst = str;
 
+    for(; *str && *str != '\n'; ++str) {
+        if(*str == '\\' && str[1]) {
+            ++str;
+            *dst++ = *str == 'n' ? '\n' : *str;
         }
         else {
-            ip4->sin_family = AF_INET;
-            ip4->sin_addr.s_addr = j->netmask[0];
+            *dst++ = *str;
         }
+    }
 
-        my_ntop(&addr, tmp_str);
-        xmlNewProp(node, XC"ip", XC tmp_str);
+    *dst = '\0';
+}
 
-        sprintf(tmp_str, "%lld", (long long)j->start_time);
-        xmlNewProp(node, XC"start", XC tmp_str);
+static int journal_gc_ban(guildcard_ban_t *ban) {
+    size_t rlen = strlen(ban->reason);
+    char line[rlen * 2 + 128];
+    int len;
 
-        sprintf(tmp_str, "%lld", (long long)j->end_time);
-        xmlNewProp(node, XC"end", XC tmp_str);
+    len = sprintf(line, "G %" PRIu32 " %" PRIu32 " %lld %lld ", ban->set_by,
+                  ban->banned_gc, (long long)ban->start_time,
+                  (long long)ban->end_time);
+    escape_reason(line + len, ban->reason);
+    strcat(line, "\n");
 
-        xmlNewProp(node, XC"reason", XC j->reason);
-    }
+    return journal_append(line);
+}
 
-    pthread_rwlock_unlock(&s->banlock);
+static int journal_ip_ban(ip_ban_t *ban) {
+    size_t rlen = strlen(ban->reason);
+    char line[rlen * 2 + INET6_ADDRSTRLEN * 2 + 128];
+    char ip[INET6_ADDRSTRLEN], nm[INET6_ADDRSTRLEN];
+    int len;
 
-    /* Save the file out */
-    xmlSaveFormatFileEnc(s->cfg->bans_file, doc, "UTF-8", 1);
+    ip_to_str(ban->ip_addr, ban->ipv6, ip);
+    ip_to_str(ban->netmask, ban->ipv6, nm);
 
-err_doc:
-    free(doc);
+    len = sprintf(line, "I %" PRIu32 " %d %s %s %lld %lld ", ban->set_by,
+                  ban->ipv6, ip, nm, (long long)ban->start_time,
+                  (long long)ban->end_time);
+    escape_reason(line + len, ban->reason);
+    strcat(line, "\n");
 
-    return rv;
+    return journal_append(line);
 }
 
 static int ban_gc_int(ship_t *s, time_t end_time, time_t start_time,
-                      uint32_t set_by, uint32_t guildcard, const char *reason) {
+                      uint32_t set_by, uint32_t guildcard, const char *reason,
+                      int journal) {
     guildcard_ban_t *ban;
-    int len = reason ? strlen(reason) + 1 : 1;
+    int len = reason ? strlen(reason) + 1 : 1, rv = 0;
 
     /* Allocate space for the new ban... */
     ban = (guildcard_ban_t *)malloc(sizeof(guildcard_ban_t));
@@ -228,18 +801,31 @@ static int ban_gc_int(ship_t *s, time_t end_time, time_t start_time,
 
     /* Now that that's done, we need to add it to the list... */
     pthread_rwlock_wrlock(&s->banlock);
+
+    if(index_gc_ban(&s->ban_idx, ban)) {
+        pthread_rwlock_unlock(&s->banlock);
+        debug(DBG_WARN, "Can't allocate space to index guildcard ban\n");
+        free(ban->reason);
+        free(ban);
+        return -1;
+    }
+
     TAILQ_INSERT_TAIL(&s->guildcard_bans, ban, qentry);
+
+    if(journal && journal_gc_ban(ban))
+        rv = -2;
+
     pthread_rwlock_unlock(&s->banlock);
 
-    return 0;
+    return rv;
 }
 
 static int ban_ip_int(ship_t *s, time_t end_time, time_t start_time,
                       uint32_t set_by, const struct sockaddr_storage *ip,
                       const struct sockaddr_storage *netmask,
-                      const char *reason) {
+                      const char *reason, int journal) {
     ip_ban_t *ban;
-    int len = reason ? strlen(reason) + 1 : 1;
+    int len = reason ? strlen(reason) + 1 : 1, rv = 0;
 
     /* Allocate space for the new ban... */
     ban = (ip_ban_t *)malloc(sizeof(ip_ban_t));
@@ -293,208 +879,175 @@ static int ban_ip_int(ship_t *s, time_t end_time, time_t start_time,
 
     /* Now that that's done, we need to add it to the list... */
     pthread_rwlock_wrlock(&s->banlock);
+
+    if(index_ip_ban(&s->ban_idx, ban)) {
+        pthread_rwlock_unlock(&s->banlock);
+        debug(DBG_WARN, "Can't allocate space to index ip ban\n");
+        free(ban->reason);
+        free(ban);
+        return -1;
+    }
+
     TAILQ_INSERT_TAIL(&s->ip_bans, ban, qentry);
+
+    if(journal && journal_ip_ban(ban))
+        rv = -2;
+
     pthread_rwlock_unlock(&s->banlock);
 
-    return 0;
+    return rv;
 }
 
 int ban_guildcard(ship_t *s, time_t end_time, uint32_t set_by,
                   uint32_t guildcard, const char *reason) {
-    /* Add the ban to the list... */
-    if(ban_gc_int(s, end_time, time(NULL), set_by, guildcard, reason))
-        return -1;
+    int rv;
+
+    /* Add the ban to the list, and note it in the journal. The bans file itself
+       gets written out later by the writer thread. */
+    rv = ban_gc_int(s, end_time, time(NULL), set_by, guildcard, reason, 1);
 
-    /* Save the file */
-    if(write_bans_list(s)) {
+    if(rv == -2)
         debug(DBG_WARN, "Couldn't save bans list\n");
-        return -2;
-    }
 
-    return 0;
+    return rv;
 }
 
 int ban_ip(ship_t *s, time_t end_time, uint32_t set_by,
            const struct sockaddr_storage *ip,
            const struct sockaddr_storage *netmask, const char *reason) {
-    /* Add the ban to the list... */
-    if(ban_ip_int(s, end_time, time(NULL), set_by, ip, netmask, reason))
-        return -1;
+    int rv;
 
-    /* Save the file */
-    if(write_bans_list(s)) {
+    /* Add the ban to the list, and note it in the journal. */
+    rv = ban_ip_int(s, end_time, time(NULL), set_by, ip, netmask, reason, 1);
+
+    if(rv == -2)
         debug(DBG_WARN, "Couldn't save bans list\n");
-        return -2;
-    }
 
-    return 0;
+    return rv;
 }
 
-int ban_lift_guildcard_ban(ship_t *s, uint32_t guildcard) {
+/* Remove all the bans on a guildcard. The banlock must be held for writing. */
+static int lift_gc_locked(ship_t *s, uint32_t guildcard) {
     guildcard_ban_t *i, *tmp;
-    int num_lifted = 0, num_matching = 0;
-    time_t now = time(NULL);
-
-    /* This involves writing to the ban list, in general. So, we have to lock
-       for writing, unfortunately... */
-    pthread_rwlock_wrlock(&s->banlock);
+    int num_matching = 0;
 
-    /* Look for any matching entries, and remove all of them. */
-    i = TAILQ_FIRST(&s->guildcard_bans);
+    i = s->ban_idx.gc_hash[gcban_hash(guildcard)];
     while(i) {
-        tmp = TAILQ_NEXT(i, qentry);
+        tmp = i->hnext;
 
-        /* Did we find a match? */
         if(i->banned_gc == guildcard) {
-            TAILQ_REMOVE(&s->guildcard_bans, i, qentry);
-            free(i->reason);
-            free(i);
-            ++num_lifted;
+            drop_gc_ban(s, i);
             ++num_matching;
         }
 
-        /* While we're at it, remove any stale bans */
-        if(i->end_time != (time_t)-1 && i->end_time < now) {
-            TAILQ_REMOVE(&s->guildcard_bans, i, qentry);
-            free(i->reason);
-            free(i);
-            ++num_lifted;
-        }
-
         i = tmp;
     }
 
-    /* We're done with writing to the list, unlock this now... */
-    pthread_rwlock_unlock(&s->banlock);
-
-    if(num_lifted) {
-        /* Save the file */
-        if(write_bans_list(s)) {
-            debug(DBG_WARN, "Couldn't save bans list\n");
-            return -2;
-        }
-
-        return num_matching ? 0 : -1;
-    }
-
-    /* Didn't find anything if we get here, return failure. */
-    return -1;
+    return num_matching;
 }
 
-int ban_lift_ip_ban(ship_t *s, const struct sockaddr_storage *ip) {
+/* Remove all the bans on an address. The banlock must be held for writing. */
+static int lift_ip_locked(ship_t *s, const struct sockaddr_storage *ip) {
     ip_ban_t *i, *tmp;
-    int num_lifted = 0, num_matching = 0;
-    time_t now = time(NULL);
+    int num_matching = 0;
 
-    /* This involves writing to the ban list, in general. So, we have to lock
-       for writing, unfortunately... */
-    pthread_rwlock_wrlock(&s->banlock);
-
-    /* Look for any matching entries, and remove all of them. */
     i = TAILQ_FIRST(&s->ip_bans);
     while(i) {
         tmp = TAILQ_NEXT(i, qentry);
 
         /* Did we find a match? */
         if(i->ipv6) {
-            if(eq_ip6((const struct sockaddr_in6 *)ip, i->ip_addr,
+            if(ip->ss_family == AF_INET6 &&
+               eq_ip6((const struct sockaddr_in6 *)ip, i->ip_addr,
                       i->netmask)) {
-                TAILQ_REMOVE(&s->ip_bans, i, qentry);
-                free(i->reason);
-                free(i);
-                ++num_lifted;
+                drop_ip_ban(s, i);
                 ++num_matching;
             }
         }
-        else {
+        else if(ip->ss_family == AF_INET) {
             const struct sockaddr_in *ip4 = (const struct sockaddr_in *)ip;
             if(i->ip_addr[0] == ip4->sin_addr.s_addr) {
-                TAILQ_REMOVE(&s->ip_bans, i, qentry);
-                free(i->reason);
-                free(i);
-                ++num_lifted;
+                drop_ip_ban(s, i);
                 ++num_matching;
             }
         }
 
-        /* While we're at it, remove any stale bans */
-        if(i->end_time != (time_t)-1 && i->end_time < now) {
-            TAILQ_REMOVE(&s->ip_bans, i, qentry);
-            free(i->reason);
-            free(i);
-            ++num_lifted;
-        }
-
         i = tmp;
     }
 
-    /* We're done with writing to the list, unlock this now... */
-    pthread_rwlock_unlock(&s->banlock);
+    return num_matching;
+}
 
-    if(num_lifted) {
-        /* Save the file */
-        if(write_bans_list(s)) {
-            debug(DBG_WARN, "Couldn't save bans list\n");
-            return -2;
-        }
+int ban_lift_guildcard_ban(ship_t *s, uint32_t guildcard) {
+    int num_matching, rv = -1;
+    char line[32];
 
-        return num_matching ? 0 : -1;
+    /* This involves writing to the ban list, in general. So, we have to lock
+       for writing, unfortunately... */
+    pthread_rwlock_wrlock(&s->banlock);
+
+    /* Look for any matching entries, and remove all of them. */
+    num_matching = lift_gc_locked(s, guildcard);
+
+    if(num_matching) {
+        sprintf(line, "g %" PRIu32 "\n", guildcard);
+        rv = journal_append(line) ? -2 : 0;
     }
 
-    /* Didn't find anything if we get here, return failure. */
-    return -1;
+    /* While we're at it, remove any stale bans */
+    drop_expired(s, time(NULL));
+
+    /* We're done with writing to the list, unlock this now... */
+    pthread_rwlock_unlock(&s->banlock);
+
+    if(rv == -2)
+        debug(DBG_WARN, "Couldn't save bans list\n");
+
+    return rv;
 }
 
-int ban_sweep(ship_t *s) {
-    guildcard_ban_t *i, *tmp;
-    ip_ban_t *j, *tmp2;
-    int num_lifted = 0;
-    time_t now = time(NULL);
+int ban_lift_ip_ban(ship_t *s, const struct sockaddr_storage *ip) {
+    int num_matching, rv = -1;
+    char line[INET6_ADDRSTRLEN + 16], str[INET6_ADDRSTRLEN];
 
     /* This involves writing to the ban list, in general. So, we have to lock
        for writing, unfortunately... */
     pthread_rwlock_wrlock(&s->banlock);
 
-    /* Look for any expired entries, and remove all of them. */
-    i = TAILQ_FIRST(&s->guildcard_bans);
-    while(i) {
-        tmp = TAILQ_NEXT(i, qentry);
-
-        if(i->end_time != (time_t)-1 && i->end_time < now) {
-            TAILQ_REMOVE(&s->guildcard_bans, i, qentry);
-            free(i->reason);
-            free(i);
-            ++num_lifted;
-        }
+    /* Look for any matching entries, and remove all of them. */
+    num_matching = lift_ip_locked(s, ip);
 
-        i = tmp;
+    if(num_matching) {
+        my_ntop((struct sockaddr_storage *)ip, str);
+        sprintf(line, "i %d %s\n", ip->ss_family == AF_INET6, str);
+        rv = journal_append(line) ? -2 : 0;
     }
 
-    j = TAILQ_FIRST(&s->ip_bans);
-    while(j) {
-        tmp2 = TAILQ_NEXT(j, qentry);
+    /* While we're at it, remove any stale bans */
+    drop_expired(s, time(NULL));
 
-        if(j->end_time != (time_t)-1 && j->end_time < now) {
-            TAILQ_REMOVE(&s->ip_bans, j, qentry);
-            free(j->reason);
-            free(j);
-            ++num_lifted;
-        }
+    /* We're done with writing to the list, unlock this now... */
+    pthread_rwlock_unlock(&s->banlock);
 
-        j = tmp2;
-    }
+    if(rv == -2)
+        debug(DBG_WARN, "Couldn't save bans list\n");
+
+    return rv;
+}
+
+int ban_sweep(ship_t *s) {
+    /* This involves writing to the ban list, in general. So, we have to lock
+       for writing, unfortunately... */
+    pthread_rwlock_wrlock(&s->banlock);
+
+    /* Everything that's run out is at the top of the heap. Bans that have
+       expired are left out of the file whenever it's next written, so there's
+       nothing to journal here. */
+    drop_expired(s, time(NULL));
 
     /* We're done with writing to the list, unlock this now... */
     pthread_rwlock_unlock(&s->banlock);
 
-    if(num_lifted) {
-        /* Save the file */
-        if(write_bans_list(s)) {
-            debug(DBG_WARN, "Couldn't save bans list\n");
-            return -1;
-        }
-    }
-
     return 0;
 }
 
@@ -508,7 +1061,7 @@ int is_guildcard_banned(ship_t *s, uint32_t guildcard, char **reason,
     pthread_rwlock_rdlock(&s->banlock);
 
     /* Look for the user with any bans that haven't expired */
-    TAILQ_FOREACH(i, &s->guildcard_bans, qentry) {
+    for(i = s->ban_idx.gc_hash[gcban_hash(guildcard)]; i; i = i->hnext) {
         if(i->banned_gc == guildcard) {
             if(i->end_time >= now || i->end_time == (time_t)-1) {
                 banned = 1;
@@ -529,20 +1082,26 @@ static int is_ip4_banned(ship_t *s, const struct sockaddr_in *ip, char **reason,
     time_t now = time(NULL);
     ip_ban_t *i;
 
-    /* Look for the user with any bans that haven't expired */
-    TAILQ_FOREACH(i, &s->ip_bans, qentry) {
-        if(i->ipv6)
-            continue;
+    /* Look for the most specific ban on the address that hasn't expired... */
+    i = trie_lookup(s->ban_idx.ip4_root, (const uint8_t *)&ip->sin_addr.s_addr,
+                    32, now);
 
-        if((i->end_time >= now || i->end_time == (time_t) -1) &&
-           (ip->sin_addr.s_addr & i->netmask[0]) ==
-           (i->ip_addr[0] & i->netmask[0])) {
-            *reason = strdup(i->reason);
-            *until = i->end_time;
-            return 1;
+    /* ...and failing that, any of the oddball ones. */
+    if(!i) {
+        for(i = s->ban_idx.ip_other; i; i = i->tnext) {
+            if(!i->ipv6 && (i->end_time >= now || i->end_time == (time_t)-1) &&
+               (ip->sin_addr.s_addr & i->netmask[0]) ==
+               (i->ip_addr[0] & i->netmask[0]))
+                break;
         }
     }
 
+    if(i) {
+        *reason = strdup(i->reason);
+        *until = i->end_time;
+        return 1;
+    }
+
     return 0;
 }
 
@@ -551,19 +1110,24 @@ static int is_ip6_banned(ship_t *s, const struct sockaddr_in6 *ip,
     time_t now = time(NULL);
     ip_ban_t *i;
 
-    /* Look for the user with any bans that haven't expired */
-    TAILQ_FOREACH(i, &s->ip_bans, qentry) {
-        if(!i->ipv6)
-            continue;
+    /* Look for the most specific ban on the address that hasn't expired... */
+    i = trie_lookup(s->ban_idx.ip6_root, ip->sin6_addr.s6_addr, 128, now);
 
-        if((i->end_time >= now || i->end_time == (time_t) -1) &&
-           eq_ip6(ip, i->ip_addr, i->netmask)) {
-            *reason = strdup(i->reason);
-            *until = i->end_time;
-            return 1;
+    /* ...and failing that, any of the oddball ones. */
+    if(!i) {
+        for(i = s->ban_idx.ip_other; i; i = i->tnext) {
+            if(i->ipv6 && (i->end_time >= now || i->end_time == (time_t)-1) &&
+               eq_ip6(ip, i->ip_addr, i->netmask))
+                break;
         }
     }
 
+    if(i) {
+        *reason = strdup(i->reason);
+        *until = i->end_time;
+        return 1;
+    }
+
     return 0;
 }
 
@@ -586,7 +1150,7 @@ int is_ip_banned(ship_t *s, const struct sockaddr_storage *ip, char **reason,
     return banned;
 }
 
-int ban_list_read(const char *fn, ship_t *s) {
+static int read_bans_xml(const char *fn, ship_t *s) {
     xmlParserCtxtPtr cxt;
     xmlDoc *doc;
     xmlNode *n;
@@ -597,11 +1161,6 @@ int ban_list_read(const char *fn, ship_t *s) {
     int rv = 0, num_bans = 0, is_ipv6 = 0;
     struct sockaddr_storage ban_ip, ban_nm;
 
-    if(!TAILQ_EMPTY(&s->guildcard_bans)) {
-        debug(DBG_WARN, "Cannot read guildcard bans multiple times!\n");
-        return -1;
-    }
-
     /* Make sure the file exists and can be read, otherwise quietly bail out */
     if(access(fn, R_OK)) {
         return -1;
@@ -699,7 +1258,8 @@ int ban_list_read(const char *fn, ship_t *s) {
 
             /* Add the ban to the list, if its not expired already */
             if(e_time == -1 || e_time > now) {
-                ban_gc_int(s, e_time, s_time, set_gc, ban_gc, (char *)reason);
+                ban_gc_int(s, e_time, s_time, set_gc, ban_gc,
+                           (char *)reason, 0);
                 ++num_bans;
             }
 
@@ -784,7 +1344,7 @@ next:
             /* Add the ban to the list, if its not expired already */
             if(e_time == -1 || e_time > now) {
                 ban_ip_int(s, e_time, s_time, set_gc, &ban_ip, &ban_nm,
-                           (char *)reason);
+                           (char *)reason, 0);
                 ++num_bans;
             }
 
@@ -817,6 +1377,172 @@ err:
     return rv;
 }
 
+static int gc_ban_exists(ship_t *s, uint32_t gc, uint32_t set_by,
+                         time_t start) {
+    guildcard_ban_t *i;
+
+    for(i = s->ban_idx.gc_hash[gcban_hash(gc)]; i; i = i->hnext) {
+        if(i->banned_gc == gc && i->set_by == set_by && i->start_time == start)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int ip_ban_exists(ship_t *s, const struct sockaddr_storage *ip,
+                         const struct sockaddr_storage *nm, uint32_t set_by,
+                         time_t start) {
+    ip_ban_t *i;
+    uint32_t a[4] = { 0 }, m[4] = { 0 };
+    int v6 = ip->ss_family == AF_INET6;
+
+    if(v6) {
+        memcpy(a, ((const struct sockaddr_in6 *)ip)->sin6_addr.s6_addr, 16);
+        memcpy(m, ((const struct sockaddr_in6 *)nm)->sin6_addr.s6_addr, 16);
+    }
+    else {
+        a[0] = ((const struct sockaddr_in *)ip)->sin_addr.s_addr;
+        m[0] = ((const struct sockaddr_in *)nm)->sin_addr.s_addr;
+    }
+
+    TAILQ_FOREACH(i, &s->ip_bans, qentry) {
+        if(i->ipv6 == v6 && i->set_by == set_by && i->start_time == start &&
+           !memcmp(i->ip_addr, a, 16) && !memcmp(i->netmask, m, 16))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Apply whatever changes made it into the journal but not into the bans file.
+   Adds that are already in the list were written out to the file before the
+   journal could be trimmed, so they're skipped. */
+static int replay_journal(const char *fn, ship_t *s) {
+    char jfn[strlen(fn) + 10];
+    FILE *fp;
+    char *line = NULL, *reason;
+    size_t sz = 0;
+    unsigned long set_by, gc;
+    long long st, et;
+    int v6, off, num = 0, lineno = 0;
+    char ip[INET6_ADDRSTRLEN], nm[INET6_ADDRSTRLEN];
+    struct sockaddr_storage ban_ip, ban_nm;
+    time_t now = time(NULL);
+
+    sprintf(jfn, "%s.journal", fn);
+
+    if(!(fp = fopen(jfn, "r")))
+        return 0;
+
+    while(getline(&line, &sz, fp) > 0) {
+        ++lineno;
+        off = -1;
+
+        /* A line without a newline is from a write that didn't finish. */
+        if(!strchr(line, '\n'))
+            break;
+
+        switch(line[0]) {
+            case 'G':
+                if(sscanf(line, "G %lu %lu %lld %lld%n", &set_by, &gc, &st,
+                          &et, &off) < 4 || off < 0 || line[off] != ' ')
+                    goto bad;
+
+                reason = line + off + 1;
+                unescape_reason(reason);
+
+                if((et != -1 && et <= now) ||
+                   gc_ban_exists(s, (uint32_t)gc, (uint32_t)set_by, (time_t)st))
+                    break;
+
+                ban_gc_int(s, (time_t)et, (time_t)st, (uint32_t)set_by,
+                           (uint32_t)gc, reason, 0);
+                ++num;
+                break;
+
+            case 'I':
+                if(sscanf(line, "I %lu %d %45s %45s %lld %lld%n", &set_by, &v6,
+                          ip, nm, &st, &et, &off) < 6 || off < 0 ||
+                   line[off] != ' ')
+                    goto bad;
+
+                if(my_pton(v6 ? AF_INET6 : AF_INET, ip, &ban_ip) != 1 ||
+                   my_pton(v6 ? AF_INET6 : AF_INET, nm, &ban_nm) != 1)
+                    goto bad;
+
+                ban_ip.ss_family = ban_nm.ss_family = v6 ? AF_INET6 : AF_INET;
+                reason = line + off + 1;
+                unescape_reason(reason);
+
+                if((et != -1 && et <= now) ||
+                   ip_ban_exists(s, &ban_ip, &ban_nm, (uint32_t)set_by,
+                                 (time_t)st))
+                    break;
+
+                ban_ip_int(s, (time_t)et, (time_t)st, (uint32_t)set_by, &ban_ip,
+                           &ban_nm, reason, 0);
+                ++num;
+                break;
+
+            case 'g':
+                if(sscanf(line, "g %lu", &gc) != 1)
+                    goto bad;
+
+                pthread_rwlock_wrlock(&s->banlock);
+                num += lift_gc_locked(s, (uint32_t)gc);
+                pthread_rwlock_unlock(&s->banlock);
+                break;
+
+            case 'i':
+                if(sscanf(line, "i %d %45s", &v6, ip) != 2 ||
+                   my_pton(v6 ? AF_INET6 : AF_INET, ip, &ban_ip) != 1)
+                    goto bad;
+
+                ban_ip.ss_family = v6 ? AF_INET6 : AF_INET;
+
+                pthread_rwlock_wrlock(&s->banlock);
+                num += lift_ip_locked(s, &ban_ip);
+                pthread_rwlock_unlock(&s->banlock);
+                break;
+
+            default:
+bad:
+                debug(DBG_WARN, "Invalid bans journal entry on line %d\n",
+                      lineno);
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    if(num)
+        debug(DBG_LOG, "Replayed %d changes from the bans journal\n", num);
+
+    return num;
+}
+
+int ban_list_read(const char *fn, ship_t *s) {
+    int rv;
+
+    if(!TAILQ_EMPTY(&s->guildcard_bans)) {
+        debug(DBG_WARN, "Cannot read guildcard bans multiple times!\n");
+        return -1;
+    }
+
+    rv = read_bans_xml(fn, s);
+
+    /* Anything in the journal is newer than the file, so it gets applied on top
+       of it, and the file will be brought up to date once the writer starts. */
+    if(replay_journal(fn, s) > 0) {
+        pthread_mutex_lock(&jlock);
+        jpending = 1;
+        pthread_mutex_unlock(&jlock);
+        rv = 0;
+    }
+
+    return rv;
+}
+
 void ban_list_clear(ship_t *s) {
     guildcard_ban_t *i, *tmp;
     ip_ban_t *j, *tmp2;
@@ -848,5 +1574,10 @@ void ban_list_clear(ship_t *s) {
     TAILQ_INIT(&s->guildcard_bans);
     TAILQ_INIT(&s->ip_bans);
 
+    trie_free(s->ban_idx.ip4_root);
+    trie_free(s->ban_idx.ip6_root);
+    free(s->ban_idx.heap);
+    memset(&s->ban_idx, 0, sizeof(ban_index_t));
+
     pthread_rwlock_unlock(&s->banlock);
 }
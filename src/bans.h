@@ -32,6 +32,9 @@ typedef struct ship ship_t;
 
 typedef struct ip_ban {
     TAILQ_ENTRY(ip_ban) qentry;
+    struct ip_ban *tnext;               /* Next ban on the same trie node. */
+    int heap_idx;                       /* -1 for permanent bans. */
+    int prefix;                         /* -1 if the netmask isn't CIDR. */
     int ipv6;
     char *reason;
     time_t start_time;
@@ -43,6 +46,8 @@ typedef struct ip_ban {
 
 typedef struct guildcard_ban {
     TAILQ_ENTRY(guildcard_ban) qentry;
+    struct guildcard_ban *hnext;        /* Next ban in the same bucket. */
+    int heap_idx;                       /* -1 for permanent bans. */
     char *reason;
     time_t start_time;
     time_t end_time;
@@ -53,6 +58,34 @@ typedef struct guildcard_ban {
 TAILQ_HEAD(gcban_queue, guildcard_ban);
 TAILQ_HEAD(ipban_queue, ip_ban);
 
+/* Must be a power of two. */
+#define GCBAN_BUCKETS       1024
+
+typedef struct ban_trie_node ban_trie_node_t;
+
+/* An entry in the heap of bans that will run out, soonest first. */
+typedef struct ban_expiry {
+    time_t end_time;
+    int ip;
+    void *ban;
+} ban_expiry_t;
+
+/* Indexes over the ban lists, so that checking a connection doesn't have to
+   look at every ban. Guildcard bans are hashed by guildcard number, and IP
+   bans are kept in a binary trie per address family by their prefix. The odd
+   IP ban with a netmask that isn't a prefix goes on its own list. Everything
+   here is protected by the ship's banlock, just like the lists. */
+typedef struct ban_index {
+    guildcard_ban_t *gc_hash[GCBAN_BUCKETS];
+    ban_trie_node_t *ip4_root;
+    ban_trie_node_t *ip6_root;
+    ip_ban_t *ip_other;
+
+    ban_expiry_t *heap;
+    int heap_count;
+    int heap_size;
+} ban_index_t;
+
 int ban_guildcard(ship_t *s, time_t end_time, uint32_t set_by,
                   uint32_t guildcard, const char *reason);
 int ban_lift_guildcard_ban(ship_t *s, uint32_t guildcard);
@@ -72,4 +105,9 @@ int is_ip_banned(ship_t *s, const struct sockaddr_storage *ip, char **reason,
 int ban_list_read(const char *fn, ship_t *s);
 void ban_list_clear(ship_t *s);
 
+/* Start/stop the thread that folds the journal of ban changes into the bans
+   file. Stopping it writes out anything still pending. */
+int ban_writer_start(ship_t *s);
+void ban_writer_stop(ship_t *s);
+
 #endif /* !BANS_H */
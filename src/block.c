@@ -22,9 +22,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
 
 #include <sylverant/debug.h>
@@ -42,275 +42,459 @@
 #include "gm.h"
 #include "subcmd.h"
 #include "scripts.h"
+#include "gcindex.h"
 #include "admin.h"
 #include "smutdata.h"
+#include "evloop.h"
+#include "quest_functions.h"
 
 extern int enable_ipv6;
+extern int block_workers;
+extern int client_defer_sends;
+extern int client_tcp_cork;
+extern int lobby_move_ms;
 extern uint32_t ship_ip4;
 extern uint8_t ship_ip6[16];
 
-static void *block_thd(void *d) {
-    block_t *b = (block_t *)d;
+/* Maximum number of events to handle per pass through the event loop. */
+#define BLOCK_MAX_EVENTS    256
+
+/* Listening sockets for each version, as seen by the event loop. */
+typedef struct block_listener {
+    int sock;
+    int version;
+    const char *desc;
+} block_listener_t;
+
+/* Figure out when we next need to check on a client, and schedule it. The
+   deadlines only ever move later as packets come in, so there's no need to
+   touch the timer every time we hear from the client. If it fires early, we
+   just push it back to the real deadline. */
+static void block_client_arm(block_worker_t *w, ship_client_t *c) {
+    time_t next, ping;
+
+    /* Ping timeout... */
+    next = c->last_message + 90;
+
+    /* Sending a ping... */
+    ping = c->last_message + 30;
+    if(c->last_sent + 10 > ping)
+        ping = c->last_sent + 10;
+
+    if(ping < next)
+        next = ping;
+
+    /* Running out of time to login after a protection message... */
+    if((c->flags & CLIENT_FLAG_GC_PROTECT) && c->join_time + 60 < next)
+        next = c->join_time + 60;
+
+    /* The checks are all of the form now > deadline, so it is the second after
+       the deadline where something actually needs to happen. */
+    timer_add(&w->timers, &c->timer, ((uint64_t)next + 1) * 1000);
+}
+
+static void block_client_timer(timer_entry_t *t, void *d) {
+    ship_client_t *c = (ship_client_t *)d;
+    block_worker_t *w = c->worker;
+    time_t now = time(NULL);
+    char nm[64];
+
+    pthread_mutex_lock(&c->mutex);
+
+    if(c->flags & CLIENT_FLAG_DISCONNECTED)
+        goto out;
+
+    /* If we haven't heard from a client in a minute and a half, it is probably
+       dead. Disconnect it. */
+    if(now > c->last_message + 90) {
+        if(c->bb_pl) {
+            istrncpy16(ic_utf16_to_utf8, nm, &c->pl->bb.character.name[2], 64);
+            debug(DBG_LOG, "Ping Timeout: %s(%d)\n", nm, c->guildcard);
+        }
+        else if(c->pl) {
+            debug(DBG_LOG, "Ping Timeout: %s(%d)\n", c->pl->v1.name,
+                  c->guildcard);
+        }
+
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        goto out;
+    }
+    /* Otherwise, if we haven't heard from them in half of a minute, ping
+       them. */
+    else if(now > c->last_message + 30 && now > c->last_sent + 10) {
+        if(send_simple(c, PING_TYPE, 0)) {
+            c->flags |= CLIENT_FLAG_DISCONNECTED;
+            goto out;
+        }
+
+        c->last_sent = now;
+    }
+
+    /* Check if their timeout expired to login after getting a protection
+       message. */
+    if((c->flags & CLIENT_FLAG_GC_PROTECT) && c->join_time + 60 < now) {
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        goto out;
+    }
+
+    block_client_arm(w, c);
+
+out:
+    if(c->flags & CLIENT_FLAG_DISCONNECTED)
+        w->reap = 1;
+
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/* Send on whatever movement was being held for a client. This runs from the
+   worker's event loop rather than a packet handler, so it has to take the same
+   locks that handling a packet would. */
+static void block_move_timer(timer_entry_t *t, void *d) {
+    ship_client_t *c = (ship_client_t *)d;
+    block_t *b = c->worker->b;
+    lobby_t *l;
+
+    if(b->num_workers > 1)
+        pthread_mutex_lock(&b->dispatch_lock);
+
+    pthread_rwlock_rdlock(&b->lock);
+    pthread_mutex_lock(&c->mutex);
+
+    if(!(c->flags & CLIENT_FLAG_DISCONNECTED) && (l = c->cur_lobby)) {
+        pthread_mutex_lock(&l->mutex);
+        subcmd_flush_move(c, l);
+        pthread_mutex_unlock(&l->mutex);
+    }
+
+    c->move_pending = 0;
+
+    pthread_mutex_unlock(&c->mutex);
+    pthread_rwlock_unlock(&b->lock);
+
+    if(b->num_workers > 1)
+        pthread_mutex_unlock(&b->dispatch_lock);
+}
+
+/* Write back the quest flags that the client's quest has changed. Like the
+   move timer, this has to take the locks that handling a packet would. */
+static void block_qflag_timer(timer_entry_t *t, void *d) {
+    ship_client_t *c = (ship_client_t *)d;
+    block_t *b = c->worker->b;
+
+    if(b->num_workers > 1)
+        pthread_mutex_lock(&b->dispatch_lock);
+
+    pthread_rwlock_rdlock(&b->lock);
+    pthread_mutex_lock(&c->mutex);
+
+    /* If the shipgate couldn't take everything, try again later. The client
+       going away will take care of it if they're disconnected. */
+    if(!(c->flags & CLIENT_FLAG_DISCONNECTED) && quest_flag_cache_flush(c))
+        timer_add(&c->worker->timers, &c->qflag_timer,
+                  get_ms_time() + QFLAG_WRITE_MS);
+
+    pthread_mutex_unlock(&c->mutex);
+    pthread_rwlock_unlock(&b->lock);
+
+    if(b->num_workers > 1)
+        pthread_mutex_unlock(&b->dispatch_lock);
+}
+
+/* Set up a newly accepted connection on the worker that will own it. This must
+   be called from that worker's thread. */
+static void block_setup_client(block_worker_t *w, int sock, int version,
+                               struct sockaddr *addr, socklen_t len) {
+    block_t *b = w->b;
+    ship_client_t *c;
+
+    if(!(c = client_create_connection(sock, version, CLIENT_TYPE_BLOCK,
+                                      b->clients, b->ship, w, addr, len)))
+        return;
+
+    timer_init(&c->timer, &block_client_timer, c);
+    timer_init(&c->move_timer, &block_move_timer, c);
+    timer_init(&c->qflag_timer, &block_qflag_timer, c);
+    block_client_arm(w, c);
+}
+
+/* Pick up any connections that have been handed off to this worker. */
+static void block_setup_pending(block_worker_t *w) {
+    struct block_pending_queue q;
+    block_pending_t *p;
+
+    TAILQ_INIT(&q);
+
+    pthread_mutex_lock(&w->pending_lock);
+    while((p = TAILQ_FIRST(&w->pending))) {
+        TAILQ_REMOVE(&w->pending, p, qentry);
+        TAILQ_INSERT_TAIL(&q, p, qentry);
+    }
+    pthread_mutex_unlock(&w->pending_lock);
+
+    while((p = TAILQ_FIRST(&q))) {
+        TAILQ_REMOVE(&q, p, qentry);
+        block_setup_client(w, p->sock, p->version,
+                           (struct sockaddr *)&p->addr, p->len);
+        free(p);
+    }
+}
+
+static void block_accept(block_worker_t *w, block_listener_t *lis) {
+    block_t *b = w->b;
     ship_t *s = b->ship;
-    int nfds, i;
-    struct timeval timeout;
-    fd_set readfds, writefds;
-    ship_client_t *it, *tmp;
     socklen_t len;
     struct sockaddr_storage addr;
     struct sockaddr *addr_p = (struct sockaddr *)&addr;
     char ipstr[INET6_ADDRSTRLEN];
-    char nm[64];
+    block_worker_t *dest;
+    block_pending_t *p;
     int sock;
-    ssize_t sent;
-    time_t now;
-    int numsocks = 1;
 
-#ifdef SYLVERANT_ENABLE_IPV6
-    if(enable_ipv6) {
-        numsocks = 2;
+    len = sizeof(struct sockaddr_storage);
+    if((sock = accept(lis->sock, addr_p, &len)) < 0) {
+        perror("accept");
+        return;
     }
-#endif
 
-    debug(DBG_LOG, "%s(%d): Up and running\n", s->cfg->name, b->b);
+    my_ntop(&addr, ipstr);
+    debug(DBG_LOG, "%s(%d): Accepted %s block connection from %s\n",
+          s->cfg->name, b->b, lis->desc, ipstr);
 
-    /* While we're still supposed to run... do it. */
-    while(b->run) {
-        /* Clear the fd_sets so we can use them again. */
-        nfds = 0;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        timeout.tv_sec = 15;
-        timeout.tv_usec = 0;
-        now = time(NULL);
-
-        /* Fill the sockets into the fd_sets so we can use select below. */
-        pthread_rwlock_rdlock(&b->lock);
+    /* Spread the connections out over the workers in turn. */
+    dest = &b->workers[b->next_worker];
+    b->next_worker = (b->next_worker + 1) % b->num_workers;
 
-        TAILQ_FOREACH(it, b->clients, qentry) {
-            /* If we haven't heard from a client in a minute and a half, it is
-               probably dead. Disconnect it. */
-            if(now > it->last_message + 90) {
-                if(it->bb_pl) {
-                    istrncpy16(ic_utf16_to_utf8, nm,
-                               &it->pl->bb.character.name[2], 64);
-                    debug(DBG_LOG, "Ping Timeout: %s(%d)\n", nm, it->guildcard);
-                }
-                else if(it->pl) {
-                    debug(DBG_LOG, "Ping Timeout: %s(%d)\n", it->pl->v1.name,
-                          it->guildcard);
-                }
+    if(dest == w) {
+        block_setup_client(w, sock, lis->version, addr_p, len);
+        return;
+    }
 
-                it->flags |= CLIENT_FLAG_DISCONNECTED;
+    /* Hand it off to the worker that will own it, since only that worker can
+       touch its timers. */
+    if(!(p = (block_pending_t *)malloc(sizeof(block_pending_t)))) {
+        debug(DBG_ERROR, "%s(%d): Cannot allocate memory for connection!\n",
+              s->cfg->name, b->b);
+        close(sock);
+        return;
+    }
 
-                /* Make sure that we disconnect the client ASAP! */
-                timeout.tv_sec = 0;
+    p->sock = sock;
+    p->version = lis->version;
+    p->len = len;
+    memcpy(&p->addr, &addr, len);
 
-                continue;
-            }
-            /* Otherwise, if we haven't heard from them in half of a minute,
-               ping them. */
-            else if(now > it->last_message + 30 && now > it->last_sent + 10) {
-                if(send_simple(it, PING_TYPE, 0)) {
-                    it->flags |= CLIENT_FLAG_DISCONNECTED;
-                    timeout.tv_sec = 0;
-                    continue;
-                }
+    pthread_mutex_lock(&dest->pending_lock);
+    TAILQ_INSERT_TAIL(&dest->pending, p, qentry);
+    pthread_mutex_unlock(&dest->pending_lock);
 
-                it->last_sent = now;
-            }
+    write(dest->pipes[1], "\xFF", 1);
+}
 
-            /* Check if their timeout expired to login after getting a
-               protection message. */
-            if((it->flags & CLIENT_FLAG_GC_PROTECT) &&
-               it->join_time + 60 < now) {
-                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                timeout.tv_sec = 0;
-                continue;
-            }
+/* Read and handle everything waiting from a client on a block with more than
+   one worker. Reading and decrypting happen alongside the other workers, but
+   handling the packets is still done under the block's dispatch lock, so only
+   one worker at a time runs the packet handlers. That lock has to be taken
+   before the client list lock and the client's own mutex, since the packet
+   handlers will go on to lock other clients in the same lobby (which may be in
+   the middle of a read on another worker), and will take the client list lock
+   again themselves. */
+static int block_worker_read(block_t *b, ship_client_t *c) {
+    int rv, rv2;
+
+    do {
+        pthread_mutex_lock(&c->mutex);
+        rv = client_recv(c);
+        pthread_mutex_unlock(&c->mutex);
 
-            FD_SET(it->sock, &readfds);
+        pthread_mutex_lock(&b->dispatch_lock);
+        pthread_rwlock_rdlock(&b->lock);
+        pthread_mutex_lock(&c->mutex);
+        rv2 = client_handle_pkts(c);
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
+        pthread_mutex_unlock(&b->dispatch_lock);
+    } while(!rv && !rv2 && !(c->flags & CLIENT_FLAG_DISCONNECTED));
 
-            /* Only add to the write fd set if we have something to send out. */
-            if(it->sendbuf_cur) {
-                FD_SET(it->sock, &writefds);
-            }
+    return (rv < 0 || rv2) ? -1 : 0;
+}
 
-            nfds = nfds > it->sock ? nfds : it->sock;
-        }
+static void *block_thd(void *d) {
+    block_worker_t *w = (block_worker_t *)d;
+    block_t *b = w->b;
+    ship_t *s = b->ship;
+    int i, j, nev, nls = 0, err;
+    evloop_event_t evs[BLOCK_MAX_EVENTS];
+    block_listener_t lis[10];
+    ship_client_t *it, *tmp;
+    char ipstr[INET6_ADDRSTRLEN];
+    char nm[64];
+    uint8_t dummy;
+    uint64_t now;
+    int numsocks = 1;
+    int cork = client_tcp_cork && !client_defer_sends;
 
-        pthread_rwlock_unlock(&b->lock);
+#ifdef SYLVERANT_ENABLE_IPV6
+    if(enable_ipv6) {
+        numsocks = 2;
+    }
+#endif
 
-        /* Add the listening sockets to the read fd_set. */
+    /* The first worker accepts all the new connections for the block. Unlike
+       the clients, the listening sockets are level-triggered, so we only need
+       to accept one connection per wakeup. */
+    if(!w->id) {
         for(i = 0; i < numsocks; ++i) {
-            FD_SET(b->dcsock[i], &readfds);
-            nfds = nfds > b->dcsock[i] ? nfds : b->dcsock[i];
-            FD_SET(b->pcsock[i], &readfds);
-            nfds = nfds > b->pcsock[i] ? nfds : b->pcsock[i];
-            FD_SET(b->gcsock[i], &readfds);
-            nfds = nfds > b->gcsock[i] ? nfds : b->gcsock[i];
-            FD_SET(b->ep3sock[i], &readfds);
-            nfds = nfds > b->ep3sock[i] ? nfds : b->ep3sock[i];
-            FD_SET(b->bbsock[i], &readfds);
-            nfds = nfds > b->bbsock[i] ? nfds : b->bbsock[i];
-        }
-
-        FD_SET(b->pipes[1], &readfds);
-        nfds = nfds > b->pipes[1] ? nfds : b->pipes[1];
-
-        /* Wait for some activity... */
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
-            if(FD_ISSET(b->pipes[1], &readfds)) {
-                read(b->pipes[1], &len, 1);
-            }
-
-            for(i = 0; i < numsocks; ++i) {
-                if(FD_ISSET(b->dcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->dcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted DC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+            lis[nls++] = (block_listener_t){ b->dcsock[i], CLIENT_VERSION_DCV1,
+                                             "DC" };
+            lis[nls++] = (block_listener_t){ b->pcsock[i], CLIENT_VERSION_PC,
+                                             "PC" };
+            lis[nls++] = (block_listener_t){ b->gcsock[i], CLIENT_VERSION_GC,
+                                             "GC" };
+            lis[nls++] = (block_listener_t){ b->ep3sock[i],
+                                             CLIENT_VERSION_EP3, "Episode 3" };
+            lis[nls++] = (block_listener_t){ b->bbsock[i], CLIENT_VERSION_BB,
+                                             "Blue Burst" };
+        }
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_DCV1,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+        for(i = 0; i < nls; ++i) {
+            if(evloop_add(w->evloop, lis[i].sock, EVLOOP_READ, &lis[i])) {
+                debug(DBG_ERROR, "%s(%d): Cannot add listening socket to "
+                      "event loop: %s\n", s->cfg->name, b->b, strerror(errno));
+            }
+        }
+    }
 
-                if(FD_ISSET(b->pcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->pcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    evloop_add(w->evloop, w->pipes[0], EVLOOP_READ, w->pipes);
+    client_set_thread_worker(w);
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted PC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+    if(b->num_workers > 1)
+        debug(DBG_LOG, "%s(%d): Worker %d up and running\n", s->cfg->name,
+              b->b, w->id);
+    else
+        debug(DBG_LOG, "%s(%d): Up and running\n", s->cfg->name, b->b);
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_PC,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
+    /* While we're still supposed to run... do it. */
+    while(b->run) {
+        /* Wait for some activity, or for the next client deadline to come
+           around, whichever happens first. */
+        nev = evloop_wait(w->evloop, evs, BLOCK_MAX_EVENTS,
+                          timer_wheel_timeout(&w->timers, get_ms_time()));
+
+        /* Handle the pipe and any new connections first, since they don't need
+           the client list to be locked. */
+        for(i = 0; i < nev; ++i) {
+            if(evs[i].data == w->pipes) {
+                /* Either someone marked one of our clients as disconnected
+                   from another thread, we've been handed new connections, or
+                   we're shutting down. */
+                while(read(w->pipes[0], &dummy, 1) > 0) {
                 }
 
-                if(FD_ISSET(b->gcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->gcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted GC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+                block_setup_pending(w);
+                w->reap = 1;
+                evs[i].data = NULL;
+                continue;
+            }
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_GC,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
+            for(j = 0; j < nls; ++j) {
+                if(evs[i].data == &lis[j]) {
+                    block_accept(w, &lis[j]);
+                    evs[i].data = NULL;
+                    break;
                 }
+            }
+        }
 
-                if(FD_ISSET(b->ep3sock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->ep3sock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+        /* Process client connections that have something going on. Only this
+           worker ever removes its clients from the list, so there's no need to
+           lock the list just to keep them around. */
+        for(i = 0; i < nev; ++i) {
+            if(!(it = (ship_client_t *)evs[i].data))
+                continue;
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted Episode 3 block "
-                          "connection from %s\n", s->cfg->name, b->b, ipstr);
+            err = 0;
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_EP3,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+            /* Check if this connection was trying to send us something. */
+            if((evs[i].events & EVLOOP_READ) &&
+               !(it->flags & CLIENT_FLAG_DISCONNECTED)) {
+                /* Anything we send back in response should go out in as few
+                   segments as possible. Coalesced sends take care of this with
+                   MSG_MORE on their own. */
+                if(cork)
+                    client_cork(it, 1);
 
-                if(FD_ISSET(b->bbsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->bbsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+                if(b->num_workers > 1) {
+                    err = block_worker_read(b, it);
+                }
+                else {
+                    pthread_rwlock_rdlock(&b->lock);
+                    pthread_mutex_lock(&it->mutex);
+                    err = client_process_pkt(it);
+                    pthread_mutex_unlock(&it->mutex);
+                    pthread_rwlock_unlock(&b->lock);
+                }
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted Blue Burst block "
-                          "connection from %s\n", s->cfg->name, b->b, ipstr);
+                /* If they just logged in, let everyone else find them. This
+                   can't be done from the login handlers, since those run with
+                   the client's mutex held. Their guildcard number is only
+                   ever set from this thread. */
+                if(it->guildcard && !it->gc_indexed &&
+                   !(it->flags & CLIENT_FLAG_DISCONNECTED))
+                    gcindex_add(it);
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_BB,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+                if(cork)
+                    client_cork(it, 0);
             }
 
-            pthread_rwlock_rdlock(&b->lock);
-
-            /* Process client connections. */
-            TAILQ_FOREACH(it, b->clients, qentry) {
-                pthread_mutex_lock(&it->mutex);
+            pthread_mutex_lock(&it->mutex);
 
-                /* Check if this connection was trying to send us something. */
-                if(FD_ISSET(it->sock, &readfds)) {
-                    if(client_process_pkt(it)) {
-                        it->flags |= CLIENT_FLAG_DISCONNECTED;
-                        pthread_mutex_unlock(&it->mutex);
-                        continue;
-                    }
-                }
+            if(err)
+                it->flags |= CLIENT_FLAG_DISCONNECTED;
 
-                /* If we have anything to write, check if we can right now. */
-                if(FD_ISSET(it->sock, &writefds)) {
-                    if(it->sendbuf_cur) {
-                        sent = send(it->sock, it->sendbuf + it->sendbuf_start,
-                                    it->sendbuf_cur - it->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                                pthread_mutex_unlock(&it->mutex);
-                                continue;
-                            }
-                        }
-                        else {
-                            it->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(it->sendbuf_start == it->sendbuf_cur) {
-                                free(it->sendbuf);
-                                it->sendbuf = NULL;
-                                it->sendbuf_cur = 0;
-                                it->sendbuf_size = 0;
-                                it->sendbuf_start = 0;
-                            }
-                        }
-                    }
+            /* If we have anything to write, send out as much as we can. */
+            if((evs[i].events & EVLOOP_WRITE) &&
+               !(it->flags & CLIENT_FLAG_DISCONNECTED)) {
+                if(client_flush(it)) {
+                    it->flags |= CLIENT_FLAG_DISCONNECTED;
                 }
-
-                pthread_mutex_unlock(&it->mutex);
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            if(it->flags & CLIENT_FLAG_DISCONNECTED)
+                w->reap = 1;
+
+            pthread_mutex_unlock(&it->mutex);
         }
 
+        /* Take care of any clients whose deadlines have passed. */
+        now = get_ms_time();
+        if(timer_wheel_next(&w->timers) <= now)
+            timer_wheel_run(&w->timers, now);
+
+        /* Send out everything that got queued up along the way. */
+        client_flush_deferred(w);
+
         /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE
            in the middle of a TAILQ_FOREACH, and client_destroy_connection
-           does indeed use TAILQ_REMOVE). */
+           does indeed use TAILQ_REMOVE). This only needs to be done if one of
+           the clients we just looked at has been marked as disconnected, or if
+           another thread told us that it marked one. Each worker only cleans
+           up its own clients, since nobody else can touch their timers. */
+        if(!w->reap)
+            continue;
+
+        w->reap = 0;
+
+        /* Removing someone from their lobby is as good as handling a packet,
+           so it needs the dispatch lock too. */
+        if(b->num_workers > 1)
+            pthread_mutex_lock(&b->dispatch_lock);
+
         pthread_rwlock_wrlock(&b->lock);
         it = TAILQ_FIRST(b->clients);
         while(it) {
             tmp = TAILQ_NEXT(it, qentry);
 
-            if(it->flags & CLIENT_FLAG_DISCONNECTED) {
+            if(it->worker == w && (it->flags & CLIENT_FLAG_DISCONNECTED)) {
                 if(it->bb_pl) {
                     istrncpy16(ic_utf16_to_utf8, nm,
                                &it->pl->bb.character.name[2], 64);
@@ -337,11 +521,81 @@ static void *block_thd(void *d) {
         }
 
         pthread_rwlock_unlock(&b->lock);
+
+        if(b->num_workers > 1)
+            pthread_mutex_unlock(&b->dispatch_lock);
+    }
+
+    for(i = 0; i < nls; ++i) {
+        evloop_del(w->evloop, lis[i].sock);
     }
 
+    evloop_del(w->evloop, w->pipes[0]);
+
+    if(client_defer_sends)
+        debug(DBG_LOG, "%s(%d): Worker %d saved %" PRId64 " send calls by "
+              "coalescing\n", s->cfg->name, b->b, w->id, w->sends_saved);
+
+    if(lobby_move_ms)
+        debug(DBG_LOG, "%s(%d): Worker %d held back %" PRId64 " outdated "
+              "movement packets\n", s->cfg->name, b->b, w->id, w->moves_saved);
+
     pthread_exit(NULL);
 }
 
+/* Set up everything a worker needs, short of actually starting its thread. */
+static int block_worker_init(block_t *b, block_worker_t *w, int id,
+                             uint32_t rng_seed) {
+    memset(w, 0, sizeof(block_worker_t));
+    w->b = b;
+    w->id = id;
+
+    /* Make our pipe. Neither end of it should ever block, since any number of
+       wakeups pending at once are as good as one. */
+    if(pipe(w->pipes) == -1) {
+        debug(DBG_ERROR, "%s(%d): Cannot create pipe!\n", b->ship->cfg->name,
+              b->b);
+        return -1;
+    }
+
+    fcntl(w->pipes[0], F_SETFL, fcntl(w->pipes[0], F_GETFL) | O_NONBLOCK);
+    fcntl(w->pipes[1], F_SETFL, fcntl(w->pipes[1], F_GETFL) | O_NONBLOCK);
+
+    /* Create the event loop that the worker's thread will wait on. */
+    if(!(w->evloop = evloop_create())) {
+        debug(DBG_ERROR, "%s(%d): Cannot create event loop!\n",
+              b->ship->cfg->name, b->b);
+        close(w->pipes[0]);
+        close(w->pipes[1]);
+        return -1;
+    }
+
+    timer_wheel_init(&w->timers, get_ms_time());
+    pthread_mutex_init(&w->pending_lock, NULL);
+    TAILQ_INIT(&w->pending);
+    TAILQ_INIT(&w->flushq);
+    mt19937_init(&w->rng, rng_seed);
+
+    return 0;
+}
+
+static void block_worker_cleanup(block_worker_t *w) {
+    block_pending_t *p;
+
+    /* Anything that got handed off right as we shut down never got set up, so
+       just drop the connection. */
+    while((p = TAILQ_FIRST(&w->pending))) {
+        TAILQ_REMOVE(&w->pending, p, qentry);
+        close(p->sock);
+        free(p);
+    }
+
+    pthread_mutex_destroy(&w->pending_lock);
+    evloop_destroy(w->evloop);
+    close(w->pipes[0]);
+    close(w->pipes[1]);
+}
+
 block_t *block_server_start(ship_t *s, int b, uint16_t port) {
     block_t *rv;
     int dcsock[2] = { -1, -1 }, pcsock[2] = { -1, -1 };
@@ -417,19 +671,38 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
 
     memset(rv, 0, sizeof(block_t));
 
-    /* Make our pipe */
-    if(pipe(rv->pipes) == -1) {
-        debug(DBG_ERROR, "%s(%d): Cannot create pipe!\n", s->cfg->name, b);
-        goto err_free;
-    }
-
     /* Make room for the client list. */
     rv->clients = (struct client_queue *)malloc(sizeof(struct client_queue));
 
     if(!rv->clients) {
         debug(DBG_ERROR, "%s(%d): Cannot allocate memory for clients!\n",
               s->cfg->name, b);
-        goto err_pipes;
+        goto err_free;
+    }
+
+    /* Make room for the workers. */
+    rv->workers = (block_worker_t *)malloc(sizeof(block_worker_t) *
+                                           block_workers);
+
+    if(!rv->workers) {
+        debug(DBG_ERROR, "%s(%d): Cannot allocate memory for workers!\n",
+              s->cfg->name, b);
+        goto err_clients;
+    }
+
+    /* Initialize the random number generators. The seed value is the current
+       UNIX time, xored with the port (so that each block will use a different
+       seed even though they'll probably get the same timestamp). Each worker
+       gets its own generator as well, seeded a little differently. */
+    rng_seed = (uint32_t)(time(NULL) ^ port);
+    mt19937_init(&rv->rng, rng_seed);
+
+    for(i = 0; i < block_workers; ++i) {
+        if(block_worker_init(rv, &rv->workers[i], i,
+                             rng_seed ^ ((uint32_t)(i + 1) << 16)))
+            goto err_workers;
+
+        ++rv->num_workers;
     }
 
     /* Fill in the structure. */
@@ -455,6 +728,9 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
 
     TAILQ_INIT(&rv->lobbies);
 
+    /* Set up scripting before anything that might want a script table. */
+    script_block_init(rv);
+
     /* Create the first 20 lobbies (the default ones) */
     for(i = 1; i <= 20; ++i) {
         /* Grab a new lobby. XXXX: Check the return value. */
@@ -467,18 +743,25 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
     /* Create the reader-writer locks */
     pthread_rwlock_init(&rv->lock, NULL);
     pthread_rwlock_init(&rv->lobby_lock, NULL);
+    pthread_mutex_init(&rv->dispatch_lock, NULL);
 
-    /* Initialize the random number generator. The seed value is the current
-       UNIX time, xored with the port (so that each block will use a different
-       seed even though they'll probably get the same timestamp). */
-    rng_seed = (uint32_t)(time(NULL) ^ port);
-    mt19937_init(&rv->rng, rng_seed);
+    /* Start up the threads for this block. */
+    for(i = 0; i < rv->num_workers; ++i) {
+        if(pthread_create(&rv->workers[i].thd, NULL, &block_thd,
+                          &rv->workers[i])) {
+            debug(DBG_ERROR, "%s(%d): Cannot start block thread!\n",
+                  s->cfg->name, b);
 
-    /* Start up the thread for this block. */
-    if(pthread_create(&rv->thd, NULL, &block_thd, rv)) {
-        debug(DBG_ERROR, "%s(%d): Cannot start block thread!\n",
-              s->cfg->name, b);
-        goto err_lobbies;
+            /* Stop any that we've already started. */
+            rv->run = 0;
+            block_wake(rv);
+
+            while(i--) {
+                pthread_join(rv->workers[i].thd, NULL);
+            }
+
+            goto err_lobbies;
+        }
     }
 
     return rv;
@@ -491,12 +774,18 @@ err_lobbies:
         l2 = l;
     }
 
+    script_block_cleanup(rv);
     pthread_rwlock_destroy(&rv->lock);
     pthread_rwlock_destroy(&rv->lobby_lock);
+    pthread_mutex_destroy(&rv->dispatch_lock);
+err_workers:
+    for(i = 0; i < rv->num_workers; ++i) {
+        block_worker_cleanup(&rv->workers[i]);
+    }
+
+    free(rv->workers);
+err_clients:
     free(rv->clients);
-err_pipes:
-    close(rv->pipes[0]);
-    close(rv->pipes[1]);
 err_free:
     free(rv);
 err_close_all:
@@ -530,19 +819,20 @@ err_close_dc:
 void block_server_stop(block_t *b) {
     lobby_t *it2, *tmp2;
     ship_client_t *it, *tmp;
+    int i;
 
     /* Set the flag to kill the block. */
     b->run = 0;
 
-    /* Send a byte to the pipe so that we actually break out of the select. */
-    write(b->pipes[0], "\xFF", 1);
+    /* Wake the threads up so that they actually notice. */
+    block_wake(b);
 
-    /* Wait for it to die. */
-    pthread_join(b->thd, NULL);
+    /* Wait for them to die. */
+    for(i = 0; i < b->num_workers; ++i) {
+        pthread_join(b->workers[i].thd, NULL);
+    }
 
     /* Close all the sockets so nobody can connect... */
-    close(b->pipes[0]);
-    close(b->pipes[1]);
     close(b->dcsock[0]);
     close(b->pcsock[0]);
     close(b->gcsock[0]);
@@ -586,10 +876,30 @@ void block_server_stop(block_t *b) {
     pthread_rwlock_destroy(&b->lobby_lock);
     pthread_rwlock_destroy(&b->lock);
 
+    pthread_mutex_destroy(&b->dispatch_lock);
+    script_block_cleanup(b);
+
+    for(i = 0; i < b->num_workers; ++i) {
+        block_worker_cleanup(&b->workers[i]);
+    }
+
+    free(b->workers);
     free(b->clients);
     free(b);
 }
 
+/* Wake up the block's threads. This must be called by anything outside of the
+   block's threads that marks one of its clients as disconnected, otherwise the
+   client won't get cleaned up until its next deadline comes around. */
+void block_wake(block_t *b) {
+    int i;
+
+    /* If a pipe is full, there's already a wakeup on the way. */
+    for(i = 0; i < b->num_workers; ++i) {
+        write(b->workers[i].pipes[1], "\xFF", 1);
+    }
+}
+
 int block_info_reply(ship_client_t *c, uint32_t block) {
     block_t *b;
     char string[256];
@@ -1605,7 +1915,6 @@ static int bb_process_chat(ship_client_t *c, bb_chat_pkt *pkt) {
 
 /* Process a Guild Search request. */
 static int dc_process_guild_search(ship_client_t *c, dc_guild_search_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_target);
     int done = 0, rv = -1;
@@ -1622,44 +1931,29 @@ static int dc_process_guild_search(ship_client_t *c, dc_guild_search_pkt *pkt) {
         return 0;
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
-
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
+    if((it = gcindex_find(gc))) {
+        /* Check if the target has player data. If they're on but don't have
+           data, we're not going to find them anywhere else, return success. */
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
 #ifdef SYLVERANT_ENABLE_IPV6
-                if((c->flags & CLIENT_FLAG_IPV6)) {
-                    rv = send_guild_reply6(c, it);
-                }
-                else {
-                    rv = send_guild_reply(c, it);
-                }
-#else
-                rv = send_guild_reply(c, it);
-#endif
-                done = 1;
-                pthread_mutex_unlock(&it->mutex);
+            if((c->flags & CLIENT_FLAG_IPV6)) {
+                rv = send_guild_reply6(c, it);
             }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
+            else {
+                rv = send_guild_reply(c, it);
             }
-
-            if(done)
-                break;
+#else
+            rv = send_guild_reply(c, it);
+#endif
+            pthread_mutex_unlock(&it->mutex);
+        }
+        else {
+            rv = 0;
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        done = 1;
+        gcindex_release(gc);
     }
 
     /* If we get here, we didn't find it locally. Send to the shipgate to
@@ -1678,7 +1972,6 @@ static int dc_process_guild_search(ship_client_t *c, dc_guild_search_pkt *pkt) {
 }
 
 static int bb_process_guild_search(ship_client_t *c, bb_guild_search_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_target);
     int done = 0, rv = -1;
@@ -1695,44 +1988,29 @@ static int bb_process_guild_search(ship_client_t *c, bb_guild_search_pkt *pkt) {
         return 0;
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
-
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
+    if((it = gcindex_find(gc))) {
+        /* Check if the target has player data. If they're on but don't have
+           data, we're not going to find them anywhere else, return success. */
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
 #ifdef SYLVERANT_ENABLE_IPV6
-                if((c->flags & CLIENT_FLAG_IPV6)) {
-                    rv = send_guild_reply6(c, it);
-                }
-                else {
-                    rv = send_guild_reply(c, it);
-                }
-#else
-                rv = send_guild_reply(c, it);
-#endif
-                done = 1;
-                pthread_mutex_unlock(&it->mutex);
+            if((c->flags & CLIENT_FLAG_IPV6)) {
+                rv = send_guild_reply6(c, it);
             }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
+            else {
+                rv = send_guild_reply(c, it);
             }
-
-            if(done)
-                break;
+#else
+            rv = send_guild_reply(c, it);
+#endif
+            pthread_mutex_unlock(&it->mutex);
+        }
+        else {
+            rv = 0;
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        done = 1;
+        gcindex_release(gc);
     }
 
     /* If we get here, we didn't find it locally. Send to the shipgate to
@@ -1751,7 +2029,6 @@ static int bb_process_guild_search(ship_client_t *c, bb_guild_search_pkt *pkt) {
 }
 
 static int dc_process_mail(ship_client_t *c, dc_simple_mail_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_dest);
     int done = 0, rv = -1;
@@ -1779,29 +2056,17 @@ static int dc_process_mail(ship_client_t *c, dc_simple_mail_pkt *pkt) {
         return 0;
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
-
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
+    if((it = gcindex_find(gc))) {
+        /* Check if the target has player data. If they're on but don't have
+           data, we're not going to find them anywhere else, return success. */
+        rv = 0;
 
-                /* Make sure the user hasn't blacklisted the sender. */
-                if(client_has_blacklisted(it, c->guildcard) ||
-                   client_has_ignored(it, c->guildcard)) {
-                    done = 1;
-                    pthread_mutex_unlock(&it->mutex);
-                    rv = 0;
-                    break;
-                }
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
 
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(it, c->guildcard) &&
+               !client_has_ignored(it, c->guildcard)) {
                 /* Check if the user has an autoreply set. */
                 if(it->autoreply_on) {
                     send_mail_autoreply(c, it);
@@ -1809,20 +2074,13 @@ static int dc_process_mail(ship_client_t *c, dc_simple_mail_pkt *pkt) {
 
                 /* Send the mail. */
                 rv = send_simple_mail(c->version, it, (dc_pkt_hdr_t *)pkt);
-                pthread_mutex_unlock(&it->mutex);
-                done = 1;
-                break;
-            }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
-                break;
             }
+
+            pthread_mutex_unlock(&it->mutex);
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        done = 1;
+        gcindex_release(gc);
     }
 
     if(!done) {
@@ -1835,7 +2093,6 @@ static int dc_process_mail(ship_client_t *c, dc_simple_mail_pkt *pkt) {
 }
 
 static int pc_process_mail(ship_client_t *c, pc_simple_mail_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_dest);
     int done = 0, rv = -1;
@@ -1863,49 +2120,30 @@ static int pc_process_mail(ship_client_t *c, pc_simple_mail_pkt *pkt) {
         return 0;
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
+    if((it = gcindex_find(gc))) {
+        /* Check if the target has player data. If they're on but don't have
+           data, we're not going to find them anywhere else, return success. */
+        rv = 0;
 
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
-
-                /* Make sure the user hasn't blacklisted the sender. */
-                if(client_has_blacklisted(it, c->guildcard) ||
-                   client_has_ignored(it, c->guildcard)) {
-                    done = 1;
-                    pthread_mutex_unlock(&it->mutex);
-                    rv = 0;
-                    break;
-                }
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
 
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(it, c->guildcard) &&
+               !client_has_ignored(it, c->guildcard)) {
                 /* Check if the user has an autoreply set. */
                 if(it->autoreply_on) {
                     send_mail_autoreply(c, it);
                 }
 
                 rv = send_simple_mail(c->version, it, (dc_pkt_hdr_t *)pkt);
-                pthread_mutex_unlock(&it->mutex);
-                done = 1;
-                break;
-            }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
-                break;
             }
+
+            pthread_mutex_unlock(&it->mutex);
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        done = 1;
+        gcindex_release(gc);
     }
 
     if(!done) {
@@ -1918,7 +2156,6 @@ static int pc_process_mail(ship_client_t *c, pc_simple_mail_pkt *pkt) {
 }
 
 static int bb_process_mail(ship_client_t *c, bb_simple_mail_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_dest);
     int done = 0, rv = -1;
@@ -1946,49 +2183,30 @@ static int bb_process_mail(ship_client_t *c, bb_simple_mail_pkt *pkt) {
         return 0;
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
+    if((it = gcindex_find(gc))) {
+        /* Check if the target has player data. If they're on but don't have
+           data, we're not going to find them anywhere else, return success. */
+        rv = 0;
 
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
-
-                /* Make sure the user hasn't blacklisted the sender. */
-                if(client_has_blacklisted(it, c->guildcard) ||
-                   client_has_ignored(it, c->guildcard)) {
-                    done = 1;
-                    pthread_mutex_unlock(&it->mutex);
-                    rv = 0;
-                    break;
-                }
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
 
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(it, c->guildcard) &&
+               !client_has_ignored(it, c->guildcard)) {
                 /* Check if the user has an autoreply set. */
                 if(it->autoreply_on) {
                     send_mail_autoreply(c, it);
                 }
 
                 rv = send_bb_simple_mail(it, pkt);
-                pthread_mutex_unlock(&it->mutex);
-                done = 1;
-                break;
-            }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
-                break;
             }
+
+            pthread_mutex_unlock(&it->mutex);
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        done = 1;
+        gcindex_release(gc);
     }
 
     if(!done) {
@@ -2548,7 +2766,7 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
             pthread_rwlock_rdlock(&ship->qlock);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(ship->qmap.count) {
                 lang = (menu_id >> 24) & 0xFF;
                 rv = send_quest_list(c, (int)item_id, lang);
             }
@@ -2724,7 +2942,7 @@ static int process_info_req(ship_client_t *c, uint32_t menu_id,
             pthread_rwlock_rdlock(&ship->qlock);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(ship->qmap.count) {
                 rv = send_quest_info(c->cur_lobby, item_id, lang);
             }
             else {
@@ -2991,8 +3209,12 @@ static int process_qload_done(ship_client_t *c) {
     /* If we get here, everyone's done. Send out the packet to everyone now. */
     for(i = 0; i < l->max_clients; ++i) {
         if((c2 = l->clients[i]) && c2->version >= CLIENT_VERSION_GC) {
-            if(send_simple(c2, QUEST_LOAD_DONE_TYPE, 0))
+            if(send_simple(c2, QUEST_LOAD_DONE_TYPE, 0)) {
+                /* The client might belong to another of the block's
+                   workers, so make sure it notices. */
                 c2->flags |= CLIENT_FLAG_DISCONNECTED;
+                block_wake(c2->cur_block);
+            }
         }
     }
 
@@ -3071,17 +3293,14 @@ int send_motd(ship_client_t *c) {
 ship_client_t *block_find_client(block_t *b, uint32_t gc) {
     ship_client_t *it;
 
-    pthread_rwlock_rdlock(&b->lock);
+    if((it = gcindex_find(gc))) {
+        if(it->cur_block != b)
+            it = NULL;
 
-    TAILQ_FOREACH(it, b->clients, qentry) {
-        if(it->guildcard == gc) {
-            pthread_rwlock_unlock(&b->lock);
-            return it;
-        }
+        gcindex_release(gc);
     }
 
-    pthread_rwlock_unlock(&b->lock);
-    return NULL;
+    return it;
 }
 
 /* Process block commands for a Dreamcast client. */
@@ -3257,7 +3476,7 @@ static int dc_process_pkt(ship_client_t *c, uint8_t *pkt) {
             pthread_mutex_lock(&c->cur_lobby->mutex);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(ship->qmap.count) {
                 c->cur_lobby->flags |= LOBBY_FLAG_QUESTSEL;
                 rv = send_quest_categories(c, c->q_lang);
             }
@@ -3504,7 +3723,7 @@ static int bb_process_pkt(ship_client_t *c, uint8_t *pkt) {
             pthread_mutex_lock(&c->cur_lobby->mutex);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(ship->qmap.count) {
                 c->cur_lobby->flags |= LOBBY_FLAG_QUESTSEL;
                 rv = send_quest_categories(c, c->q_lang);
             }
@@ -3548,7 +3767,48 @@ static int bb_process_pkt(ship_client_t *c, uint8_t *pkt) {
 }
 
 /* Process any packet that comes into a block. */
+/* Send on any movement being held for the client before handling a packet
+   from it that isn't a broadcast subcommand, so that nothing the client sends
+   later can reach anyone before it. Broadcast subcommands sort this out for
+   themselves, since a newer movement can replace the held one. */
+static int block_settle_move(ship_client_t *c, uint8_t *pkt) {
+    lobby_t *l;
+    uint16_t type;
+    int rv = 0;
+
+    if(!c->move_pending)
+        return 0;
+
+    switch(c->version) {
+        case CLIENT_VERSION_BB:
+            type = LE16(((bb_pkt_hdr_t *)pkt)->pkt_type);
+            break;
+
+        case CLIENT_VERSION_PC:
+            type = ((pc_pkt_hdr_t *)pkt)->pkt_type;
+            break;
+
+        default:
+            type = ((dc_pkt_hdr_t *)pkt)->pkt_type;
+    }
+
+    if(type == GAME_COMMAND0_TYPE)
+        return 0;
+
+    if((l = c->cur_lobby)) {
+        pthread_mutex_lock(&l->mutex);
+        rv = subcmd_flush_move(c, l);
+        pthread_mutex_unlock(&l->mutex);
+    }
+
+    c->move_pending = 0;
+    return rv;
+}
+
 int block_process_pkt(ship_client_t *c, uint8_t *pkt) {
+    if(block_settle_move(c, pkt))
+        return -1;
+
     switch(c->version) {
         case CLIENT_VERSION_DCV1:
         case CLIENT_VERSION_DCV2:
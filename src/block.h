@@ -20,11 +20,15 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
 
 #include <sylverant/config.h>
 #include <sylverant/mtwist.h>
 
 #include "lobby.h"
+#include "evloop.h"
+#include "timers.h"
 
 /* Forward declarations. */
 struct ship;
@@ -41,10 +45,67 @@ typedef struct ship_client ship_client_t;
 typedef struct ship ship_t;
 #endif
 
+/* The most worker threads that any one block can be split across. */
+#define BLOCK_MAX_WORKERS   64
+
+/* A connection that the block has accepted, but that hasn't been picked up by
+   the worker that it was handed off to yet. */
+typedef struct block_pending {
+    TAILQ_ENTRY(block_pending) qentry;
+    int sock;
+    int version;
+    socklen_t len;
+    struct sockaddr_storage addr;
+} block_pending_t;
+
+TAILQ_HEAD(block_pending_queue, block_pending);
+TAILQ_HEAD(block_flush_queue, ship_client);
+
+/* One of the threads servicing the clients on a block. Each client belongs to
+   exactly one worker for its whole life. The first worker also accepts all new
+   connections for the block and hands them out to the rest. */
+typedef struct block_worker {
+    struct block *b;
+    int id;
+
+    pthread_t thd;
+    evloop_t *evloop;
+    int pipes[2];
+
+    /* Ping, timeout, and protection deadlines for each client. This (and the
+       reap flag) is only ever touched by the worker's own thread. */
+    timer_wheel_t timers;
+    int reap;
+
+    /* Connections waiting to be set up by this worker */
+    pthread_mutex_t pending_lock;
+    struct block_pending_queue pending;
+
+    /* Random number generator state, for setting up new connections */
+    struct mt19937_state rng;
+
+    /* Clients with coalesced output waiting to go out at the end of this pass
+       through the event loop, and how many send calls that has saved so far.
+       Both of these are only touched by the worker's own thread. */
+    struct block_flush_queue flushq;
+    int64_t sends_saved;
+
+    /* How many movement packets from this worker's clients have been replaced
+       by newer ones before they were sent, in lobbies that coalesce them. */
+    int64_t moves_saved;
+} block_worker_t;
+
 struct block {
     ship_t *ship;
 
-    pthread_t thd;
+    /* Threads servicing the block's clients. When there's more than one, only
+       one at a time may be handling packets from its clients, since handling a
+       packet can touch any other client in the same lobby. The dispatch lock
+       must be taken before the client list lock by the workers. */
+    block_worker_t *workers;
+    int num_workers;
+    int next_worker;
+    pthread_mutex_t dispatch_lock;
 
     /* Reader-writer lock for the client tailqueue */
     pthread_rwlock_t lock;
@@ -59,8 +120,6 @@ struct block {
     int ep3sock[2];
     int bbsock[2];
 
-    int pipes[2];
-
     uint16_t dc_port;
     uint16_t pc_port;
     uint16_t gc_port;
@@ -74,6 +133,9 @@ struct block {
 
     /* Random number generator state */
     struct mt19937_state rng;
+
+    /* The script interpreter for the block, which may be the ship's */
+    struct script_state *scripts;
 };
 
 #ifndef BLOCK_DEFINED
@@ -83,6 +145,7 @@ typedef struct block block_t;
 
 block_t *block_server_start(ship_t *s, int b, uint16_t port);
 void block_server_stop(block_t *b);
+void block_wake(block_t *b);
 int block_process_pkt(ship_client_t *c, uint8_t *pkt);
 
 lobby_t *block_get_lobby(block_t *b, uint32_t lobby_id);
@@ -24,7 +24,11 @@
 #include <time.h>
 #include <errno.h>
 #include <math.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <sylverant/encryption.h>
 #include <sylverant/mtwist.h>
@@ -39,6 +43,8 @@
 #include "subcmd.h"
 #include "mapdata.h"
 #include "items.h"
+#include "gcindex.h"
+#include "quest_functions.h"
 
 #ifdef ENABLE_LUA
 #include <lua.h>
@@ -58,6 +64,17 @@ pthread_key_t recvbuf_key;
 /* The key for accessing our thread-specific send buffer. */
 pthread_key_t sendbuf_key;
 
+/* The key for finding out which block worker (if any) the current thread is. */
+static pthread_key_t worker_key;
+
+/* The most chunks of a client's send queue to hand to the kernel at once. */
+#define CLIENT_MAX_IOV      64
+
+extern int client_defer_sends;
+extern int client_tcp_cork;
+
+static int client_send_queued(ship_client_t *c);
+
 /* Destructor for the thread-specific receive buffer */
 static void buf_dtor(void *rb) {
     free(rb);
@@ -75,6 +92,17 @@ int client_init(sylverant_ship_t *cfg) {
         return -1;
     }
 
+    if(pthread_key_create(&worker_key, NULL)) {
+        perror("pthread_key_create");
+        return -1;
+    }
+
+    if(gcindex_init())
+        return -1;
+
+    if(pktcap_init())
+        return -1;
+
     return 0;
 }
 
@@ -82,14 +110,20 @@ int client_init(sylverant_ship_t *cfg) {
 void client_shutdown(void) {
     pthread_key_delete(recvbuf_key);
     pthread_key_delete(sendbuf_key);
+    pthread_key_delete(worker_key);
+    pktcap_shutdown();
+    gcindex_cleanup();
+    sendq_pool_cleanup();
 }
 
-/* Create a new connection, storing it in the list of clients. */
+/* Create a new connection, storing it in the list of clients. The socket is
+   closed if anything goes wrong. */
 ship_client_t *client_create_connection(int sock, int version, int type,
                                         struct client_queue *clients,
-                                        ship_t *ship, block_t *block,
+                                        ship_t *ship, block_worker_t *w,
                                         struct sockaddr *ip, socklen_t size) {
     ship_client_t *rv = (ship_client_t *)malloc(sizeof(ship_client_t));
+    block_t *block = w ? w->b : NULL;
     uint32_t client_seed_dc, server_seed_dc;
     uint8_t client_seed_bb[48], server_seed_bb[48];
     int i;
@@ -98,6 +132,7 @@ ship_client_t *client_create_connection(int sock, int version, int type,
 
     if(!rv) {
         perror("malloc");
+        close(sock);
         return NULL;
     }
 
@@ -156,6 +191,8 @@ ship_client_t *client_create_connection(int sock, int version, int type,
     rv->sock = sock;
     rv->version = version;
     rv->cur_block = block;
+    rv->worker = w;
+    rv->evloop = (type == CLIENT_TYPE_SHIP) ? ship->evloop : w->evloop;
     rv->arrow = 1;
     rv->last_message = rv->login_time = time(NULL);
     rv->hdr_size = 4;
@@ -176,18 +213,32 @@ ship_client_t *client_create_connection(int sock, int version, int type,
     rv->ckey.type = 0xFF;
     rv->skey.type = 0xFF;
 
+    /* The socket is edge-triggered in the event loop, so it can never block on
+       us. Anything that can't be sent right away gets buffered instead. */
+    if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        goto err_sock;
+    }
+
+    /* Register the socket with the event loop before we send anything, in case
+       the welcome packet has to be buffered. */
+    if(evloop_add(rv->evloop, sock, CLIENT_EVLOOP_EVENTS, rv)) {
+        perror("evloop_add");
+        goto err_sock;
+    }
+
     if(type == CLIENT_TYPE_SHIP) {
         rv->flags |= CLIENT_FLAG_TYPE_SHIP;
         rng = &ship->rng;
     }
     else {
-        rng = &block->rng;
+        rng = &w->rng;
     }
 
 #ifdef ENABLE_LUA
     /* Initialize the script table */
-    lua_newtable(ship->lstate);
-    rv->script_ref = luaL_ref(ship->lstate, LUA_REGISTRYINDEX);
+    rv->scripts = block ? block->scripts : ship->scripts;
+    rv->script_ref = script_table_new(rv->scripts);
 #endif
 
     switch(version) {
@@ -254,10 +305,18 @@ ship_client_t *client_create_connection(int sock, int version, int type,
 
     /* Insert it at the end of our list, and we're done. */
     if(type == CLIENT_TYPE_BLOCK) {
+        /* On a block with more than one worker, the dispatch lock always has to
+           be taken before the client list lock. */
+        if(block->num_workers > 1)
+            pthread_mutex_lock(&block->dispatch_lock);
+
         pthread_rwlock_wrlock(&block->lock);
         TAILQ_INSERT_TAIL(clients, rv, qentry);
         ++block->num_clients;
         pthread_rwlock_unlock(&block->lock);
+
+        if(block->num_workers > 1)
+            pthread_mutex_unlock(&block->dispatch_lock);
     }
     else {
         TAILQ_INSERT_TAIL(clients, rv, qentry);
@@ -270,9 +329,17 @@ ship_client_t *client_create_connection(int sock, int version, int type,
 err:
 #ifdef ENABLE_LUA
     /* Remove the table from the registry */
-    luaL_unref(ship->lstate, LUA_REGISTRYINDEX, rv->script_ref);
+    script_table_free(rv->scripts, rv->script_ref);
 #endif
 
+    evloop_del(rv->evloop, sock);
+    sendq_clear(&rv->sendq);
+
+    /* The welcome packet may have put us on the worker's flush list. */
+    if(rv->flush_queued)
+        TAILQ_REMOVE(&rv->worker->flushq, rv, fentry);
+
+err_sock:
     close(sock);
 
     if(type == CLIENT_TYPE_BLOCK) {
@@ -291,7 +358,6 @@ err:
 void client_destroy_connection(ship_client_t *c,
                                struct client_queue *clients) {
     time_t now = time(NULL);
-    char tstr[26];
     script_action_t action = ScriptActionClientShipLogout;
 
     if(!(c->flags & CLIENT_FLAG_TYPE_SHIP))
@@ -299,6 +365,18 @@ void client_destroy_connection(ship_client_t *c,
 
     TAILQ_REMOVE(clients, c, qentry);
 
+    /* Make sure the block doesn't try to ping them after they're gone, and
+       that nobody else can find them anymore. */
+    if(!(c->flags & CLIENT_FLAG_TYPE_SHIP)) {
+        gcindex_remove(c);
+        timer_del(&c->worker->timers, &c->timer);
+        timer_del(&c->worker->timers, &c->move_timer);
+        timer_del(&c->worker->timers, &c->qflag_timer);
+
+        if(c->flush_queued)
+            TAILQ_REMOVE(&c->worker->flushq, c, fentry);
+    }
+
     /* If the client was on Blue Burst, update their db character */
     if(c->version == CLIENT_VERSION_BB &&
        !(c->flags & CLIENT_FLAG_TYPE_SHIP)) {
@@ -313,7 +391,7 @@ void client_destroy_connection(ship_client_t *c,
 
 #ifdef ENABLE_LUA
     /* Remove the table from the registry */
-    luaL_unref(ship->lstate, LUA_REGISTRYINDEX, c->script_ref);
+    script_table_free(c->scripts, c->script_ref);
 #endif
 
     /* If the user was on a block, notify the shipgate */
@@ -329,6 +407,10 @@ void client_destroy_connection(ship_client_t *c,
 
     ship_dec_clients(ship);
 
+    /* Anything the player's quest changed that hasn't been written back yet
+       needs to go out now. */
+    quest_flag_cache_destroy(c);
+
     /* If the client has a lobby sitting around that was created but not added
        to the list of lobbies, destroy it */
     if(c->create_lobby) {
@@ -336,14 +418,17 @@ void client_destroy_connection(ship_client_t *c,
     }
 
     /* If we were logging the user, close the file */
-    if(c->logfile) {
-        ctime_r(&now, tstr);
-        tstr[strlen(tstr) - 1] = 0;
-        fprintf(c->logfile, "[%s] Connection closed\n", tstr);
-        fclose(c->logfile);
+    if(c->capture) {
+        pktcap_close(c->capture, PKTCAP_CLOSED, c->guildcard, c->version);
     }
 
     if(c->sock >= 0) {
+        /* Make one last try at getting out anything still queued up, since it
+           might well be the message explaining why they're being cut off. */
+        if(c->sendq.len)
+            client_send_queued(c);
+
+        evloop_del(c->evloop, c->sock);
         close(c->sock);
     }
 
@@ -354,9 +439,7 @@ void client_destroy_connection(ship_client_t *c,
         free(c->recvbuf);
     }
 
-    if(c->sendbuf) {
-        free(c->sendbuf);
-    }
+    sendq_clear(&c->sendq);
 
     if(c->autoreply) {
         free(c->autoreply);
@@ -387,75 +470,69 @@ void client_destroy_connection(ship_client_t *c,
     free(c);
 }
 
-/* Read data from a client that is connected to any port. */
-int client_process_pkt(ship_client_t *c) {
-    ssize_t sz;
-    uint16_t pkt_sz;
-    int rv = 0;
-    unsigned char *rbp;
-    void *tmp;
-    uint8_t *recvbuf = get_recvbuf();
+/* Figure out how much space the packet with the given (decrypted) header takes
+   up in the receive buffer, or -1 if the header is bad. */
+static int client_pkt_size(ship_client_t *c, const pkt_header_t *hdr) {
+    int pkt_sz;
     int hsz = c->hdr_size;
 
-    /* Make sure we got the recvbuf, otherwise, bail. */
-    if(!recvbuf) {
-        return -1;
-    }
+    /* Read the packet size to see how much we're expecting. */
+    switch(c->version) {
+        case CLIENT_VERSION_DCV1:
+        case CLIENT_VERSION_DCV2:
+        case CLIENT_VERSION_GC:
+        case CLIENT_VERSION_EP3:
+            pkt_sz = LE16(hdr->dc.pkt_len);
+            break;
 
-    /* If we've got anything buffered, copy it out to the main buffer to make
-       the rest of this a bit easier. */
-    if(c->recvbuf_cur) {
-        memcpy(recvbuf, c->recvbuf, c->recvbuf_cur);
-    }
+        case CLIENT_VERSION_PC:
+            pkt_sz = LE16(hdr->pc.pkt_len);
+            break;
 
-    /* Attempt to read, and if we don't get anything, punt. */
-    if((sz = recv(c->sock, recvbuf + c->recvbuf_cur, 65536 - c->recvbuf_cur,
-                  0)) <= 0) {
-        if(sz == -1) {
-            perror("recv");
-        }
+        case CLIENT_VERSION_BB:
+            pkt_sz = LE16(hdr->bb.pkt_len);
+            break;
 
+        default:
+            return -1;
+    }
+
+    /* A packet with a size less than that of it's header is obviously bad.
+       Quite possibly, malicious. */
+    if(pkt_sz < hsz)
         return -1;
+
+    /* We'll always need a multiple of 8 or 4 (depending on the type of
+       the client) bytes. */
+    if(pkt_sz & (hsz - 1)) {
+        pkt_sz = (pkt_sz & (0x10000 - hsz)) + hsz;
     }
 
-    sz += c->recvbuf_cur;
-    c->recvbuf_cur = 0;
-    rbp = recvbuf;
+    return pkt_sz;
+}
+
+/* Decrypt every full packet in the client's receive buffer that hasn't been
+   decrypted yet, in place. Decrypted packets are left for client_handle_pkts,
+   and any partial packet at the end is left where it is. This only touches the
+   client itself, so it doesn't need any lock but the client's mutex. */
+static int client_decrypt_pkts(ship_client_t *c) {
+    unsigned char *rbp = c->recvbuf + c->recvbuf_ready;
+    ssize_t sz = c->recvbuf_cur - c->recvbuf_ready;
+    int pkt_sz;
+    int hsz = c->hdr_size;
 
     /* As long as what we have is long enough, decrypt it. */
-    while(sz >= hsz && rv == 0) {
+    while(sz >= hsz) {
         /* Decrypt the packet header so we know what exactly we're looking
            for, in terms of packet length. */
         if(!(c->flags & CLIENT_FLAG_HDR_READ)) {
+            CRYPT_CryptData(&c->ckey, rbp, hsz, 0);
             memcpy(&c->pkt, rbp, hsz);
-            CRYPT_CryptData(&c->ckey, &c->pkt, hsz, 0);
             c->flags |= CLIENT_FLAG_HDR_READ;
         }
 
-        /* Read the packet size to see how much we're expecting. */
-        switch(c->version) {
-            case CLIENT_VERSION_DCV1:
-            case CLIENT_VERSION_DCV2:
-            case CLIENT_VERSION_GC:
-            case CLIENT_VERSION_EP3:
-                pkt_sz = LE16(c->pkt.dc.pkt_len);
-                break;
-
-            case CLIENT_VERSION_PC:
-                pkt_sz = LE16(c->pkt.pc.pkt_len);
-                break;
-
-            case CLIENT_VERSION_BB:
-                pkt_sz = LE16(c->pkt.bb.pkt_len);
-                break;
-
-            default:
-                return -1;
-        }
-
-        /* A packet with a size less than that of it's header is obviously bad.
-           Quite possibly, malicious. Boot the user and log it. */
-        if(pkt_sz < hsz) {
+        /* Boot the user and log it if the length is bad. */
+        if((pkt_sz = client_pkt_size(c, &c->pkt)) < 0) {
             if(c->guildcard)
                 debug(DBG_WARN, "User %" PRIu32 " sent packet with invalid "
                       "length!\n", c->guildcard);
@@ -466,70 +543,277 @@ int client_process_pkt(ship_client_t *c) {
             return -1;
         }
 
-        /* We'll always need a multiple of 8 or 4 (depending on the type of
-           the client) bytes. */
-        if(pkt_sz & (hsz - 1)) {
-            pkt_sz = (pkt_sz & (0x10000 - hsz)) + hsz;
+        /* Do we have the whole packet? If not, leave it for the next pass. */
+        if(sz < (ssize_t)pkt_sz)
+            break;
+
+        /* Yes, we do, decrypt the rest of it. */
+        CRYPT_CryptData(&c->ckey, rbp + hsz, pkt_sz - hsz, 0);
+        c->last_message = time(NULL);
+
+        /* If we're logging the client, write into the log */
+        if(c->capture) {
+            pktcap_packet(c->capture, PKTCAP_RECV, c->guildcard,
+                          c->version, rbp, pkt_sz);
+        }
+
+        rbp += pkt_sz;
+        sz -= pkt_sz;
+        c->recvbuf_ready += pkt_sz;
+
+        c->flags &= ~CLIENT_FLAG_HDR_READ;
+    }
+
+    return 0;
+}
+
+/* Handle every decrypted packet sitting in the client's receive buffer. Each
+   one is handed off right from the buffer. */
+static int client_dispatch_pkts(ship_client_t *c) {
+    unsigned char *rbp;
+    int rv = 0;
+
+    while(c->recvbuf_start < c->recvbuf_ready && rv == 0) {
+        rbp = c->recvbuf + c->recvbuf_start;
+
+        /* The header was checked when the packet was decrypted. */
+        c->recvbuf_start += client_pkt_size(c, (pkt_header_t *)rbp);
+
+        /* Pass it onto the correct handler. */
+        if(c->flags & CLIENT_FLAG_TYPE_SHIP) {
+            rv = ship_process_pkt(c, rbp);
+        }
+        else {
+            rv = block_process_pkt(c, rbp);
         }
+    }
 
-        /* Do we have the whole packet? */
-        if(sz >= (ssize_t)pkt_sz) {
-            /* Yes, we do, decrypt it. */
-            CRYPT_CryptData(&c->ckey, rbp + hsz, pkt_sz - hsz, 0);
-            memcpy(rbp, &c->pkt, hsz);
-            c->last_message = time(NULL);
+    /* Start over at the beginning of the buffer if we've used up everything,
+       so that we don't have to move anything around later. */
+    if(c->recvbuf_start == c->recvbuf_cur) {
+        c->recvbuf_start = 0;
+        c->recvbuf_ready = 0;
+        c->recvbuf_cur = 0;
+    }
 
-            /* If we're logging the client, write into the log */
-            if(c->logfile) {
-                fprint_packet(c->logfile, rbp, pkt_sz, 1);
+    return rv;
+}
+
+/* Read data from a client that is connected to any port. */
+int client_process_pkt(ship_client_t *c) {
+    int rv;
+
+    /* We only get told when new data shows up on the socket, so keep reading
+       until it runs dry (or the client gets disconnected). */
+    do {
+        if((rv = client_recv(c)) < 0 || client_dispatch_pkts(c))
+            return -1;
+    } while(!rv && !(c->flags & CLIENT_FLAG_DISCONNECTED));
+
+    return 0;
+}
+
+int client_recv(ship_client_t *c) {
+    ssize_t sz;
+    void *tmp;
+    int len, rv;
+
+    for(;;) {
+        /* If we've hit the end of the buffer, make some room. Moving whatever
+           partial packet is sitting at the end back to the start is cheap, and
+           only needs to be done once in a while. If the whole buffer is one
+           partial packet, then it needs to be bigger. */
+        if(c->recvbuf_cur == c->recvbuf_size) {
+            if(c->recvbuf_start) {
+                len = c->recvbuf_cur - c->recvbuf_start;
+                memmove(c->recvbuf, c->recvbuf + c->recvbuf_start, len);
+                c->recvbuf_ready -= c->recvbuf_start;
+                c->recvbuf_start = 0;
+                c->recvbuf_cur = len;
             }
+            else if(c->recvbuf_size < CLIENT_RECVBUF_MAX) {
+                len = c->recvbuf_size ? c->recvbuf_size << 1 :
+                    CLIENT_RECVBUF_MIN;
 
-            /* Pass it onto the correct handler. */
-            if(c->flags & CLIENT_FLAG_TYPE_SHIP) {
-                rv = ship_process_pkt(c, rbp);
+                if(!(tmp = realloc(c->recvbuf, len))) {
+                    perror("realloc");
+                    return -1;
+                }
+
+                c->recvbuf = (unsigned char *)tmp;
+                c->recvbuf_size = len;
             }
             else {
-                rv = block_process_pkt(c, rbp);
+                /* Full of packets that need handling first. */
+                rv = 0;
+                break;
             }
+        }
 
-            rbp += pkt_sz;
-            sz -= pkt_sz;
+        if((sz = recv(c->sock, c->recvbuf + c->recvbuf_cur,
+                      c->recvbuf_size - c->recvbuf_cur, 0)) <= 0) {
+            if(sz == -1) {
+                if(errno == EINTR)
+                    continue;
+                else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    rv = 1;
+                    break;
+                }
 
-            c->flags &= ~CLIENT_FLAG_HDR_READ;
+                perror("recv");
+            }
+
+            return -1;
         }
-        else {
-            /* Nope, we're missing part, break out of the loop, and buffer
-               the remaining data. */
+
+        c->recvbuf_cur += sz;
+    }
+
+    /* Decrypt what came in now, so that handling it later is all that needs
+       any more than the client's own lock. */
+    if(client_decrypt_pkts(c))
+        return -1;
+
+    return rv;
+}
+
+int client_handle_pkts(ship_client_t *c) {
+    if(c->recvbuf_ready == c->recvbuf_start)
+        return 0;
+
+    return client_dispatch_pkts(c);
+}
+
+/* Hand as much of the client's send queue to the kernel as it will take.
+   Returns 1 if everything went out, 0 if the socket filled up first, or -1 on
+   error. */
+static int client_send_queued(ship_client_t *c) {
+    struct iovec iov[CLIENT_MAX_IOV];
+    struct msghdr msg;
+    ssize_t sent;
+    size_t total;
+    int i, n, flags, calls = 0, rv = 1;
+
+    while(c->sendq.len) {
+        n = sendq_iov(&c->sendq, iov, CLIENT_MAX_IOV);
+
+        for(i = 0, total = 0; i < n; ++i)
+            total += iov[i].iov_len;
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        flags = 0;
+
+#ifdef MSG_MORE
+        /* If this isn't all of it, let the kernel know that more is coming so
+           it doesn't push out a short segment at the end. */
+        if(client_tcp_cork && total < c->sendq.len)
+            flags |= MSG_MORE;
+#endif
+
+        sent = sendmsg(c->sock, &msg, flags);
+        ++calls;
+
+        if(sent == -1) {
+            if(errno == EINTR)
+                continue;
+
+            rv = (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
             break;
         }
+
+        sendq_consume(&c->sendq, (size_t)sent);
     }
 
-    /* If we've still got something left here, buffer it for the next pass. */
-    if(sz && rv == 0) {
-        /* Reallocate the recvbuf for the client if its too small. */
-        if(c->recvbuf_size < sz) {
-            tmp = realloc(c->recvbuf, sz);
+    /* Keep track of how many send calls we got away without making, compared
+       to sending every packet on its own. */
+    if(c->worker && client_defer_sends) {
+        c->worker->sends_saved += (int64_t)c->sendq.pkts - calls;
+        c->sendq.pkts = 0;
+    }
 
-            if(!tmp) {
-                perror("realloc");
-                return -1;
-            }
+    return rv;
+}
 
-            c->recvbuf = (unsigned char *)tmp;
-            c->recvbuf_size = sz;
+/* Send out as much of the client's buffered data as the socket will take. */
+int client_flush(ship_client_t *c) {
+    int rv;
+
+    if(!c->sendq.len)
+        return 0;
+
+    if((rv = client_send_queued(c)) <= 0)
+        return rv;
+
+    /* We've sent everything, so quit waiting for the socket to become
+       writable. */
+    return evloop_mod(c->evloop, c->sock, CLIENT_EVLOOP_EVENTS, c);
+}
+
+/* Mark the calling thread as belonging to the given block worker. */
+void client_set_thread_worker(block_worker_t *w) {
+    pthread_setspecific(worker_key, w);
+}
+
+/* Arrange for data that has just been queued up on a client with an empty
+   queue to be sent. If we're on the thread that owns the client, it goes out
+   with everything else queued up during this pass through the event loop.
+   Otherwise, wake the owner up by waiting for the socket to be writable. */
+int client_schedule_flush(ship_client_t *c) {
+    block_worker_t *w = c->worker;
+
+    if(w && pthread_getspecific(worker_key) == w) {
+        if(!c->flush_queued) {
+            TAILQ_INSERT_TAIL(&w->flushq, c, fentry);
+            c->flush_queued = 1;
         }
 
-        memcpy(c->recvbuf, rbp, sz);
-        c->recvbuf_cur = sz;
+        return 0;
     }
-    else if(c->recvbuf) {
-        /* Free the buffer, if we've got nothing in it. */
-        free(c->recvbuf);
-        c->recvbuf = NULL;
-        c->recvbuf_size = 0;
+
+    return evloop_mod(c->evloop, c->sock, CLIENT_EVLOOP_EVENTS | EVLOOP_WRITE,
+                      c);
+}
+
+/* Send out everything queued up by clients on this worker during this pass
+   through the event loop. */
+void client_flush_deferred(block_worker_t *w) {
+    ship_client_t *c;
+    int rv;
+
+    while((c = TAILQ_FIRST(&w->flushq))) {
+        TAILQ_REMOVE(&w->flushq, c, fentry);
+
+        pthread_mutex_lock(&c->mutex);
+        c->flush_queued = 0;
+
+        /* If the socket filled up, wait for it to drain before trying to send
+           the rest. */
+        if((rv = client_send_queued(c)) == 0)
+            rv = evloop_mod(c->evloop, c->sock,
+                            CLIENT_EVLOOP_EVENTS | EVLOOP_WRITE, c);
+
+        if(rv < 0) {
+            c->flags |= CLIENT_FLAG_DISCONNECTED;
+            w->reap = 1;
+        }
+
+        pthread_mutex_unlock(&c->mutex);
     }
+}
 
-    return rv;
+/* Hold back (or let go of) partial segments on the client's socket, so that a
+   burst of packets goes out in as few segments as possible. */
+void client_cork(ship_client_t *c, int on) {
+#if defined(TCP_CORK)
+    setsockopt(c->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
+#elif defined(TCP_NOPUSH)
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(int));
+#else
+    (void)c;
+    (void)on;
+#endif
 }
 
 /* Retrieve the thread-specific recvbuf for the current thread. */
@@ -1234,9 +1518,14 @@ static int client_sendMsg_lua(lua_State *l) {
 static int client_getTable_lua(lua_State *l) {
     ship_client_t *c;
 
+    /* A client's table only exists in the interpreter for its block. */
     if(lua_islightuserdata(l, 1)) {
         c = (ship_client_t *)lua_touserdata(l, 1);
-        lua_rawgeti(l, LUA_REGISTRYINDEX, c->script_ref);
+
+        if(c->scripts == script_state_from_lua(l))
+            lua_rawgeti(l, LUA_REGISTRYINDEX, c->script_ref);
+        else
+            lua_pushnil(l);
     }
     else {
         lua_pushnil(l);
@@ -1525,16 +1814,14 @@ static int client_item_lua(lua_State *l) {
 static int client_find_lua(lua_State *l) {
     ship_client_t *c;
     uint32_t gc;
-    int i;
 
     if(lua_isinteger(l, 1)) {
         gc = (uint32_t)lua_tointeger(l, 1);
 
-        for(i = 0; i < ship->cfg->blocks; ++i) {
-            if((c = block_find_client(ship->blocks[i], gc))) {
-                lua_pushlightuserdata(l, c);
-                return 1;
-            }
+        if((c = gcindex_find(gc))) {
+            gcindex_release(gc);
+            lua_pushlightuserdata(l, c);
+            return 1;
         }
 
         lua_pushnil(l);
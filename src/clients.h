@@ -40,6 +40,10 @@
 #include "ship.h"
 #include "block.h"
 #include "player.h"
+#include "evloop.h"
+#include "timers.h"
+#include "sendq.h"
+#include "pktcap.h"
 
 /* Pull in the packet header types. */
 #define PACKETS_H_HEADERS_ONLY
@@ -59,6 +63,12 @@ typedef struct lobby lobby_t;
 #define CLIENT_IGNORE_LIST_SIZE     10
 #define CLIENT_MAX_QSTACK           32
 
+/* Bounds on the size of a client's receive buffer. It starts out small, and
+   only grows when it needs to hold a packet bigger than it is. The largest
+   size needs to fit the biggest possible packet. */
+#define CLIENT_RECVBUF_MIN          4096
+#define CLIENT_RECVBUF_MAX          65536
+
 #ifdef PACKED
 #undef PACKED
 #endif
@@ -78,6 +88,8 @@ typedef struct bb_security_data {
 /* Ship server client structure. */
 struct ship_client {
     TAILQ_ENTRY(ship_client) qentry;
+    TAILQ_ENTRY(ship_client) fentry;
+    struct ship_client *gc_next;
 
     pthread_mutex_t mutex;
     pkt_header_t pkt;
@@ -92,13 +104,14 @@ struct ship_client {
 
     int language_code;
     int cur_area;
+    int recvbuf_start;
+    int recvbuf_ready;                  /* End of the decrypted packets */
     int recvbuf_cur;
     int recvbuf_size;
 
-    int sendbuf_cur;
-    int sendbuf_size;
-    int sendbuf_start;
     int item_count;
+    int flush_queued;
+    int gc_indexed;
 
     int autoreply_len;
     int lobby_id;
@@ -111,6 +124,7 @@ struct ship_client {
     struct sockaddr_storage ip_addr;
 
     uint32_t guildcard;
+    uint32_t gc_key;                    /* Guildcard in the gcindex. */
     uint32_t flags;
     uint32_t arrow;
 
@@ -133,13 +147,15 @@ struct ship_client {
     item_t items[30];
 
     block_t *cur_block;
+    block_worker_t *worker;
     lobby_t *cur_lobby;
     player_t *pl;
+    evloop_t *evloop;
 
     unsigned char *recvbuf;
-    unsigned char *sendbuf;
+    sendq_t sendq;
     void *autoreply;
-    FILE *logfile;
+    pktcap_t *capture;
 
     char *infoboard;                    /* Points into the player struct. */
     uint8_t *c_rank;                    /* Points into the player struct. */
@@ -154,17 +170,30 @@ struct ship_client {
     time_t last_sent;
     time_t join_time;
     time_t login_time;
+    timer_entry_t timer;
+
+    /* The newest movement packet from the client that hasn't been sent on to
+       the rest of its lobby yet, for lobbies that coalesce movement. */
+    timer_entry_t move_timer;
+    int move_pending;
+    uint8_t move_pkt[0x20];
 
     bb_security_data_t sec_data;
     sylverant_bb_db_char_t *bb_pl;
     sylverant_bb_db_opts_t *bb_opts;
 
+    struct script_state *scripts;
     int script_ref;
     uint64_t aoe_timer;
 
     uint32_t q_stack[CLIENT_MAX_QSTACK];
     int q_stack_top;
 
+    /* The player's flags for the quest they're on, and the timer for writing
+       changes to them back to the shipgate. See quest_functions.h. */
+    struct client_qflags *qflags;
+    timer_entry_t qflag_timer;
+
 #ifdef DEBUG
     uint8_t sdrops_ver;
     uint8_t sdrops_ep;
@@ -228,6 +257,10 @@ extern pthread_key_t sendbuf_key;
 #define CLIENT_VERSION_EP3      4
 #define CLIENT_VERSION_BB       5
 
+/* Events that every client's socket waits on in its event loop. EVLOOP_WRITE
+   is added to these only while there is data buffered to send. */
+#define CLIENT_EVLOOP_EVENTS    (EVLOOP_READ | EVLOOP_EDGE)
+
 /* Language codes. */
 #define CLIENT_LANG_JAPANESE        0
 #define CLIENT_LANG_ENGLISH         1
@@ -312,7 +345,7 @@ void client_shutdown(void);
 /* Create a new connection, storing it in the list of clients. */
 ship_client_t *client_create_connection(int sock, int version, int type,
                                         struct client_queue *clients,
-                                        ship_t *ship, block_t *block,
+                                        ship_t *ship, block_worker_t *w,
                                         struct sockaddr *ip, socklen_t size);
 
 /* Destroy a connection, closing the socket and removing it from the list. */
@@ -321,6 +354,27 @@ void client_destroy_connection(ship_client_t *c, struct client_queue *clients);
 /* Read data from a client that is connected to any port. */
 int client_process_pkt(ship_client_t *c);
 
+/* Split versions of the above, for when reading from the socket and handling
+   the packets need to be done under different locks. client_recv buffers up
+   whatever it can from the socket and decrypts any full packets, returning 1
+   if the socket ran dry, 0 if the buffer filled first, or -1 on error.
+   client_handle_pkts then handles the decrypted packets, right where they
+   sit. */
+int client_recv(ship_client_t *c);
+int client_handle_pkts(ship_client_t *c);
+
+/* Send out as much of the client's buffered data as the socket will take. */
+int client_flush(ship_client_t *c);
+
+/* Support for coalescing everything sent to a block client during one pass
+   through its worker's event loop into as few send calls as possible. */
+void client_set_thread_worker(block_worker_t *w);
+int client_schedule_flush(ship_client_t *c);
+void client_flush_deferred(block_worker_t *w);
+
+/* Turn TCP_CORK (or the local equivalent) on or off for the client. */
+void client_cork(ship_client_t *c, int on);
+
 /* Retrieve the thread-specific recvbuf for the current thread. */
 uint8_t *get_recvbuf(void);
 
@@ -20,7 +20,6 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <iconv.h>
 #include <time.h>
 #include <ctype.h>
 #include <sys/time.h>
@@ -43,6 +42,7 @@
 #include "mapdata.h"
 #include "rtdata.h"
 #include "scripts.h"
+#include "gcindex.h"
 
 int handle_dc_gcsend(ship_client_t *s, ship_client_t *d,
                      subcmd_dc_gcsend_t *pkt);
@@ -2018,10 +2018,8 @@ static int handle_gameevent(ship_client_t *c, const char *params) {
 /* Usage: /ban:d guildcard reason */
 static int handle_ban_d(ship_client_t *c, const char *params) {
     uint32_t gc;
-    block_t *b;
     ship_client_t *i;
     char *reason;
-    int j;
 
     /* Make sure the requester is a local GM. */
     if(!LOCAL_GM(c)) {
@@ -2042,34 +2040,32 @@ static int handle_ban_d(ship_client_t *c, const char *params) {
         return send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
     }
 
-    /* Look for the requested user and kick them if they're on the ship. */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        if((b = ship->blocks[j])) {
-            pthread_rwlock_rdlock(&b->lock);
+    /* Look for the requested user and kick them if they're on the ship,
+       as many times as they're on it. */
+    if((i = gcindex_find(gc))) {
+        do {
+            pthread_mutex_lock(&i->mutex);
 
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(strlen(reason) > 1) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "1 day"), __(i, "Reason:"),
-                                         reason + 1);
-                    }
-                    else {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "1 day"));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                }
+            if(strlen(reason) > 1) {
+                send_message_box(i, "%s\n%s %s\n%s\n%s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "1 day"), __(i, "Reason:"),
+                                 reason + 1);
+            }
+            else {
+                send_message_box(i, "%s\n%s %s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "1 day"));
             }
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+            i->flags |= CLIENT_FLAG_DISCONNECTED;
+            block_wake(i->cur_block);
+            pthread_mutex_unlock(&i->mutex);
+        } while((i = gcindex_next(i, gc)));
+
+        gcindex_release(gc);
     }
 
     return send_txt(c, "%s", __(c, "\tE\tC7Successfully set ban."));
@@ -2078,10 +2074,8 @@ static int handle_ban_d(ship_client_t *c, const char *params) {
 /* Usage: /ban:w guildcard reason */
 static int handle_ban_w(ship_client_t *c, const char *params) {
     uint32_t gc;
-    block_t *b;
     ship_client_t *i;
     char *reason;
-    int j;
 
     /* Make sure the requester is a local GM. */
     if(!LOCAL_GM(c)) {
@@ -2102,34 +2096,32 @@ static int handle_ban_w(ship_client_t *c, const char *params) {
         return send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
     }
 
-    /* Look for the requested user and kick them if they're on the ship. */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        if((b = ship->blocks[j])) {
-            pthread_rwlock_rdlock(&b->lock);
+    /* Look for the requested user and kick them if they're on the ship,
+       as many times as they're on it. */
+    if((i = gcindex_find(gc))) {
+        do {
+            pthread_mutex_lock(&i->mutex);
 
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(strlen(reason) > 1) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "1 week"), __(i, "Reason:"),
-                                         reason + 1);
-                    }
-                    else {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "1 week"));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                }
+            if(strlen(reason) > 1) {
+                send_message_box(i, "%s\n%s %s\n%s\n%s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "1 week"), __(i, "Reason:"),
+                                 reason + 1);
+            }
+            else {
+                send_message_box(i, "%s\n%s %s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "1 week"));
             }
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+            i->flags |= CLIENT_FLAG_DISCONNECTED;
+            block_wake(i->cur_block);
+            pthread_mutex_unlock(&i->mutex);
+        } while((i = gcindex_next(i, gc)));
+
+        gcindex_release(gc);
     }
 
     return send_txt(c, "%s", __(c, "\tE\tC7Successfully set ban."));
@@ -2138,10 +2130,8 @@ static int handle_ban_w(ship_client_t *c, const char *params) {
 /* Usage: /ban:m guildcard reason */
 static int handle_ban_m(ship_client_t *c, const char *params) {
     uint32_t gc;
-    block_t *b;
     ship_client_t *i;
     char *reason;
-    int j;
 
     /* Make sure the requester is a local GM. */
     if(!LOCAL_GM(c)) {
@@ -2163,34 +2153,32 @@ static int handle_ban_m(ship_client_t *c, const char *params) {
         return send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
     }
 
-    /* Look for the requested user and kick them if they're on the ship. */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        if((b = ship->blocks[j])) {
-            pthread_rwlock_rdlock(&b->lock);
+    /* Look for the requested user and kick them if they're on the ship,
+       as many times as they're on it. */
+    if((i = gcindex_find(gc))) {
+        do {
+            pthread_mutex_lock(&i->mutex);
 
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(strlen(reason) > 1) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "30 days"), __(i, "Reason:"),
-                                         reason + 1);
-                    }
-                    else {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "30 days"));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                }
+            if(strlen(reason) > 1) {
+                send_message_box(i, "%s\n%s %s\n%s\n%s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "30 days"), __(i, "Reason:"),
+                                 reason + 1);
+            }
+            else {
+                send_message_box(i, "%s\n%s %s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "30 days"));
             }
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+            i->flags |= CLIENT_FLAG_DISCONNECTED;
+            block_wake(i->cur_block);
+            pthread_mutex_unlock(&i->mutex);
+        } while((i = gcindex_next(i, gc)));
+
+        gcindex_release(gc);
     }
 
     return send_txt(c, "%s", __(c, "\tE\tC7Successfully set ban."));
@@ -2199,9 +2187,7 @@ static int handle_ban_m(ship_client_t *c, const char *params) {
 /* Usage: /ban:p guildcard reason */
 static int handle_ban_p(ship_client_t *c, const char *params) {
     uint32_t gc;
-    block_t *b;
     ship_client_t *i;
-    int j;
     char *reason;
 
     /* Make sure the requester is a local GM. */
@@ -2223,34 +2209,32 @@ static int handle_ban_p(ship_client_t *c, const char *params) {
         return send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
     }
 
-    /* Look for the requested user and kick them if they're on the ship. */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        if((b = ship->blocks[j])) {
-            pthread_rwlock_rdlock(&b->lock);
+    /* Look for the requested user and kick them if they're on the ship,
+       as many times as they're on it. */
+    if((i = gcindex_find(gc))) {
+        do {
+            pthread_mutex_lock(&i->mutex);
 
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(strlen(reason) > 1) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "Forever"), __(i, "Reason:"),
-                                         reason + 1);
-                    }
-                    else {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "Forever"));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                }
+            if(strlen(reason) > 1) {
+                send_message_box(i, "%s\n%s %s\n%s\n%s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "Forever"), __(i, "Reason:"),
+                                 reason + 1);
+            }
+            else {
+                send_message_box(i, "%s\n%s %s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "Forever"));
             }
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+            i->flags |= CLIENT_FLAG_DISCONNECTED;
+            block_wake(i->cur_block);
+            pthread_mutex_unlock(&i->mutex);
+        } while((i = gcindex_next(i, gc)));
+
+        gcindex_release(gc);
     }
 
     return send_txt(c, "%s", __(c, "\tE\tC7Successfully set ban."));
@@ -3176,7 +3160,7 @@ static int handle_quest(ship_client_t *c, const char *params) {
     pthread_rwlock_rdlock(&ship->qlock);
 
     /* Do we have quests configured? */
-    if(!TAILQ_EMPTY(&ship->qmap)) {
+    if(ship->qmap.count) {
         /* Find the quest first, since someone might be doing something
            stupid... */
            quest_map_elem_t *e = quest_lookup(&ship->qmap, quest_id);
@@ -3410,6 +3394,7 @@ static int handle_ib(ship_client_t *c, const char *params) {
                     }
 
                     i->flags |= CLIENT_FLAG_DISCONNECTED;
+                    block_wake(b);
                 }
             }
 
@@ -3575,10 +3560,10 @@ int command_parse(ship_client_t *c, dc_chat_pkt *pkt) {
     outptr = buf;
 
     if(pkt->msg[0] == '\t' && pkt->msg[1] == 'J') {
-        iconv(ic_sjis_to_utf8, &inptr, &in, &outptr, &out);
+        tconv(ic_sjis_to_utf8, &inptr, &in, &outptr, &out);
     }
     else {
-        iconv(ic_8859_to_utf8, &inptr, &in, &outptr, &out);
+        tconv(ic_8859_to_utf8, &inptr, &in, &outptr, &out);
     }
 
     /* Handle the command... */
@@ -3597,7 +3582,7 @@ int wcommand_parse(ship_client_t *c, dc_chat_pkt *pkt) {
     out = tlen * 2;
     inptr = (ICONV_CONST char *)pkt->msg;
     outptr = buf;
-    iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+    tconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
 
     /* Handle the command... */
     return command_call(c, buf, (tlen * 2) - out);
@@ -3615,7 +3600,7 @@ int bbcommand_parse(ship_client_t *c, bb_chat_pkt *pkt) {
     out = tlen * 2;
     inptr = (ICONV_CONST char *)pkt->msg;
     outptr = buf;
-    iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+    tconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
 
     /* Handle the command... */
     return command_call(c, buf, (tlen * 2) - out);
@@ -0,0 +1,291 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#endif
+
+#include <sylverant/debug.h>
+
+#include "evloop.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+struct evloop {
+    int epfd;
+};
+
+evloop_t *evloop_create(void) {
+    evloop_t *rv;
+
+    if(!(rv = (evloop_t *)malloc(sizeof(evloop_t)))) {
+        debug(DBG_ERROR, "Cannot allocate event loop: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    if((rv->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        debug(DBG_ERROR, "Cannot create epoll instance: %s\n", strerror(errno));
+        free(rv);
+        return NULL;
+    }
+
+    return rv;
+}
+
+void evloop_destroy(evloop_t *l) {
+    close(l->epfd);
+    free(l);
+}
+
+static int evloop_ctl(evloop_t *l, int op, int fd, int events, void *data) {
+    struct epoll_event ev;
+
+    ev.events = 0;
+    ev.data.ptr = data;
+
+    if(events & EVLOOP_READ)
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if(events & EVLOOP_WRITE)
+        ev.events |= EPOLLOUT;
+    if(events & EVLOOP_EDGE)
+        ev.events |= EPOLLET;
+
+    return epoll_ctl(l->epfd, op, fd, &ev);
+}
+
+int evloop_add(evloop_t *l, int fd, int events, void *data) {
+    return evloop_ctl(l, EPOLL_CTL_ADD, fd, events, data);
+}
+
+int evloop_mod(evloop_t *l, int fd, int events, void *data) {
+    return evloop_ctl(l, EPOLL_CTL_MOD, fd, events, data);
+}
+
+int evloop_del(evloop_t *l, int fd) {
+    struct epoll_event ev;
+
+    /* Kernels before 2.6.9 require a non-NULL event here, even though its
+       contents are ignored. */
+    memset(&ev, 0, sizeof(struct epoll_event));
+    return epoll_ctl(l->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int evloop_wait(evloop_t *l, evloop_event_t *evs, int max, int timeout) {
+    struct epoll_event eevs[max];
+    int i, n;
+
+    if((n = epoll_wait(l->epfd, eevs, max, timeout)) < 0) {
+        if(errno == EINTR)
+            return 0;
+
+        return -1;
+    }
+
+    for(i = 0; i < n; ++i) {
+        evs[i].data = eevs[i].data.ptr;
+        evs[i].events = 0;
+
+        /* Errors and hangups are reported as readable, so that the next read
+           on the socket will pick up on the problem. */
+        if(eevs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            evs[i].events |= EVLOOP_READ;
+        if(eevs[i].events & EPOLLOUT)
+            evs[i].events |= EVLOOP_WRITE;
+    }
+
+    return n;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+/* Unlike epoll, select() won't notice changes made from other threads while
+   it's waiting, so anyone adding new events to wait on pokes the wake pipe. */
+struct evloop {
+    pthread_mutex_t mutex;
+    int wake[2];
+    int waiting;
+    int maxfd;
+    int events[FD_SETSIZE];
+    void *data[FD_SETSIZE];
+};
+
+evloop_t *evloop_create(void) {
+    evloop_t *rv;
+
+    if(!(rv = (evloop_t *)malloc(sizeof(evloop_t)))) {
+        debug(DBG_ERROR, "Cannot allocate event loop: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memset(rv, 0, sizeof(evloop_t));
+
+    if(pipe(rv->wake) == -1) {
+        debug(DBG_ERROR, "Cannot create event loop pipe: %s\n",
+              strerror(errno));
+        free(rv);
+        return NULL;
+    }
+
+    fcntl(rv->wake[0], F_SETFL, fcntl(rv->wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(rv->wake[1], F_SETFL, fcntl(rv->wake[1], F_GETFL) | O_NONBLOCK);
+
+    rv->maxfd = -1;
+    pthread_mutex_init(&rv->mutex, NULL);
+
+    return rv;
+}
+
+void evloop_destroy(evloop_t *l) {
+    pthread_mutex_destroy(&l->mutex);
+    close(l->wake[0]);
+    close(l->wake[1]);
+    free(l);
+}
+
+int evloop_add(evloop_t *l, int fd, int events, void *data) {
+    uint8_t dummy = 0;
+    int old;
+
+    if(fd < 0 || fd >= FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&l->mutex);
+    old = l->events[fd];
+    l->events[fd] = events & (EVLOOP_READ | EVLOOP_WRITE);
+    l->data[fd] = data;
+
+    if(fd > l->maxfd)
+        l->maxfd = fd;
+
+    if(l->waiting && (l->events[fd] & ~old))
+        write(l->wake[1], &dummy, 1);
+
+    pthread_mutex_unlock(&l->mutex);
+    return 0;
+}
+
+int evloop_mod(evloop_t *l, int fd, int events, void *data) {
+    return evloop_add(l, fd, events, data);
+}
+
+int evloop_del(evloop_t *l, int fd) {
+    if(fd < 0 || fd >= FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&l->mutex);
+    l->events[fd] = 0;
+    l->data[fd] = NULL;
+
+    while(l->maxfd >= 0 && !l->data[l->maxfd])
+        --l->maxfd;
+
+    pthread_mutex_unlock(&l->mutex);
+    return 0;
+}
+
+int evloop_wait(evloop_t *l, evloop_event_t *evs, int max, int timeout) {
+    fd_set readfds, writefds;
+    struct timeval tv, *tvp = NULL;
+    int i, n, nfds, maxfd;
+    uint8_t dummy;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+
+    pthread_mutex_lock(&l->mutex);
+    maxfd = l->maxfd;
+
+    for(i = 0; i <= maxfd; ++i) {
+        if(l->events[i] & EVLOOP_READ)
+            FD_SET(i, &readfds);
+        if(l->events[i] & EVLOOP_WRITE)
+            FD_SET(i, &writefds);
+    }
+
+    FD_SET(l->wake[0], &readfds);
+    nfds = (l->wake[0] > maxfd ? l->wake[0] : maxfd) + 1;
+    l->waiting = 1;
+    pthread_mutex_unlock(&l->mutex);
+
+    if(timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    n = select(nfds, &readfds, &writefds, NULL, tvp);
+
+    pthread_mutex_lock(&l->mutex);
+    l->waiting = 0;
+    pthread_mutex_unlock(&l->mutex);
+
+    if(n <= 0) {
+        if(n < 0 && errno != EINTR)
+            return -1;
+
+        return 0;
+    }
+
+    if(FD_ISSET(l->wake[0], &readfds)) {
+        while(read(l->wake[0], &dummy, 1) > 0) {
+        }
+    }
+
+    /* Anything we don't have room for this time around will still be ready
+       the next time, since select() is level-triggered. */
+    n = 0;
+    pthread_mutex_lock(&l->mutex);
+
+    for(i = 0; i < nfds && n < max; ++i) {
+        if(!l->data[i])
+            continue;
+
+        evs[n].events = 0;
+
+        if(FD_ISSET(i, &readfds))
+            evs[n].events |= EVLOOP_READ;
+        if(FD_ISSET(i, &writefds))
+            evs[n].events |= EVLOOP_WRITE;
+
+        if(evs[n].events) {
+            evs[n].data = l->data[i];
+            ++n;
+        }
+    }
+
+    pthread_mutex_unlock(&l->mutex);
+
+    return n;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,67 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+/* Events that can be waited on (and reported) for a file descriptor. */
+#define EVLOOP_READ     0x00000001
+#define EVLOOP_WRITE    0x00000002
+
+/* Only report an event when the state of the descriptor changes. Anything
+   registered with this flag must be read/written until it returns EAGAIN.
+   The select() backend ignores this flag (it is always level-triggered), so
+   code that honors the above rule works the same with either backend. */
+#define EVLOOP_EDGE     0x80000000
+
+typedef struct evloop_event {
+    void *data;
+    int events;
+} evloop_event_t;
+
+struct evloop;
+
+#ifndef EVLOOP_DEFINED
+#define EVLOOP_DEFINED
+typedef struct evloop evloop_t;
+#endif
+
+/* Create a new event loop. */
+evloop_t *evloop_create(void);
+
+/* Destroy an event loop. This does not close any of the registered file
+   descriptors. */
+void evloop_destroy(evloop_t *l);
+
+/* Register a file descriptor with the event loop. The data pointer is what will
+   be reported back by evloop_wait, so it must be unique within the loop. */
+int evloop_add(evloop_t *l, int fd, int events, void *data);
+
+/* Change the set of events that a registered file descriptor is waiting on.
+   This is safe to call from any thread. */
+int evloop_mod(evloop_t *l, int fd, int events, void *data);
+
+/* Remove a file descriptor from the event loop. This must be done before the
+   descriptor is closed. */
+int evloop_del(evloop_t *l, int fd);
+
+/* Wait up to timeout milliseconds (or forever, if timeout is negative) for
+   something to happen on any registered file descriptor. Returns the number of
+   events stored in evs, or -1 on error. */
+int evloop_wait(evloop_t *l, evloop_event_t *evs, int max, int timeout);
+
+#endif /* !EVLOOP_H */
@@ -0,0 +1,150 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+
+#include <sylverant/debug.h>
+
+#include "gcindex.h"
+#include "clients.h"
+
+/* These both must be powers of two, and there must be at least as many buckets
+   as there are locks. */
+#define GCINDEX_BUCKETS     1024
+#define GCINDEX_LOCKS       64
+
+static ship_client_t *buckets[GCINDEX_BUCKETS];
+static pthread_rwlock_t locks[GCINDEX_LOCKS];
+
+static inline uint32_t gc_hash(uint32_t gc) {
+    /* Guildcard numbers are handed out sequentially, so mix them up a bit to
+       keep neighbors from landing on the same lock. */
+    gc ^= gc >> 16;
+    gc *= 0x45D9F3B;
+    gc ^= gc >> 16;
+    return gc & (GCINDEX_BUCKETS - 1);
+}
+
+#define LOCK_FOR(h) (&locks[(h) & (GCINDEX_LOCKS - 1)])
+
+int gcindex_init(void) {
+    int i;
+
+    for(i = 0; i < GCINDEX_LOCKS; ++i) {
+        if(pthread_rwlock_init(&locks[i], NULL)) {
+            debug(DBG_ERROR, "Cannot initialize guildcard index lock\n");
+
+            while(i--) {
+                pthread_rwlock_destroy(&locks[i]);
+            }
+
+            return -1;
+        }
+    }
+
+    for(i = 0; i < GCINDEX_BUCKETS; ++i) {
+        buckets[i] = NULL;
+    }
+
+    return 0;
+}
+
+void gcindex_cleanup(void) {
+    int i;
+
+    for(i = 0; i < GCINDEX_LOCKS; ++i) {
+        pthread_rwlock_destroy(&locks[i]);
+    }
+}
+
+static void remove_locked(ship_client_t *c, uint32_t h) {
+    ship_client_t **i;
+
+    for(i = &buckets[h]; *i; i = &(*i)->gc_next) {
+        if(*i == c) {
+            *i = c->gc_next;
+            break;
+        }
+    }
+
+    c->gc_next = NULL;
+    c->gc_indexed = 0;
+}
+
+void gcindex_remove(ship_client_t *c) {
+    uint32_t h;
+
+    if(!c->gc_indexed)
+        return;
+
+    h = gc_hash(c->gc_key);
+    pthread_rwlock_wrlock(LOCK_FOR(h));
+
+    if(c->gc_indexed)
+        remove_locked(c, h);
+
+    pthread_rwlock_unlock(LOCK_FOR(h));
+}
+
+void gcindex_add(ship_client_t *c) {
+    uint32_t h;
+
+    /* Once someone may have found them under one number, leave them there. */
+    if(c->gc_indexed)
+        return;
+
+    h = gc_hash(c->guildcard);
+    pthread_rwlock_wrlock(LOCK_FOR(h));
+
+    c->gc_key = c->guildcard;
+    c->gc_next = buckets[h];
+    c->gc_indexed = 1;
+    buckets[h] = c;
+
+    pthread_rwlock_unlock(LOCK_FOR(h));
+}
+
+ship_client_t *gcindex_find(uint32_t gc) {
+    uint32_t h = gc_hash(gc);
+    ship_client_t *i;
+
+    pthread_rwlock_rdlock(LOCK_FOR(h));
+
+    for(i = buckets[h]; i; i = i->gc_next) {
+        if(i->gc_key == gc)
+            return i;
+    }
+
+    pthread_rwlock_unlock(LOCK_FOR(h));
+    return NULL;
+}
+
+ship_client_t *gcindex_next(ship_client_t *c, uint32_t gc) {
+    ship_client_t *i;
+
+    for(i = c->gc_next; i; i = i->gc_next) {
+        if(i->gc_key == gc)
+            return i;
+    }
+
+    return NULL;
+}
+
+void gcindex_release(uint32_t gc) {
+    uint32_t h = gc_hash(gc);
+    pthread_rwlock_unlock(LOCK_FOR(h));
+}
@@ -0,0 +1,69 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCINDEX_H
+#define GCINDEX_H
+
+#include <stdint.h>
+
+/* Forward declarations. */
+struct ship_client;
+
+#ifndef SHIP_CLIENT_DEFINED
+#define SHIP_CLIENT_DEFINED
+typedef struct ship_client ship_client_t;
+#endif
+
+/* An index of every client logged into any block on the ship, keyed by their
+   guildcard number. The table is split into a number of stripes, each with
+   its own lock, so that lookups on different blocks rarely get in each
+   other's way.
+
+   Locking order: the index's locks nest inside of a block's lock, and outside
+   of a client's mutex. Never try to take a block's lock while holding a
+   client found through the index, never look up another client while still
+   holding one, and never add or remove a client while holding any client's
+   mutex. */
+
+int gcindex_init(void);
+void gcindex_cleanup(void);
+
+/* Add a client to the index under its current guildcard number. This should
+   be called once they've logged into a block, but NOT with the client's mutex
+   held. A client is only ever indexed under the first number it logs in
+   with. */
+void gcindex_add(ship_client_t *c);
+
+/* Remove a client from the index, if it is in there. Once this returns, no
+   other thread can be holding onto the client through the index. */
+void gcindex_remove(ship_client_t *c);
+
+/* Look for the block client with the given guildcard number. If one is found,
+   it is returned with its part of the index locked, which will keep it from
+   being destroyed until gcindex_release() is called with the same number. The
+   client's own mutex is NOT locked. If nothing is found, NULL is returned and
+   nothing is left locked. */
+ship_client_t *gcindex_find(uint32_t gc);
+void gcindex_release(uint32_t gc);
+
+/* Look for another client with the same guildcard number as one returned by
+   gcindex_find(), for when someone is connected more than once. Unlike
+   gcindex_find(), this leaves the index locked when nothing else is found, so
+   gcindex_release() must still be called. */
+ship_client_t *gcindex_next(ship_client_t *c, uint32_t gc);
+
+#endif /* !GCINDEX_H */
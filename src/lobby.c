@@ -40,6 +40,7 @@
 #include "pmtdata.h"
 #include "rtdata.h"
 #include "scripts.h"
+#include "quest_functions.h"
 
 #ifdef ENABLE_LUA
 #include <lua.h>
@@ -47,6 +48,8 @@
 #include <lauxlib.h>
 #endif
 
+extern int lobby_move_ms;
+
 static pthread_key_t id_key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 
@@ -77,6 +80,7 @@ lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev) {
     l->min_level = 0;
     l->max_level = 9001;                /* Its OVER 9000! */
     l->event = ev;
+    l->move_ms = lobby_move_ms;
 
     /* Fill in the name of the lobby. */
     if(lobby_id <= 15) {
@@ -92,8 +96,7 @@ lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev) {
 
 #ifdef ENABLE_LUA
     /* Initialize the script table */
-    lua_newtable(block->ship->lstate);
-    l->script_ref = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
+    l->script_ref = script_table_new(block->scripts);
 #endif
 
     /* Initialize the lobby mutex. */
@@ -448,8 +451,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
 
 #ifdef ENABLE_LUA
     /* Initialize the script table */
-    lua_newtable(block->ship->lstate);
-    l->script_ref = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
+    l->script_ref = script_table_new(block->scripts);
 
     if(!(l->script_ids = (int *)malloc(sizeof(int) * ScriptActionCount)))
         debug(DBG_WARN, "Couldn't allocate team script list!\n");
@@ -553,8 +555,7 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
 
 #ifdef ENABLE_LUA
     /* Initialize the script table */
-    lua_newtable(block->ship->lstate);
-    l->script_ref = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
+    l->script_ref = script_table_new(block->scripts);
 
     if(!(l->script_ids = (int *)malloc(sizeof(int) * ScriptActionCount)))
         debug(DBG_WARN, "Couldn't allocate team script list!\n");
@@ -588,7 +589,6 @@ static void lobby_empty_pkt_queue(lobby_t *l) {
 static void lobby_destroy_locked(lobby_t *l, int remove) {
     pthread_mutex_t m = l->mutex;
     lobby_item_t *i, *tmp;
-    int j;
 
 #ifdef DEBUG
     pthread_mutex_lock(&log_mutex);
@@ -607,21 +607,13 @@ static void lobby_destroy_locked(lobby_t *l, int remove) {
         team_log_stop(l);
 
     /* Run the team deletion script, if one exists. */
-    script_execute(ScriptActionTeamDestroy, NULL, SCRIPT_ARG_PTR, l,
-                   SCRIPT_ARG_END);
+    script_execute_block(l->block, ScriptActionTeamDestroy, NULL,
+                         SCRIPT_ARG_PTR, l, SCRIPT_ARG_END);
 
 #ifdef ENABLE_LUA
-    /* Clean up any scripts. */
-    for(j = 0; j < ScriptActionCount; ++j) {
-        if(l->script_ids[j])
-            luaL_unref(l->block->ship->lstate, LUA_REGISTRYINDEX,
-                       l->script_ids[j]);
-    }
-
+    /* Clean up any scripts, and remove the table from the registry. */
+    script_lobby_cleanup(l);
     free(l->script_ids);
-
-    /* Remove the table from the registry */
-    luaL_unref(l->block->ship->lstate, LUA_REGISTRYINDEX, l->script_ref);
 #endif
 
     /* TAILQ_REMOVE may or may not be safe to use if the item was never actually
@@ -655,6 +647,8 @@ static void lobby_destroy_locked(lobby_t *l, int remove) {
         free_game_enemies(l);
     }
 
+    free(l->qdrops);
+
     free(l);
 
     pthread_mutex_unlock(&m);
@@ -942,6 +936,11 @@ static int lobby_remove_client_locked(ship_client_t *c, int client_id,
     l->clients[client_id] = NULL;
     --l->num_clients;
 
+    /* Any movement still being held for them is meaningless now. Changes to
+       their quest flags aren't though, so get those out of the way. */
+    c->move_pending = 0;
+    quest_flag_cache_flush(c);
+
     /* Make sure the maximum challenge level available hasn't changed... */
     if(l->challenge)
         l->max_chal = lobby_find_max_challenge(l);
@@ -1286,9 +1285,10 @@ int lobby_send_pkt_dcnte(lobby_t *l, ship_client_t *c, void *h, void *h2,
 
 int lobby_send_pkt_dc(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
     dc_pkt_hdr_t *hdr = (dc_pkt_hdr_t *)h;
-    int i;
+    ship_client_t *dests[LOBBY_MAX_CLIENTS];
+    int i, count = 0;
 
-    /* Send the packet to every connected client. */
+    /* Figure out who gets the packet, then send it to all of them at once. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
             /* If we're supposed to check the ignore list, and this client is on
@@ -1297,18 +1297,19 @@ int lobby_send_pkt_dc(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
                 continue;
             }
 
-            send_pkt_dc(l->clients[i], hdr);
+            dests[count++] = l->clients[i];
         }
     }
 
-    return 0;
+    return send_pkt_dc_multi(dests, count, hdr);
 }
 
 int lobby_send_pkt_bb(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
     bb_pkt_hdr_t *hdr = (bb_pkt_hdr_t *)h;
-    int i;
+    ship_client_t *dests[LOBBY_MAX_CLIENTS];
+    int i, count = 0;
 
-    /* Send the packet to every connected client. */
+    /* Figure out who gets the packet, then send it to all of them at once. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
             /* If we're supposed to check the ignore list, and this client is on
@@ -1317,11 +1318,11 @@ int lobby_send_pkt_bb(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
                 continue;
             }
 
-            send_pkt_bb(l->clients[i], hdr);
+            dests[count++] = l->clients[i];
         }
     }
 
-    return 0;
+    return send_pkt_bb_multi(dests, count, hdr);
 }
 
 int lobby_send_pkt_ep3(lobby_t *l, ship_client_t *c, void *h) {
@@ -1807,7 +1808,7 @@ int lobby_setup_quest(lobby_t *l, ship_client_t *c, uint32_t qid, int lang) {
     pthread_mutex_lock(&l->mutex);
 
     /* Do we have quests configured? */
-    if(!TAILQ_EMPTY(&ship->qmap)) {
+    if(ship->qmap.count) {
         e = quest_lookup(&ship->qmap, qid);
 
         /* We have a bit of extra work on GC/BB quests... */
@@ -2215,7 +2216,11 @@ static int lobby_gettable_lua(lua_State *l) {
 
     if(lua_islightuserdata(l, 1)) {
         lb = (lobby_t *)lua_touserdata(l, 1);
-        lua_rawgeti(l, LUA_REGISTRYINDEX, lb->script_ref);
+
+        if(lb->block->scripts == script_state_from_lua(l))
+            lua_rawgeti(l, LUA_REGISTRYINDEX, lb->script_ref);
+        else
+            lua_pushnil(l);
     }
     else {
         lua_pushnil(l);
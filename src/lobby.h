@@ -57,9 +57,9 @@ typedef struct block block_t;
 typedef struct ship ship_t;
 #endif
 
-#ifndef QENEMY_DEFINED
-#define QENEMY_DEFINED
-typedef struct sylverant_quest_enemy qenemy_t;
+#ifndef QDROPS_DEFINED
+#define QDROPS_DEFINED
+typedef struct quest_drops quest_drops_t;
 #endif
 
 typedef struct lobby_pkt {
@@ -115,6 +115,10 @@ struct lobby {
     uint32_t rand_seed;
     uint32_t qid;
 
+    /* If nonzero, movement in the lobby is held for up to this many ms so
+       that only the latest position for each player gets sent out. */
+    int move_ms;
+
     char name[65];
     char passwd[65];
     uint32_t maps[0x20];
@@ -127,15 +131,11 @@ struct lobby {
     struct lobby_pkt_queue burst_queue;
     time_t create_time;
 
-    game_enemies_t *map_enemies;
-    game_objs_t *map_objs;
+    game_enemy_map_t *map_enemies;
+    game_obj_map_t *map_objs;
     bb_battle_param_t *bb_params;
 
-    int num_mtypes;
-    int num_mids;
-
-    qenemy_t *mtypes;
-    qenemy_t *mids;
+    quest_drops_t *qdrops;
     sylverant_limits_t *limits_list;
 
     int (*dropfunc)(ship_client_t *c, struct lobby *l, void *req);
@@ -21,11 +21,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <sylverant/debug.h>
 #include <psoarchive/PRS.h>
 
 #include "mapdata.h"
+#include "mapsnap.h"
 #include "lobby.h"
 #include "clients.h"
 
@@ -62,6 +64,13 @@ static parsed_objs_t gc_parsed_objs[2][0x10];
 /* Did we read in gc map data? */
 static int have_gc_maps = 0;
 
+/* Snapshots that the parsed maps above were loaded from, if any. */
+static mapsnap_t *bb_snap = NULL;
+static mapsnap_t *v2_snap = NULL;
+static mapsnap_t *gc_snap = NULL;
+
+extern int map_snapshots;               /* in ship_server.c */
+
 /* Header for sections of the .dat files for quests. */
 typedef struct quest_dat_hdr {
     uint32_t obj_type;
@@ -71,11 +80,12 @@ typedef struct quest_dat_hdr {
     uint8_t data[];
 } quest_dat_hdr_t;
 
-static int read_param_file(bb_battle_param_t dst[4][0x60], const char *fn) {
+static int read_param_file(bb_battle_param_t dst[4][0x60], int dfd,
+                           const char *fn) {
     FILE *fp;
     const size_t sz = 0x60 * sizeof(bb_battle_param_t);
 
-    if(!(fp = fopen(fn, "rb"))) {
+    if(!(fp = mapsnap_fopen(NULL, dfd, fn))) {
         debug(DBG_ERROR, "Cannot open %s for reading: %s\n", fn,
               strerror(errno));
         return 1;
@@ -106,15 +116,18 @@ static int read_param_file(bb_battle_param_t dst[4][0x60], const char *fn) {
     return 0;
 }
 
-static int read_bb_level_data(const char *fn) {
+static int read_bb_level_data(const char *dir, const char *file) {
     uint8_t *buf;
     int decsize;
+    char fn[strlen(dir) + strlen(file) + 2];
 
 #if defined(WORDS_BIGENDIAN) || defined(__BIG_ENDIAN__)
     int i, j;
 #endif
 
     /* Read in the file and decompress it. */
+    sprintf(fn, "%s/%s", dir, file);
+
     if((decsize = pso_prs_decompress_file(fn, &buf)) < 0) {
         debug(DBG_ERROR, "Cannot read levels %s: %s\n", fn, strerror(-decsize));
         return -1;
@@ -137,15 +150,18 @@ static int read_bb_level_data(const char *fn) {
     return 0;
 }
 
-static int read_v2_level_data(const char *fn) {
+static int read_v2_level_data(const char *dir, const char *file) {
     uint8_t *buf;
     int decsize;
+    char fn[strlen(dir) + strlen(file) + 2];
 
 #if defined(WORDS_BIGENDIAN) || defined(__BIG_ENDIAN__)
     int i, j;
 #endif
 
     /* Read in the file and decompress it. */
+    sprintf(fn, "%s/%s", dir, file);
+
     if((decsize = pso_prs_decompress_file(fn, &buf)) < 0) {
         debug(DBG_ERROR, "Cannot read levels %s: %s\n", fn, strerror(-decsize));
         return -1;
@@ -700,7 +716,8 @@ static int parse_map(map_enemy_t *en, int en_ct, game_enemies_t *game,
     return 0;
 }
 
-static int read_bb_map_set(int solo, int i, int j) {
+static int read_bb_map_set(int solo, int i, int j, int dfd,
+                           mapsnap_files_t *files) {
     int srv;
     char fn[256];
     int k, l, nmaps, nvars, m;
@@ -726,8 +743,8 @@ static int read_bb_map_set(int solo, int i, int j) {
     bb_parsed_objs[solo][i][j].map_count = nmaps;
     bb_parsed_objs[solo][i][j].variation_count = nvars;
 
-    if(!(tmp = (game_enemies_t *)malloc(sizeof(game_enemies_t) * nmaps *
-                                        nvars))) {
+    if(!(tmp = (game_enemies_t *)calloc(nmaps * nvars,
+                                        sizeof(game_enemies_t)))) {
         debug(DBG_ERROR, "Cannot allocate for maps: %s\n",
               strerror(errno));
         return 10;
@@ -735,7 +752,7 @@ static int read_bb_map_set(int solo, int i, int j) {
 
     bb_parsed_maps[solo][i][j].data = tmp;
 
-    if(!(tmp2 = (game_objs_t *)malloc(sizeof(game_objs_t) * nmaps * nvars))) {
+    if(!(tmp2 = (game_objs_t *)calloc(nmaps * nvars, sizeof(game_objs_t)))) {
         debug(DBG_ERROR, "Cannot allocate for objs: %s\n", strerror(errno));
         return 11;
     }
@@ -755,7 +772,7 @@ static int read_bb_map_set(int solo, int i, int j) {
                     return 1;
                 }
 
-                fp = fopen(fn, "rb");
+                fp = mapsnap_fopen(files, dfd, fn);
             }
 
             if(!fp) {
@@ -764,7 +781,7 @@ static int read_bb_map_set(int solo, int i, int j) {
                     return 1;
                 }
 
-                if(!(fp = fopen(fn, "rb"))) {
+                if(!(fp = mapsnap_fopen(files, dfd, fn))) {
                     debug(DBG_ERROR, "Cannot read map \"%s\": %s\n", fn,
                           strerror(errno));
                     return 2;
@@ -832,7 +849,7 @@ static int read_bb_map_set(int solo, int i, int j) {
                     return 1;
                 }
 
-                fp = fopen(fn, "rb");
+                fp = mapsnap_fopen(files, dfd, fn);
             }
 
             if(!fp) {
@@ -841,7 +858,7 @@ static int read_bb_map_set(int solo, int i, int j) {
                     return 1;
                 }
 
-                if(!(fp = fopen(fn, "rb"))) {
+                if(!(fp = mapsnap_fopen(files, dfd, fn))) {
                     debug(DBG_ERROR, "Cannot read objects file \"%s\": %s\n",
                           fn, strerror(errno));
                     return 2;
@@ -917,7 +934,8 @@ static int read_bb_map_set(int solo, int i, int j) {
     return 0;
 }
 
-static int read_v2_map_set(int j, int gcep) {
+static int read_v2_map_set(int j, int gcep, int dfd,
+                           mapsnap_files_t *files) {
     int srv, ep;
     char fn[256];
     int k, l, nmaps, nvars, i;
@@ -953,8 +971,8 @@ static int read_v2_map_set(int j, int gcep) {
         gc_parsed_objs[gcep - 1][j].variation_count = nvars;
     }
 
-    if(!(tmp = (game_enemies_t *)malloc(sizeof(game_enemies_t) * nmaps *
-                                        nvars))) {
+    if(!(tmp = (game_enemies_t *)calloc(nmaps * nvars,
+                                        sizeof(game_enemies_t)))) {
         debug(DBG_ERROR, "Cannot allocate for maps: %s\n", strerror(errno));
         return 10;
     }
@@ -964,7 +982,7 @@ static int read_v2_map_set(int j, int gcep) {
     else
         gc_parsed_maps[gcep - 1][j].data = tmp;
 
-    if(!(tmp2 = (game_objs_t *)malloc(sizeof(game_objs_t) * nmaps * nvars))) {
+    if(!(tmp2 = (game_objs_t *)calloc(nmaps * nvars, sizeof(game_objs_t)))) {
         debug(DBG_ERROR, "Cannot allocate for objs: %s\n", strerror(errno));
         return 11;
     }
@@ -987,7 +1005,7 @@ static int read_v2_map_set(int j, int gcep) {
                 return 1;
             }
 
-            if(!(fp = fopen(fn, "rb"))) {
+            if(!(fp = mapsnap_fopen(files, dfd, fn))) {
                 debug(DBG_ERROR, "Cannot read map %s: %s\n", fn,
                       strerror(errno));
                 return 2;
@@ -1055,7 +1073,7 @@ static int read_v2_map_set(int j, int gcep) {
                 return 1;
             }
 
-            if(!(fp = fopen(fn, "rb"))) {
+            if(!(fp = mapsnap_fopen(files, dfd, fn))) {
                 debug(DBG_ERROR, "Cannot read objects: %s\n", strerror(errno));
                 return 2;
             }
@@ -1129,15 +1147,15 @@ static int read_v2_map_set(int j, int gcep) {
     return 0;
 }
 
-static int read_bb_map_files(void) {
+static int read_bb_map_files(int dfd, mapsnap_files_t *files) {
     int srv, i, j;
 
     for(i = 0; i < 3; ++i) {                            /* Episode */
         for(j = 0; j < 16 && j <= max_area[i]; ++j) {   /* Area */
             /* Read both the multi-player and single-player maps. */
-            if((srv = read_bb_map_set(0, i, j)))
+            if((srv = read_bb_map_set(0, i, j, dfd, files)))
                 return srv;
-            if((srv = read_bb_map_set(1, i, j)))
+            if((srv = read_bb_map_set(1, i, j, dfd, files)))
                 return srv;
         }
     }
@@ -1145,37 +1163,73 @@ static int read_bb_map_files(void) {
     return 0;
 }
 
-static int read_v2_map_files(void) {
+static int read_v2_map_files(int dfd, mapsnap_files_t *files) {
     int srv, j;
 
     for(j = 0; j < 16 && j <= max_area[0]; ++j) {
-        if((srv = read_v2_map_set(j, 0)))
+        if((srv = read_v2_map_set(j, 0, dfd, files)))
             return srv;
     }
 
     return 0;
 }
 
-static int read_gc_map_files(void) {
+static int read_gc_map_files(int dfd, mapsnap_files_t *files) {
     int srv, j;
 
     for(j = 0; j < 16 && j <= max_area[0]; ++j) {
-        if((srv = read_v2_map_set(j, 1)))
+        if((srv = read_v2_map_set(j, 1, dfd, files)))
             return srv;
     }
 
     for(j = 0; j < 16 && j <= max_area[1]; ++j) {
-        if((srv = read_v2_map_set(j, 2)))
+        if((srv = read_v2_map_set(j, 2, dfd, files)))
             return srv;
     }
 
     return 0;
 }
 
+/* Read one version's maps from the files in the current directory, or from
+   the snapshot of them, if snapshots are turned on and it's up to date. */
+static int read_map_tables(int (*reader)(int, mapsnap_files_t *), int dfd,
+                           uint32_t kind, parsed_map_t *maps,
+                           parsed_objs_t *objs, int slots, mapsnap_t **snap) {
+    mapsnap_files_t files = { 0, 0, NULL };
+    int rv;
+
+    if(!map_snapshots)
+        return reader(dfd, NULL);
+
+    if((*snap = mapsnap_load(dfd, MAPSNAP_FILE, kind, maps, objs, slots))) {
+        debug(DBG_LOG, "Using map snapshot\n");
+        return 0;
+    }
+
+    if(!(rv = reader(dfd, &files))) {
+        if(mapsnap_write(dfd, MAPSNAP_FILE, kind, &files, maps, objs, slots))
+            debug(DBG_WARN, "Couldn't write map snapshot\n");
+        else
+            debug(DBG_LOG, "Wrote new map snapshot\n");
+    }
+
+    mapsnap_files_free(&files);
+    return rv;
+}
+
+/* The readers below work relative to a directory descriptor rather than
+   changing the working directory, so that they can all run at once. */
+static int open_dir(const char *dir, const char *what) {
+    int dfd;
+
+    if((dfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0)
+        debug(DBG_ERROR, "Error opening %s dir: %s\n", what, strerror(errno));
+
+    return dfd;
+}
+
 int bb_read_params(sylverant_ship_t *cfg) {
-    int rv = 0;
-    long sz;
-    char *buf, *path;
+    int rv = 0, dfd;
 
     /* Make sure we have a directory set... */
     if(!cfg->bb_param_dir || !cfg->bb_map_dir) {
@@ -1184,46 +1238,24 @@ int bb_read_params(sylverant_ship_t *cfg) {
         return 1;
     }
 
-    /* Save the current working directory, so we can do this a bit easier. */
-    sz = pathconf(".", _PC_PATH_MAX);
-    if(!(buf = malloc(sz))) {
-        debug(DBG_ERROR, "Error allocating memory: %s\n", strerror(errno));
-        return -1;
-    }
-
-    if(!(path = getcwd(buf, (size_t)sz))) {
-        debug(DBG_ERROR, "Error getting current dir: %s\n", strerror(errno));
-        free(buf);
-        return -1;
-    }
-
-    if(chdir(cfg->bb_param_dir)) {
-        debug(DBG_ERROR, "Error changing to Blue Burst param dir: %s\n",
-              strerror(errno));
-        free(buf);
+    if((dfd = open_dir(cfg->bb_param_dir, "Blue Burst param")) < 0)
         return 1;
-    }
 
     /* Attempt to read all the files. */
     debug(DBG_LOG, "Loading Blue Burst battle parameter data...\n");
-    rv = read_param_file(battle_params[0][0], "BattleParamEntry_on.dat");
-    rv += read_param_file(battle_params[0][1], "BattleParamEntry_lab_on.dat");
-    rv += read_param_file(battle_params[0][2], "BattleParamEntry_ep4_on.dat");
-    rv += read_param_file(battle_params[1][0], "BattleParamEntry.dat");
-    rv += read_param_file(battle_params[1][1], "BattleParamEntry_lab.dat");
-    rv += read_param_file(battle_params[1][2], "BattleParamEntry_ep4.dat");
+    rv = read_param_file(battle_params[0][0], dfd, "BattleParamEntry_on.dat");
+    rv += read_param_file(battle_params[0][1], dfd,
+                          "BattleParamEntry_lab_on.dat");
+    rv += read_param_file(battle_params[0][2], dfd,
+                          "BattleParamEntry_ep4_on.dat");
+    rv += read_param_file(battle_params[1][0], dfd, "BattleParamEntry.dat");
+    rv += read_param_file(battle_params[1][1], dfd, "BattleParamEntry_lab.dat");
+    rv += read_param_file(battle_params[1][2], dfd, "BattleParamEntry_ep4.dat");
+    close(dfd);
 
     /* Try to read the levelup data */
     debug(DBG_LOG, "Loading Blue Burst levelup table...\n");
-    rv += read_bb_level_data("PlyLevelTbl.prs");
-
-    /* Change back to the original directory. */
-    if(chdir(path)) {
-        debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-              strerror(errno));
-        free(buf);
-        return -1;
-    }
+    rv += read_bb_level_data(cfg->bb_param_dir, "PlyLevelTbl.prs");
 
     /* Bail out early, if appropriate. */
     if(rv) {
@@ -1231,23 +1263,14 @@ int bb_read_params(sylverant_ship_t *cfg) {
     }
 
     /* Next, try to read the map data */
-    if(chdir(cfg->bb_map_dir)) {
-        debug(DBG_ERROR, "Error changing to Blue Burst param dir: %s\n",
-              strerror(errno));
-        free(buf);
+    if((dfd = open_dir(cfg->bb_map_dir, "Blue Burst map")) < 0)
         return 1;
-    }
 
     debug(DBG_LOG, "Loading Blue Burst Map Enemy Data...\n");
-    rv = read_bb_map_files();
-
-    /* Change back to the original directory */
-    if(chdir(path)) {
-        debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-              strerror(errno));
-        free(buf);
-        return -1;
-    }
+    rv = read_map_tables(read_bb_map_files, dfd, MAPSNAP_BB,
+                         &bb_parsed_maps[0][0][0], &bb_parsed_objs[0][0][0],
+                         2 * 3 * 0x10, &bb_snap);
+    close(dfd);
 
 bail:
     if(rv) {
@@ -1258,15 +1281,11 @@ bail:
         have_bb_maps = 1;
     }
 
-    /* Clean up and return. */
-    free(buf);
     return rv;
 }
 
 int v2_read_params(sylverant_ship_t *cfg) {
-    int rv = 0;
-    long sz;
-    char *buf, *path;
+    int rv = 0, dfd;
 
     /* Make sure we have a directory set... */
     if(!cfg->v2_map_dir) {
@@ -1275,58 +1294,22 @@ int v2_read_params(sylverant_ship_t *cfg) {
         return 1;
     }
 
-    /* Save the current working directory, so we can do this a bit easier. */
-    sz = pathconf(".", _PC_PATH_MAX);
-    if(!(buf = malloc(sz))) {
-        debug(DBG_ERROR, "Error allocating memory: %s\n", strerror(errno));
-        return -1;
-    }
-
-    if(!(path = getcwd(buf, (size_t)sz))) {
-        debug(DBG_ERROR, "Error getting current dir: %s\n", strerror(errno));
-        free(buf);
-        return -1;
-    }
-
     if(cfg->v2_param_dir) {
-        if(chdir(cfg->v2_param_dir)) {
-            debug(DBG_ERROR, "Error changing to v2 param dir: %s\n",
-                  strerror(errno));
-            free(buf);
-            return -1;
-        }
-
         /* Try to read the levelup data */
         debug(DBG_LOG, "Loading v2 levelup table...\n");
-        read_v2_level_data("PlayerTable.prs");
-
-        /* Change back to the original directory. */
-        if(chdir(path)) {
-            debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-                  strerror(errno));
-            free(buf);
-            return -1;
-        }
+        read_v2_level_data(cfg->v2_param_dir, "PlayerTable.prs");
     }
 
     /* Next, try to read the map data */
-    if(chdir(cfg->v2_map_dir)) {
-        debug(DBG_ERROR, "Error changing to v2 map dir: %s\n",
-              strerror(errno));
+    if((dfd = open_dir(cfg->v2_map_dir, "v2 map")) < 0) {
         rv = 1;
         goto bail;
     }
 
     debug(DBG_LOG, "Loading v2 Map Enemy Data...\n");
-    rv = read_v2_map_files();
-
-    /* Change back to the original directory */
-    if(chdir(path)) {
-        debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-              strerror(errno));
-        free(buf);
-        return -1;
-    }
+    rv = read_map_tables(read_v2_map_files, dfd, MAPSNAP_V2, v2_parsed_maps,
+                         v2_parsed_objs, 0x10, &v2_snap);
+    close(dfd);
 
 bail:
     if(rv) {
@@ -1337,15 +1320,11 @@ bail:
         have_v2_maps = 1;
     }
 
-    /* Clean up and return. */
-    free(buf);
     return rv;
 }
 
 int gc_read_params(sylverant_ship_t *cfg) {
-    int rv = 0;
-    long sz;
-    char *buf, *path;
+    int rv = 0, dfd;
 
     /* Make sure we have a directory set... */
     if(!cfg->gc_map_dir) {
@@ -1354,37 +1333,17 @@ int gc_read_params(sylverant_ship_t *cfg) {
         return 1;
     }
 
-    /* Save the current working directory, so we can do this a bit easier. */
-    sz = pathconf(".", _PC_PATH_MAX);
-    if(!(buf = malloc(sz))) {
-        debug(DBG_ERROR, "Error allocating memory: %s\n", strerror(errno));
-        return -1;
-    }
-
-    if(!(path = getcwd(buf, (size_t)sz))) {
-        debug(DBG_ERROR, "Error getting current dir: %s\n", strerror(errno));
-        free(buf);
-        return -1;
-    }
-
     /* Next, try to read the map data */
-    if(chdir(cfg->gc_map_dir)) {
-        debug(DBG_ERROR, "Error changing to GC map dir: %s\n",
-              strerror(errno));
+    if((dfd = open_dir(cfg->gc_map_dir, "GC map")) < 0) {
         rv = 1;
         goto bail;
     }
 
     debug(DBG_LOG, "Loading GC Map Enemy Data...\n");
-    rv = read_gc_map_files();
-
-    /* Change back to the original directory */
-    if(chdir(path)) {
-        debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-              strerror(errno));
-        free(buf);
-        return -1;
-    }
+    rv = read_map_tables(read_gc_map_files, dfd, MAPSNAP_GC,
+                         &gc_parsed_maps[0][0], &gc_parsed_objs[0][0],
+                         2 * 0x10, &gc_snap);
+    close(dfd);
 
 bail:
     if(rv) {
@@ -1395,209 +1354,123 @@ bail:
         have_gc_maps = 1;
     }
 
-    /* Clean up and return. */
-    free(buf);
     return rv;
 }
 
-void bb_free_params(void) {
-    int i, j, k;
+static void free_map_tables(parsed_map_t *maps, parsed_objs_t *objs,
+                            int slots, mapsnap_t **snap) {
+    int i;
     uint32_t l, nmaps;
-    parsed_map_t *m;
 
-    for(i = 0; i < 2; ++i) {
-        for(j = 0; j < 3; ++j) {
-            for(k = 0; k < 0x10; ++k) {
-                m = &bb_parsed_maps[i][j][k];
-                nmaps = m->map_count * m->variation_count;
+    for(i = 0; i < slots; ++i) {
+        nmaps = maps[i].map_count * maps[i].variation_count;
 
-                for(l = 0; l < nmaps; ++l) {
-                    free(m->data[l].enemies);
-                }
-
-                free(m->data);
-                m->data = NULL;
-                m->map_count = m->variation_count = 0;
-            }
+        /* Anything that came from a snapshot lives in the snapshot itself. */
+        for(l = 0; l < nmaps && !*snap; ++l) {
+            if(maps[i].data)
+                free(maps[i].data[l].enemies);
+            if(objs[i].data)
+                free(objs[i].data[l].objs);
         }
-    }
-}
 
-void v2_free_params(void) {
-    int k;
-    uint32_t l, nmaps;
-    parsed_map_t *m;
+        free(maps[i].data);
+        free(objs[i].data);
+        maps[i].data = NULL;
+        objs[i].data = NULL;
+        maps[i].map_count = maps[i].variation_count = 0;
+        objs[i].map_count = objs[i].variation_count = 0;
+    }
 
-    for(k = 0; k < 0x10; ++k) {
-        m = &v2_parsed_maps[k];
-        nmaps = m->map_count * m->variation_count;
+    mapsnap_unload(*snap);
+    *snap = NULL;
+}
 
-        for(l = 0; l < nmaps; ++l) {
-            free(m->data[l].enemies);
-        }
+void bb_free_params(void) {
+    free_map_tables(&bb_parsed_maps[0][0][0], &bb_parsed_objs[0][0][0],
+                    2 * 3 * 0x10, &bb_snap);
+    have_bb_maps = 0;
+}
 
-        free(m->data);
-        m->data = NULL;
-        m->map_count = m->variation_count = 0;
-    }
+void v2_free_params(void) {
+    free_map_tables(v2_parsed_maps, v2_parsed_objs, 0x10, &v2_snap);
+    have_v2_maps = 0;
 }
 
 void gc_free_params(void) {
-    int k, j;
-    uint32_t l, nmaps;
-    parsed_map_t *m;
-
-    for(j = 0; j < 2; ++j) {
-        for(k = 0; k < 0x10; ++k) {
-            m = &gc_parsed_maps[j][k];
-            nmaps = m->map_count * m->variation_count;
-
-            for(l = 0; l < nmaps; ++l) {
-                free(m->data[l].enemies);
-            }
-
-            free(m->data);
-            m->data = NULL;
-            m->map_count = m->variation_count = 0;
-        }
-    }
+    free_map_tables(&gc_parsed_maps[0][0], &gc_parsed_objs[0][0], 2 * 0x10,
+                    &gc_snap);
+    have_gc_maps = 0;
 }
 
-int bb_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
-    int solo = (l->flags & LOBBY_FLAG_SINGLEPLAYER) ? 1 : 0, i;
-    uint32_t enemies = 0, index, objects = 0, index2;
-    parsed_map_t *maps;
-    parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
-
-    /* Figure out the parameter set that will be in use first... */
-    l->bb_params = battle_params[solo][l->episode - 1][l->difficulty];
-
-    /* Figure out the total number of enemies that the game will have... */
-    for(i = 0; i < 0x20; i += 2) {
-        maps = &bb_parsed_maps[solo][l->episode - 1][i >> 1];
-        objs = &bb_parsed_objs[solo][l->episode - 1][i >> 1];
-
-        /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
-            break;
-        }
-
-        /* Sanity Check! */
-        if(l->maps[i] > maps->map_count ||
-           l->maps[i + 1] > maps->variation_count) {
-            debug(DBG_ERROR, "Invalid map set generated for level %d (ep %d): "
-                  "(%d %d)\n", i, l->episode, l->maps[i], l->maps[i + 1]);
-            return -1;
-        }
-
-        index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
-    }
-
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
+/* Figure out what the special Rappy in a game should be for its event. */
+static uint8_t rappy_rt_index(lobby_t *l) {
+    switch(l->event) {
+        case LOBBY_EVENT_CHRISTMAS:
+            return 79;
+        case LOBBY_EVENT_EASTER:
+            return 81;
+        case LOBBY_EVENT_HALLOWEEN:
+            return 80;
+        default:
+            return 51;
     }
+}
 
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
+/* Allocate the per-game part of a game's enemies and objects. Everything lives
+   in one zeroed block that starts with the enemy map, so freeing that frees the
+   whole thing. */
+static int alloc_game_maps(uint32_t enemies, uint32_t objects,
+                           game_enemy_map_t **enp, game_obj_map_t **obp) {
+    game_enemy_map_t *en;
+    game_obj_map_t *ob;
+    uint8_t *ptr;
+
+    ptr = (uint8_t *)calloc(1, sizeof(game_enemy_map_t) +
+                            sizeof(game_obj_map_t) +
+                            objects * sizeof(uint32_t) + enemies * 3);
+    if(!ptr) {
+        debug(DBG_ERROR, "Error allocating game map state: %s\n",
+              strerror(errno));
+        return -1;
     }
 
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
-    }
-
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
+    en = (game_enemy_map_t *)ptr;
+    ptr += sizeof(game_enemy_map_t);
+    ob = (game_obj_map_t *)ptr;
+    ptr += sizeof(game_obj_map_t);
+    ob->flags = (uint32_t *)ptr;
+    ptr += objects * sizeof(uint32_t);
+    en->clients_hit = ptr;
+    en->last_client = ptr + enemies;
+    en->drop_done = ptr + enemies * 2;
 
     en->count = enemies;
     ob->count = objects;
-    index = index2 = 0;
-
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
-
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
-
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-        else if(en->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    en->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    en->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    en->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    en->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
-    }
-
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
+    *enp = en;
+    *obp = ob;
     return 0;
 }
 
-int v2_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
+static int load_game_maps(lobby_t *l, parsed_map_t *mapset,
+                          parsed_objs_t *objset, int rappies) {
+    game_enemy_map_t *en;
+    game_obj_map_t *ob;
     int i;
-    uint32_t enemies = 0, index, objects = 0, index2;
+    uint32_t enemies = 0, index, objects = 0;
     parsed_map_t *maps;
     parsed_objs_t *objs;
     game_enemies_t *sets[0x10];
     game_objs_t *osets[0x10];
+    int nsets = 0;
 
     /* Figure out the total number of enemies that the game will have... */
     for(i = 0; i < 0x20; i += 2) {
-        maps = &v2_parsed_maps[i >> 1];
-        objs = &v2_parsed_objs[i >> 1];
+        maps = &mapset[i >> 1];
+        objs = &objset[i >> 1];
 
         /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
+        if(maps->map_count == 0 && maps->variation_count == 0)
             break;
-        }
 
         /* Sanity Check! */
         if(l->maps[i] > maps->map_count ||
@@ -1610,199 +1483,107 @@ int v2_load_game_enemies(lobby_t *l) {
         index = l->maps[i] * maps->variation_count + l->maps[i + 1];
         enemies += maps->data[index].count;
         objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
+        sets[nsets] = &maps->data[index];
+        osets[nsets++] = &objs->data[index];
     }
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
+    if(alloc_game_maps(enemies, objects, &en, &ob))
         return -2;
-    }
 
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
-    }
-
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
-    }
+    /* Point at the shared data for each area, rather than copying it. */
+    enemies = objects = 0;
 
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
-
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
-
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
-
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
-
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
+    for(i = 0; i < nsets; ++i) {
+        if(sets[i]->count) {
+            en->start[en->runs] = enemies;
+            en->data[en->runs++] = sets[i]->enemies;
+            enemies += sets[i]->count;
+        }
 
-    /* Fixup Dark Falz' data for difficulties other than normal... */
-    if(l->difficulty) {
-        for(i = 0; i < en->count; ++i) {
-            if(en->enemies[i].bp_entry == 0x37) {
-                en->enemies[i].bp_entry = 0x38;
-            }
+        if(osets[i]->count) {
+            ob->start[ob->runs] = objects;
+            ob->data[ob->runs++] = osets[i]->objs;
+            objects += osets[i]->count;
         }
     }
 
+    /* Dark Falz' data needs fixing up for difficulties other than normal and
+       the special Rappy data does too. That happens on lookup. */
+    en->boss_fix = l->difficulty ? 1 : 0;
+    en->rappy_rt = rappies ? rappy_rt_index(l) : 0;
+
     /* Done! */
     l->map_enemies = en;
     l->map_objs = ob;
     return 0;
 }
 
-int gc_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
-    int i;
-    uint32_t enemies = 0, index, objects = 0, index2;
-    parsed_map_t *maps;
-    parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
+int bb_load_game_enemies(lobby_t *l) {
+    int solo = (l->flags & LOBBY_FLAG_SINGLEPLAYER) ? 1 : 0;
 
-    /* Figure out the total number of enemies that the game will have... */
-    for(i = 0; i < 0x20; i += 2) {
-        maps = &gc_parsed_maps[l->episode - 1][i >> 1];
-        objs = &gc_parsed_objs[l->episode - 1][i >> 1];
+    /* Figure out the parameter set that will be in use first... */
+    l->bb_params = battle_params[solo][l->episode - 1][l->difficulty];
 
-        /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
-            break;
-        }
+    return load_game_maps(l, bb_parsed_maps[solo][l->episode - 1],
+                          bb_parsed_objs[solo][l->episode - 1], 1);
+}
 
-        /* Sanity Check! */
-        if(l->maps[i] > maps->map_count ||
-           l->maps[i + 1] > maps->variation_count) {
-            debug(DBG_ERROR, "Invalid map set generated for level %d (ep %d): "
-                  "(%d %d)\n", i, l->episode, l->maps[i], l->maps[i + 1]);
-            return -1;
-        }
+int v2_load_game_enemies(lobby_t *l) {
+    return load_game_maps(l, v2_parsed_maps, v2_parsed_objs, 0);
+}
 
-        index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
-    }
+int gc_load_game_enemies(lobby_t *l) {
+    return load_game_maps(l, gc_parsed_maps[l->episode - 1],
+                          gc_parsed_objs[l->episode - 1], 1);
+}
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
+void free_game_enemies(lobby_t *l) {
+    if(l->map_enemies) {
+        free(l->map_enemies->owned);
+        free(l->map_objs->owned);
+        free(l->map_enemies);
     }
 
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
-    }
+    l->map_enemies = NULL;
+    l->map_objs = NULL;
+    l->bb_params = NULL;
+}
 
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
-    }
+/* Find which run of the shared data a given index falls into. */
+static int find_run(const uint32_t *start, uint32_t runs, uint32_t i) {
+    uint32_t lo = 0, hi = runs - 1, mid;
 
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
+    while(lo < hi) {
+        mid = (lo + hi + 1) >> 1;
 
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
+        if(start[mid] <= i)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
 
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
+    return (int)lo;
+}
 
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
+void game_enemy_get(const game_enemy_map_t *m, uint32_t i, game_enemy_t *rv) {
+    int r = find_run(m->start, m->runs, i);
 
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
+    *rv = m->data[r][i - m->start[r]];
 
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-        else if(en->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    en->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    en->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    en->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    en->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
-    }
+    if(rv->bp_entry == 0x37 && m->boss_fix)
+        rv->bp_entry = 0x38;
+    else if(rv->rt_index == (uint8_t)-1 && m->rappy_rt)
+        rv->rt_index = m->rappy_rt;
 
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
-    return 0;
+    rv->clients_hit = m->clients_hit[i];
+    rv->last_client = m->last_client[i];
+    rv->drop_done = m->drop_done[i];
 }
 
-void free_game_enemies(lobby_t *l) {
-    if(l->map_enemies) {
-        free(l->map_enemies->enemies);
-        free(l->map_enemies);
-    }
-
-    if(l->map_objs) {
-        free(l->map_objs->objs);
-        free(l->map_objs);
-    }
+const game_object_t *game_obj_get(const game_obj_map_t *m, uint32_t i) {
+    int r = find_run(m->start, m->runs, i);
 
-    l->map_enemies = NULL;
-    l->map_objs = NULL;
-    l->bb_params = NULL;
+    return &m->data[r][i - m->start[r]];
 }
 
 int map_have_v2_maps(void) {
@@ -1965,13 +1746,14 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
     FILE *fp;
     size_t dlen = strlen(ship->cfg->quests_dir);
     char fn[dlen + 40];
-    void *tmp;
-    uint32_t cnt, i;
+    uint32_t cnt, ocnt, i;
     sylverant_quest_t *q;
     quest_map_elem_t *el;
     uint32_t flags = l->flags;
-    game_enemies_t *newen;
-    game_objs_t *newob;
+    game_enemy_t *enemies;
+    game_object_t *objs;
+    game_enemy_map_t *newen;
+    game_obj_map_t *newob;
 
     /* Cowardly refuse to do this on challenge or battle mode. */
     if(l->challenge || l->battle)
@@ -2000,93 +1782,61 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
         return -2;
     }
 
-    /* Allocate the storage for the new enemy/object arrays. */
-    if(!(newen = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_WARN, "Cannot allocate enemies for quest: %s\n",
-              strerror(errno));
-        fclose(fp);
-        return -10;
-    }
-
-    if(!(newob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_WARN, "Cannot allocate objects for quest: %s\n",
-              strerror(errno));
-        free(newen);
-        fclose(fp);
-        return -11;
-    }
-
-    memset(newen, 0, sizeof(game_enemies_t));
-    memset(newob, 0, sizeof(game_objs_t));
-
     /* Allocate the objects array. */
-    newob->count = cnt = LE32(cnt);
-    if(!(tmp = malloc(cnt * sizeof(game_object_t)))) {
+    ocnt = cnt = LE32(cnt);
+    if(!(objs = (game_object_t *)malloc(cnt * sizeof(game_object_t)))) {
         debug(DBG_WARN, "Cannot allocate object array for quest: %s\n",
               strerror(errno));
         debug(DBG_WARN, "Quest ID: %" PRIu32 " Version: %d\n", qid, ver);
         debug(DBG_WARN, "Object count: %" PRIu32 "\n", cnt);
-        free(newob);
-        free(newen);
         fclose(fp);
         return -3;
     }
 
-    newob->objs = (game_object_t *)tmp;
-
     /* Read the objects in from the cache file. */
     for(i = 0; i < cnt; ++i) {
-        if(fread(&newob->objs[i].data, 1, sizeof(map_object_t),
+        if(fread(&objs[i].data, 1, sizeof(map_object_t),
                  fp) != sizeof(map_object_t)) {
             debug(DBG_WARN, "Cannot read cached map objects: %s\n",
                   strerror(errno));
             debug(DBG_WARN, "Quest ID: %" PRIu32 " Version: %d\n", qid, ver);
             debug(DBG_WARN, "Object count: %" PRIu32 "\n", cnt);
-            free(newob->objs);
-            free(newob);
-            free(newen);
+            free(objs);
             fclose(fp);
             return -4;
         }
 
-        newob->objs[i].flags = 0;
+        objs[i].flags = 0;
+        objs[i].area = 0;
     }
 
     if(fread(&cnt, 1, 4, fp) != 4) {
         debug(DBG_WARN, "Cannot read file \"%s\": %s\n", fn, strerror(errno));
-        free(newob->objs);
-        free(newob);
-        free(newen);
+        free(objs);
         fclose(fp);
         return -5;
     }
 
     /* Allocate the enemies array. */
-    newen->count = cnt = LE32(cnt);
-    if(!(tmp = malloc(cnt * sizeof(game_enemy_t)))) {
+    cnt = LE32(cnt);
+    if(!(enemies = (game_enemy_t *)malloc(cnt * sizeof(game_enemy_t)))) {
         debug(DBG_WARN, "Cannot allocate enemies array for quest: %s\n",
               strerror(errno));
         debug(DBG_WARN, "Quest ID: %" PRIu32 " Version: %d\n", qid, ver);
         debug(DBG_WARN, "Enemy count: %" PRIu32 "\n", cnt);
-        free(newob->objs);
-        free(newob);
-        free(newen);
+        free(objs);
         fclose(fp);
         return -6;
     }
 
-    newen->enemies = (game_enemy_t *)tmp;
-
     /* Read the enemies in from the cache file. */
-    if(fread(newen->enemies, sizeof(game_enemy_t), cnt, fp) != cnt) {
+    if(fread(enemies, sizeof(game_enemy_t), cnt, fp) != cnt) {
         debug(DBG_WARN, "Cannot read map cache: %s\n", strerror(errno));
         debug(DBG_WARN, "Quest ID: %" PRIu32 " Version: %d\n", qid, ver);
-        debug(DBG_WARN, "Object count: %" PRIu32 "\n", newob->count);
-        debug(DBG_WARN, "Enemy count: %" PRIu32 "\n", newen->count);
-        free(newen->enemies);
-        free(newob->objs);
-        free(newob);
-        free(newen);
+        debug(DBG_WARN, "Object count: %" PRIu32 "\n", ocnt);
+        debug(DBG_WARN, "Enemy count: %" PRIu32 "\n", cnt);
+        free(enemies);
+        free(objs);
         fclose(fp);
         return -7;
     }
@@ -2094,39 +1844,46 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
     /* We're done with the file now, so close it. */
     fclose(fp);
 
-    /* It should be safe to swap things out now, so do it. */
-    free(l->map_enemies->enemies);
-    free(l->map_objs->objs);
-    free(l->map_enemies);
-    free(l->map_objs);
+    /* Set up the game's state for the quest's enemies and objects. Unlike the
+       normal maps, nothing else uses this data, so it goes with the game. */
+    if(alloc_game_maps(cnt, ocnt, &newen, &newob)) {
+        free(enemies);
+        free(objs);
+        return -10;
+    }
 
-    l->map_enemies = newen;
-    l->map_objs = newob;
+    newen->owned = enemies;
+    newob->owned = objs;
+
+    if(cnt) {
+        newen->runs = 1;
+        newen->data[0] = enemies;
+    }
+
+    if(ocnt) {
+        newob->runs = 1;
+        newob->data[0] = objs;
+    }
 
     /* Fixup Dark Falz' data for difficulties other than normal and the special
        Rappy data too... */
-    for(i = 0; i < cnt; ++i) {
-        if(l->map_enemies->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            l->map_enemies->enemies[i].bp_entry = 0x38;
-        }
-        else if(l->map_enemies->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    l->map_enemies->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    l->map_enemies->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    l->map_enemies->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    l->map_enemies->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
+    newen->boss_fix = l->difficulty ? 1 : 0;
+    newen->rappy_rt = rappy_rt_index(l);
+
+    /* It should be safe to swap things out now, so do it. */
+    if(l->map_enemies) {
+        free(l->map_enemies->owned);
+        free(l->map_objs->owned);
+        free(l->map_enemies);
     }
 
+    l->map_enemies = newen;
+    l->map_objs = newob;
+
+    /* Throw away the drop tables from any quest loaded before this one. */
+    free(l->qdrops);
+    l->qdrops = NULL;
+
     /* Find the quest since we need to check the enemies later for drops... */
     if(!(el = quest_lookup(&ship->qmap, qid))) {
         debug(DBG_WARN, "Cannot look up quest?!\n");
@@ -2149,27 +1906,16 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
     if(!q || (!q->num_monster_ids && !q->num_monster_types))
         goto done;
 
-    /* Make a copy of the monster data from the quest. */
-    l->num_mtypes = q->num_monster_types;
-    if(!(l->mtypes = (qenemy_t *)malloc(sizeof(qenemy_t) * l->num_mtypes))) {
-        debug(DBG_WARN, "Cannot allocate monster types: %s\n", strerror(errno));
-        l->num_mtypes = 0;
-        goto done;
-    }
-
-    l->num_mids = q->num_monster_ids;
-    if(!(l->mids = (qenemy_t *)malloc(sizeof(qenemy_t) * l->num_mids))) {
-        debug(DBG_WARN, "Cannot allocate monster ids: %s\n", strerror(errno));
-        free(l->mtypes);
-        l->mtypes = NULL;
-        l->num_mtypes = 0;
-        l->num_mids = 0;
+    /* Build the drop lookup tables from the quest's monster data. */
+    if(!(l->qdrops = quest_drops_compile(q->monster_types,
+                                         q->num_monster_types,
+                                         q->monster_ids,
+                                         q->num_monster_ids))) {
+        debug(DBG_WARN, "Cannot allocate quest drop tables: %s\n",
+              strerror(errno));
         goto done;
     }
 
-    memcpy(l->mtypes, q->monster_types, sizeof(qenemy_t) * l->num_mtypes);
-    memcpy(l->mids, q->monster_ids, sizeof(qenemy_t) * l->num_mids);
-
 done:
     /* Re-set the server drops flag if it was set and clean up. */
     l->flags = flags;
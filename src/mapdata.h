@@ -153,6 +153,32 @@ typedef struct parsed_objects {
     game_objs_t *data;
 } parsed_objs_t;
 
+/* The enemies of a single game. The game_enemy_t data for each one is shared
+   with every other game on the same maps (one run per area), and only what
+   changes while the game is being played is kept separately for each game. */
+typedef struct game_enemy_map {
+    uint32_t count;
+    uint32_t runs;
+    uint32_t start[0x10];
+    const game_enemy_t *data[0x10];
+    uint8_t *clients_hit;
+    uint8_t *last_client;
+    uint8_t *drop_done;
+    uint8_t boss_fix;                   /* Swap Dark Falz for his harder form */
+    uint8_t rappy_rt;                   /* 0 for no event Rappy fixup */
+    game_enemy_t *owned;                /* Quest enemies, only used by us */
+} game_enemy_map_t;
+
+/* Same as above, for the objects of a single game. */
+typedef struct game_obj_map {
+    uint32_t count;
+    uint32_t runs;
+    uint32_t start[0x10];
+    const game_object_t *data[0x10];
+    uint32_t *flags;
+    game_object_t *owned;
+} game_obj_map_t;
+
 #undef PACKED
 
 /* Object types */
@@ -187,6 +213,12 @@ int v2_load_game_enemies(lobby_t *l);
 int gc_load_game_enemies(lobby_t *l);
 void free_game_enemies(lobby_t *l);
 
+/* Look up enemy/object i (which must be less than the count) in a game. The
+   enemy is copied out with any fixups for the game applied and its current
+   state filled in. */
+void game_enemy_get(const game_enemy_map_t *m, uint32_t i, game_enemy_t *rv);
+const game_object_t *game_obj_get(const game_obj_map_t *m, uint32_t i);
+
 int map_have_v2_maps(void);
 int map_have_gc_maps(void);
 int map_have_bb_maps(void);
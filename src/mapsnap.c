@@ -0,0 +1,430 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/checksum.h>
+
+#include "mapsnap.h"
+
+#define MAPSNAP_MAGIC       0x504E534D  /* "MSNP" */
+#define MAPSNAP_VERSION     1
+
+#define ALIGN8(x)           (((x) + 7) & ~((uint64_t)7))
+
+/* The file starts with this header, followed by the source file list, a
+   map/variation count pair for each table slot, a set entry for each map and
+   variation of each slot, and finally the enemy and object arrays themselves.
+   Everything is stored in the native byte order and layout, so a snapshot
+   written by a different build (or on a different machine) won't pass the
+   checks on the header. The CRC covers everything after the header. */
+typedef struct mapsnap_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;
+    uint32_t enemy_size;
+    uint32_t object_size;
+    uint32_t src_count;
+    uint32_t slot_count;
+    uint32_t set_count;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t reserved;
+} mapsnap_hdr_t;
+
+typedef struct mapsnap_slot {
+    uint32_t map_count;
+    uint32_t variation_count;
+} mapsnap_slot_t;
+
+typedef struct mapsnap_set {
+    uint32_t enemy_count;
+    uint32_t object_count;
+    uint64_t enemy_offs;
+    uint64_t object_offs;
+} mapsnap_set_t;
+
+static void note_file(mapsnap_files_t *f, int dfd, const char *fn, FILE *fp) {
+    struct stat st;
+    mapsnap_src_t *tmp;
+    int rv;
+
+    if(f->count == f->max) {
+        rv = f->max ? f->max * 2 : 64;
+
+        if(!(tmp = (mapsnap_src_t *)realloc(f->ents, rv *
+                                            sizeof(mapsnap_src_t)))) {
+            debug(DBG_WARN, "Cannot grow map source list: %s\n",
+                  strerror(errno));
+
+            /* Make sure we never write out a snapshot that would be missing a
+               file. */
+            f->max = -1;
+            return;
+        }
+
+        f->ents = tmp;
+        f->max = rv;
+    }
+    else if(f->max < 0) {
+        return;
+    }
+
+    tmp = &f->ents[f->count++];
+    memset(tmp->name, 0, sizeof(tmp->name));
+    strncpy(tmp->name, fn, sizeof(tmp->name) - 1);
+
+    if(fp)
+        rv = fstat(fileno(fp), &st);
+    else
+        rv = fstatat(dfd, fn, &st, 0);
+
+    if(!rv) {
+        tmp->mtime = (int64_t)st.st_mtime;
+        tmp->size = (int64_t)st.st_size;
+    }
+    else {
+        tmp->mtime = tmp->size = -1;
+    }
+}
+
+FILE *mapsnap_fopen(mapsnap_files_t *f, int dfd, const char *fn) {
+    FILE *fp = NULL;
+    int fd;
+
+    if((fd = openat(dfd, fn, O_RDONLY)) >= 0 && !(fp = fdopen(fd, "rb")))
+        close(fd);
+
+    if(f) {
+        /* Names that are too long to be stored can't be checked later. */
+        if(strlen(fn) >= sizeof(f->ents[0].name))
+            f->max = -1;
+        else
+            note_file(f, dfd, fn, fp);
+    }
+
+    return fp;
+}
+
+void mapsnap_files_free(mapsnap_files_t *f) {
+    free(f->ents);
+    f->ents = NULL;
+    f->count = f->max = 0;
+}
+
+int mapsnap_write(int dfd, const char *fn, uint32_t kind,
+                  const mapsnap_files_t *f, const parsed_map_t *maps,
+                  const parsed_objs_t *objs, int slots) {
+    uint32_t sets = 0, i, j, n;
+    uint64_t offs, sz;
+    uint8_t *buf;
+    mapsnap_hdr_t *hdr;
+    mapsnap_slot_t *slot;
+    mapsnap_set_t *set;
+    char tmpfn[strlen(fn) + 5];
+    FILE *fp = NULL;
+    int fd;
+
+    if(f->max < 0)
+        return -1;
+
+    /* Figure out where everything goes. */
+    for(i = 0; i < (uint32_t)slots; ++i) {
+        if(maps[i].map_count != objs[i].map_count ||
+           maps[i].variation_count != objs[i].variation_count)
+            return -1;
+
+        sets += maps[i].map_count * maps[i].variation_count;
+    }
+
+    offs = sizeof(mapsnap_hdr_t) + f->count * sizeof(mapsnap_src_t) +
+        slots * sizeof(mapsnap_slot_t) + sets * sizeof(mapsnap_set_t);
+    sz = ALIGN8(offs);
+
+    for(i = 0; i < (uint32_t)slots; ++i) {
+        n = maps[i].map_count * maps[i].variation_count;
+
+        for(j = 0; j < n; ++j) {
+            sz += ALIGN8(maps[i].data[j].count * sizeof(game_enemy_t));
+            sz += ALIGN8(objs[i].data[j].count * sizeof(game_object_t));
+        }
+    }
+
+    if(!(buf = (uint8_t *)calloc(1, sz))) {
+        debug(DBG_WARN, "Cannot allocate map snapshot: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Fill in all the tables and copy the data in. */
+    hdr = (mapsnap_hdr_t *)buf;
+    hdr->magic = MAPSNAP_MAGIC;
+    hdr->version = MAPSNAP_VERSION;
+    hdr->kind = kind;
+    hdr->enemy_size = sizeof(game_enemy_t);
+    hdr->object_size = sizeof(game_object_t);
+    hdr->src_count = f->count;
+    hdr->slot_count = slots;
+    hdr->set_count = sets;
+    hdr->size = sz;
+
+    memcpy(buf + sizeof(mapsnap_hdr_t), f->ents,
+           f->count * sizeof(mapsnap_src_t));
+    slot = (mapsnap_slot_t *)(buf + sizeof(mapsnap_hdr_t) +
+                              f->count * sizeof(mapsnap_src_t));
+    set = (mapsnap_set_t *)(slot + slots);
+    offs = ALIGN8(offs);
+
+    for(i = 0; i < (uint32_t)slots; ++i) {
+        slot[i].map_count = maps[i].map_count;
+        slot[i].variation_count = maps[i].variation_count;
+        n = maps[i].map_count * maps[i].variation_count;
+
+        for(j = 0; j < n; ++j, ++set) {
+            set->enemy_count = maps[i].data[j].count;
+            set->enemy_offs = offs;
+            if(set->enemy_count)
+                memcpy(buf + offs, maps[i].data[j].enemies,
+                       set->enemy_count * sizeof(game_enemy_t));
+            offs += ALIGN8(set->enemy_count * sizeof(game_enemy_t));
+
+            set->object_count = objs[i].data[j].count;
+            set->object_offs = offs;
+            if(set->object_count)
+                memcpy(buf + offs, objs[i].data[j].objs,
+                       set->object_count * sizeof(game_object_t));
+            offs += ALIGN8(set->object_count * sizeof(game_object_t));
+        }
+    }
+
+    hdr->crc = sylverant_crc32(buf + sizeof(mapsnap_hdr_t),
+                               (int)(sz - sizeof(mapsnap_hdr_t)));
+
+    /* Write it to a temporary file first, so that nobody ever sees a partial
+       snapshot. */
+    sprintf(tmpfn, "%s.tmp", fn);
+
+    fd = openat(dfd, tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(fd >= 0 && !(fp = fdopen(fd, "wb")))
+        close(fd);
+
+    if(!fp) {
+        debug(DBG_WARN, "Cannot open map snapshot \"%s\": %s\n", tmpfn,
+              strerror(errno));
+        free(buf);
+        return -1;
+    }
+
+    if(fwrite(buf, 1, sz, fp) != sz) {
+        debug(DBG_WARN, "Cannot write map snapshot: %s\n", strerror(errno));
+        fclose(fp);
+        unlinkat(dfd, tmpfn, 0);
+        free(buf);
+        return -1;
+    }
+
+    free(buf);
+
+    if(fclose(fp) || renameat(dfd, tmpfn, dfd, fn)) {
+        debug(DBG_WARN, "Cannot save map snapshot: %s\n", strerror(errno));
+        unlinkat(dfd, tmpfn, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int check_sources(int dfd, const mapsnap_src_t *src, uint32_t count) {
+    struct stat st;
+    uint32_t i;
+
+    for(i = 0; i < count; ++i) {
+        if(src[i].name[sizeof(src[i].name) - 1])
+            return -1;
+
+        if(fstatat(dfd, src[i].name, &st, 0)) {
+            if(src[i].mtime != -1)
+                return -1;
+        }
+        else if(src[i].mtime != (int64_t)st.st_mtime ||
+                src[i].size != (int64_t)st.st_size) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void clear_tables(parsed_map_t *maps, parsed_objs_t *objs, int slots) {
+    int i;
+
+    for(i = 0; i < slots; ++i) {
+        free(maps[i].data);
+        free(objs[i].data);
+        memset(&maps[i], 0, sizeof(parsed_map_t));
+        memset(&objs[i], 0, sizeof(parsed_objs_t));
+    }
+}
+
+mapsnap_t *mapsnap_load(int dfd, const char *fn, uint32_t kind,
+                        parsed_map_t *maps, parsed_objs_t *objs, int slots) {
+    int fd;
+    struct stat st;
+    uint8_t *base;
+    const mapsnap_hdr_t *hdr;
+    const mapsnap_src_t *src;
+    const mapsnap_slot_t *slot;
+    const mapsnap_set_t *set;
+    uint64_t tbls, esz, osz;
+    uint32_t i, j, n, sets = 0;
+    mapsnap_t *rv;
+
+    if((fd = openat(dfd, fn, O_RDONLY)) < 0)
+        return NULL;
+
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(mapsnap_hdr_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    base = (uint8_t *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                           fd, 0);
+    close(fd);
+
+    if(base == MAP_FAILED) {
+        debug(DBG_WARN, "Cannot map snapshot \"%s\": %s\n", fn,
+              strerror(errno));
+        return NULL;
+    }
+
+    /* Make sure it's a snapshot we can actually use. */
+    hdr = (const mapsnap_hdr_t *)base;
+
+    if(hdr->magic != MAPSNAP_MAGIC || hdr->version != MAPSNAP_VERSION ||
+       hdr->kind != kind || hdr->enemy_size != sizeof(game_enemy_t) ||
+       hdr->object_size != sizeof(game_object_t) ||
+       hdr->slot_count != (uint32_t)slots ||
+       hdr->size != (uint64_t)st.st_size) {
+        debug(DBG_LOG, "Map snapshot \"%s\" doesn't match this build\n", fn);
+        goto out_unmap;
+    }
+
+    tbls = sizeof(mapsnap_hdr_t) + (uint64_t)hdr->src_count *
+        sizeof(mapsnap_src_t) + (uint64_t)slots * sizeof(mapsnap_slot_t) +
+        (uint64_t)hdr->set_count * sizeof(mapsnap_set_t);
+
+    if(tbls > hdr->size) {
+        debug(DBG_WARN, "Map snapshot \"%s\" is damaged\n", fn);
+        goto out_unmap;
+    }
+
+    if(sylverant_crc32(base + sizeof(mapsnap_hdr_t),
+                       (int)(hdr->size - sizeof(mapsnap_hdr_t))) != hdr->crc) {
+        debug(DBG_WARN, "Map snapshot \"%s\" fails its checksum\n", fn);
+        goto out_unmap;
+    }
+
+    src = (const mapsnap_src_t *)(base + sizeof(mapsnap_hdr_t));
+
+    if(check_sources(dfd, src, hdr->src_count)) {
+        debug(DBG_LOG, "Map snapshot \"%s\" is out of date\n", fn);
+        goto out_unmap;
+    }
+
+    slot = (const mapsnap_slot_t *)(src + hdr->src_count);
+    set = (const mapsnap_set_t *)(slot + slots);
+
+    /* Check every set before touching the tables. */
+    for(i = 0; i < (uint32_t)slots; ++i) {
+        sets += slot[i].map_count * slot[i].variation_count;
+    }
+
+    if(sets != hdr->set_count) {
+        debug(DBG_WARN, "Map snapshot \"%s\" is damaged\n", fn);
+        goto out_unmap;
+    }
+
+    for(i = 0; i < sets; ++i) {
+        esz = (uint64_t)set[i].enemy_count * sizeof(game_enemy_t);
+        osz = (uint64_t)set[i].object_count * sizeof(game_object_t);
+
+        if(set[i].enemy_offs < tbls || set[i].enemy_offs + esz > hdr->size ||
+           set[i].object_offs < tbls ||
+           set[i].object_offs + osz > hdr->size ||
+           (set[i].enemy_offs & 7) || (set[i].object_offs & 7)) {
+            debug(DBG_WARN, "Map snapshot \"%s\" is damaged\n", fn);
+            goto out_unmap;
+        }
+    }
+
+    if(!(rv = (mapsnap_t *)malloc(sizeof(mapsnap_t)))) {
+        debug(DBG_WARN, "Cannot allocate map snapshot: %s\n", strerror(errno));
+        goto out_unmap;
+    }
+
+    rv->base = base;
+    rv->len = (size_t)st.st_size;
+
+    /* Point the tables at the data in the snapshot. */
+    for(i = 0; i < (uint32_t)slots; ++i) {
+        n = slot[i].map_count * slot[i].variation_count;
+        maps[i].map_count = objs[i].map_count = slot[i].map_count;
+        maps[i].variation_count = slot[i].variation_count;
+        objs[i].variation_count = slot[i].variation_count;
+
+        if(!n)
+            continue;
+
+        maps[i].data = (game_enemies_t *)malloc(sizeof(game_enemies_t) * n);
+        objs[i].data = (game_objs_t *)malloc(sizeof(game_objs_t) * n);
+
+        if(!maps[i].data || !objs[i].data) {
+            debug(DBG_WARN, "Cannot allocate for maps: %s\n", strerror(errno));
+            clear_tables(maps, objs, i + 1);
+            free(rv);
+            goto out_unmap;
+        }
+
+        for(j = 0; j < n; ++j, ++set) {
+            maps[i].data[j].count = set->enemy_count;
+            maps[i].data[j].enemies = (game_enemy_t *)(base + set->enemy_offs);
+            objs[i].data[j].count = set->object_count;
+            objs[i].data[j].objs = (game_object_t *)(base + set->object_offs);
+        }
+    }
+
+    return rv;
+
+out_unmap:
+    munmap(base, (size_t)st.st_size);
+    return NULL;
+}
+
+void mapsnap_unload(mapsnap_t *s) {
+    if(s) {
+        munmap(s->base, s->len);
+        free(s);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MAPSNAP_H
+#define MAPSNAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mapdata.h"
+
+/* Map snapshots hold all of the parsed map data for one version of the game
+   in a single file in its map directory. When a snapshot is usable, it is
+   mapped into memory read-only and the parsed map tables point right into it,
+   rather than reading and parsing each of the map files again.
+
+   A snapshot records every map file that went into it (including the ones
+   that were looked for but not found), and is only used if all of those
+   still look exactly the same as they did when it was written. */
+
+#define MAPSNAP_FILE        ".mapsnap"
+
+/* Which set of maps a snapshot holds. */
+#define MAPSNAP_V2          0
+#define MAPSNAP_GC          1
+#define MAPSNAP_BB          2
+
+typedef struct mapsnap_src {
+    char name[32];
+    int64_t mtime;
+    int64_t size;
+} mapsnap_src_t;
+
+/* The list of source files that were looked at while reading maps. */
+typedef struct mapsnap_files {
+    int count;
+    int max;
+    mapsnap_src_t *ents;
+} mapsnap_files_t;
+
+typedef struct mapsnap {
+    void *base;
+    size_t len;
+} mapsnap_t;
+
+/* Open a map file in the directory dfd for reading, noting it in the list. The
+   list may be NULL, in which case nothing is noted. */
+FILE *mapsnap_fopen(mapsnap_files_t *f, int dfd, const char *fn);
+void mapsnap_files_free(mapsnap_files_t *f);
+
+/* Write out a snapshot of the given tables of parsed maps and objects, which
+   both must have the given number of entries. All of the file names are
+   relative to the directory dfd. */
+int mapsnap_write(int dfd, const char *fn, uint32_t kind,
+                  const mapsnap_files_t *f, const parsed_map_t *maps,
+                  const parsed_objs_t *objs, int slots);
+
+/* Try to load a snapshot into the given (empty) tables. Returns NULL and
+   leaves the tables empty if the snapshot doesn't exist, is damaged, or is out
+   of date. Tables filled in from a snapshot must have only their data arrays
+   freed, and then the snapshot released with mapsnap_unload(). */
+mapsnap_t *mapsnap_load(int dfd, const char *fn, uint32_t kind,
+                        parsed_map_t *maps, parsed_objs_t *objs, int slots);
+void mapsnap_unload(mapsnap_t *s);
+
+#endif /* !MAPSNAP_H */
@@ -0,0 +1,521 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <sylverant/debug.h>
+
+#include "pktcap.h"
+#include "utils.h"
+
+/* How much each thread can have waiting to be written before packets start to
+   get dropped from the logs, and how often the writer checks for more. */
+#define PKTCAP_RING_SIZE    (1 << 20)
+#define PKTCAP_INTERVAL_MS  100
+
+/* What actually gets put into a thread's ring for each packet. */
+typedef struct pktcap_ent {
+    pktcap_t *cap;
+    uint64_t ts;
+    uint32_t len;
+    uint32_t gc;
+    uint8_t type;
+    uint8_t version;
+} pktcap_ent_t;
+
+#define PKTCAP_ENT_SIZE(len) \
+    ((sizeof(pktcap_ent_t) + (len) + 7) & ~((size_t)7))
+
+/* A single-producer, single-consumer ring of entries. Each thread that logs
+   packets gets its own, which only it ever adds to and only the writer thread
+   ever takes from. The head and tail just keep counting up. */
+typedef struct pktcap_ring {
+    struct pktcap_ring *next;
+    size_t head;
+    size_t tail;
+    int dead;
+    uint32_t dropped;
+    uint8_t data[PKTCAP_RING_SIZE];
+} pktcap_ring_t;
+
+struct pktcap {
+    FILE *fp;
+    pktcap_t *next_dirty;
+    pktcap_t *next_close;
+    int dirty;
+    uint64_t close_ts;
+    uint32_t close_gc;
+    uint8_t close_type;
+    uint8_t close_version;
+};
+
+static pthread_key_t ring_key;
+static pthread_t thd;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pktcap_ring_t *rings = NULL;
+static pktcap_t *closing = NULL;
+static int stop = 0;
+
+static inline uint64_t now_usec(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static inline void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+    put16(p, (uint16_t)v);
+    put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static inline void put64(uint8_t *p, uint64_t v) {
+    put32(p, (uint32_t)v);
+    put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static inline uint64_t get64(const uint8_t *p) {
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static int write_rec(FILE *fp, uint64_t ts, uint32_t gc, int type,
+                     int version, const void *data, uint32_t len) {
+    uint8_t hdr[PKTCAP_REC_HDR_SZ];
+
+    put64(hdr, ts);
+    put32(hdr + 8, len);
+    put32(hdr + 12, gc);
+    hdr[16] = (uint8_t)type;
+    hdr[17] = (uint8_t)version;
+    put16(hdr + 18, 0);
+
+    if(fwrite(hdr, 1, PKTCAP_REC_HDR_SZ, fp) != PKTCAP_REC_HDR_SZ)
+        return -1;
+
+    if(len && fwrite(data, 1, len, fp) != len)
+        return -1;
+
+    return 0;
+}
+
+static void ring_dtor(void *p) {
+    pktcap_ring_t *r = (pktcap_ring_t *)p;
+
+    /* Leave it for the writer to free once it's been emptied out. */
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static pktcap_ring_t *get_ring(void) {
+    pktcap_ring_t *r = (pktcap_ring_t *)pthread_getspecific(ring_key);
+
+    if(r)
+        return r;
+
+    if(!(r = (pktcap_ring_t *)malloc(sizeof(pktcap_ring_t)))) {
+        debug(DBG_WARN, "Cannot allocate packet capture buffer\n");
+        return NULL;
+    }
+
+    r->head = r->tail = 0;
+    r->dead = 0;
+    r->dropped = 0;
+
+    if(pthread_setspecific(ring_key, r)) {
+        free(r);
+        return NULL;
+    }
+
+    /* New rings only ever go on the front of the list, so the writer can walk
+       the list without holding the lock. */
+    pthread_mutex_lock(&mutex);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&mutex);
+
+    return r;
+}
+
+static void ring_copy_in(pktcap_ring_t *r, size_t pos, const void *src,
+                         size_t len) {
+    size_t off = pos & (PKTCAP_RING_SIZE - 1);
+    size_t first = PKTCAP_RING_SIZE - off;
+
+    if(first >= len) {
+        memcpy(r->data + off, src, len);
+    }
+    else {
+        memcpy(r->data + off, src, first);
+        memcpy(r->data, (const uint8_t *)src + first, len - first);
+    }
+}
+
+static void ring_copy_out(pktcap_ring_t *r, size_t pos, void *dst,
+                          size_t len) {
+    size_t off = pos & (PKTCAP_RING_SIZE - 1);
+    size_t first = PKTCAP_RING_SIZE - off;
+
+    if(first >= len) {
+        memcpy(dst, r->data + off, len);
+    }
+    else {
+        memcpy(dst, r->data + off, first);
+        memcpy((uint8_t *)dst + first, r->data, len - first);
+    }
+}
+
+void pktcap_packet(pktcap_t *cap, int type, uint32_t gc, int version,
+                   const void *pkt, uint32_t len) {
+    pktcap_ring_t *r;
+    pktcap_ent_t ent;
+    size_t head, tail, sz = PKTCAP_ENT_SIZE(len);
+
+    if(!(r = get_ring()))
+        return;
+
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    if(sz > PKTCAP_RING_SIZE - (head - tail)) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ent.cap = cap;
+    ent.ts = now_usec();
+    ent.len = len;
+    ent.gc = gc;
+    ent.type = (uint8_t)type;
+    ent.version = (uint8_t)version;
+
+    ring_copy_in(r, head, &ent, sizeof(pktcap_ent_t));
+    ring_copy_in(r, head + sizeof(pktcap_ent_t), pkt, len);
+    __atomic_store_n(&r->head, head + sz, __ATOMIC_RELEASE);
+}
+
+/* Write out everything in a ring. Only the writer thread calls this. */
+static void ring_drain(pktcap_ring_t *r, pktcap_t **dirty) {
+    pktcap_ent_t ent;
+    uint8_t buf[65536];
+    size_t head, tail = r->tail;
+    uint32_t dropped, len;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    while(tail != head) {
+        ring_copy_out(r, tail, &ent, sizeof(pktcap_ent_t));
+
+        /* Anything bigger than this isn't something we'd ever be sending or
+           receiving, so just write out the start of it. */
+        len = ent.len > sizeof(buf) ? (uint32_t)sizeof(buf) : ent.len;
+
+        ring_copy_out(r, tail + sizeof(pktcap_ent_t), buf, len);
+        tail += PKTCAP_ENT_SIZE(ent.len);
+
+        if(write_rec(ent.cap->fp, ent.ts, ent.gc, ent.type, ent.version, buf,
+                     len)) {
+            debug(DBG_WARN, "Error writing packet capture: %s\n",
+                  strerror(errno));
+        }
+
+        if(!ent.cap->dirty) {
+            ent.cap->dirty = 1;
+            ent.cap->next_dirty = *dirty;
+            *dirty = ent.cap;
+        }
+    }
+
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+    if((dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED))) {
+        debug(DBG_WARN, "Packet capture buffer full, dropped %u packets\n",
+              (unsigned int)dropped);
+    }
+}
+
+static void drain_all(void) {
+    pktcap_ring_t *r, *first, **prev;
+    pktcap_t *dirty = NULL, *cap;
+
+    pthread_mutex_lock(&mutex);
+    first = rings;
+    pthread_mutex_unlock(&mutex);
+
+    for(r = first; r; r = r->next) {
+        ring_drain(r, &dirty);
+    }
+
+    while((cap = dirty)) {
+        dirty = cap->next_dirty;
+        cap->dirty = 0;
+        fflush(cap->fp);
+    }
+
+    /* Free up the rings of any threads that have gone away, now that they're
+       empty. */
+    pthread_mutex_lock(&mutex);
+    prev = &rings;
+
+    while((r = *prev)) {
+        if(__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+           r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+            *prev = r->next;
+            free(r);
+        }
+        else {
+            prev = &r->next;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+static void *pktcap_thd(void *d) {
+    struct timespec ts;
+    pktcap_t *cl, *cap;
+    int done;
+
+    (void)d;
+
+    for(;;) {
+        pthread_mutex_lock(&mutex);
+
+        if(!stop && !closing) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += PKTCAP_INTERVAL_MS * 1000000;
+
+            if(ts.tv_nsec >= 1000000000) {
+                ts.tv_nsec -= 1000000000;
+                ++ts.tv_sec;
+            }
+
+            pthread_cond_timedwait(&cond, &mutex, &ts);
+        }
+
+        /* Grab the list of captures to close before draining the rings, so
+           that anything added to them before they were closed gets written
+           out before we close them. */
+        cl = closing;
+        closing = NULL;
+        done = stop;
+        pthread_mutex_unlock(&mutex);
+
+        drain_all();
+
+        while((cap = cl)) {
+            cl = cap->next_close;
+
+            write_rec(cap->fp, cap->close_ts, cap->close_gc, cap->close_type,
+                      cap->close_version, NULL, 0);
+            fclose(cap->fp);
+            free(cap);
+        }
+
+        if(done)
+            break;
+    }
+
+    return NULL;
+}
+
+int pktcap_init(void) {
+    if(pthread_key_create(&ring_key, &ring_dtor)) {
+        perror("pthread_key_create");
+        return -1;
+    }
+
+    stop = 0;
+
+    if(pthread_create(&thd, NULL, &pktcap_thd, NULL)) {
+        debug(DBG_ERROR, "Cannot start packet capture thread\n");
+        pthread_key_delete(ring_key);
+        return -1;
+    }
+
+    return 0;
+}
+
+void pktcap_shutdown(void) {
+    pktcap_ring_t *r;
+
+    pthread_mutex_lock(&mutex);
+    stop = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    pthread_join(thd, NULL);
+
+    /* The writer emptied everything out on its way out the door. */
+    while((r = rings)) {
+        rings = r->next;
+        free(r);
+    }
+
+    pthread_setspecific(ring_key, NULL);
+    pthread_key_delete(ring_key);
+}
+
+pktcap_t *pktcap_open(const char *fn, uint32_t gc, int version) {
+    pktcap_t *rv;
+    uint8_t hdr[PKTCAP_FILE_HDR_SZ];
+
+    if(!(rv = (pktcap_t *)malloc(sizeof(pktcap_t))))
+        return NULL;
+
+    memset(rv, 0, sizeof(pktcap_t));
+
+    if(!(rv->fp = fopen(fn, "wb"))) {
+        free(rv);
+        return NULL;
+    }
+
+    put32(hdr, PKTCAP_MAGIC);
+    put16(hdr + 4, PKTCAP_VERSION);
+    put16(hdr + 6, PKTCAP_REC_HDR_SZ);
+    put32(hdr + 8, gc);
+    put32(hdr + 12, 0);
+
+    /* Nothing else can have this yet, so it's safe to write directly. */
+    if(fwrite(hdr, 1, PKTCAP_FILE_HDR_SZ, rv->fp) != PKTCAP_FILE_HDR_SZ ||
+       write_rec(rv->fp, now_usec(), gc, PKTCAP_START, version, NULL, 0)) {
+        fclose(rv->fp);
+        free(rv);
+        return NULL;
+    }
+
+    fflush(rv->fp);
+    return rv;
+}
+
+void pktcap_close(pktcap_t *cap, int type, uint32_t gc, int version) {
+    cap->close_ts = now_usec();
+    cap->close_gc = gc;
+    cap->close_type = (uint8_t)type;
+    cap->close_version = (uint8_t)version;
+
+    pthread_mutex_lock(&mutex);
+    cap->next_close = closing;
+    closing = cap;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+int pktcap_dump(const char *fn, FILE *out) {
+    FILE *fp;
+    uint8_t hdr[PKTCAP_FILE_HDR_SZ], rhdr[PKTCAP_REC_HDR_SZ];
+    uint8_t *data = NULL;
+    uint32_t len, dsize = 0;
+    uint16_t rsize;
+    uint64_t ts;
+    time_t t;
+    char tstr[26];
+    void *tmp;
+    int rv = 0;
+
+    if(!(fp = fopen(fn, "rb"))) {
+        debug(DBG_ERROR, "Cannot open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+
+    if(fread(hdr, 1, PKTCAP_FILE_HDR_SZ, fp) != PKTCAP_FILE_HDR_SZ ||
+       get32(hdr) != PKTCAP_MAGIC) {
+        debug(DBG_ERROR, "%s is not a packet capture\n", fn);
+        fclose(fp);
+        return -2;
+    }
+
+    if(get16(hdr + 4) != PKTCAP_VERSION ||
+       (rsize = get16(hdr + 6)) < PKTCAP_REC_HDR_SZ) {
+        debug(DBG_ERROR, "Unsupported packet capture version: %d\n",
+              (int)get16(hdr + 4));
+        fclose(fp);
+        return -3;
+    }
+
+    while(fread(rhdr, 1, PKTCAP_REC_HDR_SZ, fp) == PKTCAP_REC_HDR_SZ) {
+        /* Skip over anything a newer version added to the header. */
+        if(rsize > PKTCAP_REC_HDR_SZ)
+            fseek(fp, rsize - PKTCAP_REC_HDR_SZ, SEEK_CUR);
+
+        ts = get64(rhdr);
+        len = get32(rhdr + 8);
+
+        if(len > dsize) {
+            if(!(tmp = realloc(data, len))) {
+                debug(DBG_ERROR, "Out of memory reading capture\n");
+                rv = -4;
+                break;
+            }
+
+            data = (uint8_t *)tmp;
+            dsize = len;
+        }
+
+        if(len && fread(data, 1, len, fp) != len) {
+            debug(DBG_WARN, "Packet capture is truncated\n");
+            rv = -5;
+            break;
+        }
+
+        t = (time_t)(ts / 1000000);
+        ctime_r(&t, tstr);
+        tstr[strlen(tstr) - 1] = 0;
+
+        switch(rhdr[16]) {
+            case PKTCAP_SENT:
+            case PKTCAP_RECV:
+                fprintf(out, "[%s] Packet %s by server\n", tstr,
+                        rhdr[16] == PKTCAP_RECV ? "received" : "sent");
+                fprint_packet(out, data, (int)len, -1);
+                break;
+
+            case PKTCAP_START:
+                fprintf(out, "[%s] Packet log started\n", tstr);
+                break;
+
+            case PKTCAP_STOP:
+                fprintf(out, "[%s] Packet log ended\n", tstr);
+                break;
+
+            case PKTCAP_CLOSED:
+                fprintf(out, "[%s] Connection closed\n", tstr);
+                break;
+        }
+    }
+
+    free(data);
+    fclose(fp);
+    return rv;
+}
@@ -0,0 +1,83 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PKTCAP_H
+#define PKTCAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Packet logs are written out in a compact binary format by a background
+   thread, rather than being formatted on the thread that is sending or
+   receiving the packets. Everything in a capture file is little-endian.
+
+   Each file starts with a header:
+       uint32_t magic           PKTCAP_MAGIC
+       uint16_t version         PKTCAP_VERSION
+       uint16_t rec_hdr_size    size of each record's header
+       uint32_t guildcard       of the client when the log was started
+       uint32_t reserved
+
+   Followed by any number of records, each of which is:
+       uint64_t timestamp       microseconds since the epoch
+       uint32_t len             length of the data following the header
+       uint32_t guildcard
+       uint8_t type             one of the PKTCAP_* types below
+       uint8_t version          CLIENT_VERSION_* of the client
+       uint16_t reserved
+       uint8_t data[len]        the decrypted packet, if any
+
+   Use ship_server --dump-capture to turn one back into a readable log. */
+
+#define PKTCAP_MAGIC        0x50414353  /* 'SCAP' */
+#define PKTCAP_VERSION      1
+#define PKTCAP_FILE_HDR_SZ  16
+#define PKTCAP_REC_HDR_SZ   20
+
+/* Record types. */
+#define PKTCAP_SENT         0
+#define PKTCAP_RECV         1
+#define PKTCAP_START        2
+#define PKTCAP_STOP         3
+#define PKTCAP_CLOSED       4
+
+typedef struct pktcap pktcap_t;
+
+/* Start up and shut down the capture writer thread. Anything still waiting to
+   be written is written out before shutdown returns. */
+int pktcap_init(void);
+void pktcap_shutdown(void);
+
+/* Create a new capture file, writing out its header and a start record. */
+pktcap_t *pktcap_open(const char *fn, uint32_t gc, int version);
+
+/* Add a packet to a capture. The packet is copied into a buffer belonging to
+   the calling thread without taking any locks, and written out to the file
+   later on. If that buffer is full, the packet is dropped from the log. */
+void pktcap_packet(pktcap_t *cap, int type, uint32_t gc, int version,
+                   const void *pkt, uint32_t len);
+
+/* Close a capture, ending it with a record of the given type (PKTCAP_STOP or
+   PKTCAP_CLOSED). Everything added to the capture before this is called will
+   still make it into the file. The capture must not be used afterwards. */
+void pktcap_close(pktcap_t *cap, int type, uint32_t gc, int version);
+
+/* Write a capture file out in the same text format that packet logs used to
+   be written in. */
+int pktcap_dump(const char *fn, FILE *out);
+
+#endif /* !PKTCAP_H */
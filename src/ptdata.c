@@ -1580,7 +1580,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, rarea, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
+    game_enemy_t enemy;
     int csr = 0;
     uint32_t qdrop = 0xFFFFFFFF;
 
@@ -1631,7 +1631,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
 #ifdef DEBUG
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested v2 drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard,
@@ -1645,20 +1645,20 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
+    game_enemy_get(l->map_enemies, mid, &enemy);
 
     LOG(l, "Guildcard %" PRIu32 " requested v2 drop...\n"
         "mid: %d (max: %d), pt: %d (%d), area: %d (%d), quest: %" PRIu32
         "section: %d, difficulty: %d\n",
         c->guildcard, mid, l->map_enemies->count, req->pt_index,
-        enemy->rt_index, area + 1, rarea, l->qid, section, l->difficulty);
+        enemy.rt_index, area + 1, rarea, l->qid, section, l->difficulty);
 
-    if(enemy->drop_done) {
+    if(enemy.drop_done) {
         LOGV(l, "Drop already done.\n");
         return 0;
     }
 
-    enemy->drop_done = 1;
+    l->map_enemies->drop_done[mid] = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
     rnd = mt19937_genrand_int32(rng) % 100;
@@ -1671,11 +1671,11 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
-        if(l->mids)
-            qdrop = quest_search_enemy_list(mid, l->mids, l->num_mids, 1);
-        if(qdrop == 0xFFFFFFFF && l->mtypes)
-            qdrop = quest_search_enemy_list(req->pt_index, l->mtypes,
-                                            l->num_mtypes, 1);
+        if(l->qdrops) {
+            qdrop = quest_drops_by_id(l->qdrops, mid, 1);
+            if(qdrop == QUEST_DROPS_NONE)
+                qdrop = quest_drops_by_type(l->qdrops, req->pt_index, 1);
+        }
 
         switch(qdrop) {
             case SYLVERANT_QUEST_ENDROP_NONE:
@@ -1868,8 +1868,8 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->v1.section;
     pt_v2_entry_t *ent;
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const game_object_t *gobj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
@@ -1891,15 +1891,15 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    gobj = game_obj_get(l->map_objs, obj_id);
+    if(l->map_objs->flags[obj_id] & 0x00000001)
         return 0;
 
     obj = &gobj->data;
@@ -1933,12 +1933,12 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->flags[obj_id] |= 0x00000001;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
-        if(l->mtypes)
-            qdrop = quest_search_enemy_list(0x30, l->mtypes, l->num_mtypes, 1);
+        if(l->qdrops)
+            qdrop = quest_drops_by_type(l->qdrops, 0x30, 1);
 
         switch(qdrop) {
             case SYLVERANT_QUEST_ENDROP_NONE:
@@ -2153,7 +2153,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, darea, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
+    game_enemy_t enemy;
     int csr = 0;
 
     /* Make sure the PT index in the packet is sane */
@@ -2254,7 +2254,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     /* We only really need this separate for debugging... */
     area = darea;
 
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
 #ifdef DEBUG
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested GC drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
@@ -2271,8 +2271,8 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
-    if(enemy->drop_done) {
+    game_enemy_get(l->map_enemies, mid, &enemy);
+    if(enemy.drop_done) {
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
             debug(DBG_LOG, "Drop already done. Returning no item.\n");
@@ -2280,7 +2280,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
         return 0;
     }
 
-    enemy->drop_done = 1;
+    l->map_enemies->drop_done[mid] = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
     rnd = mt19937_genrand_int32(rng) % 100;
@@ -2500,8 +2500,8 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->v1.section;
     pt_v3_entry_t *ent;
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const game_object_t *gobj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, darea, do_rare = 1;
     uint32_t item[4];
@@ -2522,15 +2522,15 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001) {
+    gobj = game_obj_get(l->map_objs, obj_id);
+    if(l->map_objs->flags[obj_id] & 0x00000001) {
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
             debug(DBG_LOG, "Requested drop from opened box: %d\n", obj_id);
@@ -2600,7 +2600,7 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --darea;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->flags[obj_id] |= 0x00000001;
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS) {
@@ -2855,7 +2855,7 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
+    game_enemy_t enemy;
     int csr = 0;
 
     /* XXXX: Handle Episode 4 */
@@ -2931,7 +2931,7 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
               l->map_enemies->count, l->qid);
@@ -2939,11 +2939,11 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
-    if(enemy->drop_done)
+    game_enemy_get(l->map_enemies, mid, &enemy);
+    if(enemy.drop_done)
         return 0;
 
-    enemy->drop_done = 1;
+    l->map_enemies->drop_done[mid] = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
     rnd = mt19937_genrand_int32(rng) % 100;
@@ -3102,8 +3102,8 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->bb.character.section;
     pt_v3_entry_t *ent;
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const game_object_t *gobj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
@@ -3123,15 +3123,15 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    gobj = game_obj_get(l->map_objs, obj_id);
+    if(l->map_objs->flags[obj_id] & 0x00000001)
         return 0;
 
     obj = &gobj->data;
@@ -3195,7 +3195,7 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->flags[obj_id] |= 0x00000001;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
@@ -17,12 +17,18 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sylverant/debug.h>
 
 #include "clients.h"
 #include "lobby.h"
 #include "quest_functions.h"
 #include "ship_packets.h"
 #include "smutdata.h"
+#include "shipgate.h"
+#include "utils.h"
 
 static uint32_t get_section_id(ship_client_t *c, lobby_t *l) {
     if(c->q_stack[1] != 1)
@@ -561,6 +567,228 @@ static uint32_t get_random_integer(ship_client_t *c, lobby_t *l) {
     return QUEST_FUNC_RET_NO_ERROR;
 }
 
+/* Get the client's flag cache for the quest their team is on. If they've moved
+   on from the quest the cache was for, anything left over from that one gets
+   written back first. If that can't be done, the old flags are kept for the
+   write-back timer to retry, and the cache isn't used for the new quest. */
+static client_qflags_t *qflag_cache(ship_client_t *c, lobby_t *l) {
+    client_qflags_t *q = c->qflags;
+
+    if(!q) {
+        if(!(q = (client_qflags_t *)calloc(1, sizeof(client_qflags_t))))
+            return NULL;
+
+        q->qid = l->qid;
+        c->qflags = q;
+    }
+    else if(q->qid != l->qid) {
+        if(quest_flag_cache_flush(c))
+            return NULL;
+
+        memset(q->vals, 0, sizeof(q->vals));
+        memset(q->state, 0, sizeof(q->state));
+        q->dirty = 0;
+        q->qid = l->qid;
+    }
+
+    return q;
+}
+
+int quest_flag_cache_get(ship_client_t *c, lobby_t *l, uint32_t fid,
+                         uint32_t *val) {
+    client_qflags_t *q;
+    int lf = !!(fid & QFLAG_LONG_FLAG);
+    uint8_t id = (uint8_t)fid, st;
+
+    if(!(q = qflag_cache(c, l)) || !((st = q->state[lf][id]) &
+                                     QFLAG_CACHE_KNOWN))
+        return 0;
+
+    if(st & QFLAG_CACHE_ABSENT)
+        return -1;
+
+    *val = q->vals[lf][id];
+    return 1;
+}
+
+int quest_flag_cache_set(ship_client_t *c, lobby_t *l, uint32_t fid,
+                         uint32_t val) {
+    client_qflags_t *q;
+    int lf = !!(fid & QFLAG_LONG_FLAG);
+    uint8_t id = (uint8_t)fid;
+
+    /* The write-back timer lives on the client's worker. */
+    if(!c->worker || !(q = qflag_cache(c, l)))
+        return -1;
+
+    if(!(q->state[lf][id] & QFLAG_CACHE_DIRTY))
+        ++q->dirty;
+
+    if(fid & QFLAG_DELETE_FLAG) {
+        q->state[lf][id] = QFLAG_CACHE_KNOWN | QFLAG_CACHE_ABSENT |
+            QFLAG_CACHE_DIRTY;
+        q->vals[lf][id] = 0;
+    }
+    else {
+        q->state[lf][id] = QFLAG_CACHE_KNOWN | QFLAG_CACHE_DIRTY;
+        q->vals[lf][id] = val;
+    }
+
+    if(!c->qflag_timer.queued)
+        timer_add(&c->worker->timers, &c->qflag_timer,
+                  get_ms_time() + QFLAG_WRITE_MS);
+
+    return 0;
+}
+
+int quest_flag_cache_flush(ship_client_t *c) {
+    client_qflags_t *q = c->qflags;
+    uint32_t fid;
+    int lf, i, rv = 0;
+
+    if(!q || !q->dirty)
+        return 0;
+
+    for(lf = 0; lf < 2; ++lf) {
+        for(i = 0; i < 256; ++i) {
+            if(!(q->state[lf][i] & QFLAG_CACHE_DIRTY))
+                continue;
+
+            fid = (uint32_t)i;
+
+            if(lf)
+                fid |= QFLAG_LONG_FLAG;
+
+            if(q->state[lf][i] & QFLAG_CACHE_ABSENT)
+                fid |= QFLAG_DELETE_FLAG;
+
+            /* If this doesn't make it out, it stays dirty for next time. */
+            if(shipgate_send_qflag(&ship->sg, c, 1, fid, q->qid,
+                                   q->vals[lf][i])) {
+                rv = -1;
+                continue;
+            }
+
+            q->state[lf][i] &= ~QFLAG_CACHE_DIRTY;
+            --q->dirty;
+
+            if(q->inflight[lf][i] < 255)
+                ++q->inflight[lf][i];
+        }
+    }
+
+    if(rv)
+        debug(DBG_WARN, "Couldn't write back quest flags for %" PRIu32 "\n",
+              c->guildcard);
+
+    return rv;
+}
+
+void quest_flag_cache_destroy(ship_client_t *c) {
+    client_qflags_t *q = c->qflags;
+    int lf, i;
+
+    if(!q)
+        return;
+
+    /* Whatever can't be written back now is gone for good, so at least leave
+       enough in the log for someone to put it back by hand. */
+    if(quest_flag_cache_flush(c)) {
+        for(lf = 0; lf < 2; ++lf) {
+            for(i = 0; i < 256; ++i) {
+                if(!(q->state[lf][i] & QFLAG_CACHE_DIRTY))
+                    continue;
+
+                if(q->state[lf][i] & QFLAG_CACHE_ABSENT)
+                    debug(DBG_ERROR, "Lost quest flag delete for %" PRIu32
+                          ": quest %" PRIu32 ", %s flag %d\n", c->guildcard,
+                          q->qid, lf ? "long" : "short", i);
+                else
+                    debug(DBG_ERROR, "Lost quest flag write for %" PRIu32
+                          ": quest %" PRIu32 ", %s flag %d = %" PRIu32 "\n",
+                          c->guildcard, q->qid, lf ? "long" : "short", i,
+                          q->vals[lf][i]);
+            }
+        }
+    }
+
+    free(q);
+    c->qflags = NULL;
+}
+
+int quest_flag_gate_reply(ship_client_t *c, int set, uint32_t qid,
+                          uint32_t fid, uint32_t value, int err) {
+    client_qflags_t *q = c->qflags;
+    int lf = !!(fid & QFLAG_LONG_FLAG);
+    uint8_t id = (uint8_t)fid;
+
+    if(!q)
+        return 0;
+
+    if(set) {
+        /* Every set comes from a write-back, unless the cache couldn't be
+           used when the quest did it. */
+        if(!q->inflight[lf][id])
+            return 0;
+
+        --q->inflight[lf][id];
+
+        /* If the gate didn't take it, we don't know what it has anymore. */
+        if(err && q->qid == qid && !(q->state[lf][id] & QFLAG_CACHE_DIRTY)) {
+            debug(DBG_WARN, "Shipgate rejected quest flag %" PRIx32 " for %"
+                  PRIu32 ": %" PRIu32 "\n", fid, c->guildcard, value);
+            q->state[lf][id] = 0;
+        }
+
+        return 1;
+    }
+
+    /* Remember what the gate said, unless the quest has changed the flag since
+       it asked. */
+    if(q->qid == qid && !q->state[lf][id]) {
+        if(!err) {
+            q->state[lf][id] = QFLAG_CACHE_KNOWN;
+            q->vals[lf][id] = value;
+        }
+        else if(value == ERR_QFLAG_NO_DATA) {
+            q->state[lf][id] = QFLAG_CACHE_KNOWN | QFLAG_CACHE_ABSENT;
+        }
+    }
+
+    return 0;
+}
+
+/* Answer a quest function's request to read a flag from the cache, if it can
+   be. */
+static int qflag_get_local(ship_client_t *c, lobby_t *l, uint32_t fid,
+                           uint8_t reg) {
+    uint32_t val;
+
+    switch(quest_flag_cache_get(c, l, fid, &val)) {
+        case 1:
+            send_sync_register(c, reg, val);
+            return 1;
+
+        case -1:
+            /* Same as what quest_flag_reply() gives for ERR_QFLAG_NO_DATA. */
+            send_sync_register(c, reg, (uint32_t)-3);
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Keep a flag the quest set or deleted in the cache, and tell the quest it
+   went fine. */
+static int qflag_set_local(ship_client_t *c, lobby_t *l, uint32_t fid,
+                           uint32_t val, uint8_t reg) {
+    if(quest_flag_cache_set(c, l, fid, val))
+        return 0;
+
+    send_sync_register(c, reg, 0);
+    return 1;
+}
+
 static uint32_t get_quest_sflag(ship_client_t *c, lobby_t *l) {
     if(c->q_stack[1] != 1)
         return QUEST_FUNC_RET_BAD_ARG_COUNT;
@@ -574,6 +802,9 @@ static uint32_t get_quest_sflag(ship_client_t *c, lobby_t *l) {
     if(c->q_stack[4] > 255)
         return QUEST_FUNC_RET_INVALID_REGISTER;
 
+    if(qflag_get_local(c, l, c->q_stack[3], c->q_stack[4]))
+        return QUEST_FUNC_RET_NO_ERROR;
+
     /* Send the request to the shipgate... */
     if(shipgate_send_qflag(&ship->sg, c, 0, c->q_stack[3], l->qid, 0))
         return QUEST_FUNC_RET_SHIPGATE_ERR;
@@ -599,6 +830,9 @@ static uint32_t set_quest_sflag(ship_client_t *c, lobby_t *l) {
     if(c->q_stack[5] > 255)
         return QUEST_FUNC_RET_INVALID_REGISTER;
 
+    if(qflag_set_local(c, l, c->q_stack[3], c->q_stack[4], c->q_stack[5]))
+        return QUEST_FUNC_RET_NO_ERROR;
+
     /* Send the request to the shipgate... */
     if(shipgate_send_qflag(&ship->sg, c, 1, c->q_stack[3], l->qid,
                            c->q_stack[4]))
@@ -622,6 +856,9 @@ static uint32_t get_quest_lflag(ship_client_t *c, lobby_t *l) {
     if(c->q_stack[4] > 255)
         return QUEST_FUNC_RET_INVALID_REGISTER;
 
+    if(qflag_get_local(c, l, c->q_stack[3] | QFLAG_LONG_FLAG, c->q_stack[4]))
+        return QUEST_FUNC_RET_NO_ERROR;
+
     /* Send the request to the shipgate... */
     if(shipgate_send_qflag(&ship->sg, c, 0, c->q_stack[3] | 0x80000000, l->qid,
                            0))
@@ -645,6 +882,10 @@ static uint32_t set_quest_lflag(ship_client_t *c, lobby_t *l) {
     if(c->q_stack[5] > 255)
         return QUEST_FUNC_RET_INVALID_REGISTER;
 
+    if(qflag_set_local(c, l, c->q_stack[3] | QFLAG_LONG_FLAG, c->q_stack[4],
+                       c->q_stack[5]))
+        return QUEST_FUNC_RET_NO_ERROR;
+
     /* Send the request to the shipgate... */
     if(shipgate_send_qflag(&ship->sg, c, 1, c->q_stack[3] | 0x80000000, l->qid,
                            c->q_stack[4]))
@@ -668,6 +909,10 @@ static uint32_t del_quest_sflag(ship_client_t *c, lobby_t *l) {
     if(c->q_stack[5] > 255)
         return QUEST_FUNC_RET_INVALID_REGISTER;
 
+    if(qflag_set_local(c, l, c->q_stack[3] | QFLAG_DELETE_FLAG, 0,
+                       c->q_stack[5]))
+        return QUEST_FUNC_RET_NO_ERROR;
+
     /* Send the request to the shipgate... */
     if(shipgate_send_qflag(&ship->sg, c, 1, c->q_stack[3] | QFLAG_DELETE_FLAG,
                            l->qid, c->q_stack[4]))
@@ -691,6 +936,10 @@ static uint32_t del_quest_lflag(ship_client_t *c, lobby_t *l) {
     if(c->q_stack[5] > 255)
         return QUEST_FUNC_RET_INVALID_REGISTER;
 
+    if(qflag_set_local(c, l, c->q_stack[3] | QFLAG_LONG_FLAG |
+                       QFLAG_DELETE_FLAG, 0, c->q_stack[5]))
+        return QUEST_FUNC_RET_NO_ERROR;
+
     /* Send the request to the shipgate... */
     if(shipgate_send_qflag(&ship->sg, c, 1,
                            c->q_stack[3] | QFLAG_LONG_FLAG | QFLAG_DELETE_FLAG,
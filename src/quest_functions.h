@@ -207,4 +207,50 @@ extern uint32_t quest_function_dispatch(ship_client_t *c, lobby_t *l);
 
 extern int quest_flag_reply(ship_client_t *c, uint32_t reason, uint32_t value);
 
+/* Quest flags that a player has read or set during a quest are remembered on
+   the ship, so that the quest doesn't have to wait on the shipgate for each
+   one. Changes are written back to the shipgate QFLAG_WRITE_MS after the first
+   of them (and every QFLAG_WRITE_MS after that until the shipgate takes them),
+   and whenever the player leaves the team. Flags are identified like
+   they are to the shipgate, with QFLAG_LONG_FLAG and QFLAG_DELETE_FLAG or'ed
+   into the flag number. */
+#define QFLAG_WRITE_MS      1000
+
+#define QFLAG_CACHE_KNOWN   0x01        /* We know what the gate has. */
+#define QFLAG_CACHE_ABSENT  0x02        /* ...and it's that there's no flag. */
+#define QFLAG_CACHE_DIRTY   0x04        /* Needs to be written back. */
+
+typedef struct client_qflags {
+    uint32_t qid;
+    int dirty;
+    uint32_t vals[2][256];              /* [0] short flags, [1] long flags */
+    uint8_t state[2][256];
+
+    /* Write-backs that the shipgate hasn't answered yet. These are about what's
+       on the wire, so they outlive the quest the writes were for. */
+    uint8_t inflight[2][256];
+} client_qflags_t;
+
+/* Look up a flag. Returns 1 and fills in val if it's known, -1 if it's known
+   not to exist, or 0 if it has to be asked of the shipgate. */
+extern int quest_flag_cache_get(ship_client_t *c, lobby_t *l, uint32_t fid,
+                                uint32_t *val);
+
+/* Set or delete a flag, to be written back later. Returns -1 if it can't be
+   kept, in which case it should be sent to the shipgate directly. */
+extern int quest_flag_cache_set(ship_client_t *c, lobby_t *l, uint32_t fid,
+                                uint32_t val);
+
+/* Send any changed flags to the shipgate now. Returns -1 if any of them
+   couldn't be sent, in which case they're kept to be tried again. */
+extern int quest_flag_cache_flush(ship_client_t *c);
+
+/* Write back anything that's changed one last time, and free the cache. */
+extern void quest_flag_cache_destroy(ship_client_t *c);
+
+/* Let the cache see a reply from the shipgate. Returns nonzero if it was in
+   response to a write-back, and so shouldn't go any further. */
+extern int quest_flag_gate_reply(ship_client_t *c, int set, uint32_t qid,
+                                 uint32_t fid, uint32_t value, int err);
+
 #endif /* !QUEST_FUNCTIONS_H */
@@ -18,6 +18,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 
@@ -31,35 +33,141 @@
 #include "ship.h"
 #include "packets.h"
 
-uint32_t quest_search_enemy_list(uint32_t id, qenemy_t *list, int len, int sd) {
+/* The most threads that will be used to build the quest map cache. */
+#define QCACHE_MAX_THREADS  16
+
+/* Fill in one of the quest_drops_t tables from a list. Earlier entries in the
+   list take precedence over later ones. */
+static void qdrops_fill(uint16_t (*tbl)[2], uint32_t count,
+                        const qenemy_t *list, int len) {
+    int i;
+    uint32_t k;
+
+    for(i = len - 1; i >= 0; --i) {
+        if((k = list[i].key) >= count)
+            continue;
+
+        if(list[i].mask & SYLVERANT_QUEST_ENDROP_SDROPS)
+            tbl[k][0] = (uint16_t)(list[i].value & 0xFF);
+        if(list[i].mask & SYLVERANT_QUEST_ENDROP_CDROPS)
+            tbl[k][1] = (uint16_t)(list[i].value & 0xFF);
+    }
+}
+
+quest_drops_t *quest_drops_compile(const qenemy_t *types, int num_types,
+                                   const qenemy_t *ids, int num_ids) {
+    quest_drops_t *rv;
+    uint32_t count = 0;
     int i;
-    uint32_t mask = sd ? SYLVERANT_QUEST_ENDROP_SDROPS :
-        SYLVERANT_QUEST_ENDROP_CDROPS;
 
-    for(i = 0; i < len; ++i) {
-        if(list[i].key == id && (list[i].mask & mask))
-            return list[i].value & 0xFF;
+    /* Enemy ids come from the client as 16-bit values, so anything bigger than
+       that can't ever match. */
+    for(i = 0; i < num_ids; ++i) {
+        if(ids[i].key <= 0xFFFF && ids[i].key >= count)
+            count = ids[i].key + 1;
     }
 
-    return 0xFFFFFFFF;
+    rv = (quest_drops_t *)malloc(sizeof(quest_drops_t) +
+                                 count * sizeof(uint16_t [2]));
+    if(!rv)
+        return NULL;
+
+    rv->id_count = count;
+    rv->ids = (uint16_t (*)[2])(rv + 1);
+    memset(rv->types, 0xFF, sizeof(rv->types));
+    memset(rv->ids, 0xFF, count * sizeof(uint16_t [2]));
+
+    qdrops_fill(rv->types, 256, types, num_types);
+    qdrops_fill(rv->ids, count, ids, num_ids);
+
+    return rv;
+}
+
+uint32_t quest_drops_by_id(const quest_drops_t *d, uint32_t id, int sd) {
+    uint16_t v;
+
+    if(id >= d->id_count || (v = d->ids[id][sd ? 0 : 1]) == 0xFFFF)
+        return QUEST_DROPS_NONE;
+
+    return v;
+}
+
+uint32_t quest_drops_by_type(const quest_drops_t *d, uint32_t type, int sd) {
+    uint16_t v;
+
+    if(type > 0xFF || (v = d->types[type][sd ? 0 : 1]) == 0xFFFF)
+        return QUEST_DROPS_NONE;
+
+    return v;
+}
+
+static inline uint32_t qid_hash(uint32_t qid) {
+    /* Quest IDs tend to be handed out in runs, so spread them out a bit. */
+    qid ^= qid >> 16;
+    qid *= 0x45D9F3B;
+    qid ^= qid >> 16;
+    return qid;
+}
+
+void quest_map_init(quest_map_t *map) {
+    map->table = NULL;
+    map->size = 0;
+    map->count = 0;
 }
 
 /* Find a quest by ID, if it exists */
 quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid) {
     quest_map_elem_t *i;
+    uint32_t h;
 
-    TAILQ_FOREACH(i, map, qentry) {
-        if(qid == i->qid) {
+    if(!map->size)
+        return NULL;
+
+    h = qid_hash(qid) & (map->size - 1);
+
+    while((i = map->table[h])) {
+        if(qid == i->qid)
             return i;
-        }
+
+        h = (h + 1) & (map->size - 1);
     }
 
     return NULL;
 }
 
+static int quest_map_grow(quest_map_t *map) {
+    uint32_t size = map->size ? map->size << 1 : 64;
+    quest_map_elem_t **table, *i;
+    uint32_t j, h;
+
+    if(!(table = (quest_map_elem_t **)calloc(size, sizeof(quest_map_elem_t *))))
+        return -1;
+
+    for(j = 0; j < map->size; ++j) {
+        if(!(i = map->table[j]))
+            continue;
+
+        h = qid_hash(i->qid) & (size - 1);
+        while(table[h])
+            h = (h + 1) & (size - 1);
+
+        table[h] = i;
+    }
+
+    free(map->table);
+    map->table = table;
+    map->size = size;
+    return 0;
+}
+
 /* Add a quest to the list */
 quest_map_elem_t *quest_add(quest_map_t *map, uint32_t qid) {
     quest_map_elem_t *el;
+    uint32_t h;
+
+    /* Make sure there'll be room for it first. */
+    if((map->count + 1) * 2 > map->size && quest_map_grow(map))
+        return NULL;
 
     /* Create the element */
     el = (quest_map_elem_t *)malloc(sizeof(quest_map_elem_t));
@@ -72,26 +180,62 @@ quest_map_elem_t *quest_add(quest_map_t *map, uint32_t qid) {
     memset(el, 0, sizeof(quest_map_elem_t));
     el->qid = qid;
 
-    /* Add to the list */
-    TAILQ_INSERT_TAIL(map, el, qentry);
+    if(pthread_mutex_init(&el->cache_lock, NULL)) {
+        free(el);
+        return NULL;
+    }
+
+    /* Add to the table */
+    h = qid_hash(qid) & (map->size - 1);
+    while(map->table[h])
+        h = (h + 1) & (map->size - 1);
+
+    map->table[h] = el;
+    ++map->count;
     return el;
 }
 
 /* Clean the list out */
 void quest_cleanup(quest_map_t *map) {
-    quest_map_elem_t *tmp, *i;
+    quest_map_elem_t *i;
+    uint32_t n;
+    int j, k;
 
     /* Remove all elements, freeing them as we go along */
-    i = TAILQ_FIRST(map);
-    while(i) {
-        tmp = TAILQ_NEXT(i, qentry);
+    for(n = 0; n < map->size; ++n) {
+        if(!(i = map->table[n]))
+            continue;
 
+        for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
+            for(k = 0; k < CLIENT_LANG_COUNT; ++k) {
+                free(i->cache[j][k][0]);
+                free(i->cache[j][k][1]);
+            }
+        }
+
+        pthread_mutex_destroy(&i->cache_lock);
         free(i);
-        i = tmp;
     }
 
+    free(map->table);
+
     /* Reinit the map, just in case we reuse it */
-    TAILQ_INIT(map);
+    quest_map_init(map);
+}
+
+quest_cache_t *quest_cache_alloc(int count, size_t len) {
+    quest_cache_t *rv;
+
+    rv = (quest_cache_t *)malloc(sizeof(quest_cache_t) +
+                                 count * sizeof(uint32_t) + len);
+
+    if(!rv)
+        return NULL;
+
+    rv->count = count;
+    rv->lens = (uint32_t *)(rv + 1);
+    rv->data = (uint8_t *)(rv->lens + count);
+    return rv;
 }
 
 /* Process an entire list of quests read in for a version/language combo. */
@@ -135,15 +279,15 @@ int quest_map(quest_map_t *map, sylverant_quest_list_t *list, int version,
     return 0;
 }
 
-static uint32_t quest_cat_type(ship_t *s, int ver, int lang,
+static uint32_t quest_cat_type(sylverant_quest_list_t *list,
                                sylverant_quest_t *q) {
     int i, j;
 
     /* Look for it. */
-    for(i = 0; i < s->qlist[ver][lang].cat_count; ++i) {
-        for(j = 0; j < s->qlist[ver][lang].cats[i].quest_count; ++j) {
-            if(q == &s->qlist[ver][lang].cats[i].quests[j])
-                return s->qlist[ver][lang].cats[i].type;
+    for(i = 0; i < list->cat_count; ++i) {
+        for(j = 0; j < list->cats[i].quest_count; ++j) {
+            if(q == &list->cats[i].quests[j])
+                return list->cats[i].type;
         }
     }
 
@@ -554,17 +698,104 @@ static uint8_t *read_and_dec_qst(const char *fn, uint32_t *osz, int ver) {
     return rv;
 }
 
+/* One quest map cache file that needs to be (re)built. */
+typedef struct qcache_job {
+    char *src;
+    char *dst;
+    int format;
+    int version;
+    int episode;
+} qcache_job_t;
+
+typedef struct qcache_pool {
+    qcache_job_t *jobs;
+    int count;
+    int next;
+} qcache_pool_t;
+
+static void qcache_build(qcache_job_t *j) {
+    char tmp[strlen(j->dst) + 5];
+    uint8_t *dat;
+    uint32_t dat_sz;
+    int rv;
+
+    if(j->format == SYLVERANT_QUEST_BINDAT)
+        dat = read_and_dec_dat(j->src, &dat_sz);
+    else
+        dat = read_and_dec_qst(j->src, &dat_sz, j->version);
+
+    if(!dat)
+        return;
+
+    /* Build the new cache off to the side and then move it into place, so that
+       anyone loading the quest in the meantime sees either the old one or the
+       new one, and never half of one. */
+    sprintf(tmp, "%s.tmp", j->dst);
+    rv = cache_quest_enemies(tmp, dat, dat_sz, j->episode);
+    free(dat);
+
+    if(rv || rename(tmp, j->dst)) {
+        debug(DBG_WARN, "Couldn't build map cache for \"%s\"\n", j->src);
+        unlink(tmp);
+    }
+}
+
+static void *qcache_thd(void *d) {
+    qcache_pool_t *p = (qcache_pool_t *)d;
+    int i;
+
+    while((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->count) {
+        qcache_build(&p->jobs[i]);
+    }
+
+    return NULL;
+}
+
+/* Build whatever cache files are out of date, spread across one thread per
+   CPU. */
+static void qcache_run(qcache_job_t *jobs, int count) {
+    qcache_pool_t p = { jobs, count, 0 };
+    pthread_t thds[QCACHE_MAX_THREADS];
+    int i, nthds;
+
+    nthds = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(nthds > QCACHE_MAX_THREADS)
+        nthds = QCACHE_MAX_THREADS;
+
+    if(nthds > count)
+        nthds = count;
+
+    /* This thread works on the jobs too, so it's no big deal if the others
+       don't all start. */
+    for(i = 0; i < nthds - 1; ++i) {
+        if(pthread_create(&thds[i], NULL, &qcache_thd, &p))
+            break;
+    }
+
+    nthds = i;
+    qcache_thd(&p);
+
+    for(i = 0; i < nthds; ++i) {
+        pthread_join(thds[i], NULL);
+    }
+}
+
 /* Build/rebuild the quest enemy/object data cache. */
-int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
+int quest_cache_maps(quest_map_t *map,
+                     sylverant_quest_list_t qlist[CLIENT_VERSION_COUNT]
+                                                 [CLIENT_LANG_COUNT],
+                     const char *dir) {
     quest_map_elem_t *i;
+    uint32_t n;
     size_t dlen = strlen(dir);
     char mdir[dlen + 20];
     char *fn1, *fn2;
-    int j, k;
+    int j, k, count = 0, max = 0, rv = 0;
     sylverant_quest_t *q;
     const static char exts[2][4] = { "dat", "qst" };
-    uint8_t *dat;
-    uint32_t dat_sz, tmp;
+    uint32_t tmp;
+    qcache_job_t *jobs = NULL, *tjobs;
 
     /* Make sure we have all the directories we'll need. */
     sprintf(mdir, "%s/.mapcache", dir);
@@ -602,7 +833,10 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
         return -1;
     }
 
-    TAILQ_FOREACH(i, map, qentry) {
+    for(n = 0; n < map->size; ++n) {
+        if(!(i = map->table[n]))
+            continue;
+
         /* Process it. */
         for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
             /* Skip PC, it is the same as v2. */
@@ -612,7 +846,7 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
             for(k = 0; k < CLIENT_LANG_COUNT; ++k) {
                 if((q = i->qptr[j][k])) {
                     /* Don't bother with battle or challenge quests. */
-                    tmp = quest_cat_type(s, j, k, q);
+                    tmp = quest_cat_type(&qlist[j][k], q);
                     if(tmp & (SYLVERANT_QUEST_BATTLE |
                               SYLVERANT_QUEST_CHALLENGE))
                         break;
@@ -620,14 +854,16 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
                     if(!(fn1 = (char *)malloc(dlen + 25 + strlen(q->prefix)))) {
                         debug(DBG_ERROR, "Error allocating memory: %s\n",
                               strerror(errno));
-                        return -1;
+                        rv = -1;
+                        goto out;
                     }
 
                     if(!(fn2 = (char *)malloc(dlen + 35))) {
                         debug(DBG_ERROR, "Error allocating memory: %s\n",
                               strerror(errno));
                         free(fn1);
-                        return -1;
+                        rv = -1;
+                        goto out;
                     }
 
                     sprintf(fn1, "%s/%s-%s/%s.%s", dir, version_codes[j],
@@ -635,26 +871,38 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
                     sprintf(fn2, "%s/.mapcache/%s/%08x", dir, version_codes[j],
                             q->qid);
 
-                    if(check_cache_age(fn1, fn2)) {
-                        debug(DBG_LOG, "Cache for %s-%s %d needs updating!\n",
-                              version_codes[j], language_codes[k], q->qid);
+                    /* Leave anything that's already up to date alone. */
+                    if(check_cache_age(fn1, fn2) <= 0) {
+                        free(fn2);
+                        free(fn1);
+                        break;
                     }
 
-                    if(q->format == SYLVERANT_QUEST_BINDAT) {
-                        if((dat = read_and_dec_dat(fn1, &dat_sz))) {
-                            cache_quest_enemies(fn2, dat, dat_sz, q->episode);
-                            free(dat);
-                        }
-                    }
-                    else {
-                        if((dat = read_and_dec_qst(fn1, &dat_sz, j))) {
-                            cache_quest_enemies(fn2, dat, dat_sz, q->episode);
-                            free(dat);
+                    debug(DBG_LOG, "Cache for %s-%s %d needs updating!\n",
+                          version_codes[j], language_codes[k], q->qid);
+
+                    if(count == max) {
+                        max = max ? max * 2 : 64;
+                        tjobs = (qcache_job_t *)realloc(jobs, max *
+                                                        sizeof(qcache_job_t));
+                        if(!tjobs) {
+                            debug(DBG_ERROR, "Error allocating memory: %s\n",
+                                  strerror(errno));
+                            free(fn2);
+                            free(fn1);
+                            rv = -1;
+                            goto out;
                         }
+
+                        jobs = tjobs;
                     }
 
-                    free(fn2);
-                    free(fn1);
+                    jobs[count].src = fn1;
+                    jobs[count].dst = fn2;
+                    jobs[count].format = q->format;
+                    jobs[count].version = j;
+                    jobs[count].episode = q->episode;
+                    ++count;
 
                     break;
                 }
@@ -662,5 +910,17 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
         }
     }
 
-    return 0;
+    if(count) {
+        debug(DBG_LOG, "Building %d quest map cache file(s)...\n", count);
+        qcache_run(jobs, count);
+    }
+
+out:
+    for(j = 0; j < count; ++j) {
+        free(jobs[j].src);
+        free(jobs[j].dst);
+    }
+
+    free(jobs);
+    return rv;
 }
@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include <sylverant/quest.h>
 
@@ -38,15 +39,56 @@ typedef struct ship ship_t;
 typedef struct sylverant_quest_enemy qenemy_t;
 #endif
 
+/* Returned by the quest_drops_* functions when the quest doesn't say anything
+   about the enemy in question. */
+#define QUEST_DROPS_NONE    0xFFFFFFFF
+
+/* A quest's enemy drop overrides, laid out to be looked up directly by enemy id
+   or by enemy type. Each entry holds the override for server drops in [0] and
+   for client drops in [1], or 0xFFFF if there isn't one. Free it with
+   free(). */
+#ifndef QDROPS_DEFINED
+#define QDROPS_DEFINED
+typedef struct quest_drops quest_drops_t;
+#endif
+
+struct quest_drops {
+    uint16_t types[256][2];
+    uint32_t id_count;
+    uint16_t (*ids)[2];
+};
+
+/* A quest's file(s), already laid out as the packets that get sent to a client
+   to load it. Each of the count segments is lens[i] bytes long, and they're
+   all packed back to back in data. */
+typedef struct quest_cache {
+    int count;
+    uint32_t *lens;
+    uint8_t *data;
+} quest_cache_t;
+
 typedef struct quest_map_elem {
-    TAILQ_ENTRY(quest_map_elem) qentry;
     uint32_t qid;
 
     sylverant_quest_t *qptr[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
+
+    /* Packets for sending the quest, built on first use. These are indexed by
+       the version of the client, the language, and whether the quest is being
+       sent in v1 compatibility mode. */
+    pthread_mutex_t cache_lock;
+    quest_cache_t *cache[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT][2];
 } quest_map_elem_t;
 
-TAILQ_HEAD(quest_map, quest_map_elem);
-typedef struct quest_map quest_map_t;
+/* All of the quests on the ship, by ID. This is an open-addressed hash table
+   with linear probing, kept no more than half full. Empty slots are NULL. */
+typedef struct quest_map {
+    quest_map_elem_t **table;
+    uint32_t size;
+    uint32_t count;
+} quest_map_t;
+
+/* Set up an empty map. */
+void quest_map_init(quest_map_t *map);
 
 /* Find a quest by ID, if it exists */
 quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid);
@@ -57,14 +99,29 @@ quest_map_elem_t *quest_add(quest_map_t *map, uint32_t qid);
 /* Clean the list out */
 void quest_cleanup(quest_map_t *map);
 
+/* Allocate space for count segments totalling len bytes in one block. The
+   lens array must be filled in by the caller. Free it with free(). */
+quest_cache_t *quest_cache_alloc(int count, size_t len);
+
 /* Process an entire list of quests read in for a version/language combo. */
 int quest_map(quest_map_t *map, sylverant_quest_list_t *list, int version,
               int language);
 
-/* Build/rebuild the quest enemy/object data cache. */
-int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir);
-
-/* Search an enemy list from a quest for an entry. */
-uint32_t quest_search_enemy_list(uint32_t id, qenemy_t *list, int len, int sd);
+/* Build/rebuild the quest enemy/object data cache for any of the quests in the
+   map that have changed since their cache files were built. The lists are the
+   ones the map was built from. */
+int quest_cache_maps(quest_map_t *map,
+                     sylverant_quest_list_t qlist[CLIENT_VERSION_COUNT]
+                                                 [CLIENT_LANG_COUNT],
+                     const char *dir);
+
+/* Build the lookup tables for a quest's enemy type and enemy id lists. */
+quest_drops_t *quest_drops_compile(const qenemy_t *types, int num_types,
+                                   const qenemy_t *ids, int num_ids);
+
+/* Look up the drop override for an enemy by its id in the map or by its type.
+   sd selects server drops over client drops. */
+uint32_t quest_drops_by_id(const quest_drops_t *d, uint32_t id, int sd);
+uint32_t quest_drops_by_type(const quest_drops_t *d, uint32_t type, int sd);
 
 #endif /* !QUESTS_H */
@@ -44,12 +44,54 @@
 
 #ifdef ENABLE_LUA
 
-static pthread_mutex_t script_mutex = PTHREAD_MUTEX_INITIALIZER;
-static lua_State *lstate;
-static int scripts_ref = 0;
+/* One Lua interpreter, and everything that has been loaded into it. The ship
+   always has one of these, and each block either shares it or has one of its
+   own (with --block-scripts). Anything running in an interpreter has to hold
+   its mutex, which is recursive so that scripts can call back into things that
+   take it again. */
+struct script_state {
+    TAILQ_ENTRY(script_state) qentry;
+    pthread_mutex_t mutex;
+    lua_State *l;
+    int scripts_ref;
+    int ship_ref;
+
+    int script_ids[ScriptActionCount];
+    int script_ids_gate[ScriptActionCount];
+};
+
+TAILQ_HEAD(script_state_queue, script_state);
+
+/* A value stored with ship.setShared, for all the interpreters to see. */
+typedef struct script_shared {
+    TAILQ_ENTRY(script_shared) qentry;
+    char *key;
+    int type;
+    int isint;
+    lua_Integer ival;
+    lua_Number nval;
+    char *str;
+    size_t len;
+} script_shared_t;
+
+TAILQ_HEAD(script_shared_queue, script_shared);
+
+extern int block_scripts;
+
+/* Every interpreter that exists, so that scripts and modules sent by the
+   shipgate can be loaded into all of them. The filenames of the scripts the
+   shipgate has sent are kept around so that they can be loaded into any new
+   interpreters as well. */
+static pthread_mutex_t states_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct script_state_queue states = TAILQ_HEAD_INITIALIZER(states);
+static script_state_t *ship_state = NULL;
+static char *gate_files[ScriptActionCount] = { NULL };
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct script_shared_queue shared = TAILQ_HEAD_INITIALIZER(shared);
 
-static int script_ids[ScriptActionCount] = { 0 };
-static int script_ids_gate[ScriptActionCount] = { 0 };
+/* Key in each interpreter's registry that points back at its state. */
+static const char state_key = 0;
 
 /* Text versions of the script actions. This must match the list in the
    script_action_t enum in scripts.h. */
@@ -91,12 +133,50 @@ static inline script_action_t script_action_to_index(xmlChar *str) {
     return ScriptActionInvalid;
 }
 
+/* Figure out which interpreter should handle an event for a client. */
+static script_state_t *client_state(ship_client_t *c) {
+    if(c && c->cur_block && c->cur_block->scripts)
+        return c->cur_block->scripts;
+
+    return ship_state;
+}
+
+/* Load a script sent by the shipgate into one interpreter. */
+static int state_add_gate(script_state_t *st, script_action_t action,
+                          const char *realfn) {
+    pthread_mutex_lock(&st->mutex);
+
+    /* Pull the scripts table out to the top of the stack. */
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
+
+    /* Attempt to read in the script. */
+    if(luaL_loadfile(st->l, realfn) != LUA_OK) {
+        lua_pop(st->l, 1);
+        pthread_mutex_unlock(&st->mutex);
+        return -1;
+    }
+
+    /* Replace anything that was already there. */
+    if(st->script_ids_gate[action])
+        luaL_unref(st->l, -2, st->script_ids_gate[action]);
+
+    /* Add the script to the Lua table. */
+    st->script_ids_gate[action] = luaL_ref(st->l, -2);
+
+    /* Pop off the scripts table and unlock the mutex to clean up. */
+    lua_pop(st->l, 1);
+    pthread_mutex_unlock(&st->mutex);
+
+    return 0;
+}
+
 int script_add(script_action_t action, const char *filename) {
     char realfn[64];
-    int len;
+    int len, rv = 0;
+    script_state_t *st;
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!ship_state)
         return 0;
 
     /* Make the real filename we'll try to load from... */
@@ -106,98 +186,113 @@ int script_add(script_action_t action, const char *filename) {
         return -1;
     }
 
-    pthread_mutex_lock(&script_mutex);
-
-    /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
-
-    /* Attempt to read in the script. */
-    if(luaL_loadfile(lstate, realfn) != LUA_OK) {
-        debug(DBG_WARN, "Couldn't load script \"%s\"\n", filename);
-        lua_pop(lstate, 1);
-        pthread_mutex_unlock(&script_mutex);
-        return -1;
-    }
+    pthread_mutex_lock(&states_lock);
 
     /* Issue a warning if we're redefining something before doing it. */
-    if(script_ids_gate[action]) {
+    if(gate_files[action]) {
         debug(DBG_WARN, "Redefining script event %d\n", (int)action);
-        luaL_unref(lstate, -2, script_ids_gate[action]);
+        free(gate_files[action]);
     }
 
-    /* Add the script to the Lua table. */
-    script_ids_gate[action] = luaL_ref(lstate, -2);
-    debug(DBG_LOG, "Script for type %d added as ID %d\n", (int)action,
-          script_ids_gate[action]);
+    gate_files[action] = strdup(filename);
 
-    /* Pop off the scripts table and unlock the mutex to clean up. */
-    lua_pop(lstate, 1);
-    pthread_mutex_unlock(&script_mutex);
+    /* Load it into every interpreter we have. */
+    TAILQ_FOREACH(st, &states, qentry) {
+        if(state_add_gate(st, action, realfn)) {
+            rv = -1;
+            break;
+        }
+    }
 
-    return 0;
+    if(rv) {
+        debug(DBG_WARN, "Couldn't load script \"%s\"\n", filename);
+    }
+    else {
+        debug(DBG_LOG, "Script for type %d added as ID %d\n", (int)action,
+              ship_state->script_ids_gate[action]);
+    }
+
+    pthread_mutex_unlock(&states_lock);
+
+    return rv;
 }
 
 int script_add_lobby_locked(lobby_t *l, script_action_t action) {
+    script_state_t *st = l->block->scripts;
+
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st || !st->scripts_ref)
         return 0;
 
     /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
 
     /* Issue a warning if we're redefining something before doing it. */
     if(l->script_ids[action]) {
         debug(DBG_WARN, "Redefining lobby event %d for lobby %" PRIu32 "\n",
               (int)action, l->lobby_id);
-        luaL_unref(lstate, -1, l->script_ids[action]);
+        luaL_unref(st->l, -1, l->script_ids[action]);
     }
 
     /* Pull the function out to the top of the stack. */
-    lua_pushvalue(lstate, -2);
+    lua_pushvalue(st->l, -2);
 
     /* Add the script to the Lua table. */
-    l->script_ids[action] = luaL_ref(lstate, -2);
+    l->script_ids[action] = luaL_ref(st->l, -2);
     debug(DBG_LOG, "Lobby callback for type %d added as ID %d\n", (int)action,
           l->script_ids[action]);
 
     /* Pop off the scripts table and the function to clean up. */
-    lua_pop(lstate, 2);
+    lua_pop(st->l, 2);
 
     return 0;
 }
 
 int script_remove(script_action_t action) {
+    script_state_t *st;
+
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!ship_state)
         return 0;
 
-    pthread_mutex_lock(&script_mutex);
+    pthread_mutex_lock(&states_lock);
 
     /* Make sure there's actually something registered. */
-    if(!script_ids_gate[action]) {
+    if(!gate_files[action]) {
         debug(DBG_WARN, "Attempt to unregister script for event %d that does "
               "not exist.\n", (int)action);
-        pthread_mutex_unlock(&script_mutex);
+        pthread_mutex_unlock(&states_lock);
         return -1;
     }
 
-    /* Pull the scripts table out to the top of the stack and remove the
-       script reference from it. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
-    luaL_unref(lstate, -2, script_ids_gate[action]);
+    free(gate_files[action]);
+    gate_files[action] = NULL;
 
-    /* Pop off the scripts table, clear out the id stored in the script_ids_gate
-       array, and unlock the mutex to finish up. */
-    lua_pop(lstate, 1);
-    script_ids_gate[action] = 0;
-    pthread_mutex_unlock(&script_mutex);
+    TAILQ_FOREACH(st, &states, qentry) {
+        pthread_mutex_lock(&st->mutex);
+
+        /* Pull the scripts table out to the top of the stack and remove the
+           script reference from it. */
+        if(st->script_ids_gate[action]) {
+            lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
+            luaL_unref(st->l, -1, st->script_ids_gate[action]);
+            lua_pop(st->l, 1);
+            st->script_ids_gate[action] = 0;
+        }
+
+        pthread_mutex_unlock(&st->mutex);
+    }
+
+    pthread_mutex_unlock(&states_lock);
 
     return 0;
 }
 
 int script_remove_lobby_locked(lobby_t *l, script_action_t action) {
+    script_state_t *st = l->block->scripts;
+
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st || !st->scripts_ref)
         return 0;
 
     /* Make sure there's actually something registered. */
@@ -209,12 +304,12 @@ int script_remove_lobby_locked(lobby_t *l, script_action_t action) {
 
     /* Pull the scripts table out to the top of the stack and remove the
        script reference from it. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
-    luaL_unref(lstate, -2, l->script_ids[action]);
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
+    luaL_unref(st->l, -2, l->script_ids[action]);
 
     /* Pop off the scripts table and clear out the id stored in the lobby's
        script_ids array to finish up. */
-    lua_pop(lstate, 1);
+    lua_pop(st->l, 1);
     l->script_ids[action] = 0;
 
     return 0;
@@ -224,9 +319,10 @@ int script_update_module(const char *filename) {
     char *script;
     size_t size;
     char *modname, *tmp;
+    script_state_t *st;
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!ship_state)
         return 0;
 
     /* Chop off the extension of the filename. */
@@ -244,10 +340,17 @@ int script_update_module(const char *filename) {
 
     snprintf(script, size + 100, "package.loaded['%s'] = nil", modname);
 
-    /* Set the module search path to include the scripts/modules dir. */
-    pthread_mutex_lock(&script_mutex);
-    (void)luaL_dostring(lstate, script);
-    pthread_mutex_unlock(&script_mutex);
+    /* Make every interpreter load the new version of the module the next time
+       it's required. */
+    pthread_mutex_lock(&states_lock);
+
+    TAILQ_FOREACH(st, &states, qentry) {
+        pthread_mutex_lock(&st->mutex);
+        (void)luaL_dostring(st->l, script);
+        pthread_mutex_unlock(&st->mutex);
+    }
+
+    pthread_mutex_unlock(&states_lock);
     free(script);
     free(modname);
 
@@ -255,17 +358,18 @@ int script_update_module(const char *filename) {
 }
 
 /* Parse the XML for the script definitions */
-int script_eventlist_read(const char *fn) {
+static int script_eventlist_read(script_state_t *st, const char *fn) {
     xmlParserCtxtPtr cxt;
     xmlDoc *doc;
     xmlNode *n;
     xmlChar *file, *event;
     int rv = 0;
     script_action_t idx;
+    lua_State *lstate = st->l;
 
     /* If we're reloading, kill the old list. */
-    if(scripts_ref) {
-        luaL_unref(lstate, LUA_REGISTRYINDEX, scripts_ref);
+    if(st->scripts_ref) {
+        luaL_unref(lstate, LUA_REGISTRYINDEX, st->scripts_ref);
     }
 
     /* Create an XML Parsing context */
@@ -342,7 +446,7 @@ int script_eventlist_read(const char *fn) {
             }
 
             /* Issue a warning if we're redefining something */
-            if(script_ids[idx]) {
+            if(st->script_ids[idx]) {
                 debug(DBG_WARN, "Redefining event \"%s\" on line %hu\n",
                       (char *)event, n->line);
             }
@@ -356,9 +460,9 @@ int script_eventlist_read(const char *fn) {
             }
 
             /* Add the script to the Lua table. */
-            script_ids[idx] = luaL_ref(lstate, -2);
+            st->script_ids[idx] = luaL_ref(lstate, -2);
             debug(DBG_LOG, "Script for type %s added as ID %d\n", event,
-                  script_ids[idx]);
+                  st->script_ids[idx]);
 
 next:
             /* Free the memory we allocated here... */
@@ -370,7 +474,7 @@ next:
     }
 
     /* Store the table of scripts to the registry for later use. */
-    scripts_ref = luaL_ref(lstate, LUA_REGISTRYINDEX);
+    st->scripts_ref = luaL_ref(lstate, LUA_REGISTRYINDEX);
 
     /* Cleanup/error handling below... */
 err_doc:
@@ -382,41 +486,60 @@ err:
     return rv;
 }
 
-void init_scripts(ship_t *s) {
+/* Create a new interpreter, and load up everything the ship has configured
+   into it, including any scripts that the shipgate has sent along. */
+static script_state_t *state_create(ship_t *s) {
     long size = pathconf(".", _PC_PATH_MAX);
-    char *path_str, *script;
+    char *path_str, *script, realfn[64];
+    script_state_t *st;
+    pthread_mutexattr_t attr;
+    int i;
 
     if(!(path_str = (char *)malloc(size))) {
         debug(DBG_WARN, "Out of memory, bailing out!\n");
-        return;
+        return NULL;
     }
     else if(!getcwd(path_str, size)) {
         debug(DBG_WARN, "Cannot save path, local packages will not work!\n");
+        free(path_str);
+        path_str = NULL;
     }
 
-    /* Not that this should happen, but just in case... */
-    if(lstate) {
-        debug(DBG_WARN, "Attempt to initialize scripting twice!\n");
-        return;
+    if(!(st = (script_state_t *)malloc(sizeof(script_state_t)))) {
+        debug(DBG_WARN, "Out of memory, bailing out!\n");
+        free(path_str);
+        return NULL;
     }
 
+    memset(st, 0, sizeof(script_state_t));
+
     /* Initialize the Lua interpreter */
-    debug(DBG_LOG, "Initializing scripting support...\n");
-    if(!(lstate = luaL_newstate())) {
+    if(!(st->l = luaL_newstate())) {
         debug(DBG_ERROR, "Cannot initialize Lua!\n");
-        return;
+        free(path_str);
+        free(st);
+        return NULL;
     }
 
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&st->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
     /* Load up the standard libraries. */
-    luaL_openlibs(lstate);
+    luaL_openlibs(st->l);
 
     /* Register various scripting libraries. */
-    luaL_requiref(lstate, "ship", ship_register_lua, 1);
-    lua_pop(lstate, 1);
-    luaL_requiref(lstate, "client", client_register_lua, 1);
-    lua_pop(lstate, 1);
-    luaL_requiref(lstate, "lobby", lobby_register_lua, 1);
-    lua_pop(lstate, 1);
+    luaL_requiref(st->l, "ship", ship_register_lua, 1);
+    lua_pop(st->l, 1);
+    luaL_requiref(st->l, "client", client_register_lua, 1);
+    lua_pop(st->l, 1);
+    luaL_requiref(st->l, "lobby", lobby_register_lua, 1);
+    lua_pop(st->l, 1);
+
+    /* Remember which state this is, for the library functions. */
+    lua_pushlightuserdata(st->l, st);
+    lua_rawsetp(st->l, LUA_REGISTRYINDEX, &state_key);
 
     if(path_str) {
         size = strlen(path_str) + 100;
@@ -429,7 +552,7 @@ void init_scripts(ship_t *s) {
                      "\";%s/scripts/modules/?.lua\"", path_str);
 
             /* Set the module search path to include the scripts/modules dir. */
-            (void)luaL_dostring(lstate, script);
+            (void)luaL_dostring(st->l, script);
             free(script);
         }
 
@@ -437,45 +560,322 @@ void init_scripts(ship_t *s) {
     }
 
     /* Read in the configuration into our script table */
-    if(script_eventlist_read(s->cfg->scripts_file)) {
+    if(script_eventlist_read(st, s->cfg->scripts_file)) {
         debug(DBG_WARN, "Couldn't load scripts configuration!\n");
 
         /* Make a scripts table, in case the gate sends us some later. */
-        lua_newtable(lstate);
-        scripts_ref = luaL_ref(lstate, LUA_REGISTRYINDEX);
+        lua_newtable(st->l);
+        st->scripts_ref = luaL_ref(st->l, LUA_REGISTRYINDEX);
     }
     else {
         debug(DBG_LOG, "Read script configuration\n");
     }
 
-    s->lstate = lstate;
+    /* Initialize the table that ship.getTable hands out. */
+    lua_newtable(st->l);
+    st->ship_ref = luaL_ref(st->l, LUA_REGISTRYINDEX);
+
+    /* Pick up anything that the shipgate has sent us already, and add this
+       one to the list, so it gets anything sent later. */
+    pthread_mutex_lock(&states_lock);
+
+    for(i = 0; i < ScriptActionCount; ++i) {
+        if(gate_files[i]) {
+            snprintf(realfn, 64, "scripts/%s", gate_files[i]);
+
+            if(state_add_gate(st, (script_action_t)i, realfn))
+                debug(DBG_WARN, "Couldn't load script \"%s\"\n", gate_files[i]);
+        }
+    }
+
+    TAILQ_INSERT_TAIL(&states, st, qentry);
+    pthread_mutex_unlock(&states_lock);
+
+    return st;
+}
+
+static void state_destroy(script_state_t *st) {
+    pthread_mutex_lock(&states_lock);
+    TAILQ_REMOVE(&states, st, qentry);
+    pthread_mutex_unlock(&states_lock);
+
+    /* For good measure, remove the tables from the registry. This should
+       garbage collect everything in them, I hope. */
+    luaL_unref(st->l, LUA_REGISTRYINDEX, st->ship_ref);
+
+    if(st->scripts_ref)
+        luaL_unref(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
+
+    lua_close(st->l);
+    pthread_mutex_destroy(&st->mutex);
+    free(st);
+}
+
+void init_scripts(ship_t *s) {
+    /* Not that this should happen, but just in case... */
+    if(ship_state) {
+        debug(DBG_WARN, "Attempt to initialize scripting twice!\n");
+        return;
+    }
+
+    /* Initialize the Lua interpreter */
+    debug(DBG_LOG, "Initializing scripting support...\n");
+    ship_state = state_create(s);
+    s->scripts = ship_state;
 }
 
 void cleanup_scripts(ship_t *s) {
+    script_shared_t *i;
+    int j;
+
+    if(ship_state) {
+        state_destroy(ship_state);
+
+        /* Clean everything back to a sensible state. */
+        ship_state = NULL;
+        s->scripts = NULL;
+
+        for(j = 0; j < ScriptActionCount; ++j) {
+            free(gate_files[j]);
+            gate_files[j] = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&shared_lock);
+
+    while((i = TAILQ_FIRST(&shared))) {
+        TAILQ_REMOVE(&shared, i, qentry);
+        free(i->key);
+        free(i->str);
+        free(i);
+    }
+
+    pthread_mutex_unlock(&shared_lock);
+}
+
+void script_block_init(block_t *b) {
+    b->scripts = ship_state;
+
+    if(!block_scripts || !ship_state)
+        return;
+
+    debug(DBG_LOG, "%s(%d): Initializing block scripting support...\n",
+          b->ship->cfg->name, b->b);
+
+    /* If we can't make a separate interpreter, sharing the ship's is better
+       than not having one at all. */
+    if(!(b->scripts = state_create(b->ship))) {
+        debug(DBG_WARN, "%s(%d): Using ship scripts instead\n",
+              b->ship->cfg->name, b->b);
+        b->scripts = ship_state;
+    }
+}
+
+void script_block_cleanup(block_t *b) {
+    if(b->scripts && b->scripts != ship_state)
+        state_destroy(b->scripts);
+
+    b->scripts = NULL;
+}
+
+int script_table_new(script_state_t *st) {
+    int rv;
+
+    if(!st)
+        return LUA_NOREF;
+
+    pthread_mutex_lock(&st->mutex);
+    lua_newtable(st->l);
+    rv = luaL_ref(st->l, LUA_REGISTRYINDEX);
+    pthread_mutex_unlock(&st->mutex);
+
+    return rv;
+}
+
+void script_table_free(script_state_t *st, int ref) {
+    if(!st)
+        return;
+
+    pthread_mutex_lock(&st->mutex);
+    luaL_unref(st->l, LUA_REGISTRYINDEX, ref);
+    pthread_mutex_unlock(&st->mutex);
+}
+
+void script_lobby_cleanup(lobby_t *l) {
+    script_state_t *st = l->block->scripts;
     int i;
 
-    if(lstate) {
-        /* For good measure, remove the scripts table from the registry. This
-           should garbage collect everything in it, I hope. */
-        if(scripts_ref)
-            luaL_unref(lstate, LUA_REGISTRYINDEX, scripts_ref);
+    if(!st)
+        return;
 
-        lua_close(lstate);
+    pthread_mutex_lock(&st->mutex);
+
+    /* Any callbacks the team set up live in the scripts table. */
+    if(l->script_ids) {
+        lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
 
-        /* Clean everything back to a sensible state. */
-        lstate = NULL;
-        scripts_ref = 0;
         for(i = 0; i < ScriptActionCount; ++i) {
-            script_ids[i] = 0;
-            script_ids_gate[i] = 0;
+            if(l->script_ids[i])
+                luaL_unref(st->l, -1, l->script_ids[i]);
         }
 
-        s->lstate = NULL;
+        lua_pop(st->l, 1);
+    }
+
+    luaL_unref(st->l, LUA_REGISTRYINDEX, l->script_ref);
+    pthread_mutex_unlock(&st->mutex);
+}
+
+script_state_t *script_state_from_lua(lua_State *l) {
+    script_state_t *rv;
+
+    lua_rawgetp(l, LUA_REGISTRYINDEX, &state_key);
+    rv = (script_state_t *)lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    return rv;
+}
+
+void script_push_ship_table(lua_State *l) {
+    script_state_t *st = script_state_from_lua(l);
+
+    if(st)
+        lua_rawgeti(l, LUA_REGISTRYINDEX, st->ship_ref);
+    else
+        lua_pushnil(l);
+}
+
+int script_shared_get_lua(lua_State *l) {
+    script_shared_t *i;
+    const char *key;
+
+    if(!lua_isstring(l, 1)) {
+        lua_pushnil(l);
+        return 1;
+    }
+
+    key = lua_tostring(l, 1);
+    pthread_mutex_lock(&shared_lock);
+
+    TAILQ_FOREACH(i, &shared, qentry) {
+        if(!strcmp(i->key, key))
+            break;
     }
+
+    if(!i) {
+        lua_pushnil(l);
+    }
+    else if(i->type == LUA_TBOOLEAN) {
+        lua_pushboolean(l, (int)i->ival);
+    }
+    else if(i->type == LUA_TNUMBER) {
+        if(i->isint)
+            lua_pushinteger(l, i->ival);
+        else
+            lua_pushnumber(l, i->nval);
+    }
+    else {
+        lua_pushlstring(l, i->str, i->len);
+    }
+
+    pthread_mutex_unlock(&shared_lock);
+    return 1;
 }
 
-static lua_Integer exec_pkt(int scr, script_action_t event, ship_client_t *c,
-                            const void *pkt, uint16_t len) {
+int script_shared_set_lua(lua_State *l) {
+    script_shared_t *i;
+    const char *key, *str;
+    int type;
+
+    if(!lua_isstring(l, 1)) {
+        lua_pushboolean(l, 0);
+        return 1;
+    }
+
+    key = lua_tostring(l, 1);
+    type = lua_type(l, 2);
+
+    /* Only plain values can be shared, since tables and functions belong to
+       the interpreter that made them. */
+    if(type != LUA_TNIL && type != LUA_TBOOLEAN && type != LUA_TNUMBER &&
+       type != LUA_TSTRING) {
+        lua_pushboolean(l, 0);
+        return 1;
+    }
+
+    pthread_mutex_lock(&shared_lock);
+
+    TAILQ_FOREACH(i, &shared, qentry) {
+        if(!strcmp(i->key, key))
+            break;
+    }
+
+    /* Setting something to nil removes it. */
+    if(type == LUA_TNIL) {
+        if(i) {
+            TAILQ_REMOVE(&shared, i, qentry);
+            free(i->key);
+            free(i->str);
+            free(i);
+        }
+
+        pthread_mutex_unlock(&shared_lock);
+        lua_pushboolean(l, 1);
+        return 1;
+    }
+
+    if(!i) {
+        if(!(i = (script_shared_t *)malloc(sizeof(script_shared_t))))
+            goto err;
+
+        memset(i, 0, sizeof(script_shared_t));
+
+        if(!(i->key = strdup(key))) {
+            free(i);
+            goto err;
+        }
+
+        TAILQ_INSERT_TAIL(&shared, i, qentry);
+    }
+
+    free(i->str);
+    i->str = NULL;
+    i->len = 0;
+    i->type = type;
+
+    if(type == LUA_TBOOLEAN) {
+        i->ival = lua_toboolean(l, 2);
+    }
+    else if(type == LUA_TNUMBER) {
+        i->isint = lua_isinteger(l, 2);
+        i->ival = lua_tointeger(l, 2);
+        i->nval = lua_tonumber(l, 2);
+    }
+    else {
+        str = lua_tolstring(l, 2, &i->len);
+
+        if(!(i->str = (char *)malloc(i->len + 1))) {
+            TAILQ_REMOVE(&shared, i, qentry);
+            free(i->key);
+            free(i);
+            goto err;
+        }
+
+        memcpy(i->str, str, i->len + 1);
+    }
+
+    pthread_mutex_unlock(&shared_lock);
+    lua_pushboolean(l, 1);
+    return 1;
+
+err:
+    pthread_mutex_unlock(&shared_lock);
+    lua_pushboolean(l, 0);
+    return 1;
+}
+
+static lua_Integer exec_pkt(lua_State *lstate, int scr, script_action_t event,
+                            ship_client_t *c, const void *pkt, uint16_t len) {
     lua_Integer rv = 0;
     int err;
 
@@ -513,34 +913,35 @@ out:
 int script_execute_pkt(script_action_t event, ship_client_t *c, const void *pkt,
                        uint16_t len) {
     lua_Integer grv = 0, lrv = 0;
+    script_state_t *st = client_state(c);
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st || !st->scripts_ref)
         return 0;
 
-    pthread_mutex_lock(&script_mutex);
+    pthread_mutex_lock(&st->mutex);
 
     /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
 
     /* See if there's a script event defined by the shipgate. */
-    if(script_ids_gate[event])
-        grv = exec_pkt(script_ids_gate[event], event, c, pkt, len);
+    if(st->script_ids_gate[event])
+        grv = exec_pkt(st->l, st->script_ids_gate[event], event, c, pkt, len);
 
     /* See if there's a script event defined locally */
-    if(script_ids[event])
-        lrv = exec_pkt(script_ids[event], event, c, pkt, len);
+    if(st->script_ids[event])
+        lrv = exec_pkt(st->l, st->script_ids[event], event, c, pkt, len);
 
     /* Pop off the table reference that we pushed up above. */
-    lua_pop(lstate, 1);
-    pthread_mutex_unlock(&script_mutex);
+    lua_pop(st->l, 1);
+    pthread_mutex_unlock(&st->mutex);
 
     /* Return success if either script ran and returned success. */
     return (int)(grv | lrv);
 }
 
-static lua_Integer push_args_and_exec(int scr, script_action_t event,
-                                      va_list ap) {
+static lua_Integer push_args_and_exec(lua_State *lstate, int scr,
+                                      script_action_t event, va_list ap) {
     lua_Integer rv = 0;
     int err = 0, argtype, argcount = 0;
 
@@ -644,85 +1045,116 @@ out:
     return rv;
 }
 
-int script_execute(script_action_t event, ship_client_t *c, ...) {
+/* Run every script for an event in one interpreter. Each script gets its own
+   copy of the arguments. */
+static int execute(script_state_t *st, script_action_t event,
+                   ship_client_t *c, va_list ap) {
     lua_Integer llrv = 0, lrv = 0, grv = 0;
-    va_list ap;
+    va_list ap2;
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st || !st->scripts_ref)
         return 0;
 
-    pthread_mutex_lock(&script_mutex);
+    pthread_mutex_lock(&st->mutex);
 
     /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
 
     /* See if there's a script event defined by the gate */
-    if(script_ids_gate[event]) {
-        va_start(ap, c);
-        grv = push_args_and_exec(script_ids_gate[event], event, ap);
-        va_end(ap);
+    if(st->script_ids_gate[event]) {
+        va_copy(ap2, ap);
+        grv = push_args_and_exec(st->l, st->script_ids_gate[event], event,
+                                 ap2);
+        va_end(ap2);
     }
 
     /* See if there's a script event defined locally */
-    if(script_ids[event]) {
-        va_start(ap, c);
-        lrv = push_args_and_exec(script_ids[event], event, ap);
-        va_end(ap);
+    if(st->script_ids[event]) {
+        va_copy(ap2, ap);
+        lrv = push_args_and_exec(st->l, st->script_ids[event], event, ap2);
+        va_end(ap2);
     }
 
     /* See if there is a team-defined event. */
     if(c && c->cur_lobby && c->cur_lobby->script_ids) {
         if(c->cur_lobby->script_ids[event]) {
-            va_start(ap, c);
-            llrv = push_args_and_exec(c->cur_lobby->script_ids[event], event,
-                                      ap);
-            va_end(ap);
+            va_copy(ap2, ap);
+            llrv = push_args_and_exec(st->l, c->cur_lobby->script_ids[event],
+                                      event, ap2);
+            va_end(ap2);
         }
     }
 
     /* Pop off the table reference that we pushed up above. */
-    lua_pop(lstate, 1);
-    pthread_mutex_unlock(&script_mutex);
+    lua_pop(st->l, 1);
+    pthread_mutex_unlock(&st->mutex);
     return (int)(llrv | lrv | grv);
 }
 
+int script_execute(script_action_t event, ship_client_t *c, ...) {
+    va_list ap;
+    int rv;
+
+    va_start(ap, c);
+    rv = execute(client_state(c), event, c, ap);
+    va_end(ap);
+
+    return rv;
+}
+
+int script_execute_block(block_t *b, script_action_t event, ship_client_t *c,
+                         ...) {
+    va_list ap;
+    int rv;
+
+    va_start(ap, c);
+    rv = execute(b->scripts, event, c, ap);
+    va_end(ap);
+
+    return rv;
+}
+
 int script_execute_file(const char *fn, lobby_t *l) {
     lua_Integer rv;
     int err;
+    script_state_t *st = l ? l->block->scripts : ship_state;
 
     /* Can't do anything if we can't run scripts. */
-    if(!scripts_ref)
+    if(!st || !st->scripts_ref)
         return -1;
 
-    pthread_mutex_lock(&script_mutex);
+    pthread_mutex_lock(&st->mutex);
 
     /* Attempt to read in the script. */
-    if(luaL_loadfile(lstate, (const char *)fn) != LUA_OK) {
+    if(luaL_loadfile(st->l, (const char *)fn) != LUA_OK) {
         debug(DBG_WARN, "Couldn't load script '%s'\n", fn);
-        lua_pop(lstate, 1);
+        lua_pop(st->l, 1);
+        pthread_mutex_unlock(&st->mutex);
         return -1;
     }
 
     /* Push the lobby structure for the team to the stack. */
-    lua_pushlightuserdata(lstate, l);
+    lua_pushlightuserdata(st->l, l);
 
     /* Run the script. */
-    if(lua_pcall(lstate, 1, 1, 0) != LUA_OK) {
+    if(lua_pcall(st->l, 1, 1, 0) != LUA_OK) {
         debug(DBG_ERROR, "Error running Lua script '%s'\n", fn);
-        lua_pop(lstate, 1);
+        lua_pop(st->l, 1);
+        pthread_mutex_unlock(&st->mutex);
         return -1;
     }
 
     /* Grab the return value from the lua function (it should be of type
        integer). */
-    rv = lua_tointegerx(lstate, -1, &err);
+    rv = lua_tointegerx(st->l, -1, &err);
     if(!err) {
         debug(DBG_ERROR, "Script '%s' didn't return int\n", fn);
     }
 
     /* Pop off the return value. */
-    lua_pop(lstate, 1);
+    lua_pop(st->l, 1);
+    pthread_mutex_unlock(&st->mutex);
 
     return (int)rv;
 }
@@ -786,4 +1218,20 @@ int script_execute_file(const char *fn, lobby_t *l) {
     return 0;
 }
 
+int script_execute_block(block_t *b, script_action_t event, ship_client_t *c,
+                         ...) {
+    (void)b;
+    (void)event;
+    (void)c;
+    return 0;
+}
+
+void script_block_init(block_t *b) {
+    b->scripts = NULL;
+}
+
+void script_block_cleanup(block_t *b) {
+    (void)b;
+}
+
 #endif /* ENABLE_LUA */
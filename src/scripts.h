@@ -65,9 +65,20 @@ typedef enum script_action {
 #define SCRIPT_ARG_STRING   7               /* Length-prepended string */
 #define SCRIPT_ARG_CSTRING  8               /* NUL-terminated string */
 
-/* Call the script function for the given event with the args listed */
+#ifndef SCRIPT_STATE_DEFINED
+#define SCRIPT_STATE_DEFINED
+typedef struct script_state script_state_t;
+#endif
+
+/* Call the script function for the given event with the args listed. This runs
+   in the interpreter for the client's block (or the ship's, if the client isn't
+   on a block). */
 int script_execute(script_action_t event, ship_client_t *c, ...);
 
+/* Same as above, but always use the given block's interpreter. */
+int script_execute_block(block_t *b, script_action_t event, ship_client_t *c,
+                         ...);
+
 /* Call the script function for the given event that involves an unknown pkt */
 int script_execute_pkt(script_action_t event, ship_client_t *c, const void *pkt,
                        uint16_t len);
@@ -75,6 +86,11 @@ int script_execute_pkt(script_action_t event, ship_client_t *c, const void *pkt,
 void init_scripts(ship_t *s);
 void cleanup_scripts(ship_t *s);
 
+/* Set up (or tear down) the interpreter for a block. Blocks share the ship's
+   interpreter unless they've been told to have their own. */
+void script_block_init(block_t *b);
+void script_block_cleanup(block_t *b);
+
 int script_add(script_action_t action, const char *filename);
 int script_add_lobby_locked(lobby_t *l, script_action_t action);
 int script_remove(script_action_t action);
@@ -83,4 +99,22 @@ int script_update_module(const char *modname);
 
 int script_execute_file(const char *fn, lobby_t *l);
 
+#ifdef ENABLE_LUA
+/* Make (or get rid of) a table in the registry of the given interpreter, for
+   something to store its script data in. */
+int script_table_new(script_state_t *st);
+void script_table_free(script_state_t *st, int ref);
+
+/* Drop the script data and callbacks belonging to a team. */
+void script_lobby_cleanup(lobby_t *l);
+
+/* Helpers for the Lua libraries. Each interpreter has its own table for
+   ship.getTable, so anything that needs to be seen by every block has to go
+   through ship.getShared and ship.setShared instead. */
+script_state_t *script_state_from_lua(lua_State *l);
+void script_push_ship_table(lua_State *l);
+int script_shared_get_lua(lua_State *l);
+int script_shared_set_lua(lua_State *l);
+#endif
+
 #endif /* !SCRIPTS_H */
@@ -0,0 +1,185 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sendq.h"
+
+/* How many chunks to allocate at once when the pool runs dry. */
+#define SENDQ_SLAB_CHUNKS   32
+
+typedef struct sendq_slab {
+    struct sendq_slab *next;
+    sendq_chunk_t chunks[SENDQ_SLAB_CHUNKS];
+} sendq_slab_t;
+
+/* The pool never gives memory back until shutdown, so it will settle at the
+   most that has ever been in use at once. */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sendq_chunk_t *free_chunks = NULL;
+static sendq_slab_t *slabs = NULL;
+
+static sendq_chunk_t *chunk_alloc(void) {
+    sendq_slab_t *slab;
+    sendq_chunk_t *rv;
+    int i;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    if(!free_chunks) {
+        if(!(slab = (sendq_slab_t *)malloc(sizeof(sendq_slab_t)))) {
+            pthread_mutex_unlock(&pool_mutex);
+            return NULL;
+        }
+
+        slab->next = slabs;
+        slabs = slab;
+
+        for(i = 0; i < SENDQ_SLAB_CHUNKS; ++i) {
+            slab->chunks[i].next = free_chunks;
+            free_chunks = &slab->chunks[i];
+        }
+    }
+
+    rv = free_chunks;
+    free_chunks = rv->next;
+
+    pthread_mutex_unlock(&pool_mutex);
+
+    rv->next = NULL;
+    rv->start = rv->end = 0;
+    return rv;
+}
+
+static void chunk_free(sendq_chunk_t *c) {
+    pthread_mutex_lock(&pool_mutex);
+    c->next = free_chunks;
+    free_chunks = c;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+int sendq_append(sendq_t *q, const void *data, size_t len) {
+    const uint8_t *ptr = (const uint8_t *)data;
+    sendq_chunk_t *c;
+    size_t amt;
+
+    ++q->pkts;
+
+    while(len) {
+        /* Grab a new chunk if the last one is full (or there isn't one). */
+        if(!q->tail || q->tail->end == SENDQ_CHUNK_SIZE) {
+            if(!(c = chunk_alloc()))
+                return -1;
+
+            if(q->tail)
+                q->tail->next = c;
+            else
+                q->head = c;
+
+            q->tail = c;
+        }
+
+        c = q->tail;
+        amt = SENDQ_CHUNK_SIZE - c->end;
+
+        if(amt > len)
+            amt = len;
+
+        memcpy(c->data + c->end, ptr, amt);
+        c->end += (int)amt;
+        q->len += amt;
+        ptr += amt;
+        len -= amt;
+    }
+
+    return 0;
+}
+
+const uint8_t *sendq_peek(sendq_t *q, size_t *len) {
+    if(!q->head) {
+        *len = 0;
+        return NULL;
+    }
+
+    *len = q->head->end - q->head->start;
+    return q->head->data + q->head->start;
+}
+
+int sendq_iov(sendq_t *q, struct iovec *iov, int max) {
+    sendq_chunk_t *c;
+    int n = 0;
+
+    for(c = q->head; c && n < max; c = c->next, ++n) {
+        iov[n].iov_base = c->data + c->start;
+        iov[n].iov_len = c->end - c->start;
+    }
+
+    return n;
+}
+
+void sendq_consume(sendq_t *q, size_t len) {
+    sendq_chunk_t *c;
+    size_t amt;
+
+    while(len && (c = q->head)) {
+        amt = c->end - c->start;
+
+        if(len < amt) {
+            c->start += (int)len;
+            q->len -= len;
+            return;
+        }
+
+        /* This chunk is done, so give it back to the pool. */
+        q->len -= amt;
+        len -= amt;
+
+        if(!(q->head = c->next))
+            q->tail = NULL;
+
+        chunk_free(c);
+    }
+}
+
+void sendq_clear(sendq_t *q) {
+    sendq_chunk_t *c;
+
+    while((c = q->head)) {
+        q->head = c->next;
+        chunk_free(c);
+    }
+
+    q->tail = NULL;
+    q->len = 0;
+    q->pkts = 0;
+}
+
+void sendq_pool_cleanup(void) {
+    sendq_slab_t *slab;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    while((slab = slabs)) {
+        slabs = slab->next;
+        free(slab);
+    }
+
+    free_chunks = NULL;
+    pthread_mutex_unlock(&pool_mutex);
+}
@@ -0,0 +1,70 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* How much data each chunk of a send queue holds. */
+#define SENDQ_CHUNK_SIZE    4096
+
+typedef struct sendq_chunk {
+    struct sendq_chunk *next;
+    int start;
+    int end;
+    uint8_t data[SENDQ_CHUNK_SIZE];
+} sendq_chunk_t;
+
+/* A queue of data waiting to go out on a socket. The chunks all come from a
+   pool shared by every queue, so that data can be added and sent without ever
+   having to reallocate or move what's already there. A queue that is all
+   zeroes is valid and empty. */
+typedef struct sendq {
+    sendq_chunk_t *head;
+    sendq_chunk_t *tail;
+    size_t len;
+    int pkts;
+} sendq_t;
+
+/* Add data to the end of the queue. Each call is counted as one packet in the
+   pkts field, for keeping track of how well sends are being coalesced. Returns
+   -1 if we run out of memory (in which case some of the data may have been
+   added). */
+int sendq_append(sendq_t *q, const void *data, size_t len);
+
+/* Get a pointer to the first contiguous run of data in the queue, storing its
+   length in len. Returns NULL if the queue is empty. */
+const uint8_t *sendq_peek(sendq_t *q, size_t *len);
+
+/* Fill in up to max iovecs describing the data at the front of the queue, for
+   sending it all with one call. Returns the number of iovecs filled in. */
+int sendq_iov(sendq_t *q, struct iovec *iov, int max);
+
+/* Drop len bytes from the front of the queue, after they've been sent. */
+void sendq_consume(sendq_t *q, size_t len);
+
+/* Throw away everything in the queue. */
+void sendq_clear(sendq_t *q);
+
+/* Free all the memory held by the shared chunk pool. This must only be called
+   once no queues have anything left in them. */
+void sendq_pool_cleanup(void);
+
+#endif /* !SENDQ_H */
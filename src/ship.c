@@ -23,7 +23,6 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
 
 #include <sylverant/debug.h>
@@ -120,21 +119,69 @@ static sylverant_event_t *find_current_event(ship_t *s) {
     return s->cfg->events;
 }
 
-static void *ship_thd(void *d) {
-    int i, nfds;
-    ship_t *s = (ship_t *)d;
-    struct timeval timeout;
-    fd_set readfds, writefds;
-    ship_client_t *it, *tmp;
+/* Maximum number of events to handle per pass through the event loop. */
+#define SHIP_MAX_EVENTS     64
+
+/* Listening sockets for each version, as seen by the event loop. */
+typedef struct ship_listener {
+    int sock;
+    int version;
+    const char *desc;
+} ship_listener_t;
+
+static void ship_accept(ship_t *s, ship_listener_t *lis) {
     socklen_t len;
     struct sockaddr_storage addr;
     struct sockaddr *addr_p = (struct sockaddr *)&addr;
     char ipstr[INET6_ADDRSTRLEN];
-    int sock, rv;
-    ssize_t sent;
+    ship_client_t *c;
+    int sock;
+
+    len = sizeof(struct sockaddr_storage);
+    if((sock = accept(lis->sock, addr_p, &len)) < 0) {
+        perror("accept");
+        return;
+    }
+
+    my_ntop(&addr, ipstr);
+    debug(DBG_LOG, "%s: Accepted %s ship connection from %s\n",
+          s->cfg->name, lis->desc, ipstr);
+
+    if(!(c = client_create_connection(sock, lis->version, CLIENT_TYPE_SHIP,
+                                      s->clients, s, NULL, addr_p, len))) {
+        return;
+    }
+
+    if(s->shutdown_time) {
+        send_message_box(c, "%s\n\n%s\n%s",
+                         __(c, "\tEShip is going down for shutdown."),
+                         __(c, "Please try another ship."),
+                         __(c, "Disconnecting."));
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+    }
+}
+
+static void ship_drop_shipgate(ship_t *s) {
+    debug(DBG_WARN, "%s: Lost connection with shipgate\n", s->cfg->name);
+
+    /* Close the connection so we can attempt to reconnect */
+    evloop_del(s->evloop, s->sg.sock);
+    shipgate_disconnect(&s->sg);
+}
+
+static void *ship_thd(void *d) {
+    int i, j, nev, nls = 0;
+    ship_t *s = (ship_t *)d;
+    int timeout;
+    evloop_event_t evs[SHIP_MAX_EVENTS];
+    ship_listener_t lis[10];
+    ship_client_t *it, *tmp;
+    uint8_t dummy;
+    int rv;
     time_t now;
     time_t last_ban_sweep = time(NULL);
     int numsocks = 1;
+    int sg_sock = -1, sg_events = 0;
     sylverant_event_t *event, *oldevent = s->cfg->events;
 
 #ifdef SYLVERANT_ENABLE_IPV6
@@ -143,6 +190,29 @@ static void *ship_thd(void *d) {
     }
 #endif
 
+    /* Add the listening sockets and the pipe to the event loop. */
+    for(i = 0; i < numsocks; ++i) {
+        lis[nls++] = (ship_listener_t){ s->dcsock[i], CLIENT_VERSION_DCV1,
+                                        "DC" };
+        lis[nls++] = (ship_listener_t){ s->pcsock[i], CLIENT_VERSION_PC,
+                                        "PC" };
+        lis[nls++] = (ship_listener_t){ s->gcsock[i], CLIENT_VERSION_GC,
+                                        "GC" };
+        lis[nls++] = (ship_listener_t){ s->ep3sock[i], CLIENT_VERSION_EP3,
+                                        "Episode 3" };
+        lis[nls++] = (ship_listener_t){ s->bbsock[i], CLIENT_VERSION_BB,
+                                        "Blue Burst" };
+    }
+
+    for(i = 0; i < nls; ++i) {
+        if(evloop_add(s->evloop, lis[i].sock, EVLOOP_READ, &lis[i])) {
+            debug(DBG_ERROR, "%s: Cannot add listening socket to event "
+                  "loop: %s\n", s->cfg->name, strerror(errno));
+        }
+    }
+
+    evloop_add(s->evloop, s->pipes[0], EVLOOP_READ, s->pipes);
+
     /* Fire up the threads for each block. */
     for(i = 1; i <= s->cfg->blocks; ++i) {
         s->blocks[i - 1] = block_server_start(s, i, s->cfg->base_port +
@@ -155,12 +225,7 @@ static void *ship_thd(void *d) {
 
     /* While we're still supposed to run... do it. */
     while(s->run) {
-        /* Clear the fd_sets so we can use them again. */
-        nfds = 0;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        timeout.tv_sec = 30;
-        timeout.tv_usec = 0;
+        timeout = 30;
         now = time(NULL);
 
         /* Break out if we're shutting down now */
@@ -175,12 +240,20 @@ static void *ship_thd(void *d) {
             last_ban_sweep = now = time(NULL);
         }
 
+        /* If writing to the shipgate failed, drop the connection so that we
+           can try again. */
+        if(s->sg.sock != -1 && __atomic_load_n(&s->sg.wfailed,
+                                               __ATOMIC_SEQ_CST)) {
+            ship_drop_shipgate(s);
+            sg_sock = -1;
+        }
+
         /* If the shipgate isn't there, attempt to reconnect */
         if(s->sg.sock == -1 && s->sg.login_attempt < now) {
             if(shipgate_reconnect(&s->sg)) {
                 /* Set the next login attempt to ~15 seconds from now... */
                 s->sg.login_attempt = now + 14;
-                timeout.tv_sec = 15;
+                timeout = 15;
             }
             else {
                 s->sg.login_attempt = 0;
@@ -206,7 +279,7 @@ static void *ship_thd(void *d) {
             oldevent = event;
         }
 
-        /* Fill the sockets into the fd_sets so we can use select below. */
+        /* Check for any clients that need pinging or have timed out. */
         TAILQ_FOREACH(it, s->clients, qentry) {
             /* If we haven't heard from a client in 2 minutes, its dead.
                Disconnect it. */
@@ -223,267 +296,89 @@ static void *ship_thd(void *d) {
 
                 it->last_sent = now;
             }
-
-            FD_SET(it->sock, &readfds);
-
-            /* Only add to the write fd set if we have something to send out. */
-            if(it->sendbuf_cur) {
-                FD_SET(it->sock, &writefds);
-            }
-
-            nfds = nfds > it->sock ? nfds : it->sock;
         }
 
-        /* Add the listening sockets to the read fd_set. */
-        for(i = 0; i < numsocks; ++i) {
-            FD_SET(s->dcsock[i], &readfds);
-            nfds = nfds > s->dcsock[i] ? nfds : s->dcsock[i];
-            FD_SET(s->pcsock[i], &readfds);
-            nfds = nfds > s->pcsock[i] ? nfds : s->pcsock[i];
-            FD_SET(s->gcsock[i], &readfds);
-            nfds = nfds > s->gcsock[i] ? nfds : s->gcsock[i];
-            FD_SET(s->ep3sock[i], &readfds);
-            nfds = nfds > s->ep3sock[i] ? nfds : s->ep3sock[i];
-            FD_SET(s->bbsock[i], &readfds);
-            nfds = nfds > s->bbsock[i] ? nfds : s->bbsock[i];
+        /* Keep the shipgate socket registered. It isn't edge-triggered, since
+           GnuTLS does its own buffering, and we only ever wait for it to be
+           readable, since all the writing is done by the shipgate's writer
+           thread. Note that sg_sock is reset whenever we drop the connection,
+           since the new socket may well end up with the same descriptor. */
+        if(s->sg.sock != sg_sock) {
+            sg_sock = s->sg.sock;
+            sg_events = 0;
         }
 
-        FD_SET(s->pipes[1], &readfds);
-        nfds = nfds > s->pipes[1] ? nfds : s->pipes[1];
-
-        /* Add the shipgate socket to the fd_sets */
-        if(s->sg.sock != -1) {
-            FD_SET(s->sg.sock, &readfds);
-
-            if(s->sg.sendbuf_cur) {
-                FD_SET(s->sg.sock, &writefds);
-            }
-
-            nfds = nfds > s->sg.sock ? nfds : s->sg.sock;
+        if(sg_sock != -1 && !sg_events) {
+            evloop_add(s->evloop, sg_sock, EVLOOP_READ, &s->sg);
+            sg_events = EVLOOP_READ;
         }
 
         /* If we're supposed to shut down soon, make sure we aren't in the
-           middle of a select still when its supposed to happen. */
-        if(s->shutdown_time && now + timeout.tv_sec > s->shutdown_time) {
-            timeout.tv_sec = s->shutdown_time - now;
+           middle of waiting still when its supposed to happen. */
+        if(s->shutdown_time && now + timeout > s->shutdown_time) {
+            timeout = s->shutdown_time - now;
         }
 
         /* Wait for some activity... */
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
-            /* Clear anything written to the pipe */
-            if(FD_ISSET(s->pipes[1], &readfds)) {
-                read(s->pipes[1], &len, 1);
-            }
-
-            for(i = 0; i < numsocks; ++i) {
-                if(FD_ISSET(s->dcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->dcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted DC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_DCV1,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
-
-                if(FD_ISSET(s->pcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->pcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted PC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock, CLIENT_VERSION_PC,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
+        if((nev = evloop_wait(s->evloop, evs, SHIP_MAX_EVENTS,
+                              timeout * 1000)) > 0) {
+            for(i = 0; i < nev; ++i) {
+                /* Clear anything written to the pipe */
+                if(evs[i].data == s->pipes) {
+                    read(s->pipes[0], &dummy, 1);
+                    continue;
                 }
 
-                if(FD_ISSET(s->gcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->gcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted GC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock, CLIENT_VERSION_GC,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
+                /* Process the shipgate */
+                if(evs[i].data == &s->sg) {
+                    if(s->sg.sock == -1)
+                        continue;
 
-                if(FD_ISSET(s->ep3sock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->ep3sock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+                    if(evs[i].events & EVLOOP_READ) {
+                        if((rv = shipgate_process_pkt(&s->sg))) {
+                            ship_drop_shipgate(s);
+                            sg_sock = -1;
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted Episode 3 ship connection "
-                          "from %s\n", s->cfg->name, ipstr);
+                            if(rv < -1) {
+                                debug(DBG_WARN, "%s: Fatal shipgate error, "
+                                      "bailing!\n", s->cfg->name);
+                                s->run = 0;
+                            }
 
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_EP3,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
+                            continue;
+                        }
                     }
 
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
+                    continue;
                 }
 
-                if(FD_ISSET(s->bbsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->bbsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted Blue Burst ship connection "
-                          "from %s\n", s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_BB,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
+                for(j = 0; j < nls; ++j) {
+                    if(evs[i].data == &lis[j])
+                        break;
                 }
-            }
 
-            /* Process the shipgate */
-            if(s->sg.sock != -1 && FD_ISSET(s->sg.sock, &readfds)) {
-                if((rv = shipgate_process_pkt(&s->sg))) {
-                    debug(DBG_WARN, "%s: Lost connection with shipgate\n",
-                          s->cfg->name);
-
-                    /* Close the connection so we can attempt to reconnect */
-                    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
-                    close(s->sg.sock);
-                    gnutls_deinit(s->sg.session);
-                    s->sg.sock = -1;
-
-                    if(rv < -1) {
-                        debug(DBG_WARN, "%s: Fatal shipgate error, bailing!\n",
-                              s->cfg->name);
-                        s->run = 0;
-                    }
+                if(j < nls) {
+                    ship_accept(s, &lis[j]);
+                    continue;
                 }
-            }
-
-            if(s->sg.sock != -1 && FD_ISSET(s->sg.sock, &writefds)) {
-                if(shipgate_send_pkts(&s->sg)) {
-                    debug(DBG_WARN, "%s: Lost connection with shipgate\n",
-                          s->cfg->name);
 
-                    /* Close the connection so we can attempt to reconnect */
-                    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
-                    close(s->sg.sock);
-                    gnutls_deinit(s->sg.session);
-                    s->sg.sock = -1;
-                }
-            }
+                /* Process client connections that have something going on. */
+                it = (ship_client_t *)evs[i].data;
 
-            /* Process client connections. */
-            TAILQ_FOREACH(it, s->clients, qentry) {
                 /* Check if this connection was trying to send us something. */
-                if(FD_ISSET(it->sock, &readfds)) {
+                if((evs[i].events & EVLOOP_READ) &&
+                   !(it->flags & CLIENT_FLAG_DISCONNECTED)) {
                     if(client_process_pkt(it)) {
                         it->flags |= CLIENT_FLAG_DISCONNECTED;
                         continue;
                     }
                 }
 
-                /* If we have anything to write, check if we can right now. */
-                if(FD_ISSET(it->sock, &writefds)) {
-                    if(it->sendbuf_cur) {
-                        sent = send(it->sock, it->sendbuf + it->sendbuf_start,
-                                    it->sendbuf_cur - it->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                                continue;
-                            }
-                        }
-                        else {
-                            it->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(it->sendbuf_start == it->sendbuf_cur) {
-                                free(it->sendbuf);
-                                it->sendbuf = NULL;
-                                it->sendbuf_cur = 0;
-                                it->sendbuf_size = 0;
-                                it->sendbuf_start = 0;
-                            }
-                        }
+                /* If we have anything to write, send out as much as we can. */
+                if((evs[i].events & EVLOOP_WRITE) &&
+                   !(it->flags & CLIENT_FLAG_DISCONNECTED)) {
+                    if(client_flush(it)) {
+                        it->flags |= CLIENT_FLAG_DISCONNECTED;
                     }
                 }
             }
@@ -504,16 +399,17 @@ static void *ship_thd(void *d) {
         }
     }
 
+    for(i = 0; i < nls; ++i) {
+        evloop_del(s->evloop, lis[i].sock);
+    }
+
+    evloop_del(s->evloop, s->pipes[0]);
+
     debug(DBG_LOG, "%s: Shutting down...\n", s->cfg->name);
 
     /* Before we shut down, run the shutdown script, if one is configured. */
     script_execute(ScriptActionShutdown, NULL, SCRIPT_ARG_PTR, s, 0);
 
-#ifdef ENABLE_LUA
-    /* Remove the table from the registry */
-    luaL_unref(s->lstate, LUA_REGISTRYINDEX, s->script_ref);
-#endif
-
     /* Disconnect any clients. */
     it = TAILQ_FIRST(s->clients);
     while(it) {
@@ -530,6 +426,7 @@ static void *ship_thd(void *d) {
     }
 
     /* Free the ship structure. */
+    ban_writer_stop(s);
     ban_list_clear(s);
     cleanup_scripts(s);
     pthread_rwlock_destroy(&s->banlock);
@@ -541,6 +438,7 @@ static void *ship_thd(void *d) {
     clean_quests(s);
     close(s->pipes[0]);
     close(s->pipes[1]);
+    evloop_destroy(s->evloop);
 #ifdef SYLVERANT_ENABLE_IPV6
     if(enable_ipv6) {
         close(s->bbsock[1]);
@@ -661,6 +559,12 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
         goto err_blocks;
     }
 
+    /* Create the event loop that the ship's thread will wait on. */
+    if(!(rv->evloop = evloop_create())) {
+        debug(DBG_ERROR, "%s: Cannot create event loop!\n", s->name);
+        goto err_clients;
+    }
+
     /* Attempt to read the quest list in. */
     if(s->quests_file && s->quests_file[0]) {
         debug(DBG_WARN, "%s: Ignoring old quests configuration!\n", s->name);
@@ -755,17 +659,16 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
     /* Initialize scripting support */
     init_scripts(rv);
 
-#ifdef ENABLE_LUA
-    /* Initialize the script table */
-    lua_newtable(rv->lstate);
-    rv->script_ref = luaL_ref(rv->lstate, LUA_REGISTRYINDEX);
-#endif
-
     /* Attempt to read the ban list */
     if(s->bans_file) {
         if(ban_list_read(s->bans_file, rv)) {
             debug(DBG_WARN, "%s: Couldn't read bans file!\n", s->name);
         }
+
+        /* Changes get saved in the background from here on. */
+        if(ban_writer_start(rv)) {
+            debug(DBG_WARN, "%s: Bans will not be saved!\n", s->name);
+        }
     }
 
     /* Create the random number generator state */
@@ -788,6 +691,7 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
 err_shipgate:
     shipgate_cleanup(&rv->sg);
 err_bans_locks:
+    ban_writer_stop(rv);
     pthread_rwlock_destroy(&rv->banlock);
     ban_list_clear(rv);
     cleanup_scripts(rv);
@@ -798,6 +702,8 @@ err_limits:
 err_quests:
     pthread_rwlock_destroy(&rv->qlock);
     clean_quests(rv);
+    evloop_destroy(rv->evloop);
+err_clients:
     free(rv->clients);
 err_blocks:
     free(rv->blocks);
@@ -853,7 +759,7 @@ void ship_check_cfg(sylverant_ship_t *s) {
 
     /* Clear it out */
     memset(rv, 0, sizeof(ship_t));
-    TAILQ_INIT(&rv->qmap);
+    quest_map_init(&rv->qmap);
     TAILQ_INIT(&rv->all_limits);
     pthread_rwlock_init(&rv->llock, NULL);
     rv->cfg = s;
@@ -973,7 +879,7 @@ void ship_server_stop(ship_t *s) {
     s->run = 0;
 
     /* Send a byte to the pipe so that we actually break out of the select. */
-    write(s->pipes[0], "\xFF", 1);
+    write(s->pipes[1], "\xFF", 1);
 
     /* Wait for it to die. */
     pthread_join(s->thd, NULL);
@@ -985,7 +891,7 @@ void ship_server_shutdown(ship_t *s, time_t when) {
 
         /* Send a byte to the pipe so that we actually break out of the select
            and put a probably more sane amount in the timeout there */
-        write(s->pipes[0], "\xFF", 1);
+        write(s->pipes[1], "\xFF", 1);
     }
 }
 
@@ -1613,11 +1519,8 @@ static int ship_name_lua(lua_State *l) {
 }
 
 static int ship_getTable_lua(lua_State *l) {
-    ship_t *sl;
-
     if(lua_islightuserdata(l, 1)) {
-        sl = (ship_t *)lua_touserdata(l, 1);
-        lua_rawgeti(l, LUA_REGISTRYINDEX, sl->script_ref);
+        script_push_ship_table(l);
     }
     else {
         lua_pushnil(l);
@@ -1641,6 +1544,8 @@ static const luaL_Reg shiplib[] = {
     { "name", ship_name_lua },
     { "getTable", ship_getTable_lua },
     { "writeLog", ship_writeLog_lua },
+    { "getShared", script_shared_get_lua },
+    { "setShared", script_shared_set_lua },
     { NULL, NULL }
 };
 
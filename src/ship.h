@@ -43,6 +43,7 @@
 
 #include "quests.h"
 #include "bans.h"
+#include "evloop.h"
 
 /* Forward declarations. */
 struct client_queue;
@@ -90,6 +91,7 @@ struct ship {
     sylverant_ship_t *cfg;
 
     pthread_t thd;
+    evloop_t *evloop;
     block_t **blocks;
     struct client_queue *clients;
 
@@ -121,6 +123,7 @@ struct ship {
     pthread_rwlock_t banlock;
     struct gcban_queue guildcard_bans;
     struct ipban_queue ip_bans;
+    ban_index_t ban_idx;
 
     struct miniship_queue ships;
     int mccount;
@@ -131,11 +134,8 @@ struct ship {
     struct limits_queue all_limits;
     sylverant_limits_t *def_limits;
 
-#ifdef ENABLE_LUA
-    lua_State *lstate;
-#endif
-
-    int script_ref;
+    /* The ship's script interpreter */
+    struct script_state *scripts;
 };
 
 #ifndef SHIP_DEFINED
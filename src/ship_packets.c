@@ -23,7 +23,6 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/socket.h>
-#include <iconv.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <ctype.h>
@@ -40,6 +39,8 @@
 
 extern uint32_t ship_ip4;
 extern uint8_t ship_ip6[16];
+extern size_t client_send_limit;
+extern int client_defer_sends;
 
 /* Options for choice search. */
 typedef struct cs_opt {
@@ -175,10 +176,33 @@ static int send_bb_lobby_arrows(lobby_t *l, ship_client_t *c);
 /* Send a raw packet away. */
 static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
     ssize_t rv, total = 0;
-    void *tmp;
+
+    /* If we're coalescing sends to block clients, don't send anything now.
+       Everything queued up goes out together once the client's worker is done
+       with this pass through its event loop. */
+    if(client_defer_sends && c->worker) {
+        if(client_send_limit &&
+           c->sendq.len + (size_t)len > client_send_limit) {
+            debug(DBG_WARN, "Disconnecting slow client (guildcard %" PRIu32
+                  "): %d bytes queued\n", c->guildcard, (int)c->sendq.len);
+            return -1;
+        }
+
+        /* Only ask for a flush once the data is actually queued, so that a
+           failed append never leaves the client on the flush list. */
+        total = (ssize_t)c->sendq.len;
+
+        if(sendq_append(&c->sendq, sendbuf, (size_t)len))
+            return -1;
+
+        if(!total && client_schedule_flush(c))
+            return -1;
+
+        return 0;
+    }
 
     /* Keep trying until the whole thing's sent. */
-    if(!c->sendbuf_cur) {
+    if(!c->sendq.len) {
         while(total < len) {
             rv = send(c->sock, sendbuf + total, len - total, 0);
 
@@ -196,30 +220,26 @@ static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
     rv = len - total;
 
     if(rv) {
-        /* Move out any already transferred data. */
-        if(c->sendbuf_start) {
-            memmove(c->sendbuf, c->sendbuf + c->sendbuf_start,
-                    c->sendbuf_cur - c->sendbuf_start);
-            c->sendbuf_cur -= c->sendbuf_start;
-            c->sendbuf_start = 0;
+        /* If the client isn't keeping up with what we're sending, cut them off
+           rather than letting the queue grow without bound. */
+        if(client_send_limit &&
+           c->sendq.len + (size_t)rv > client_send_limit) {
+            debug(DBG_WARN, "Disconnecting slow client (guildcard %" PRIu32
+                  "): %d bytes queued\n", c->guildcard, (int)c->sendq.len);
+            return -1;
         }
 
-        /* See if we need to reallocate the buffer. */
-        if(c->sendbuf_cur + rv > c->sendbuf_size) {
-            tmp = realloc(c->sendbuf, c->sendbuf_cur + rv);
-
-            /* If we can't allocate the space, bail. */
-            if(tmp == NULL) {
-                return -1;
-            }
-
-            c->sendbuf_size = c->sendbuf_cur + rv;
-            c->sendbuf = (unsigned char *)tmp;
+        /* If this is the first thing to get buffered, start waiting for the
+           socket to become writable again. */
+        if(!c->sendq.len &&
+           evloop_mod(c->evloop, c->sock, CLIENT_EVLOOP_EVENTS | EVLOOP_WRITE,
+                      c)) {
+            return -1;
         }
 
-        /* Copy what's left of the packet into the output buffer. */
-        memcpy(c->sendbuf + c->sendbuf_cur, sendbuf + total, rv);
-        c->sendbuf_cur += rv;
+        /* Queue up what's left of the packet. */
+        if(sendq_append(&c->sendq, sendbuf + total, (size_t)rv))
+            return -1;
     }
 
     return 0;
@@ -233,8 +253,9 @@ int crypt_send(ship_client_t *c, int len, uint8_t *sendbuf) {
     }
 
     /* If we're logging the client, write into the log */
-    if(c->logfile) {
-        fprint_packet(c->logfile, sendbuf, len, 0);
+    if(c->capture) {
+        pktcap_packet(c->capture, PKTCAP_SENT, c->guildcard, c->version,
+                      sendbuf, len);
     }
 
     /* Encrypt the packet */
@@ -873,7 +894,7 @@ int send_block_list(ship_client_t *c, ship_t *s) {
 static int send_dc_info_reply(ship_client_t *c, const char *msg) {
     uint8_t *sendbuf = get_sendbuf();
     dc_info_reply_pkt *pkt = (dc_info_reply_pkt *)sendbuf;
-    iconv_t ic;
+    tconv_t ic;
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
@@ -901,7 +922,7 @@ static int send_dc_info_reply(ship_client_t *c, const char *msg) {
     out = 65524;
     inptr = (ICONV_CONST char *)msg;
     outptr = pkt->msg;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    tconv(ic, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     out = 65524 - out + 12;
@@ -949,7 +970,7 @@ static int send_bb_info_reply(ship_client_t *c, const char *msg) {
     out = 65520;
     inptr = (ICONV_CONST char *)msg;
     outptr = (char *)pkt->msg;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     out = 65520 - out + 16;
@@ -1570,18 +1591,14 @@ int send_lobby_join(ship_client_t *c, lobby_t *l) {
     return 0;
 }
 
-/* Send a prepared packet to the given client. */
-int send_pkt_dc(ship_client_t *c, const dc_pkt_hdr_t *pkt) {
-    uint8_t *sendbuf = get_sendbuf();
+/* Lay out a packet built with a DC-style header in sendbuf the way the given
+   version of the client expects to see it. Returns the new length. */
+static int build_pkt_dc(uint8_t *sendbuf, const dc_pkt_hdr_t *pkt,
+                        int version) {
     int len = (int)LE16(pkt->pkt_len);
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Adjust the packet for whatever version */
-    if(c->version == CLIENT_VERSION_PC) {
+    if(version == CLIENT_VERSION_PC) {
         pc_pkt_hdr_t *hdr = (pc_pkt_hdr_t *)sendbuf;
 
         hdr->pkt_len = pkt->pkt_len;
@@ -1590,7 +1607,7 @@ int send_pkt_dc(ship_client_t *c, const dc_pkt_hdr_t *pkt) {
 
         memcpy(sendbuf + 4, ((uint8_t *)pkt) + 4, len - 4);
     }
-    else if(c->version == CLIENT_VERSION_BB) {
+    else if(version == CLIENT_VERSION_BB) {
         bb_pkt_hdr_t *hdr = (bb_pkt_hdr_t *)sendbuf;
 
         hdr->pkt_len = LE16((len + 4));
@@ -1604,25 +1621,19 @@ int send_pkt_dc(ship_client_t *c, const dc_pkt_hdr_t *pkt) {
         memcpy(sendbuf, pkt, len);
     }
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-/* Send a prepared packet to the given client. */
-int send_pkt_bb(ship_client_t *c, const bb_pkt_hdr_t *pkt) {
-    uint8_t *sendbuf = get_sendbuf();
+/* Same as above, but for a packet built with a Blue Burst header. */
+static int build_pkt_bb(uint8_t *sendbuf, const bb_pkt_hdr_t *pkt,
+                        int version) {
     int len = (int)LE16(pkt->pkt_len);
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Figure out what to do based on version... */
-    if(c->version == CLIENT_VERSION_BB) {
+    if(version == CLIENT_VERSION_BB) {
         memcpy(sendbuf, pkt, len);
     }
-    else if(c->version == CLIENT_VERSION_PC) {
+    else if(version == CLIENT_VERSION_PC) {
         pc_pkt_hdr_t *hdr = (pc_pkt_hdr_t *)sendbuf;
 
         hdr->pkt_len = LE16(len - 4);
@@ -1643,10 +1654,124 @@ int send_pkt_bb(ship_client_t *c, const bb_pkt_hdr_t *pkt) {
         len -= 4;
     }
 
+    return len;
+}
+
+/* Send a prepared packet to the given client. */
+int send_pkt_dc(ship_client_t *c, const dc_pkt_hdr_t *pkt) {
+    uint8_t *sendbuf = get_sendbuf();
+    int len;
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf) {
+        return -1;
+    }
+
+    len = build_pkt_dc(sendbuf, pkt, c->version);
+
+    /* Send it away */
+    return crypt_send(c, len, sendbuf);
+}
+
+/* Send a prepared packet to the given client. */
+int send_pkt_bb(ship_client_t *c, const bb_pkt_hdr_t *pkt) {
+    uint8_t *sendbuf = get_sendbuf();
+    int len;
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf) {
+        return -1;
+    }
+
+    len = build_pkt_bb(sendbuf, pkt, c->version);
+
     /* Send it away */
     return crypt_send(c, len, sendbuf);
 }
 
+/* Which of the three header layouts a client uses. */
+static inline int pkt_layout(ship_client_t *c) {
+    if(c->version == CLIENT_VERSION_PC)
+        return 1;
+    else if(c->version == CLIENT_VERSION_BB)
+        return 2;
+
+    return 0;
+}
+
+static int send_pkt_multi(ship_client_t **cl, int count, const void *pkt,
+                          int len, int bb) {
+    uint8_t *sendbuf = get_sendbuf();
+    uint8_t *var, *out;
+    int i, layout, vlen = 0, built;
+
+    if(!sendbuf)
+        return -1;
+
+    /* The first half of the sendbuf holds the packet laid out for whichever
+       header style is being sent at the moment, and each client's copy gets
+       encrypted in the second half. If the packet is too big for that, just
+       send it to everyone the normal way. */
+    if(len + 8 > 32768) {
+        for(i = 0; i < count; ++i) {
+            if(!cl[i])
+                continue;
+
+            if(bb)
+                send_pkt_bb(cl[i], (const bb_pkt_hdr_t *)pkt);
+            else
+                send_pkt_dc(cl[i], (const dc_pkt_hdr_t *)pkt);
+        }
+
+        return 0;
+    }
+
+    var = sendbuf;
+    out = sendbuf + 32768;
+
+    for(layout = 0; layout < 3; ++layout) {
+        built = 0;
+
+        for(i = 0; i < count; ++i) {
+            if(!cl[i] || pkt_layout(cl[i]) != layout)
+                continue;
+
+            /* Build this layout of the packet the first time someone needs it,
+               padded out the way crypt_send would. */
+            if(!built) {
+                if(bb)
+                    vlen = build_pkt_bb(var, (const bb_pkt_hdr_t *)pkt,
+                                        cl[i]->version);
+                else
+                    vlen = build_pkt_dc(var, (const dc_pkt_hdr_t *)pkt,
+                                        cl[i]->version);
+
+                while(vlen & (cl[i]->hdr_size - 1)) {
+                    var[vlen++] = 0;
+                }
+
+                built = 1;
+            }
+
+            /* Each client has its own key, so each one needs its own copy to
+               encrypt. */
+            memcpy(out, var, vlen);
+            crypt_send(cl[i], vlen, out);
+        }
+    }
+
+    return 0;
+}
+
+/* Send a prepared packet to a group of clients at once. */
+int send_pkt_dc_multi(ship_client_t **c, int count, const dc_pkt_hdr_t *pkt) {
+    return send_pkt_multi(c, count, pkt, (int)LE16(pkt->pkt_len), 0);
+}
+
+int send_pkt_bb_multi(ship_client_t **c, int count, const bb_pkt_hdr_t *pkt) {
+    return send_pkt_multi(c, count, pkt, (int)LE16(pkt->pkt_len), 1);
+}
+
 /* Send a packet to all clients in the lobby when a new player joins. */
 static int send_dcnte_lobby_add_player(lobby_t *l, ship_client_t *c,
                                        ship_client_t *nc) {
@@ -2087,7 +2212,7 @@ static int send_dc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
                               const char *msg, const char *cmsg) {
     uint8_t *sendbuf = get_sendbuf();
     dc_chat_pkt *pkt = (dc_chat_pkt *)sendbuf;
-    iconv_t ic;
+    tconv_t ic;
     char tm[strlen(msg) + 32];
     size_t in, out, len;
     ICONV_CONST char *inptr;
@@ -2153,7 +2278,7 @@ static int send_dc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     out = 65520;
     inptr = tm;
     outptr = pkt->msg;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    tconv(ic, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = 65520 - out;
@@ -2215,7 +2340,7 @@ static int send_pc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     out = 65520;
     inptr = tm;
     outptr = pkt->msg;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = 65520 - out;
@@ -2277,7 +2402,7 @@ static int send_bb_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     out = 65520;
     inptr = tm;
     outptr = (char *)pkt->msg;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = (strlen16(pkt->msg) << 1) + 0x10;
@@ -2382,7 +2507,7 @@ static int send_dc_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
         out = 65520;
         inptr = (char *)&s->pl->bb.character.name[2];
         outptr = pkt->msg;
-        iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
+        tconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
     if(!(c->flags & CLIENT_FLAG_IS_NTE)) {
         /* Add the separator */
@@ -2407,9 +2532,9 @@ static int send_dc_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
 
     /* Convert the message to the appropriate encoding. */
     if((c->flags & CLIENT_FLAG_IS_NTE) || msg[1] == LE16('J'))
-        iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+        tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
     else
-        iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+        tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = 65520 - out;
@@ -3223,7 +3348,7 @@ static int send_dcnte_txt(ship_client_t *c, const char *fmt, va_list args) {
     uint8_t *sendbuf = get_sendbuf();
     dc_chat_pkt *pkt = (dc_chat_pkt *)sendbuf;
     int len;
-    iconv_t ic;
+    tconv_t ic;
     char tm[512];
     size_t in, out;
     int i;
@@ -3271,7 +3396,7 @@ static int send_dcnte_txt(ship_client_t *c, const char *fmt, va_list args) {
     out = 65520;
     inptr = tm;
     outptr = pkt->msg;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    tconv(ic, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = 65520 - out;
@@ -3296,7 +3421,7 @@ static int send_dc_message(ship_client_t *c, uint16_t type, const char *fmt,
     uint8_t *sendbuf = get_sendbuf();
     dc_chat_pkt *pkt = (dc_chat_pkt *)sendbuf;
     int len;
-    iconv_t ic;
+    tconv_t ic;
     char tm[512];
     size_t in, out;
     ICONV_CONST char *inptr;
@@ -3344,7 +3469,7 @@ static int send_dc_message(ship_client_t *c, uint16_t type, const char *fmt,
     out = 65520;
     inptr = tm;
     outptr = pkt->msg;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    tconv(ic, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = 65520 - out;
@@ -3410,7 +3535,7 @@ static int send_bb_message(ship_client_t *c, uint16_t type, const char *fmt,
     out = 65520;
     inptr = tm;
     outptr = (char *)pkt->msg;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = 65520 - out + 0x10;
@@ -4566,7 +4691,7 @@ static int send_dc_message_box(ship_client_t *c, const char *fmt,
     uint8_t *sendbuf = get_sendbuf();
     dc_msg_box_pkt *pkt = (dc_msg_box_pkt *)sendbuf;
     int len;
-    iconv_t ic;
+    tconv_t ic;
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
@@ -4617,7 +4742,7 @@ static int send_dc_message_box(ship_client_t *c, const char *fmt,
     out = 65500;
     inptr = tm;
     outptr = (char *)pkt->msg;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    tconv(ic, &inptr, &in, &outptr, &out);
     len = 65500 - out;
 
     /* Add any padding needed */
@@ -4740,12 +4865,12 @@ static int send_dc_quest_categories(ship_client_t *c, int lang) {
         outptr = &pkt->entries[entries].name[2];
 
         if(lang == CLIENT_LANG_JAPANESE) {
-            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+            tconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
             pkt->entries[entries].name[0] = '\t';
             pkt->entries[entries].name[1] = 'J';
         }
         else {
-            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+            tconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
             pkt->entries[entries].name[0] = '\t';
             pkt->entries[entries].name[1] = 'E';
         }
@@ -4756,12 +4881,12 @@ static int send_dc_quest_categories(ship_client_t *c, int lang) {
         outptr = &pkt->entries[entries].desc[2];
 
         if(lang == CLIENT_LANG_JAPANESE) {
-            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+            tconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
             pkt->entries[entries].desc[0] = '\t';
             pkt->entries[entries].desc[1] = 'J';
         }
         else {
-            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+            tconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
             pkt->entries[entries].desc[0] = '\t';
             pkt->entries[entries].desc[1] = 'E';
         }
@@ -4846,13 +4971,13 @@ static int send_pc_quest_categories(ship_client_t *c, int lang) {
         out = 64;
         inptr = qlist->cats[i].name;
         outptr = (char *)pkt->entries[entries].name;
-        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+        tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
         in = 112;
         out = 224;
         inptr = qlist->cats[i].desc;
         outptr = (char *)pkt->entries[entries].desc;
-        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+        tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
         ++entries;
         len += 0x128;
@@ -4925,13 +5050,13 @@ static int send_bb_quest_categories(ship_client_t *c, int lang) {
         out = 64;
         inptr = qlist->cats[i].name;
         outptr = (char *)pkt->entries[entries].name;
-        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+        tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
         in = 112;
         out = 244;
         inptr = qlist->cats[i].desc;
         outptr = (char *)pkt->entries[entries].desc;
-        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+        tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
         ++entries;
         len += 0x13C;
@@ -5082,12 +5207,12 @@ static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
             outptr = &pkt->entries[entries].name[2];
 
             if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
                 pkt->entries[entries].name[0] = '\t';
                 pkt->entries[entries].name[1] = 'J';
             }
             else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
                 pkt->entries[entries].name[0] = '\t';
                 pkt->entries[entries].name[1] = 'E';
             }
@@ -5098,12 +5223,12 @@ static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
             outptr = &pkt->entries[entries].desc[2];
 
             if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
                 pkt->entries[entries].desc[0] = '\t';
                 pkt->entries[entries].desc[1] = 'J';
             }
             else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
                 pkt->entries[entries].desc[0] = '\t';
                 pkt->entries[entries].desc[1] = 'E';
             }
@@ -5238,13 +5363,13 @@ static int send_pc_quest_list(ship_client_t *c, int cn, int lang) {
             out = 64;
             inptr = quest->name;
             outptr = (char *)pkt->entries[entries].name;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+            tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
             in = 112;
             out = 224;
             inptr = quest->desc;
             outptr = (char *)pkt->entries[entries].desc;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+            tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
             ++entries;
             len += 0x128;
@@ -5396,12 +5521,12 @@ static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
             outptr = &pkt->entries[entries].name[2];
 
             if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
                 pkt->entries[entries].name[0] = '\t';
                 pkt->entries[entries].name[1] = 'J';
             }
             else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
                 pkt->entries[entries].name[0] = '\t';
                 pkt->entries[entries].name[1] = 'E';
             }
@@ -5412,12 +5537,12 @@ static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
             outptr = &pkt->entries[entries].desc[2];
 
             if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
                 pkt->entries[entries].desc[0] = '\t';
                 pkt->entries[entries].desc[1] = 'J';
             }
             else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
                 pkt->entries[entries].desc[0] = '\t';
                 pkt->entries[entries].desc[1] = 'E';
             }
@@ -5553,13 +5678,13 @@ static int send_bb_quest_list(ship_client_t *c, int cn, int lang) {
             out = 64;
             inptr = quest->name;
             outptr = (char *)pkt->entries[entries].name;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+            tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
             in = 112;
             out = 244;
             inptr = quest->desc;
             outptr = (char *)pkt->entries[entries].desc;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+            tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
             ++entries;
             len += 0x13C;
@@ -5632,12 +5757,12 @@ static int send_dc_quest_info(ship_client_t *c, sylverant_quest_t *q, int l) {
     outptr = &pkt->msg[2];
 
     if(l == CLIENT_LANG_JAPANESE) {
-        iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+        tconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
         pkt->msg[0] = '\t';
         pkt->msg[1] = 'J';
     }
     else {
-        iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+        tconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
         pkt->msg[0] = '\t';
         pkt->msg[1] = 'E';
     }
@@ -5671,7 +5796,7 @@ static int send_pc_quest_info(ship_client_t *c, sylverant_quest_t *q, int l) {
     inptr = q->long_desc;
     out = 0x248;
     outptr = pkt->msg;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Send it away */
     return crypt_send(c, PC_QUEST_INFO_LENGTH, sendbuf);
@@ -5702,7 +5827,7 @@ static int send_bb_quest_info(ship_client_t *c, sylverant_quest_t *q, int l) {
     inptr = q->long_desc;
     out = 0x248;
     outptr = pkt->msg;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Send it away */
     return crypt_send(c, BB_QUEST_INFO_LENGTH, sendbuf);
@@ -5781,758 +5906,337 @@ int send_quest_info(lobby_t *l, uint32_t qid, int lang) {
     return 0;
 }
 
-/* Send a quest to everyone in a lobby. */
-static int send_dcv1_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                           int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    dc_quest_file_pkt *file = (dc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
-    }
-
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-            version_codes[CLIENT_VERSION_DCV1], language_codes[lang],
-            q->prefix);
-
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
+/* Read an entire quest file into memory. */
+static uint8_t *read_quest_file(const char *fn, uint32_t *len) {
+    FILE *fp;
+    long sz;
+    uint8_t *rv;
 
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
+    if(!(fp = fopen(fn, "rb"))) {
+        debug(DBG_WARN, "Cannot open quest file %s: %s\n", fn,
               strerror(errno));
-        return -1;
+        return NULL;
     }
 
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
+    /* Figure out how long the file is */
+    fseek(fp, 0, SEEK_END);
+    sz = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
 
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
+    if(sz < 0 || !(rv = (uint8_t *)malloc(sz + 1))) {
+        debug(DBG_WARN, "Cannot read quest file %s: %s\n", fn,
               strerror(errno));
-        fclose(bin);
-        return -1;
+        fclose(fp);
+        return NULL;
     }
 
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
+    if(fread(rv, 1, sz, fp) != (size_t)sz) {
+        debug(DBG_WARN, "Error reading quest file %s: %s\n", fn,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
+        free(rv);
+        fclose(fp);
+        return NULL;
     }
 
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
+    fclose(fp);
+    *len = (uint32_t)sz;
+    return rv;
+}
 
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
+/* Fill in the file info packet for a .bin/.dat quest file. */
+static void build_quest_file_pkt(uint8_t *buf, int ver, sylverant_quest_t *q,
+                                 const char *ext, uint32_t len) {
+    dc_quest_file_pkt *dc = (dc_quest_file_pkt *)buf;
+    pc_quest_file_pkt *pc = (pc_quest_file_pkt *)buf;
+    gc_quest_file_pkt *gc = (gc_quest_file_pkt *)buf;
 
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
+    switch(ver) {
+        case CLIENT_VERSION_DCV1:
+        case CLIENT_VERSION_DCV2:
+            memset(dc, 0, sizeof(dc_quest_file_pkt));
+            sprintf(dc->name, "PSO/%s", q->name);
+            dc->hdr.pkt_type = QUEST_FILE_TYPE;
+            dc->hdr.flags = 0x02; /* ??? */
+            dc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            sprintf(dc->filename, "%s.%s", q->prefix, ext);
+            dc->length = LE32(len);
+            break;
 
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
+        case CLIENT_VERSION_PC:
+            memset(pc, 0, sizeof(pc_quest_file_pkt));
+            sprintf(pc->name, "PSO/%s", q->name);
+            pc->hdr.pkt_type = QUEST_FILE_TYPE;
+            pc->hdr.flags = 0x00;
+            pc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            sprintf(pc->filename, "%s.%s", q->prefix, ext);
+            pc->length = LE32(len);
+            pc->flags = 0x0002;
+            break;
 
-        ++chunknum;
+        case CLIENT_VERSION_GC:
+            memset(gc, 0, sizeof(gc_quest_file_pkt));
+            sprintf(gc->name, "PSO/%s", q->name);
+            gc->hdr.pkt_type = QUEST_FILE_TYPE;
+            gc->hdr.flags = 0x00;
+            gc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            sprintf(gc->filename, "%s.%s", q->prefix, ext);
+            gc->length = LE32(len);
+            gc->flags = 0x0002;
+            break;
     }
-
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
 }
 
-static int send_dcv2_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                           int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    dc_quest_file_pkt *file = (dc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
+/* Fill in one chunk packet of a .bin/.dat quest file. */
+static void build_quest_chunk_pkt(uint8_t *buf, int ver, sylverant_quest_t *q,
+                                  const char *ext, int num,
+                                  const uint8_t *data, uint32_t amt) {
+    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)buf;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
-    }
+    memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
 
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
-        sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
+    if(ver == CLIENT_VERSION_PC) {
+        chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
+        chunk->hdr.pc.flags = (uint8_t)num;
+        chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
     }
     else {
-        sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-                version_codes[CLIENT_VERSION_DCV1], language_codes[lang],
-                q->prefix);
-    }
-
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
-
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
+        chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
+        chunk->hdr.dc.flags = (uint8_t)num;
+        chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
+    sprintf(chunk->filename, "%s.%s", q->prefix, ext);
+    memcpy(chunk->data, data, amt);
+    chunk->length = LE32(amt);
 }
 
-static int send_pc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                         int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    pc_quest_file_pkt *file = (pc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
-    }
-
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
-        sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
-    else {
-        sprintf(fn_base, "%s/%s-%s/%sv1", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
+/* Build all the packets needed to send a .bin/.dat quest. Each quest has two
+   files: a .dat file and a .bin file. A file packet goes out for each of them,
+   followed by the chunks of the two files, interleaved. */
+static quest_cache_t *build_bindat_quest(sylverant_quest_t *q, int ver,
+                                         const char *fn_base) {
+    char filename[256];
+    uint8_t *bin, *dat, *ptr;
+    uint32_t binlen, datlen, binoff = 0, datoff = 0, amt;
+    int binchunks, datchunks, chunknum, i = 0;
+    quest_cache_t *rv;
 
     sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
+    if(!(bin = read_quest_file(filename, &binlen)))
+        return NULL;
 
     sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
+    if(!(dat = read_quest_file(filename, &datlen))) {
+        free(bin);
+        return NULL;
     }
 
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(pc_quest_file_pkt));
+    /* The last chunk of each file is always short (even if it has to be
+       empty), since that's how the client knows the file is done. */
+    binchunks = binlen / 0x400 + 1;
+    datchunks = datlen / 0x400 + 1;
 
-    sprintf(file->name, "PSO/%s", q->name);
+    rv = quest_cache_alloc(2 + binchunks + datchunks,
+                           2 * DC_QUEST_FILE_LENGTH +
+                           (binchunks + datchunks) * DC_QUEST_CHUNK_LENGTH);
 
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-    file->flags = 0x0002;
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
+    if(!rv) {
+        debug(DBG_WARN, "Cannot allocate quest cache for %s\n", fn_base);
+        free(bin);
+        free(dat);
+        return NULL;
     }
 
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(pc_quest_file_pkt));
+    ptr = rv->data;
 
-    sprintf(file->name, "PSO/%s", q->name);
+    /* Start with the file info packets, .dat file first. */
+    build_quest_file_pkt(ptr, ver, q, "dat", datlen);
+    rv->lens[i++] = DC_QUEST_FILE_LENGTH;
+    ptr += DC_QUEST_FILE_LENGTH;
 
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-    file->flags = 0x0002;
+    build_quest_file_pkt(ptr, ver, q, "bin", binlen);
+    rv->lens[i++] = DC_QUEST_FILE_LENGTH;
+    ptr += DC_QUEST_FILE_LENGTH;
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.pc.flags = (uint8_t)chunknum;
-            chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
+    /* Now the chunks of the files, interleaved. */
+    for(chunknum = 0; chunknum < binchunks || chunknum < datchunks;
+        ++chunknum) {
+        if(chunknum < datchunks) {
+            amt = datlen - datoff > 0x400 ? 0x400 : datlen - datoff;
+            build_quest_chunk_pkt(ptr, ver, q, "dat", chunknum, dat + datoff,
+                                  amt);
+            rv->lens[i++] = DC_QUEST_CHUNK_LENGTH;
+            ptr += DC_QUEST_CHUNK_LENGTH;
+            datoff += amt;
         }
 
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.pc.flags = (uint8_t)chunknum;
-            chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
+        if(chunknum < binchunks) {
+            amt = binlen - binoff > 0x400 ? 0x400 : binlen - binoff;
+            build_quest_chunk_pkt(ptr, ver, q, "bin", chunknum, bin + binoff,
+                                  amt);
+            rv->lens[i++] = DC_QUEST_CHUNK_LENGTH;
+            ptr += DC_QUEST_CHUNK_LENGTH;
+            binoff += amt;
         }
-
-        ++chunknum;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
+    free(bin);
+    free(dat);
+    return rv;
 }
 
-static int send_gc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                         int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    gc_quest_file_pkt *file = (gc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
+/* A .qst file is already a list of packets, so all that needs to be done is to
+   split it up into pieces that fit in the sendbuf. The size of the sendbuf is a
+   multiple of any header size, so none of the pieces (other than the last) will
+   end in the middle of a block of the encryption. */
+static quest_cache_t *build_qst_quest(const char *filename) {
+    uint8_t *buf;
+    uint32_t len, left, amt;
+    int count, i;
+    quest_cache_t *rv;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
-    }
+    if(!(buf = read_quest_file(filename, &len)))
+        return NULL;
 
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
-        sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
-    else {
-        sprintf(fn_base, "%s/%s-%s/%sv1", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
+    count = (len + 65535) / 65536;
+    if(!(rv = quest_cache_alloc(count, len))) {
+        debug(DBG_WARN, "Cannot allocate quest cache for %s\n", filename);
+        free(buf);
+        return NULL;
     }
 
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
+    memcpy(rv->data, buf, len);
+    free(buf);
 
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
+    for(i = 0, left = len; left; ++i, left -= amt) {
+        amt = left > 65536 ? 65536 : left;
+        rv->lens[i] = amt;
     }
 
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
+    return rv;
+}
 
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
+/* Build the packets for sending the given quest to the given client. */
+static quest_cache_t *build_quest(ship_client_t *c, quest_map_elem_t *qm,
+                                  int v1, int lang, int ver) {
+    char fn[256];
+    sylverant_quest_t *q;
 
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
+    /* Figure out what files we're going to send. */
+    if(qm->qptr[ver][lang]->format == SYLVERANT_QUEST_QST) {
+        q = qm->qptr[ver][lang];
 
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(gc_quest_file_pkt));
+        if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
+            sprintf(fn, "%s/%s-%s/%s.qst", ship->cfg->quests_dir,
+                    version_codes[c->version], language_codes[lang],
+                    q->prefix);
+        }
+        else {
+            switch(c->version) {
+                case CLIENT_VERSION_DCV1:
+                case CLIENT_VERSION_DCV2:
+                    sprintf(fn, "%s/%s-%s/%s.qst", ship->cfg->quests_dir,
+                            version_codes[CLIENT_VERSION_DCV1],
+                            language_codes[lang], q->prefix);
+                    break;
 
-    sprintf(file->name, "PSO/%s", q->name);
+                case CLIENT_VERSION_PC:
+                case CLIENT_VERSION_GC:
+                    sprintf(fn, "%s/%s-%s/%sv1.qst", ship->cfg->quests_dir,
+                            version_codes[c->version], language_codes[lang],
+                            q->prefix);
+                    break;
 
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-    file->flags = 0x0002;
+                default:
+                    return NULL;
+            }
+        }
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
+        return build_qst_quest(fn);
     }
 
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(gc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
+    if(!(q = qm->qptr[c->version][lang]))
+        return NULL;
 
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-    file->flags = 0x0002;
+    switch(ver) {
+        case CLIENT_VERSION_DCV1:
+            sprintf(fn, "%s/%s-%s/%s", ship->cfg->quests_dir,
+                    version_codes[CLIENT_VERSION_DCV1], language_codes[lang],
+                    q->prefix);
+            break;
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
+        case CLIENT_VERSION_DCV2:
+            if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
+                sprintf(fn, "%s/%s-%s/%s", ship->cfg->quests_dir,
+                        version_codes[c->version], language_codes[lang],
+                        q->prefix);
             }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
+            else {
+                sprintf(fn, "%s/%s-%s/%s", ship->cfg->quests_dir,
+                        version_codes[CLIENT_VERSION_DCV1],
+                        language_codes[lang], q->prefix);
             }
-        }
+            break;
 
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
+        case CLIENT_VERSION_PC:
+        case CLIENT_VERSION_GC:
+            if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
+                sprintf(fn, "%s/%s-%s/%s", ship->cfg->quests_dir,
+                        version_codes[c->version], language_codes[lang],
+                        q->prefix);
             }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
+            else {
+                sprintf(fn, "%s/%s-%s/%sv1", ship->cfg->quests_dir,
+                        version_codes[c->version], language_codes[lang],
+                        q->prefix);
             }
-        }
+            break;
 
-        ++chunknum;
+        case CLIENT_VERSION_EP3:    /* XXXX */
+        default:
+            return NULL;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
+    return build_bindat_quest(q, ver, fn);
 }
 
-static int send_qst_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                          int lang, int ver) {
-    char filename[256];
-    FILE *fp;
-    long len;
-    size_t read;
+/* Send a quest to a client, reading it in from disk only if nobody else has
+   had it sent to them in the same way since the quests were last loaded. */
+static int send_quest_files(ship_client_t *c, quest_map_elem_t *qm, int v1,
+                            int lang, int ver) {
     uint8_t *sendbuf = get_sendbuf();
-    sylverant_quest_t *q = qm->qptr[ver][lang];
+    quest_cache_t *qc;
+    uint8_t *ptr;
+    int i;
 
     /* Make sure we got the sendbuf and the quest */
-    if(!sendbuf || !q)
+    if(!sendbuf || !qm->qptr[ver][lang])
         return -1;
 
-    /* Figure out what file we're going to send. */
-    if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
-        sprintf(filename, "%s/%s-%s/%s.qst", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
-    else {
-        switch(c->version) {
-            case CLIENT_VERSION_DCV1:
-            case CLIENT_VERSION_DCV2:
-                sprintf(filename, "%s/%s-%s/%s.qst", ship->cfg->quests_dir,
-                        version_codes[CLIENT_VERSION_DCV1],
-                        language_codes[lang], q->prefix);
-                break;
+    pthread_mutex_lock(&qm->cache_lock);
 
-            case CLIENT_VERSION_PC:
-            case CLIENT_VERSION_GC:
-                sprintf(filename, "%s/%s-%s/%sv1.qst", ship->cfg->quests_dir,
-                        version_codes[c->version], language_codes[lang],
-                        q->prefix);
-                break;
+    if(!(qc = qm->cache[c->version][lang][v1])) {
+        if(!(qc = build_quest(c, qm, v1, lang, ver))) {
+            pthread_mutex_unlock(&qm->cache_lock);
+            return -1;
         }
-    }
-
-    fp = fopen(filename, "rb");
 
-    if(!fp) {
-        debug(DBG_WARN, "Cannot open qst file %s: %s\n", filename,
-              strerror(errno));
-        return -1;
+        qm->cache[c->version][lang][v1] = qc;
     }
 
-    /* Figure out how long the file is. */
-    fseek(fp, 0, SEEK_END);
-    len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    /* Copy the file (in chunks if necessary) to the sendbuf to actually send
-       away. */
-    while(len) {
-        read = fread(sendbuf, 1, 65536, fp);
-
-        /* If we can't read from the file, bail. */
-        if(!read) {
-            debug(DBG_WARN, "Error reading qst file %s: %s\n", filename,
-                  strerror(errno));
-            fclose(fp);
-            return -2;
-        }
+    pthread_mutex_unlock(&qm->cache_lock);
 
-        /* Make sure we read up to a header-size boundary. */
-        if((read & (c->hdr_size - 1)) && !feof(fp)) {
-            long amt = (read & (c->hdr_size - 1));
+    /* The cached packets are shared, so copy each one over to be encrypted. */
+    for(i = 0, ptr = qc->data; i < qc->count; ptr += qc->lens[i++]) {
+        memcpy(sendbuf, ptr, qc->lens[i]);
 
-            fseek(fp, -amt, SEEK_CUR);
-            read -= amt;
-        }
-
-        /* Send this chunk away. */
-        if(crypt_send(c, read, sendbuf)) {
-            debug(DBG_WARN, "Error sending qst file %s: %s\n", filename,
+        if(crypt_send(c, qc->lens[i], sendbuf)) {
+            debug(DBG_WARN, "Error sending quest %" PRIu32 ": %s\n", qm->qid,
                   strerror(errno));
-            fclose(fp);
             return -3;
         }
-
-        len -= read;
     }
 
-    /* We're finished. */
-    fclose(fp);
     return 0;
 }
 
@@ -6603,36 +6307,12 @@ int send_quest(lobby_t *l, uint32_t qid, int lc) {
             if(c->version == CLIENT_VERSION_DCV1)
                 c->autoreply_len = l->num_clients - 1;
 
-            if(q->format == SYLVERANT_QUEST_BINDAT) {
-                /* Call the appropriate function. */
-                switch(ver) {
-                    case CLIENT_VERSION_DCV1:
-                        rv = send_dcv1_quest(c, elem, v1, lang);
-                        break;
-
-                    case CLIENT_VERSION_DCV2:
-                        rv = send_dcv2_quest(c, elem, v1, lang);
-                        break;
-
-                    case CLIENT_VERSION_PC:
-                        rv = send_pc_quest(c, elem, v1, lang);
-                        break;
-
-                    case CLIENT_VERSION_GC:
-                        rv = send_gc_quest(c, elem, v1, lang);
-                        break;
-
-                    case CLIENT_VERSION_EP3:    /* XXXX */
-                    default:
-                        return -1;
-                }
-            }
-            else if(q->format == SYLVERANT_QUEST_QST) {
-                rv = send_qst_quest(c, elem, v1, lang, ver);
-            }
-            else {
+            /* Make sure we know how to send this type of quest. */
+            if(q->format != SYLVERANT_QUEST_QST &&
+               (q->format != SYLVERANT_QUEST_BINDAT || ver > CLIENT_VERSION_GC))
                 return -1;
-            }
+
+            rv = send_quest_files(c, elem, v1, lang, ver);
 
             if(rv) {
                 send_message_box(c, "Error reading quest file!\nPlease report "
@@ -6710,36 +6390,12 @@ int send_quest_one(lobby_t *l, ship_client_t *c, uint32_t qid, int lc) {
     if(c->version == CLIENT_VERSION_DCV1)
         c->autoreply_len = l->num_clients - 1;
 
-    if(q->format == SYLVERANT_QUEST_BINDAT) {
-        /* Call the appropriate function. */
-        switch(ver) {
-            case CLIENT_VERSION_DCV1:
-                rv = send_dcv1_quest(c, elem, v1, lang);
-                break;
-
-            case CLIENT_VERSION_DCV2:
-                rv = send_dcv2_quest(c, elem, v1, lang);
-                break;
-
-            case CLIENT_VERSION_PC:
-                rv = send_pc_quest(c, elem, v1, lang);
-                break;
-
-            case CLIENT_VERSION_GC:
-                rv = send_gc_quest(c, elem, v1, lang);
-                break;
-
-            case CLIENT_VERSION_EP3:    /* XXXX */
-            default:
-                return -1;
-        }
-    }
-    else if(q->format == SYLVERANT_QUEST_QST) {
-        rv = send_qst_quest(c, elem, v1, lang, ver);
-    }
-    else {
+    /* Make sure we know how to send this type of quest. */
+    if(q->format != SYLVERANT_QUEST_QST &&
+       (q->format != SYLVERANT_QUEST_BINDAT || ver > CLIENT_VERSION_GC))
         return -1;
-    }
+
+    rv = send_quest_files(c, elem, v1, lang, ver);
 
     if(rv) {
         send_message_box(c, "Error reading quest file!\nPlease report "
@@ -6811,7 +6467,7 @@ static int send_pc_lobby_name(ship_client_t *c, lobby_t *l) {
     out = 65532;
     inptr = l->name;
     outptr = pkt->msg;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = 65532 - out;
@@ -6851,7 +6507,7 @@ static int send_bb_lobby_name(ship_client_t *c, lobby_t *l) {
     out = 65532;
     inptr = l->name;
     outptr = pkt->msg;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Figure out how long the new string is. */
     len = 65532 - out;
@@ -8126,7 +7782,7 @@ static int send_pc_simple_mail_dc(ship_client_t *c, dc_simple_mail_pkt *p) {
     out = 0x20;
     inptr = p->name;
     outptr = (char *)pkt->name;
-    iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
 
     in = 0x90;
     out = 0x120;
@@ -8134,10 +7790,10 @@ static int send_pc_simple_mail_dc(ship_client_t *c, dc_simple_mail_pkt *p) {
     outptr = pkt->stuff;
 
     if(p->stuff[1] == 'J') {
-        iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+        tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
     }
     else {
-        iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+        tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
     }
 
     /* This is a BIT hackish (just a bit...). */
@@ -8180,7 +7836,7 @@ static int send_dc_simple_mail_pc(ship_client_t *c, pc_simple_mail_pkt *p) {
     out = 0x10;
     inptr = (char *)p->name;
     outptr = pkt->name;
-    iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
+    tconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
     /* Convert the first instance of text. */
     in = 0x120;
@@ -8189,10 +7845,10 @@ static int send_dc_simple_mail_pc(ship_client_t *c, pc_simple_mail_pkt *p) {
     outptr = pkt->stuff;
 
     if(p->stuff[2] == 'J') {
-        iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+        tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
     }
     else {
-        iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+        tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
     }
 
     /* This is a BIT hackish (just a bit...). */
@@ -8262,7 +7918,7 @@ static int send_dc_simple_mail_bb(ship_client_t *c, bb_simple_mail_pkt *p) {
     out = 0x10;
     inptr = (char *)&p->name[2];
     outptr = pkt->name;
-    iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
+    tconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
     /* Convert the text. */
     in = 0x158;
@@ -8271,10 +7927,10 @@ static int send_dc_simple_mail_bb(ship_client_t *c, bb_simple_mail_pkt *p) {
     outptr = pkt->stuff;
 
     if(p->message[1] == LE16('J')) {
-        iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+        tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
     }
     else {
-        iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+        tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
     }
 
     /* Send it away. */
@@ -8314,7 +7970,7 @@ static int send_bb_simple_mail_dc(ship_client_t *c, dc_simple_mail_pkt *p) {
     out = 0x1C;
     inptr = p->name;
     outptr = (char *)&pkt->name[2];
-    iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
 
     in = 0x90;
     out = 0x158;
@@ -8322,10 +7978,10 @@ static int send_bb_simple_mail_dc(ship_client_t *c, dc_simple_mail_pkt *p) {
     outptr = (char *)pkt->message;
 
     if(p->stuff[1] == 'J') {
-        iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+        tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
     }
     else {
-        iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+        tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
     }
 
     /* Fill in the date/time */
@@ -8338,7 +7994,7 @@ static int send_bb_simple_mail_dc(ship_client_t *c, dc_simple_mail_pkt *p) {
     out = 40;
     inptr = timestamp;
     outptr = (char *)pkt->timestamp;
-    iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+    tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Send it away. */
     return crypt_send(c, BB_SIMPLE_MAIL_LENGTH, sendbuf);
@@ -8610,7 +8266,7 @@ static int send_gc_infoboard(ship_client_t *c, lobby_t *l) {
                         out = 16;
                         inptr = (char *)&c2->pl->bb.character.name[2];
                         outptr = pkt->entries[entries].name;
-                        iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
+                        tconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
                         /* Convert the info */
                         in = 0x158;
@@ -8619,10 +8275,10 @@ static int send_gc_infoboard(ship_client_t *c, lobby_t *l) {
                         outptr = pkt->entries[entries].msg;
 
                         if(c2->pl->bb.infoboard[1] == LE16('J')) {
-                            iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                            tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
                         }
                         else {
-                            iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                            tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
                         }
 
                         break;
@@ -8686,7 +8342,7 @@ static int send_bb_infoboard(ship_client_t *c, lobby_t *l) {
                         inptr = c2->pl->v1.name;
                         outptr = (char *)&pkt->entries[entries].name[2];
 
-                        iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                        tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
 
                         /* Convert the info */
                         in = 0xAC;
@@ -8695,10 +8351,10 @@ static int send_bb_infoboard(ship_client_t *c, lobby_t *l) {
                         outptr = (char *)pkt->entries[entries].msg;
 
                         if(c2->infoboard[1] == 'J') {
-                            iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                            tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
                         }
                         else {
-                            iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                            tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
                         }
                         break;
                     }
@@ -8875,10 +8531,10 @@ static void copy_c_rank_dc(dc_c_rank_update_pkt *pkt, int entry,
             outptr = pkt->entries[entry].grave_team;
 
             if(s->pl->pc.c_rank.part.grave_team[1] == LE16('J')) {
-                iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
             }
 
             /* Convert the message */
@@ -8888,10 +8544,10 @@ static void copy_c_rank_dc(dc_c_rank_update_pkt *pkt, int entry,
             outptr = pkt->entries[entry].grave_message;
 
             if(s->pl->pc.c_rank.part.grave_message[1] == LE16('J')) {
-                iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
             }
 
             break;
@@ -8974,10 +8630,10 @@ static void copy_c_rank_pc(pc_c_rank_update_pkt *pkt, int entry,
             outptr = (char *)pkt->entries[entry].grave_team;
 
             if(s->pl->v2.c_rank.part.grave_team[1] == 'J') {
-                iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
             }
 
             /* Convert the message */
@@ -8987,10 +8643,10 @@ static void copy_c_rank_pc(pc_c_rank_update_pkt *pkt, int entry,
             outptr = (char *)pkt->entries[entry].grave_message;
 
             if(s->pl->v2.c_rank.part.grave_message[1] == 'J') {
-                iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
             }
 
             break;
@@ -9502,7 +9158,7 @@ static int send_dc_gm_menu(ship_client_t *c, uint32_t menu_id) {
         pkt->entries[entries].flags = LE16(0x0000);
 
         /* Fill in the text... */
-        opt = __(c, gm_opts[i].text);
+        opt = __v(c, gm_opts[i].text);
 
         if(opt[0] == '\t' && opt[1] == 'J') {
             istrncpy(ic_utf8_to_sjis, pkt->entries[entries].name, opt, 0x10);
@@ -9575,7 +9231,7 @@ static int send_pc_gm_menu(ship_client_t *c, uint32_t menu_id) {
         pkt->entries[entries].flags = LE16(0x0000);
 
         istrncpy(ic_utf8_to_utf16, (char *)pkt->entries[entries].name,
-                 __(c, gm_opts[i].text), 0x20);
+                 __v(c, gm_opts[i].text), 0x20);
 
         len += 0x2C;
         ++entries;
@@ -9641,7 +9297,7 @@ static int send_bb_gm_menu(ship_client_t *c, uint32_t menu_id) {
         pkt->entries[entries].flags = LE16(0x0000);
 
         istrncpy(ic_utf8_to_utf16, (char *)pkt->entries[entries].name,
-                 __(c, gm_opts[i].text), 0x20);
+                 __v(c, gm_opts[i].text), 0x20);
 
         len += 0x2C;
         ++entries;
@@ -9750,7 +9406,7 @@ static int send_dc_gen_menu(ship_client_t *c, uint32_t menu_id, size_t count,
         pkt->entries[entries].flags = LE16(0x0000);
 
         /* Fill in the text... */
-        opt = __(c, ents[i].text);
+        opt = __v(c, ents[i].text);
 
         if(opt[0] == '\t' && opt[1] == 'J') {
             istrncpy(ic_utf8_to_sjis, pkt->entries[entries].name, opt, 0x10);
@@ -9806,7 +9462,7 @@ static int send_pc_gen_menu(ship_client_t *c, uint32_t menu_id, size_t count,
         pkt->entries[entries].flags = LE16(0x0000);
 
         istrncpy(ic_utf8_to_utf16, (char *)pkt->entries[entries].name,
-                 __(c, ents[i].text), 0x20);
+                 __v(c, ents[i].text), 0x20);
 
         len += 0x2C;
         ++entries;
@@ -9855,7 +9511,7 @@ static int send_bb_gen_menu(ship_client_t *c, uint32_t menu_id, size_t count,
         pkt->entries[entries].flags = LE16(0x0000);
 
         istrncpy(ic_utf8_to_utf16, (char *)pkt->entries[entries].name,
-                 __(c, ents[i].text), 0x20);
+                 __v(c, ents[i].text), 0x20);
 
         len += 0x2C;
         ++entries;
@@ -145,6 +145,11 @@ int send_lobby_join(ship_client_t *c, lobby_t *l);
 int send_pkt_dc(ship_client_t *c, const dc_pkt_hdr_t *pkt);
 int send_pkt_bb(ship_client_t *c, const bb_pkt_hdr_t *pkt);
 
+/* Send a prepared packet to each of the count clients in the array, laying out
+   each style of header only once. NULL entries in the array are skipped. */
+int send_pkt_dc_multi(ship_client_t **c, int count, const dc_pkt_hdr_t *pkt);
+int send_pkt_bb_multi(ship_client_t **c, int count, const bb_pkt_hdr_t *pkt);
+
 /* Send a packet to all clients in the lobby when a new player joins. */
 int send_lobby_add_player(lobby_t *l, ship_client_t *c);
 
@@ -63,6 +63,7 @@ int pidfile_fileno(struct pidfh *pfh);
 #include "rtdata.h"
 #include "admin.h"
 #include "smutdata.h"
+#include "startup.h"
 
 #ifndef PID_DIR
 #define PID_DIR "/var/run"
@@ -75,7 +76,14 @@ int pidfile_fileno(struct pidfh *pfh);
 /* The actual ship structures. */
 ship_t *ship;
 int enable_ipv6 = 1;
+int block_workers = 1;
+size_t client_send_limit = 4 * 1024 * 1024;
+int client_defer_sends = 0;
+int client_tcp_cork = 0;
+int lobby_move_ms = 0;
+int block_scripts = 0;
 int restart_on_shutdown = 0;
+int map_snapshots = 0;
 uint32_t ship_ip4;
 uint8_t ship_ip6[16];
 
@@ -88,6 +96,7 @@ static const char *config_file = NULL;
 static const char *custom_dir = NULL;
 static int dont_daemonize = 0;
 static int check_only = 0;
+static int loader_threads = 0;
 static const char *pidfile_name = NULL;
 static struct pidfh *pf = NULL;
 static const char *runas_user = RUNAS_DEFAULT;
@@ -124,6 +133,34 @@ static void print_help(const char *bin) {
 #ifdef SYLVERANT_ENABLE_IPV6
            "--no-ipv6       Disable IPv6 support for incoming connections\n"
 #endif
+           "--block-workers n\n"
+           "                Split the clients on each block across n threads\n"
+           "                (1 by default, at most %d). Packets are still\n"
+           "                handled one at a time on each block.\n"
+           "--send-limit n  Disconnect any client with more than n KiB of\n"
+           "                data waiting to be sent to it (4096 by default,\n"
+           "                0 for no limit).\n"
+           "--coalesce-sends\n"
+           "                Queue up everything sent to a block client while\n"
+           "                handling events and send it all at once.\n"
+           "--tcp-cork      Cork client sockets while handling their packets\n"
+           "                (or use MSG_MORE with --coalesce-sends).\n"
+           "--coalesce-moves ms\n"
+           "                Hold movement in the block lobbies for up to ms\n"
+           "                milliseconds, and only send on the latest\n"
+           "                position of each player (off by default).\n"
+           "--block-scripts Give each block its own script interpreter, so\n"
+           "                that scripts on different blocks can run at the\n"
+           "                same time.\n"
+           "--loader-threads n\n"
+           "                Read the game data at startup on n threads (one\n"
+           "                per CPU by default).\n"
+           "--map-snapshots Keep a snapshot of the parsed map data in each\n"
+           "                map directory, and load from it when the maps\n"
+           "                haven't changed since it was written.\n"
+           "--dump-capture file\n"
+           "                Print out a packet capture written by /log in a\n"
+           "                readable form, then exit.\n"
            "--check-config  Load and parse the configuration, but do not\n"
            "                actually start the ship server. This implies the\n"
            "                --nodaemon option as well.\n"
@@ -133,7 +170,7 @@ static void print_help(const char *bin) {
            "--help          Print this help and exit\n\n"
            "Note that if more than one verbosity level is specified, the last\n"
            "one specified will be used. The default is --verbose.\n", bin,
-           RUNAS_DEFAULT);
+           BLOCK_MAX_WORKERS, RUNAS_DEFAULT);
 }
 
 /* Parse any command-line arguments passed in. */
@@ -180,6 +217,81 @@ static void parse_command_line(int argc, char *argv[]) {
         else if(!strcmp(argv[i], "--no-ipv6")) {
             enable_ipv6 = 0;
         }
+        else if(!strcmp(argv[i], "--block-workers")) {
+            if(i == argc - 1) {
+                printf("--block-workers requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            block_workers = atoi(argv[++i]);
+
+            if(block_workers < 1 || block_workers > BLOCK_MAX_WORKERS) {
+                printf("Invalid number of block workers: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(!strcmp(argv[i], "--send-limit")) {
+            if(i == argc - 1) {
+                printf("--send-limit requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            client_send_limit = (size_t)strtoul(argv[++i], NULL, 0) * 1024;
+        }
+        else if(!strcmp(argv[i], "--coalesce-sends")) {
+            client_defer_sends = 1;
+        }
+        else if(!strcmp(argv[i], "--tcp-cork")) {
+            client_tcp_cork = 1;
+        }
+        else if(!strcmp(argv[i], "--coalesce-moves")) {
+            if(i == argc - 1) {
+                printf("--coalesce-moves requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            lobby_move_ms = atoi(argv[++i]);
+
+            if(lobby_move_ms < 0) {
+                printf("Invalid movement hold time: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(!strcmp(argv[i], "--block-scripts")) {
+            block_scripts = 1;
+        }
+        else if(!strcmp(argv[i], "--loader-threads")) {
+            if(i == argc - 1) {
+                printf("--loader-threads requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            loader_threads = atoi(argv[++i]);
+
+            if(loader_threads < 1) {
+                printf("Invalid number of loader threads: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(!strcmp(argv[i], "--map-snapshots")) {
+            map_snapshots = 1;
+        }
+        else if(!strcmp(argv[i], "--dump-capture")) {
+            if(i == argc - 1) {
+                printf("--dump-capture requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            exit(pktcap_dump(argv[++i], stdout) ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
         else if(!strcmp(argv[i], "--check-config")) {
             check_only = 1;
             dont_daemonize = 1;
@@ -695,96 +807,14 @@ static int drop_privs(void) {
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    void *tmp;
-    sylverant_ship_t *cfg;
-    char *initial_path;
-    long size;
-    int rv;
-    pid_t op;
-
-    /* Parse the command line... */
-    parse_command_line(argc, argv);
-
-    /* Save the initial path, so that if /restart is used we'll be starting from
-       the same directory. */
-    size = pathconf(".", _PC_PATH_MAX);
-    if(!(initial_path = (char *)malloc(size))) {
-        debug(DBG_WARN, "Out of memory, bailing out!\n");
-    }
-    else if(!getcwd(initial_path, size)) {
-        debug(DBG_WARN, "Cannot save initial path, /restart may not work!\n");
-    }
-
-    cfg = load_config();
-
-    if(!custom_dir) {
-        chdir(sylverant_directory);
-    }
-    else {
-        chdir(custom_dir);
-    }
-
-    /* If we're still alive and we're supposed to daemonize, do it now. */
-    if(!dont_daemonize) {
-        /* Attempt to open and lock the pid file. */
-        if(!pidfile_name) {
-            char *pn = (char *)malloc(strlen(cfg->name) + strlen(PID_DIR) + 32);
-            sprintf(pn, "%s/ship_server-%s.pid", PID_DIR, cfg->name);
-            pidfile_name = pn;
-        }
-
-        pf = pidfile_open(pidfile_name, 0660, &op);
-
-        if(!pf) {
-            if(errno == EEXIST) {
-                debug(DBG_ERROR, "Ship Server already running? (pid: %ld)\n",
-                      (long)op);
-                exit(EXIT_FAILURE);
-            }
-
-            debug(DBG_WARN, "Cannot create pidfile: %s!\n", strerror(errno));
-        }
-        else {
-            atexit(&cleanup_pidfile);
-        }
-
-        if(daemon(1, 0)) {
-            debug(DBG_ERROR, "Cannot daemonize\n");
-            perror("daemon");
-            exit(EXIT_FAILURE);
-        }
-
-        if(drop_privs())
-            exit(EXIT_FAILURE);
-
-        open_log(cfg);
-
-        /* Write the pid file. */
-        pidfile_write(pf);
-    }
-    else {
-        if(drop_privs())
-            exit(EXIT_FAILURE);
-    }
-
-restart:
-    print_config(cfg);
-
-    /* Parse the addresses */
-    if(setup_addresses(cfg))
-        exit(EXIT_FAILURE);
-
-    /* Initialize GnuTLS stuff... */
-    if(!check_only) {
-        if(init_gnutls(cfg))
-            exit(EXIT_FAILURE);
-
-        /* Set up things for clients to connect. */
-        if(client_init(cfg))
-            exit(EXIT_FAILURE);
-    }
+/* Blue Burst can be turned off by any of several loaders, which might be
+   running at the same time. */
+static void disable_bb(sylverant_ship_t *cfg) {
+    __atomic_fetch_or(&cfg->shipgate_flags, SHIPGATE_FLAG_NOBB,
+                      __ATOMIC_SEQ_CST);
+}
 
+static int load_v2_pt(sylverant_ship_t *cfg) {
     /* Try to read the v2 ItemPT data... */
     if(cfg->v2_ptdata_file) {
         debug(DBG_LOG, "Reading v2 ItemPT file: %s\n", cfg->v2_ptdata_file);
@@ -793,6 +823,10 @@ restart:
         }
     }
 
+    return 0;
+}
+
+static int load_v2_pmt(sylverant_ship_t *cfg) {
     /* Read the v2 ItemPMT file... */
     if(cfg->v2_pmtdata_file) {
         debug(DBG_LOG, "Reading v2 ItemPMT file: %s\n", cfg->v2_pmtdata_file);
@@ -802,6 +836,10 @@ restart:
         }
     }
 
+    return 0;
+}
+
+static int load_gc_pt(sylverant_ship_t *cfg) {
     /* Read the GC ItemPT file... */
     if(cfg->gc_ptdata_file) {
         debug(DBG_LOG, "Reading GC ItemPT file: %s\n", cfg->gc_ptdata_file);
@@ -811,6 +849,10 @@ restart:
         }
     }
 
+    return 0;
+}
+
+static int load_bb_pt(sylverant_ship_t *cfg) {
     /* Read the BB ItemPT data, which is needed for Blue Burst... */
     if(cfg->bb_ptdata_file) {
         debug(DBG_LOG, "Reading BB ItemPT file: %s\n", cfg->bb_ptdata_file);
@@ -818,15 +860,19 @@ restart:
         if(pt_read_v3(cfg->bb_ptdata_file, 1)) {
             debug(DBG_WARN, "Couldn't read BB ItemPT data, disabling Blue "
                   "Burst support!\n");
-            cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
+            disable_bb(cfg);
         }
     }
     else {
         debug(DBG_WARN, "No BB ItemPT file specified, disabling Blue Burst "
               "support!\n");
-        cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
+        disable_bb(cfg);
     }
 
+    return 0;
+}
+
+static int load_gc_pmt(sylverant_ship_t *cfg) {
     /* Read the GC ItemPMT file... */
     if(cfg->gc_pmtdata_file) {
         debug(DBG_LOG, "Reading GC ItemPMT file: %s\n", cfg->gc_pmtdata_file);
@@ -836,37 +882,45 @@ restart:
         }
     }
 
+    return 0;
+}
+
+static int load_bb_pmt(sylverant_ship_t *cfg) {
     /* Read the BB ItemPMT file... */
     if(cfg->bb_pmtdata_file) {
         debug(DBG_LOG, "Reading BB ItemPMT file: %s\n", cfg->bb_pmtdata_file);
         if(pmt_read_bb(cfg->bb_pmtdata_file,
                        !(cfg->local_flags & SYLVERANT_SHIP_PMT_LIMITBB))) {
             debug(DBG_WARN, "Couldn't read BB ItemPMT file!\n");
-            cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
+            disable_bb(cfg);
         }
     }
     else {
         debug(DBG_WARN, "No BB ItemPT file specified, disabling Blue Burst "
               "support!\n");
-        cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
+        disable_bb(cfg);
     }
 
+    return 0;
+}
+
+static int load_v2_maps(sylverant_ship_t *cfg) {
     /* If we have a v2 map dir set, try to read the maps. */
-    if(cfg->v2_map_dir) {
-        rv = v2_read_params(cfg);
+    if(cfg->v2_map_dir && v2_read_params(cfg) < 0)
+        return -1;
 
-        if(rv < 0)
-            exit(EXIT_FAILURE);
-    }
+    return 0;
+}
 
+static int load_gc_maps(sylverant_ship_t *cfg) {
     /* If we have a GC map dir set, try to read the maps. */
-    if(cfg->gc_map_dir) {
-        rv = gc_read_params(cfg);
+    if(cfg->gc_map_dir && gc_read_params(cfg) < 0)
+        return -1;
 
-        if(rv < 0)
-            exit(EXIT_FAILURE);
-    }
+    return 0;
+}
 
+static int load_v2_rt(sylverant_ship_t *cfg) {
     /* Read the v2 ItemRT file... */
     if(cfg->v2_rtdata_file) {
         debug(DBG_LOG, "Reading v2 ItemRT file: %s\n", cfg->v2_rtdata_file);
@@ -875,6 +929,10 @@ restart:
         }
     }
 
+    return 0;
+}
+
+static int load_gc_rt(sylverant_ship_t *cfg) {
     /* Read the GC ItemRT file... */
     if(cfg->gc_rtdata_file) {
         debug(DBG_LOG, "Reading GC ItemRT file: %s\n", cfg->gc_rtdata_file);
@@ -883,6 +941,12 @@ restart:
         }
     }
 
+    return 0;
+}
+
+static int load_bb_maps(sylverant_ship_t *cfg) {
+    int rv;
+
     /* If Blue Burst isn't disabled already, read the parameter data and map
        data... */
     if(!(cfg->shipgate_flags & SHIPGATE_FLAG_NOBB)) {
@@ -890,11 +954,152 @@ restart:
 
         /* Less than 0 = fatal error. Greater than 0 = Blue Burst problem. */
         if(rv > 0)
-            cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
+            disable_bb(cfg);
         else if(rv < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int load_smutdata(sylverant_ship_t *cfg) {
+    /* Init the word censor. */
+    if(cfg->smutdata_file) {
+        debug(DBG_LOG, "Reading smutdata file: %s\n", cfg->smutdata_file);
+        if(smutdata_read(cfg->smutdata_file)) {
+            debug(DBG_WARN, "Couldn't read smutdata file!\n");
+        }
+    }
+
+    return 0;
+}
+
+/* All of the data that gets loaded at startup. The only ordering that matters
+   is that the Blue Burst maps aren't read if the ItemPT or ItemPMT data for
+   Blue Burst couldn't be. */
+#define TASK_BB_PT      3
+#define TASK_BB_PMT     5
+
+static startup_task_t startup_tasks[] = {
+    { "v2 ItemPT", load_v2_pt, { -1 } },
+    { "v2 ItemPMT", load_v2_pmt, { -1 } },
+    { "GC ItemPT", load_gc_pt, { -1 } },
+    { "BB ItemPT", load_bb_pt, { -1 } },
+    { "GC ItemPMT", load_gc_pmt, { -1 } },
+    { "BB ItemPMT", load_bb_pmt, { -1 } },
+    { "v2 maps", load_v2_maps, { -1 } },
+    { "GC maps", load_gc_maps, { -1 } },
+    { "v2 ItemRT", load_v2_rt, { -1 } },
+    { "GC ItemRT", load_gc_rt, { -1 } },
+    { "BB params and maps", load_bb_maps, { TASK_BB_PT, TASK_BB_PMT, -1 } },
+    { "smutdata", load_smutdata, { -1 } }
+};
+
+#define STARTUP_TASK_COUNT  (sizeof(startup_tasks) / sizeof(startup_tasks[0]))
+
+int main(int argc, char *argv[]) {
+    void *tmp;
+    sylverant_ship_t *cfg;
+    char *initial_path;
+    long size;
+    pid_t op;
+
+    /* Parse the command line... */
+    parse_command_line(argc, argv);
+
+    /* Save the initial path, so that if /restart is used we'll be starting from
+       the same directory. */
+    size = pathconf(".", _PC_PATH_MAX);
+    if(!(initial_path = (char *)malloc(size))) {
+        debug(DBG_WARN, "Out of memory, bailing out!\n");
+    }
+    else if(!getcwd(initial_path, size)) {
+        debug(DBG_WARN, "Cannot save initial path, /restart may not work!\n");
+    }
+
+    cfg = load_config();
+
+    if(!custom_dir) {
+        chdir(sylverant_directory);
+    }
+    else {
+        chdir(custom_dir);
+    }
+
+    /* If we're still alive and we're supposed to daemonize, do it now. */
+    if(!dont_daemonize) {
+        /* Attempt to open and lock the pid file. */
+        if(!pidfile_name) {
+            char *pn = (char *)malloc(strlen(cfg->name) + strlen(PID_DIR) + 32);
+            sprintf(pn, "%s/ship_server-%s.pid", PID_DIR, cfg->name);
+            pidfile_name = pn;
+        }
+
+        pf = pidfile_open(pidfile_name, 0660, &op);
+
+        if(!pf) {
+            if(errno == EEXIST) {
+                debug(DBG_ERROR, "Ship Server already running? (pid: %ld)\n",
+                      (long)op);
+                exit(EXIT_FAILURE);
+            }
+
+            debug(DBG_WARN, "Cannot create pidfile: %s!\n", strerror(errno));
+        }
+        else {
+            atexit(&cleanup_pidfile);
+        }
+
+        if(daemon(1, 0)) {
+            debug(DBG_ERROR, "Cannot daemonize\n");
+            perror("daemon");
+            exit(EXIT_FAILURE);
+        }
+
+        if(drop_privs())
+            exit(EXIT_FAILURE);
+
+        open_log(cfg);
+
+        /* Write the pid file. */
+        pidfile_write(pf);
+    }
+    else {
+        if(drop_privs())
+            exit(EXIT_FAILURE);
+    }
+
+restart:
+    print_config(cfg);
+
+    /* Parse the addresses */
+    if(setup_addresses(cfg))
+        exit(EXIT_FAILURE);
+
+    /* Initialize GnuTLS stuff... */
+    if(!check_only) {
+        if(init_gnutls(cfg))
+            exit(EXIT_FAILURE);
+
+        /* Set up things for clients to connect. */
+        if(client_init(cfg))
             exit(EXIT_FAILURE);
     }
 
+    /* Set up the tables for converting text between encodings. This has to
+       happen before any of the loaders below run, since some of them convert
+       text as they read it. */
+    if(tconv_init())
+        exit(EXIT_FAILURE);
+
+    /* Read all the game data, as much of it at once as we can. */
+    if(!loader_threads &&
+       (loader_threads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        loader_threads = 1;
+
+    if(startup_run(startup_tasks, STARTUP_TASK_COUNT, loader_threads, cfg))
+        exit(EXIT_FAILURE);
+
     /* Set a few other shipgate flags, if appropriate. */
 #ifdef ENABLE_LUA
     cfg->shipgate_flags |= LOGIN_FLAG_LUA;
@@ -908,21 +1113,9 @@ restart:
     cfg->shipgate_flags |= LOGIN_FLAG_32BIT;
 #endif
 
-    /* Initialize all the iconv contexts we'll need */
-    if(init_iconv())
-        exit(EXIT_FAILURE);
-
     /* Init mini18n if we have it */
     init_i18n();
 
-    /* Init the word censor. */
-    if(cfg->smutdata_file) {
-        debug(DBG_LOG, "Reading smutdata file: %s\n", cfg->smutdata_file);
-        if(smutdata_read(cfg->smutdata_file)) {
-            debug(DBG_WARN, "Couldn't read smutdata file!\n");
-        }
-    }
-
     if(!check_only) {
         /* Install signal handlers */
         install_signal_handlers();
@@ -948,7 +1141,6 @@ restart:
     }
 
     cleanup_i18n();
-    cleanup_iconv();
 
     if(!check_only) {
         client_shutdown();
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -38,6 +39,7 @@
 #include "shipgate.h"
 #include "ship_packets.h"
 #include "scripts.h"
+#include "gcindex.h"
 #include "quest_functions.h"
 
 /* TLS stuff -- from ship_server.c */
@@ -48,6 +50,15 @@ extern int enable_ipv6;
 extern uint32_t ship_ip4;
 extern uint8_t ship_ip6[16];
 
+/* How much can be waiting to go out to the shipgate before we start turning
+   packets away, and how much gets gathered up into each TLS record. */
+#define SG_QUEUE_MAX        (4 * 1024 * 1024)
+#define SG_RECORD_SIZE      16384
+
+/* How long (in seconds) to wait for the queue to drain when shutting down
+   before giving up on the shipgate reading it. */
+#define SG_DRAIN_TIME       5
+
 static inline ssize_t sg_recv(shipgate_conn_t *c, void *buffer, size_t len) {
     return gnutls_record_recv(c->session, buffer, len);
 }
@@ -56,25 +67,295 @@ static inline ssize_t sg_send(shipgate_conn_t *c, void *buffer, size_t len) {
     return gnutls_record_send(c->session, buffer, len);
 }
 
-/* Send a raw packet away. */
-static int send_raw(shipgate_conn_t *c, int len, uint8_t *sendbuf, int crypt) {
+/* The outbound queue is an intrusive multi-producer, single-consumer list.
+   Producers only ever swap themselves in at the head, and the writer thread
+   takes things off of the tail, with the stub node keeping the list from ever
+   being completely empty. */
+static void sg_queue_push(shipgate_conn_t *c, shipgate_qpkt_t *pkt) {
+    shipgate_qpkt_t *prev;
+
+    __atomic_store_n(&pkt->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&c->qhead, pkt, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, pkt, __ATOMIC_RELEASE);
+}
+
+static shipgate_qpkt_t *sg_queue_pop(shipgate_conn_t *c) {
+    shipgate_qpkt_t *tail = c->qtail, *next;
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if(tail == &c->qstub) {
+        if(!next)
+            return NULL;
+
+        c->qtail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(next) {
+        c->qtail = next;
+        return tail;
+    }
+
+    /* If someone is in the middle of adding something, it'll be here in a
+       moment. */
+    if(tail != __atomic_load_n(&c->qhead, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    /* Otherwise, this is the last one, so put the stub back behind it. */
+    sg_queue_push(c, &c->qstub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if(next) {
+        c->qtail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static int sg_queue_empty(shipgate_conn_t *c) {
+    return c->qtail == &c->qstub &&
+        __atomic_load_n(&c->qhead, __ATOMIC_SEQ_CST) == &c->qstub;
+}
+
+static void sg_queue_init(shipgate_conn_t *c) {
+    c->qstub.next = NULL;
+    c->qhead = c->qtail = &c->qstub;
+    c->qbytes = 0;
+}
+
+/* Throw away anything still in the queue. Only one thread may do this at a
+   time, and the writer thread must not be running. */
+static void sg_queue_discard(shipgate_conn_t *c) {
+    shipgate_qpkt_t *pkt;
+
+    while((pkt = sg_queue_pop(c))) {
+        __atomic_sub_fetch(&c->qbytes, pkt->len, __ATOMIC_RELAXED);
+        free(pkt);
+    }
+}
+
+/* Write a run of data out to the session, from the writer thread. */
+static void sg_write(shipgate_conn_t *c, uint8_t *buf, int len) {
     ssize_t rv, total = 0;
 
-    /* Keep trying until the whole thing's sent. */
-    if((!crypt || c->has_key) && c->sock >= 0 && !c->sendbuf_cur) {
-        while(total < len) {
-            rv = sg_send(c, sendbuf + total, len - total);
+    /* If something's already gone wrong, just throw it all away until the
+       connection gets dropped. */
+    if(c->wfailed)
+        return;
+
+    while(total < len) {
+        rv = sg_send(c, buf + total, len - total);
 
-            if(rv == GNUTLS_E_AGAIN || rv == GNUTLS_E_INTERRUPTED) {
-                /* Try again. */
-                continue;
+        if(rv == GNUTLS_E_AGAIN || rv == GNUTLS_E_INTERRUPTED) {
+            /* Try again. */
+            continue;
+        }
+        else if(rv <= 0) {
+            debug(DBG_WARN, "Error writing to shipgate: %s\n",
+                  gnutls_strerror((int)rv));
+
+            /* Let the ship thread know, so it can drop the connection. */
+            __atomic_store_n(&c->wfailed, 1, __ATOMIC_SEQ_CST);
+
+            if(write(c->ship->pipes[1], "\xFF", 1) != 1)
+                debug(DBG_WARN, "Cannot wake ship thread: %s\n",
+                      strerror(errno));
+
+            return;
+        }
+
+        total += rv;
+    }
+}
+
+/* Wait for more to show up in the queue. Returns 0 if the writer should exit
+   instead. */
+static int sg_writer_wait(shipgate_conn_t *c) {
+    int rv = 1;
+
+    pthread_mutex_lock(&c->wmutex);
+
+    /* Anyone that adds to the queue after this will see that we're asleep and
+       wake us up. */
+    __atomic_store_n(&c->wsleeping, 1, __ATOMIC_SEQ_CST);
+
+    while(!c->wstop && sg_queue_empty(c)) {
+        pthread_cond_wait(&c->wcond, &c->wmutex);
+    }
+
+    __atomic_store_n(&c->wsleeping, 0, __ATOMIC_SEQ_CST);
+
+    /* Don't go anywhere until everything that was queued up has been sent. */
+    if(c->wstop && sg_queue_empty(c))
+        rv = 0;
+
+    pthread_mutex_unlock(&c->wmutex);
+
+    return rv;
+}
+
+static void *sg_writer_thd(void *d) {
+    shipgate_conn_t *c = (shipgate_conn_t *)d;
+    uint8_t buf[SG_RECORD_SIZE];
+    shipgate_qpkt_t *pkt;
+    uint32_t gen = c->wthd_gen;
+    int len = 0;
+
+    for(;;) {
+        if(!(pkt = sg_queue_pop(c))) {
+            /* Nothing else is ready right now, so send what we've gathered up
+               before going to sleep. */
+            if(len) {
+                sg_write(c, buf, len);
+                len = 0;
             }
-            else if(rv <= 0) {
-                return -1;
+            else if(!sg_writer_wait(c)) {
+                break;
             }
 
-            total += rv;
+            continue;
+        }
+
+        /* Anything queued up by someone that saw the connection before it was
+           last stopped or started isn't ours to send. */
+        if(pkt->gen != gen) {
+            __atomic_sub_fetch(&c->qbytes, pkt->len, __ATOMIC_RELAXED);
+            free(pkt);
+            continue;
+        }
+
+        /* Pack as many packets into each record as will fit. */
+        if(len + pkt->len > SG_RECORD_SIZE) {
+            sg_write(c, buf, len);
+            len = 0;
+        }
+
+        if(pkt->len > SG_RECORD_SIZE) {
+            sg_write(c, pkt->data, pkt->len);
         }
+        else {
+            memcpy(buf + len, pkt->data, pkt->len);
+            len += pkt->len;
+        }
+
+        __atomic_sub_fetch(&c->qbytes, pkt->len, __ATOMIC_RELAXED);
+        free(pkt);
+    }
+
+    /* Let sg_writer_stop know we're done, in case it's waiting on a drain. */
+    pthread_mutex_lock(&c->wmutex);
+    c->wdone = 1;
+    pthread_cond_signal(&c->wdcond);
+    pthread_mutex_unlock(&c->wmutex);
+
+    return NULL;
+}
+
+static int sg_writer_start(shipgate_conn_t *c) {
+    c->wstop = 0;
+    c->wdone = 0;
+    c->wfailed = 0;
+    sg_queue_discard(c);
+
+    /* Anyone that queues something up from here on gets the new generation,
+       and only what they queue will be sent. */
+    c->wthd_gen = __atomic_add_fetch(&c->wgen, 1, __ATOMIC_SEQ_CST);
+
+    if(pthread_create(&c->wthd, NULL, &sg_writer_thd, c)) {
+        debug(DBG_ERROR, "Cannot start shipgate writer thread\n");
+        return -1;
+    }
+
+    __atomic_store_n(&c->wrunning, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/* Stop the writer thread. If drain is set, everything in the queue is sent
+   before it exits, as long as that takes no more than SG_DRAIN_TIME seconds.
+   Otherwise (or once that's up), the connection is assumed to be dead and the
+   socket is shut down so the writer can't get stuck on it. */
+static void sg_writer_stop(shipgate_conn_t *c, int drain) {
+    struct timespec ts;
+    int rv = 0;
+
+    if(!__atomic_load_n(&c->wrunning, __ATOMIC_SEQ_CST))
+        return;
+
+    /* Nobody that looks after this point will queue anything up, and anyone
+       that looked before it will have their packets thrown away. */
+    __atomic_store_n(&c->wrunning, 0, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&c->wgen, 1, __ATOMIC_SEQ_CST);
+
+    if(!drain)
+        shutdown(c->sock, SHUT_RDWR);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += SG_DRAIN_TIME;
+
+    pthread_mutex_lock(&c->wmutex);
+    c->wstop = 1;
+    pthread_cond_signal(&c->wcond);
+
+    while(drain && !c->wdone && rv != ETIMEDOUT) {
+        rv = pthread_cond_timedwait(&c->wdcond, &c->wmutex, &ts);
+    }
+
+    pthread_mutex_unlock(&c->wmutex);
+
+    if(rv == ETIMEDOUT) {
+        debug(DBG_WARN, "Shipgate isn't reading, dropping what's left\n");
+        shutdown(c->sock, SHUT_RDWR);
+    }
+
+    pthread_join(c->wthd, NULL);
+    sg_queue_discard(c);
+}
+
+/* Can a packet be queued up for the shipgate right now? */
+static int sg_can_send(shipgate_conn_t *c, int crypt) {
+    return (!crypt || __atomic_load_n(&c->has_key, __ATOMIC_ACQUIRE)) &&
+        __atomic_load_n(&c->sock, __ATOMIC_ACQUIRE) >= 0 &&
+        __atomic_load_n(&c->wrunning, __ATOMIC_SEQ_CST);
+}
+
+/* Queue a raw packet to be sent away by the writer thread. */
+static int send_raw(shipgate_conn_t *c, int len, uint8_t *sendbuf, int crypt) {
+    shipgate_qpkt_t *pkt;
+    uint32_t gen;
+
+    /* Don't bother if it can't go anywhere anyway. The generation has to be
+       read first, so that if the writer is stopped or started after the check,
+       the packet won't be sent on the wrong connection. */
+    gen = __atomic_load_n(&c->wgen, __ATOMIC_SEQ_CST);
+
+    if(!sg_can_send(c, crypt))
+        return 0;
+
+    /* If the shipgate has fallen too far behind, turn the packet away rather
+       than holding up the sender or letting the queue grow without bound. */
+    if(__atomic_add_fetch(&c->qbytes, len, __ATOMIC_RELAXED) > SG_QUEUE_MAX) {
+        __atomic_sub_fetch(&c->qbytes, len, __ATOMIC_RELAXED);
+        debug(DBG_WARN, "Shipgate send queue full, dropping packet\n");
+        return -1;
+    }
+
+    if(!(pkt = (shipgate_qpkt_t *)malloc(sizeof(shipgate_qpkt_t) + len))) {
+        __atomic_sub_fetch(&c->qbytes, len, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    pkt->gen = gen;
+    pkt->len = len;
+    memcpy(pkt->data, sendbuf, len);
+    sg_queue_push(c, pkt);
+
+    /* Wake up the writer if it went to sleep. */
+    if(__atomic_load_n(&c->wsleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&c->wmutex);
+        pthread_cond_signal(&c->wcond);
+        pthread_mutex_unlock(&c->wmutex);
     }
 
     return 0;
@@ -141,9 +422,6 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
         rv->recvbuf = NULL;
         rv->recvbuf_cur = rv->recvbuf_size = 0;
 
-        free(rv->sendbuf);
-        rv->sendbuf = NULL;
-        rv->sendbuf_cur = rv->sendbuf_size = 0;
     }
     else {
         /* Clear it first. */
@@ -276,67 +554,90 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
     return 0;
 }
 
+static void shipgate_close(shipgate_conn_t *c) {
+    gnutls_bye(c->session, GNUTLS_SHUT_RDWR);
+    close(c->sock);
+    gnutls_deinit(c->session);
+    __atomic_store_n(&c->sock, -1, __ATOMIC_RELEASE);
+}
+
 int shipgate_connect(ship_t *s, shipgate_conn_t *rv) {
-    return shipgate_conn(s, rv, 0);
+    int err;
+
+    if((err = shipgate_conn(s, rv, 0)))
+        return err;
+
+    sg_queue_init(rv);
+    pthread_mutex_init(&rv->wmutex, NULL);
+    pthread_cond_init(&rv->wcond, NULL);
+    pthread_cond_init(&rv->wdcond, NULL);
+
+    if(sg_writer_start(rv)) {
+        shipgate_close(rv);
+        pthread_cond_destroy(&rv->wdcond);
+        pthread_cond_destroy(&rv->wcond);
+        pthread_mutex_destroy(&rv->wmutex);
+        return -6;
+    }
+
+    return 0;
 }
 
 /* Reconnect to the shipgate if we are disconnected for some reason. */
 int shipgate_reconnect(shipgate_conn_t *conn) {
-    return shipgate_conn(conn->ship, conn, 1);
+    int err;
+
+    if((err = shipgate_conn(conn->ship, conn, 1)))
+        return err;
+
+    if(sg_writer_start(conn)) {
+        shipgate_close(conn);
+        return -6;
+    }
+
+    return 0;
+}
+
+void shipgate_disconnect(shipgate_conn_t *c) {
+    sg_writer_stop(c, 0);
+    shipgate_close(c);
 }
 
 /* Clean up a shipgate connection. */
 void shipgate_cleanup(shipgate_conn_t *c) {
     if(c->sock > 0) {
-        gnutls_bye(c->session, GNUTLS_SHUT_RDWR);
-        close(c->sock);
-        gnutls_deinit(c->session);
+        sg_writer_stop(c, 1);
+        shipgate_close(c);
     }
 
+    sg_queue_discard(c);
+    pthread_cond_destroy(&c->wdcond);
+    pthread_cond_destroy(&c->wcond);
+    pthread_mutex_destroy(&c->wmutex);
     free(c->recvbuf);
-    free(c->sendbuf);
 }
 
 static int handle_dc_greply(shipgate_conn_t *conn, dc_guild_reply_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_search);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
+    int rv = 0;
 
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
+    if((c = gcindex_find(dest))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(c->guildcard == dest) {
 #ifdef SYLVERANT_ENABLE_IPV6
-                    if(pkt->hdr.flags != 6) {
-                        send_guild_reply_sg(c, pkt);
-                    }
-                    else {
-                        send_guild_reply6_sg(c, (dc_guild_reply6_pkt *)pkt);
-                    }
+        if(pkt->hdr.flags != 6) {
+            send_guild_reply_sg(c, pkt);
+        }
+        else {
+            send_guild_reply6_sg(c, (dc_guild_reply6_pkt *)pkt);
+        }
 #else
-                    send_guild_reply_sg(c, pkt);
+        send_guild_reply_sg(c, pkt);
 #endif
 
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&c->mutex);
-
-                if(done) {
-                    break;
-                }
-            }
-
-            pthread_rwlock_unlock(&b->lock);
-        }
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
     return rv;
@@ -354,24 +655,18 @@ static int handle_bb_greply(shipgate_conn_t *conn, bb_guild_reply_pkt *pkt,
     }
 
     b = ship->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Look for the client */
-    TAILQ_FOREACH(c, b->clients, qentry) {
-        pthread_mutex_lock(&c->mutex);
-
-        if(c->guildcard == dest) {
+    if((c = gcindex_find(dest))) {
+        if(c->cur_block == b) {
+            pthread_mutex_lock(&c->mutex);
             send_pkt_bb(c, (bb_pkt_hdr_t *)pkt);
             pthread_mutex_unlock(&c->mutex);
-            pthread_rwlock_unlock(&b->lock);
-            return 0;
         }
 
-        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
-    pthread_rwlock_unlock(&b->lock);
-
     return 0;
 }
 
@@ -453,155 +748,92 @@ static void handle_mail_autoreply(shipgate_conn_t *c, ship_client_t *s,
 }
 
 static int handle_dc_mail(shipgate_conn_t *conn, dc_simple_mail_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
+    int rv = 0;
 
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply_on) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
+    if((c = gcindex_find(dest))) {
+        pthread_mutex_lock(&c->mutex);
 
-                    /* Forward the packet there. */
-                    rv = send_simple_mail(CLIENT_VERSION_DCV1, c,
-                                          (dc_pkt_hdr_t *)pkt);
-                    done = 1;
+        if(c->pl) {
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(c, sender) &&
+               !client_has_ignored(c, sender)) {
+                /* Check if the user has an autoreply set. */
+                if(c->autoreply_on) {
+                    handle_mail_autoreply(conn, c, sender);
                 }
 
-                pthread_mutex_unlock(&c->mutex);
-
-                if(done) {
-                    break;
-                }
+                /* Forward the packet there. */
+                rv = send_simple_mail(CLIENT_VERSION_DCV1, c,
+                                      (dc_pkt_hdr_t *)pkt);
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
     return rv;
 }
 
 static int handle_pc_mail(shipgate_conn_t *conn, pc_simple_mail_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
+    int rv = 0;
 
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
+    if((c = gcindex_find(dest))) {
+        pthread_mutex_lock(&c->mutex);
 
-                    /* Forward the packet there. */
-                    rv = send_simple_mail(CLIENT_VERSION_PC, c,
-                                          (dc_pkt_hdr_t *)pkt);
-                    done = 1;
+        if(c->pl) {
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(c, sender) &&
+               !client_has_ignored(c, sender)) {
+                /* Check if the user has an autoreply set. */
+                if(c->autoreply) {
+                    handle_mail_autoreply(conn, c, sender);
                 }
 
-                pthread_mutex_unlock(&c->mutex);
-
-                if(done) {
-                    break;
-                }
+                /* Forward the packet there. */
+                rv = send_simple_mail(CLIENT_VERSION_PC, c,
+                                      (dc_pkt_hdr_t *)pkt);
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
     return rv;
 }
 
 static int handle_bb_mail(shipgate_conn_t *conn, bb_simple_mail_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
+    int rv = 0;
 
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
+    if((c = gcindex_find(dest))) {
+        pthread_mutex_lock(&c->mutex);
 
-                    /* Forward the packet there. */
-                    rv = send_bb_simple_mail(c, pkt);
-                    done = 1;
+        if(c->pl) {
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(c, sender) &&
+               !client_has_ignored(c, sender)) {
+                /* Check if the user has an autoreply set. */
+                if(c->autoreply) {
+                    handle_mail_autoreply(conn, c, sender);
                 }
 
-                pthread_mutex_unlock(&c->mutex);
-
-                if(done) {
-                    break;
-                }
+                /* Forward the packet there. */
+                rv = send_bb_simple_mail(c, pkt);
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
     return rv;
@@ -839,11 +1071,8 @@ static int handle_sstatus(shipgate_conn_t *conn, shipgate_ship_status_pkt *p) {
 
 static int handle_creq(shipgate_conn_t *conn, shipgate_char_data_pkt *pkt) {
     int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->hdr.flags);
     uint16_t plen = ntohs(pkt->hdr.pkt_len);
     int clen = plen - sizeof(shipgate_char_data_pkt);
@@ -853,42 +1082,26 @@ static int handle_creq(shipgate_conn_t *conn, shipgate_char_data_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest) {
-                    if(!c->bb_pl && c->pl) {
-                        /* We've found them, overwrite their data, and send the
-                           refresh packet. */
-                        memcpy(c->pl, pkt->data, clen);
-                        send_lobby_join(c, c->cur_lobby);
-                    }
-                    else if(c->bb_pl) {
-                        memcpy(c->bb_pl, pkt->data, clen);
-
-                        /* Clear the item ids from the inventory. */
-                        for(i = 0; i < 30; ++i) {
-                            c->bb_pl->inv.items[i].item_id = 0xFFFFFFFF;
-                        }
-                    }
-
-                    done = 1;
-                }
+    if((c = gcindex_find(dest))) {
+        pthread_mutex_lock(&c->mutex);
 
-                pthread_mutex_unlock(&c->mutex);
+        if(!c->bb_pl && c->pl) {
+            /* We've found them, overwrite their data, and send the
+               refresh packet. */
+            memcpy(c->pl, pkt->data, clen);
+            send_lobby_join(c, c->cur_lobby);
+        }
+        else if(c->bb_pl) {
+            memcpy(c->bb_pl, pkt->data, clen);
 
-                if(done) {
-                    break;
-                }
+            /* Clear the item ids from the inventory. */
+            for(i = 0; i < 30; ++i) {
+                c->bb_pl->inv.items[i].item_id = 0xFFFFFFFF;
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
     return 0;
@@ -914,20 +1127,21 @@ static int handle_usrlogin(shipgate_conn_t *conn,
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
+    if((i = gcindex_find(gc))) {
+        if(i->cur_block == b) {
+            pthread_mutex_lock(&i->mutex);
             i->privilege |= ntohl(pkt->priv);
             i->flags |= CLIENT_FLAG_LOGGED_IN;
             i->flags &= ~CLIENT_FLAG_GC_PROTECT;
             send_txt(i, "%s", __(i, "\tE\tC7Login Successful."));
-            break;
+            pthread_mutex_unlock(&i->mutex);
         }
+
+        gcindex_release(gc);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -969,12 +1183,8 @@ static int handle_count(shipgate_conn_t *conn, shipgate_cnt_pkt *pkt) {
 }
 
 static int handle_cdata(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
 
     /* Make sure the packet looks sane */
@@ -982,54 +1192,31 @@ static int handle_cdata(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(flags & SHDR_FAILURE) {
-                        send_txt(c, "%s", __(c, "\tE\tC7Couldn't save "
-                                                "character data."));
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7Saved character "
-                                             "data."));
-                    }
-
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&c->mutex);
+    if((c = gcindex_find(dest))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(flags & SHDR_FAILURE) {
+                send_txt(c, "%s", __(c, "\tE\tC7Couldn't save "
+                                        "character data."));
+            }
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7Saved character "
+                                     "data."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
     return 0;
 }
 
 static int handle_ban(shipgate_conn_t *conn, shipgate_ban_err_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->req_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
 
     /* Make sure the packet looks sane */
@@ -1037,58 +1224,36 @@ static int handle_ban(shipgate_conn_t *conn, shipgate_ban_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(flags & SHDR_FAILURE) {
-                        /* If the not gm flag is set, disconnect the user. */
-                        if(ntohl(pkt->base.error_code) == ERR_BAN_NOT_GM) {
-                            c->flags |= CLIENT_FLAG_DISCONNECTED;
-                        }
-
-                        send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
-
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7User banned."));
-                    }
+    if((c = gcindex_find(dest))) {
+        pthread_mutex_lock(&c->mutex);
 
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(flags & SHDR_FAILURE) {
+                /* If the not gm flag is set, disconnect the user. */
+                if(ntohl(pkt->base.error_code) == ERR_BAN_NOT_GM) {
+                    c->flags |= CLIENT_FLAG_DISCONNECTED;
+                    block_wake(c->cur_block);
                 }
 
-                pthread_mutex_unlock(&c->mutex);
+                send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
 
-                if(done) {
-                    break;
-                }
             }
-
-            pthread_rwlock_unlock(&b->lock);
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7User banned."));
+            }
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
     return 0;
 }
 
 static int handle_creq_err(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
 
@@ -1097,42 +1262,23 @@ static int handle_creq_err(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_CREQ_NO_DATA) {
-                        send_txt(c, "%s", __(c, "\tE\tC7No character data "
-                                             "found."));
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7Couldn't request "
-                                             "character data."));
-                    }
-
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&c->mutex);
+    if((c = gcindex_find(dest))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_CREQ_NO_DATA) {
+                send_txt(c, "%s", __(c, "\tE\tC7No character data "
+                                     "found."));
+            }
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7Couldn't request "
+                                     "character data."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        gcindex_release(dest);
     }
 
     return 0;
@@ -1159,18 +1305,19 @@ static int handle_usrlogin_err(shipgate_conn_t *conn,
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
+    if((i = gcindex_find(gc))) {
+        if(i->cur_block == b) {
+            pthread_mutex_lock(&i->mutex);
             /* XXXX: Maybe send specific error messages sometime later? */
             send_txt(i, "%s", __(i, "\tE\tC7Login failed."));
-            break;
+            pthread_mutex_unlock(&i->mutex);
         }
+
+        gcindex_release(gc);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return rv;
 }
 
@@ -1186,17 +1333,18 @@ static int handle_blogin_err(shipgate_conn_t *c, shipgate_blogin_err_pkt *pkt) {
         return 0;
     }
 
-    pthread_rwlock_rdlock(&b->lock);
-
     /* Find the requested client and boot them off (regardless of the error type
        for now) */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
+    if((i = gcindex_find(gc))) {
+        if(i->cur_block == b) {
+            pthread_mutex_lock(&i->mutex);
             i->flags |= CLIENT_FLAG_DISCONNECTED;
+            block_wake(b);
+            pthread_mutex_unlock(&i->mutex);
         }
-    }
 
-    pthread_rwlock_unlock(&b->lock);
+        gcindex_release(gc);
+    }
 
     return 0;
 }
@@ -1283,29 +1431,24 @@ static int handle_friend(shipgate_conn_t *c, shipgate_friend_login_pkt *pkt) {
     }
 
     /* Find the user in question */
-    pthread_rwlock_rdlock(&b->lock);
-
-    TAILQ_FOREACH(cl, b->clients, qentry) {
-        if(cl->guildcard == ugc) {
+    if((cl = gcindex_find(ugc))) {
+        if(cl->cur_block == b) {
+            pthread_mutex_lock(&cl->mutex);
             /* The rest is easy */
             client_send_friendmsg(cl, on, pkt->friend_name, ms->name, fbl,
                                   pkt->friend_nick);
-            break;
+            pthread_mutex_unlock(&cl->mutex);
         }
-    }
 
-    pthread_rwlock_unlock(&b->lock);
+        gcindex_release(ugc);
+    }
 
     return 0;
 }
 
 static int handle_addfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
-    int i;
-    ship_t *s = c->ship;
-    block_t *b;
     ship_client_t *cl;
     uint32_t dest = ntohl(pkt->user_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
 
@@ -1314,53 +1457,30 @@ static int handle_addfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(cl, b->clients, qentry) {
-                pthread_mutex_lock(&cl->mutex);
-
-                if(cl->guildcard == dest && cl->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_NO_ERROR) {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Friend added."));
-                    }
-                    else {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't add "
-                                              "friend."));
-                    }
-
-                    done = 1;
-                }
-                else if(cl->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
+    if((cl = gcindex_find(dest))) {
+        pthread_mutex_lock(&cl->mutex);
 
-                pthread_mutex_unlock(&cl->mutex);
-
-                if(done) {
-                    break;
-                }
+        if(cl->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_NO_ERROR) {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Friend added."));
+            }
+            else {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't add "
+                                      "friend."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&cl->mutex);
+        gcindex_release(dest);
     }
 
     return 0;
 }
 
 static int handle_delfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
-    int i;
-    ship_t *s = c->ship;
-    block_t *b;
     ship_client_t *cl;
     uint32_t dest = ntohl(pkt->user_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
 
@@ -1369,41 +1489,22 @@ static int handle_delfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(cl, b->clients, qentry) {
-                pthread_mutex_lock(&cl->mutex);
-
-                if(cl->guildcard == dest && cl->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_NO_ERROR) {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Friend removed."));
-                    }
-                    else {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't remove "
-                                              "friend."));
-                    }
-
-                    done = 1;
-                }
-                else if(cl->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&cl->mutex);
+    if((cl = gcindex_find(dest))) {
+        pthread_mutex_lock(&cl->mutex);
 
-                if(done) {
-                    break;
-                }
+        if(cl->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_NO_ERROR) {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Friend removed."));
+            }
+            else {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't remove "
+                                      "friend."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&cl->mutex);
+        gcindex_release(dest);
     }
 
     return 0;
@@ -1422,11 +1523,11 @@ static int handle_kick(shipgate_conn_t *conn, shipgate_kick_pkt *pkt) {
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
+    if((i = gcindex_find(gc))) {
+        if(i->cur_block == b) {
+            pthread_mutex_lock(&i->mutex);
             /* Found them, send the message and disconnect the client */
             if(strlen(pkt->reason) > 0) {
                 send_message_box(i, "%s\n\n%s\n%s",
@@ -1439,11 +1540,13 @@ static int handle_kick(shipgate_conn_t *conn, shipgate_kick_pkt *pkt) {
             }
 
             i->flags |= CLIENT_FLAG_DISCONNECTED;
-            break;
+            block_wake(b);
+            pthread_mutex_unlock(&i->mutex);
         }
+
+        gcindex_release(gc);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1465,11 +1568,10 @@ static int handle_frlist(shipgate_conn_t *c, shipgate_friend_list_pkt *pkt) {
     b = s->blocks[block - 1];
     total = ntohs(pkt->hdr.pkt_len) - sizeof(shipgate_friend_list_pkt);
     msg[0] = '\0';
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
+    if((i = gcindex_find(gc))) {
+        if(i->cur_block == b) {
             pthread_mutex_lock(&i->mutex);
 
             if(!total) {
@@ -1512,15 +1614,16 @@ static int handle_frlist(shipgate_conn_t *c, shipgate_friend_list_pkt *pkt) {
             /* Send the message to the user */
             if(send_message_box(i, "%s", msg)) {
                 i->flags |= CLIENT_FLAG_DISCONNECTED;
+                block_wake(b);
             }
 
             pthread_mutex_unlock(&i->mutex);
 
-            break;
         }
+
+        gcindex_release(gc);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1582,11 +1685,10 @@ static int handle_useropt(shipgate_conn_t *c, shipgate_user_opt_pkt *pkt) {
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
+    if((i = gcindex_find(gc))) {
+        if(i->cur_block == b) {
             pthread_mutex_lock(&i->mutex);
 
             /* Deal with the options */
@@ -1677,11 +1779,11 @@ static int handle_useropt(shipgate_conn_t *c, shipgate_user_opt_pkt *pkt) {
             }
 
             pthread_mutex_unlock(&i->mutex);
-            break;
         }
+
+        gcindex_release(gc);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1697,11 +1799,10 @@ static int handle_bbopts(shipgate_conn_t *c, shipgate_bb_opts_pkt *pkt) {
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
+    if((i = gcindex_find(gc))) {
+        if(i->cur_block == b) {
             pthread_mutex_lock(&i->mutex);
 
             /* Copy the user's options */
@@ -1713,11 +1814,11 @@ static int handle_bbopts(shipgate_conn_t *c, shipgate_bb_opts_pkt *pkt) {
             send_simple(i, CHAR_DATA_REQUEST_TYPE, 0);
 
             pthread_mutex_unlock(&i->mutex);
-            break;
         }
+
+        gcindex_release(gc);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1925,11 +2026,10 @@ static int handle_sdata(shipgate_conn_t *c, shipgate_sdata_pkt *pkt) {
         return 0;
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
+    if((i = gcindex_find(gc))) {
+        if(i->cur_block == b) {
             pthread_mutex_lock(&i->mutex);
             script_execute(ScriptActionSData, i, SCRIPT_ARG_PTR, i,
                            SCRIPT_ARG_UINT32, ntohl(pkt->event_id),
@@ -1937,9 +2037,10 @@ static int handle_sdata(shipgate_conn_t *c, shipgate_sdata_pkt *pkt) {
                            SCRIPT_ARG_END);
             pthread_mutex_unlock(&i->mutex);
         }
+
+        gcindex_release(gc);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1980,6 +2081,14 @@ static int handle_qflag(shipgate_conn_t *c, shipgate_qflag_pkt *pkt) {
             pthread_mutex_lock(&i->mutex);
             l = i->cur_lobby;
 
+            /* Replies to the ship writing back flags that the quest set
+               earlier don't go to the quest at all. */
+            if(quest_flag_gate_reply(i, type == SHDR_TYPE_QFLAG_SET,
+                                     ntohl(pkt->quest_id), flag_id, value, 0)) {
+                pthread_mutex_unlock(&i->mutex);
+                break;
+            }
+
             /* Sanity check... Make sure the user hasn't been booted from the
                lobby somehow. */
             if(!l) {
@@ -1997,7 +2106,8 @@ static int handle_qflag(shipgate_conn_t *c, shipgate_qflag_pkt *pkt) {
                        something else like that... */
                     debug(DBG_WARN, "Shipgate attempted to sync long flag when "
                           "not requested by quest function!\n");
-                    return 0;
+                    pthread_mutex_unlock(&i->mutex);
+                    break;
                 }
 
                 /* Grab the register from the lobby... */
@@ -2064,6 +2174,14 @@ static int handle_qflag_err(shipgate_conn_t *c, shipgate_qflag_err_pkt *pkt) {
             pthread_mutex_lock(&i->mutex);
             l = i->cur_lobby;
 
+            /* Replies to the ship writing back flags that the quest set
+               earlier don't go to the quest at all. */
+            if(quest_flag_gate_reply(i, type == SHDR_TYPE_QFLAG_SET,
+                                     ntohl(pkt->quest_id), flag_id, value, 1)) {
+                pthread_mutex_unlock(&i->mutex);
+                break;
+            }
+
             /* Sanity check... Make sure the user hasn't been booted from the
                lobby somehow. */
             if(!l) {
@@ -2081,7 +2199,8 @@ static int handle_qflag_err(shipgate_conn_t *c, shipgate_qflag_err_pkt *pkt) {
                        something else like that... */
                     debug(DBG_WARN, "Shipgate attempted to sync long flag when "
                           "not requested by quest function!\n");
-                    return 0;
+                    pthread_mutex_unlock(&i->mutex);
+                    break;
                 }
 
                 /* Grab the register from the lobby... */
@@ -2377,33 +2496,6 @@ int shipgate_process_pkt(shipgate_conn_t *c) {
     return rv;
 }
 
-/* Send any piled up data. */
-int shipgate_send_pkts(shipgate_conn_t *c) {
-    ssize_t amt;
-
-    /* Don't even try if there's not a connection. */
-    if(!c->has_key || c->sock < 0) {
-        return 0;
-    }
-
-    /* Send as much as we can. */
-    amt = sg_send(c, c->sendbuf, c->sendbuf_cur);
-
-    if(amt == -1) {
-        perror("send");
-        return -1;
-    }
-    else if(amt == c->sendbuf_cur) {
-        c->sendbuf_cur = 0;
-    }
-    else {
-        memmove(c->sendbuf, c->sendbuf + amt, c->sendbuf_cur - amt);
-        c->sendbuf_cur -= amt;
-    }
-
-    return 0;
-}
-
 /* Packets are below here. */
 /* Send the shipgate a character data save request. */
 int shipgate_send_cdata(shipgate_conn_t *c, uint32_t gc, uint32_t slot,
@@ -3246,6 +3338,12 @@ int shipgate_send_qflag(shipgate_conn_t *c, ship_client_t *sc, int set,
     if(!sendbuf)
         return -1;
 
+    /* Unlike most packets, it matters if this one doesn't go anywhere. Either
+       a quest is going to wait on the reply, or a cached flag is going to be
+       counted as written back. */
+    if(!sg_can_send(c, 1))
+        return -1;
+
     /* Fill in the packet... */
     memset(pkt, 0, sizeof(shipgate_qflag_pkt));
     pkt->hdr.pkt_len = htons(sizeof(shipgate_qflag_pkt));
@@ -21,6 +21,7 @@
 
 #include <time.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #ifdef HAVE_SSIZE_T
 #undef HAVE_SSIZE_T
@@ -69,6 +70,16 @@ typedef struct shipgate_hdr {
     uint16_t flags;
 } PACKED shipgate_hdr_t;
 
+/* A packet waiting to be written out to the shipgate. The generation is that of
+   the connection it was meant for, so that nothing meant for an old connection
+   can go out on a new one. */
+typedef struct shipgate_qpkt {
+    struct shipgate_qpkt *next;
+    uint32_t gen;
+    int len;
+    uint8_t data[0];
+} shipgate_qpkt_t;
+
 /* Shipgate connection structure. */
 struct shipgate_conn {
     int sock;
@@ -87,10 +98,28 @@ struct shipgate_conn {
     int recvbuf_size;
     shipgate_hdr_t pkt;
 
-    unsigned char *sendbuf;
-    int sendbuf_cur;
-    int sendbuf_size;
-    int sendbuf_start;
+    /* Packets to be sent are pushed onto qhead by whatever thread is sending
+       them, without taking any locks, and are written out to the session by
+       the writer thread, which is the only thing that touches qtail. */
+    shipgate_qpkt_t *qhead;
+    shipgate_qpkt_t *qtail;
+    shipgate_qpkt_t qstub;
+    size_t qbytes;
+
+    /* The generation is bumped each time the writer is started or stopped.
+       wrunning and wgen are read by the senders without taking any locks.
+       wthd_gen is the generation the running writer is sending for. */
+    pthread_t wthd;
+    pthread_mutex_t wmutex;
+    pthread_cond_t wcond;
+    pthread_cond_t wdcond;
+    uint32_t wgen;
+    uint32_t wthd_gen;
+    int wrunning;
+    int wsleeping;
+    int wstop;
+    int wdone;
+    int wfailed;
 };
 
 #ifndef SHIPGATE_CONN_DEFINED
@@ -630,12 +659,13 @@ int shipgate_reconnect(shipgate_conn_t *conn);
 /* Clean up a shipgate connection. */
 void shipgate_cleanup(shipgate_conn_t *c);
 
+/* Drop the connection to the shipgate after it has been lost, so that it can
+   be reconnected later. */
+void shipgate_disconnect(shipgate_conn_t *c);
+
 /* Read data from the shipgate. */
 int shipgate_process_pkt(shipgate_conn_t *c);
 
-/* Send any piled up data. */
-int shipgate_send_pkts(shipgate_conn_t *c);
-
 /* Send a newly opened ship's information to the shipgate. */
 int shipgate_send_ship_info(shipgate_conn_t *c, ship_t *ship);
 
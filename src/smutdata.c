@@ -20,7 +20,6 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
-#include <iconv.h>
 #include <wchar.h>
 #include <wctype.h>
 
@@ -46,6 +45,370 @@ static wchar_t **smutdata_east = NULL;
     buf[offset] | (buf[offset + 1] << 8) | \
         (buf[offset + 2] << 16) | (buf[offset + 3] << 24)
 
+/* The word lists are compiled into an Aho-Corasick automaton for each language
+   when they're read in, so that a string can be checked against every word in
+   one pass over it, rather than trying each word at each spot in the string. */
+
+/* Fake characters standing in for the start and end of the string. These are
+   outside of the range of Unicode, so they'll never show up in real text. */
+#define SMUT_BOS            ((wchar_t)0x110000)
+#define SMUT_EOS            ((wchar_t)0x110001)
+
+/* Flags describing the pattern that ends at a node. */
+#define SMUT_HAS_BOS        (1 << 0)
+#define SMUT_HAS_EOS        (1 << 1)
+#define SMUT_LEAD_SPACE     (1 << 2)
+#define SMUT_LAST_SPACE     (1 << 3)
+
+/* How many characters we hold onto while censoring. This must be a power of
+   two and longer than any pattern. Words in the file are at most 32 characters
+   long, and the start/end markers only ever replace a space. */
+#define SMUT_RING           64
+#define SMUT_MAXLEN         (SMUT_RING - 2)
+
+typedef struct smut_node {
+    uint32_t edges;
+    uint32_t nedges;
+    uint32_t fail;
+    uint32_t dict;
+    int32_t word;
+    uint8_t plen;
+    uint8_t flags;
+} smut_node_t;
+
+typedef struct smut_ac {
+    smut_node_t *nodes;
+    wchar_t *sym;
+    uint32_t *next;
+    uint32_t maxlen;
+} smut_ac_t;
+
+/* The trie that the automaton is built from, before it is flattened out. */
+typedef struct smut_tnode {
+    wchar_t c;
+    uint32_t child;
+    uint32_t sibling;
+    int32_t word;
+    uint8_t plen;
+    uint8_t flags;
+} smut_tnode_t;
+
+typedef struct smut_trie {
+    smut_tnode_t *nodes;
+    uint32_t count;
+    uint32_t size;
+    uint32_t maxlen;
+} smut_trie_t;
+
+static smut_ac_t smut_west_ac;
+static smut_ac_t smut_east_ac;
+
+static int smut_trie_add(smut_trie_t *t, const wchar_t *p, size_t len,
+                         int32_t word) {
+    uint32_t n = 0, c;
+    size_t i;
+    smut_tnode_t *tmp;
+
+    for(i = 0; i < len; ++i) {
+        for(c = t->nodes[n].child; c; c = t->nodes[c].sibling) {
+            if(t->nodes[c].c == p[i])
+                break;
+        }
+
+        if(!c) {
+            if(t->count == t->size) {
+                tmp = (smut_tnode_t *)realloc(t->nodes, sizeof(smut_tnode_t) *
+                                              t->size * 2);
+                if(!tmp)
+                    return -1;
+
+                t->nodes = tmp;
+                t->size *= 2;
+            }
+
+            c = t->count++;
+            t->nodes[c].c = p[i];
+            t->nodes[c].child = 0;
+            t->nodes[c].sibling = t->nodes[n].child;
+            t->nodes[c].word = -1;
+            t->nodes[c].plen = 0;
+            t->nodes[c].flags = 0;
+            t->nodes[n].child = c;
+        }
+
+        n = c;
+    }
+
+    /* If more than one word ends up here, the one earlier in the list wins,
+       just like it would have when checking them in order. */
+    if(t->nodes[n].word < 0 || word < t->nodes[n].word) {
+        t->nodes[n].word = word;
+        t->nodes[n].plen = (uint8_t)len;
+        t->nodes[n].flags = 0;
+
+        if(p[0] == SMUT_BOS)
+            t->nodes[n].flags |= SMUT_HAS_BOS;
+        else if(p[0] == L' ')
+            t->nodes[n].flags |= SMUT_LEAD_SPACE;
+
+        if(p[len - 1] == SMUT_EOS)
+            t->nodes[n].flags |= SMUT_HAS_EOS | SMUT_LAST_SPACE;
+        else if(p[len - 1] == L' ')
+            t->nodes[n].flags |= SMUT_LAST_SPACE;
+    }
+
+    if(len > t->maxlen)
+        t->maxlen = (uint32_t)len;
+
+    return 0;
+}
+
+static int smut_trie_add_tabs(smut_trie_t *t, wchar_t *p, size_t len,
+                              size_t pos, int32_t word) {
+    static const wchar_t tabchars[3] = { L'\t', L'l', L'|' };
+    int i, rv = 0;
+
+    /* A tab in a western word matches 'l' and '|', so add a copy of the word
+       with each of them in its place. */
+    for(; pos < len; ++pos) {
+        if(p[pos] == L'\t') {
+            for(i = 0; i < 3 && !rv; ++i) {
+                p[pos] = tabchars[i];
+                rv = smut_trie_add_tabs(t, p, len, pos + 1, word);
+            }
+
+            p[pos] = L'\t';
+            return rv;
+        }
+    }
+
+    return smut_trie_add(t, p, len, word);
+}
+
+static int smut_add_word(smut_trie_t *t, const wchar_t *w, int32_t word,
+                         int west) {
+    wchar_t var[4][SMUT_RING];
+    size_t lens[4], len = wcslen(w);
+    int i, nv = 1, cnt;
+
+    if(!len || len > SMUT_MAXLEN)
+        return 0;
+
+    wmemcpy(var[0], w, len);
+    lens[0] = len;
+
+    /* A word starting with a space has that space ignored at the very start of
+       the string... */
+    if(w[0] == L' ') {
+        var[1][0] = SMUT_BOS;
+        wmemcpy(var[1] + 1, w + 1, len - 1);
+        lens[1] = len;
+        nv = 2;
+    }
+
+    /* ... and one ending with a space can match with the space missing at the
+       very end of the string. */
+    cnt = nv;
+    for(i = 0; i < cnt; ++i) {
+        if(lens[i] < 2 || var[i][lens[i] - 1] != L' ')
+            continue;
+
+        wmemcpy(var[nv], var[i], lens[i]);
+        var[nv][lens[i] - 1] = SMUT_EOS;
+        lens[nv++] = lens[i];
+    }
+
+    for(i = 0; i < nv; ++i) {
+        if(west) {
+            if(smut_trie_add_tabs(t, var[i], lens[i], 0, word))
+                return -1;
+        }
+        else if(smut_trie_add(t, var[i], lens[i], word)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static inline uint32_t smut_goto(const smut_ac_t *ac, uint32_t n, wchar_t c) {
+    uint32_t lo = ac->nodes[n].edges, hi = lo + ac->nodes[n].nedges, mid;
+
+    /* The root is never the target of an edge, so 0 means there wasn't one. */
+    while(lo < hi) {
+        mid = (lo + hi) >> 1;
+
+        if(ac->sym[mid] == c)
+            return ac->next[mid];
+        else if(ac->sym[mid] < c)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return 0;
+}
+
+static inline uint32_t smut_step(const smut_ac_t *ac, uint32_t n, wchar_t c) {
+    uint32_t g;
+
+    for(;;) {
+        if((g = smut_goto(ac, n, c)))
+            return g;
+
+        if(!n)
+            return 0;
+
+        n = ac->nodes[n].fail;
+    }
+}
+
+static int smut_compile(smut_ac_t *ac, smut_trie_t *t) {
+    uint32_t *queue, *map, head, tail = 0, e = 0, n, c, u, v, f, g, i, j;
+    wchar_t ts;
+    uint32_t tn;
+
+    queue = (uint32_t *)malloc(sizeof(uint32_t) * t->count);
+    map = (uint32_t *)malloc(sizeof(uint32_t) * t->count);
+    ac->nodes = (smut_node_t *)malloc(sizeof(smut_node_t) * t->count);
+    ac->sym = (wchar_t *)malloc(sizeof(wchar_t) * t->count);
+    ac->next = (uint32_t *)malloc(sizeof(uint32_t) * t->count);
+
+    if(!queue || !map || !ac->nodes || !ac->sym || !ac->next) {
+        free(queue);
+        free(map);
+        free(ac->nodes);
+        free(ac->sym);
+        free(ac->next);
+        memset(ac, 0, sizeof(smut_ac_t));
+        return -1;
+    }
+
+    /* Flatten the trie out in breadth-first order, with each node's edges
+       sorted so that they can be binary searched. */
+    queue[tail++] = 0;
+    map[0] = 0;
+
+    for(head = 0; head < tail; ++head) {
+        n = queue[head];
+        ac->nodes[head].edges = e;
+        ac->nodes[head].nedges = 0;
+        ac->nodes[head].fail = 0;
+        ac->nodes[head].dict = 0;
+        ac->nodes[head].word = t->nodes[n].word;
+        ac->nodes[head].plen = t->nodes[n].plen;
+        ac->nodes[head].flags = t->nodes[n].flags;
+
+        for(c = t->nodes[n].child; c; c = t->nodes[c].sibling) {
+            map[c] = tail;
+            queue[tail++] = c;
+
+            /* Insertion sort is fine here, there aren't many edges. */
+            ts = t->nodes[c].c;
+            tn = map[c];
+            for(j = e + ac->nodes[head].nedges; j > e && ac->sym[j - 1] > ts;
+                --j) {
+                ac->sym[j] = ac->sym[j - 1];
+                ac->next[j] = ac->next[j - 1];
+            }
+
+            ac->sym[j] = ts;
+            ac->next[j] = tn;
+            ++ac->nodes[head].nedges;
+        }
+
+        e += ac->nodes[head].nedges;
+    }
+
+    /* Fill in the failure links. Since the nodes are in breadth-first order,
+       everything shallower than the node being looked at is already done. */
+    for(u = 0; u < tail; ++u) {
+        for(i = 0; i < ac->nodes[u].nedges; ++i) {
+            v = ac->next[ac->nodes[u].edges + i];
+            f = 0;
+
+            if(u) {
+                ts = ac->sym[ac->nodes[u].edges + i];
+
+                for(g = ac->nodes[u].fail; ; g = ac->nodes[g].fail) {
+                    if((f = smut_goto(ac, g, ts)) || !g)
+                        break;
+                }
+            }
+
+            ac->nodes[v].fail = f;
+            ac->nodes[v].dict = ac->nodes[f].word >= 0 ? f : ac->nodes[f].dict;
+        }
+    }
+
+    ac->maxlen = t->maxlen;
+    free(queue);
+    free(map);
+
+    return 0;
+}
+
+static int smut_build(smut_ac_t *ac, wchar_t **words, uint32_t count,
+                      int west) {
+    smut_trie_t t;
+    uint32_t i;
+    int rv = -1;
+
+    t.size = 256;
+    t.count = 1;
+    t.maxlen = 0;
+
+    if(!(t.nodes = (smut_tnode_t *)malloc(sizeof(smut_tnode_t) * t.size)))
+        return -1;
+
+    memset(&t.nodes[0], 0, sizeof(smut_tnode_t));
+    t.nodes[0].word = -1;
+
+    for(i = 0; i < count; ++i) {
+        if(!words[i])
+            continue;
+
+        if(smut_add_word(&t, words[i], (int32_t)i, west))
+            goto out;
+    }
+
+    rv = smut_compile(ac, &t);
+
+out:
+    free(t.nodes);
+    return rv;
+}
+
+static void smut_free(smut_ac_t *ac) {
+    free(ac->nodes);
+    free(ac->sym);
+    free(ac->next);
+    memset(ac, 0, sizeof(smut_ac_t));
+}
+
+static inline uint32_t smut_first_match(const smut_ac_t *ac, uint32_t n) {
+    return ac->nodes[n].word >= 0 ? n : ac->nodes[n].dict;
+}
+
+/* Figure out where a match that ends at position t begins in the string, or
+   return -1 if it doesn't count. Position 0 is the start marker, so the first
+   real character in the string is at 1. */
+static inline long smut_match_start(const smut_node_t *m, size_t t) {
+    long j;
+
+    if((m->flags & SMUT_HAS_BOS))
+        return 0;
+
+    j = (long)(t - m->plen);
+
+    /* Words that start with a space don't get to use it at the very start of
+       the string. That case is covered by the version with the start marker. */
+    if(j == 0 && (m->flags & SMUT_LEAD_SPACE))
+        return -1;
+
+    return j;
+}
+
 int smutdata_read(const char *fn) {
     uint32_t entries1, entries2, i, j, off1, off2;
     uint16_t wordbuf[32];
@@ -135,7 +498,7 @@ int smutdata_read(const char *fn) {
         outb = 128;
         inptr = (ICONV_CONST char *)wordbuf;
         outptr = convbuf;
-        if(iconv(ic_utf16_to_utf8, &inptr, &inb, &outptr,
+        if(tconv(ic_utf16_to_utf8, &inptr, &inb, &outptr,
                  &outb) == (size_t)-1) {
             debug(DBG_WARN, "Error converting smutdata string: %s\n",
                   strerror(errno));
@@ -189,7 +552,7 @@ int smutdata_read(const char *fn) {
         outb = 128;
         inptr = (ICONV_CONST char *)wordbuf;
         outptr = convbuf;
-        if(iconv(ic_utf16_to_utf8, &inptr, &inb, &outptr,
+        if(tconv(ic_utf16_to_utf8, &inptr, &inb, &outptr,
                  &outb) == (size_t)-1) {
             debug(DBG_WARN, "Error converting smutdata string: %s\n",
                   strerror(errno));
@@ -215,6 +578,14 @@ int smutdata_read(const char *fn) {
     /* Clean up... */
     free(ucbuf);
 
+    /* Compile the lists so they can actually be used. */
+    if(smut_build(&smut_west_ac, smutdata_west, smutdata_west_count, 1) ||
+       smut_build(&smut_east_ac, smutdata_east, smutdata_east_count, 0)) {
+        debug(DBG_WARN, "Error compiling smutdata word lists\n");
+        smutdata_cleanup();
+        return -9;
+    }
+
     return 0;
 }
 
@@ -224,6 +595,9 @@ void smutdata_cleanup(void) {
     if(!smutdata_west)
         return;
 
+    smut_free(&smut_west_ac);
+    smut_free(&smut_east_ac);
+
     for(i = 0; i < smutdata_west_count; ++i) {
         free(smutdata_west[i]);
     }
@@ -241,335 +615,217 @@ void smutdata_cleanup(void) {
     smutdata_east = NULL;
 }
 
-int smutdata_check_string(const char *str, int which) {
-    size_t len = strlen(str);
-    uint32_t i, k;
-    size_t j, len2;
-    int matched = 1;
-    wchar_t *real_wstr, *cmp, *wstr;
+static int smut_scan(const smut_ac_t *ac, int lower, const char *str) {
+    size_t n, left = strlen(str), t = 0;
+    uint32_t s, m;
     mbstate_t state;
-    const char *tmp;
-    wchar_t tc;
+    wchar_t c = SMUT_BOS;
+    int done = 0;
 
-    /* If we don't have the censor loaded, then there's nothing to do. */
-    if(!smutdata_west)
-        return 0;
-
-    /* Sanity check... */
-    if(!(which & SMUTDATA_BOTH))
-        return 0;
-
-    /* Convert the input string to a string of wchar_t. */
-    if(!(real_wstr = (wchar_t *)malloc((len + 1) * sizeof(wchar_t))))
+    /* Nothing can match an empty string. */
+    if(!left)
         return 0;
 
     memset(&state, 0, sizeof(mbstate_t));
-    tmp = str;
-    mbsrtowcs(real_wstr, &tmp, len + 1, &state);
-
-    /* Does this string start with a language marker? If so, ignore it. */
-    if(len >= 2 && real_wstr[0] == L'\t' &&
-       (real_wstr[1] == L'J' || real_wstr[1] == L'E')) {
-        len -= 2;
-        wstr = real_wstr + 2;
-    }
-    else {
-        wstr = real_wstr;
-    }
+    s = smut_step(ac, 0, SMUT_BOS);
 
+    for(;;) {
+        for(m = smut_first_match(ac, s); m; m = ac->nodes[m].dict) {
+            if(smut_match_start(&ac->nodes[m], t) >= 0)
+                return 1;
+        }
 
-    /* Check the western language list. */
-    if((which & SMUTDATA_WEST)) {
-        for(j = 0; j < len; ++j) {
-            for(i = 0; i < smutdata_west_count; ++i) {
-                len2 = wcslen(smutdata_west[i]);
-                cmp = smutdata_west[i];
-                matched = 1;
+        if(done)
+            return 0;
 
-                /* If we're at the beginning of the string and the word we're
-                   checking starts with a space, ignore it. */
-                if(j == 0 && cmp[0] == L' ') {
-                    ++cmp;
-                    --len2;
-                }
-
-                for(k = 0; k < len - j && k < len2; ++k) {
-                    /* Check if we have a match. Note that a tab character
-                       matches 'l' and '|'. */
-                    tc = towlower(wstr[j + k]);
-                    if(cmp[k] != tc) {
-                        if(cmp[k] != L'\t' || (tc != L'l' && tc != L'|')) {
-                            matched = 0;
-                            break;
-                        }
-                    }
-                }
-
-                /* If we appear to have something matched right now, check if
-                   it is only set because we ran out of stuff to compare or if
-                   there's actually a match. */
-                if(matched && !wstr[j + k]) {
-                    /* We're at the end of the string... Did we have a real
-                       match (or one sans an ending space at most)? */
-                    if(len2 > k) {
-                        if(cmp[k] != L' ')
-                            matched = 0;
-
-                        if(len2 != k + 1)
-                            matched = 0;
-                    }
-                }
+        /* Decode the next character directly out of the UTF-8 input. Anything
+           that doesn't decode ends the string. */
+        n = mbrtowc(&c, str, left, &state);
+        if(n == 0 || n > left) {
+            c = SMUT_EOS;
+            done = 1;
+        }
+        else {
+            str += n;
+            left -= n;
 
-                /* If we've still got a match, then return that we matched
-                   something... */
-                if(matched) {
-                    free(real_wstr);
-                    return 1;
-                }
-            }
+            if(lower)
+                c = towlower(c);
         }
+
+        s = smut_step(ac, s, c);
+        ++t;
     }
+}
 
-    /* Check the eastern language list. */
-    if((which & SMUTDATA_EAST)) {
-        for(j = 0; j < len; ++j) {
-            for(i = 0; i < smutdata_east_count; ++i) {
-                len2 = wcslen(smutdata_east[i]);
-                cmp = smutdata_east[i];
-                matched = 1;
-
-                /* If we're at the beginning of the string and the word we're
-                   checking starts with a space, ignore it. */
-                if(j == 0 && cmp[0] == L' ') {
-                    ++cmp;
-                    --len2;
-                }
+int smutdata_check_string(const char *str, int which) {
+    /* If we don't have the censor loaded, then there's nothing to do. */
+    if(!smutdata_west)
+        return 0;
 
-                for(k = 0; k < len - j && k < len2; ++k) {
-                    /* Check if we have a match. */
-                    if(cmp[k] != wstr[j + k]) {
-                        matched = 0;
-                        break;
-                    }
-                }
+    /* Sanity check... */
+    if(!(which & SMUTDATA_BOTH))
+        return 0;
 
-                /* If we appear to have something matched right now, check if
-                   it is only set because we ran out of stuff to compare or if
-                   there's actually a match. */
-                if(matched && !wstr[j + k]) {
-                    /* We're at the end of the string... Did we have a real
-                       match (or one sans an ending space at most)? */
-                    if(len2 > k) {
-                        if(cmp[k] != L' ')
-                            matched = 0;
-
-                        if(len2 != k + 1)
-                            matched = 0;
-                    }
-                }
+    /* Does this string start with a language marker? If so, ignore it. */
+    if(str[0] == '\t' && (str[1] == 'J' || str[1] == 'E'))
+        str += 2;
 
-                /* If we've still got a match, then return that we matched
-                   something... */
-                if(matched) {
-                    free(real_wstr);
-                    return 1;
-                }
-            }
-        }
-    }
+    /* Check the western language list. Case doesn't matter for it. */
+    if((which & SMUTDATA_WEST) && smut_scan(&smut_west_ac, 1, str))
+        return 1;
+
+    /* Check the eastern language list. */
+    if((which & SMUTDATA_EAST) && smut_scan(&smut_east_ac, 0, str))
+        return 1;
 
-    free(real_wstr);
     return 0;
 }
 
 static const char censor_str[] = "#!@%";
 
-char *smutdata_censor_string(const char *str, int which) {
-    size_t len = strlen(str);
-    uint32_t i, k;
-    size_t j, len2;
-    int matched = 0, skip = 0;
-    wchar_t *wstr, *cmp, *real_wstr;
-    const wchar_t *tmp2;
-    mbstate_t state;
-    const char *tmp;
-    char *rv;
-    wchar_t tc;
+/* Censor in into out, which may be the same buffer. Only a handful of
+   characters are held onto at a time, since nothing more than the longest word
+   back from the one just read can be the start of a match anymore. Anything
+   written out is never longer than what it came from, so the output never gets
+   ahead of the input. */
+static void smut_censor(const smut_ac_t *ac, int lower, const char *in,
+                        char *out) {
+    wchar_t ring[SMUT_RING];
+    int32_t word[SMUT_RING];
+    uint8_t mlen[SMUT_RING], mflags[SMUT_RING];
+    size_t n, left = strlen(in), t = 0, r = 0, e = 0, next = 0, o = 0, k;
+    uint32_t s, m, idx;
+    mbstate_t ist, ost;
+    const smut_node_t *node;
+    wchar_t c;
+    long j;
+    int done = 0;
+
+    memset(&ist, 0, sizeof(mbstate_t));
+    memset(&ost, 0, sizeof(mbstate_t));
+
+    for(k = 0; k < SMUT_RING; ++k) {
+        word[k] = -1;
+    }
 
-    /* Convert the input string to a string of wchar_t. */
-    if(!(real_wstr = (wchar_t *)malloc((len + 1) * sizeof(wchar_t))))
-        return NULL;
+    s = smut_step(ac, 0, SMUT_BOS);
 
-    memset(&state, 0, sizeof(mbstate_t));
-    tmp = str;
-    len = mbsrtowcs(real_wstr, &tmp, len + 1, &state);
+    for(;;) {
+        /* Note where any words ending here start. Only the first word in the
+           list that starts at any given spot matters. */
+        for(m = smut_first_match(ac, s); m; m = ac->nodes[m].dict) {
+            node = &ac->nodes[m];
 
-    /* Sanity check... */
-    if(!smutdata_west)
-        goto out;
+            if((j = smut_match_start(node, t)) < 0)
+                continue;
 
-    if(!(which & SMUTDATA_BOTH))
-        goto out;
+            idx = (uint32_t)j & (SMUT_RING - 1);
+            if(word[idx] < 0 || node->word < word[idx]) {
+                word[idx] = node->word;
+                mlen[idx] = node->plen - ((node->flags & SMUT_HAS_BOS) ? 1 : 0);
+                mflags[idx] = node->flags;
+            }
+        }
 
-    /* Does this string start with a language marker? If so, ignore it. */
-    if(len >= 2 && real_wstr[0] == L'\t' &&
-       (real_wstr[1] == L'J' || real_wstr[1] == L'E')) {
-        len -= 2;
-        wstr = real_wstr + 2;
-    }
-    else {
-        wstr = real_wstr;
-    }
+        /* Anything far enough back can't have any more matches starting at it,
+           so censor it if need be and write it out. */
+        while(e < r && (done || r - e > ac->maxlen)) {
+            idx = e & (SMUT_RING - 1);
 
-    /* Check the western language list. */
-    if((which & SMUTDATA_WEST)) {
-        for(j = 0; j < len; ++j) {
-            for(i = 0; i < smutdata_west_count; ++i) {
-                len2 = wcslen(smutdata_west[i]);
-                cmp = smutdata_west[i];
-                matched = 1;
-                skip = 0;
-
-                /* If we're at the beginning of the string and the word we're
-                   checking starts with a space, ignore it. */
-                if(j == 0 && cmp[0] == L' ') {
-                    ++cmp;
-                    --len2;
-                    skip = 1;
-                }
+            if(e >= next && word[idx] >= 0) {
+                /* Don't censor spaces. */
+                for(k = 0; k < mlen[idx] && e + k < r; ++k) {
+                    c = ring[(e + k) & (SMUT_RING - 1)];
 
-                for(k = 0; k < len - j && k < len2; ++k) {
-                    /* Check if we have a match. Note that a tab character
-                       matches 'l' and '|'. */
-                    tc = towlower(wstr[j + k]);
-                    if(cmp[k] != tc) {
-                        if(cmp[k] != L'\t' || (tc != L'l' && tc != L'|')) {
-                            matched = 0;
-                            break;
-                        }
+                    if(c != L' ') {
+                        ring[(e + k) & (SMUT_RING - 1)] =
+                            censor_str[(k + (mflags[idx] & SMUT_HAS_BOS)) &
+                                       0x03];
                     }
                 }
 
-                /* If we appear to have something matched right now, check if
-                   it is only set because we ran out of stuff to compare or if
-                   there's actually a match. */
-                if(matched && !wstr[j + k]) {
-                    /* We're at the end of the string... Did we have a real
-                       match (or one sans an ending space at most)? */
-                    if(len2 > k) {
-                        if(cmp[k] != L' ')
-                            matched = 0;
-
-                        if(len2 != k + 1)
-                            matched = 0;
-                    }
-                }
+                /* Move on to the character after what we censored, unless the
+                   word ended in a space, which can start the next one. */
+                next = e + mlen[idx];
 
-                /* If we've still got a match, then break out, so we can do the
-                   censoring...*/
-                if(matched) {
-                    break;
-                }
+                if((mflags[idx] & SMUT_LAST_SPACE))
+                    --next;
+
+                if(next <= e)
+                    next = e + 1;
             }
 
-            /* Do we have something to censor? If so, do it and move on to the
-               next character after what we censored. */
-            if(matched) {
-                for(k = 0; k < len2; ++k) {
-                    /* Don't censor spaces. */
-                    if(wstr[j + k] && wstr[j + k] != L' ') {
-                        wstr[j + k] = censor_str[(k + skip) & 0x03];
-                    }
-                }
+            word[idx] = -1;
+            n = wcrtomb(out + o, ring[idx], &ost);
 
-                j += len2 - 1;
+            if(n != (size_t)-1)
+                o += n;
 
-                if(cmp[len2 - 1] == L' ')
-                    --j;
-            }
+            ++e;
         }
-    }
 
-    /* Check the eastern language list. */
-    if((which & SMUTDATA_EAST)) {
-        for(j = 0; j < len; ++j) {
-            for(i = 0; i < smutdata_east_count; ++i) {
-                len2 = wcslen(smutdata_east[i]);
-                cmp = smutdata_east[i];
-                matched = 1;
-                skip = 0;
-
-                /* If we're at the beginning of the string and the word we're
-                   checking starts with a space, ignore it. */
-                if(j == 0 && cmp[0] == L' ') {
-                    ++cmp;
-                    --len2;
-                    skip = 1;
-                }
+        if(done)
+            break;
 
-                for(k = 0; k < len - j && k < len2; ++k) {
-                    /* Check if we have a match. */
-                    if(cmp[k] != wstr[j + k]) {
-                        matched = 0;
-                        break;
-                    }
-                }
+        n = mbrtowc(&c, in, left, &ist);
+        if(n == 0 || n > left) {
+            c = SMUT_EOS;
+            done = 1;
+        }
+        else {
+            ring[r & (SMUT_RING - 1)] = c;
+            in += n;
+            left -= n;
+            ++r;
+
+            if(lower)
+                c = towlower(c);
+        }
 
-                /* If we appear to have something matched right now, check if
-                   it is only set because we ran out of stuff to compare or if
-                   there's actually a match. */
-                if(matched && !wstr[j + k]) {
-                    /* We're at the end of the string... Did we have a real
-                       match (or one sans an ending space at most)? */
-                    if(len2 > k) {
-                        if(cmp[k] != L' ')
-                            matched = 0;
-
-                        if(len2 != k + 1)
-                            matched = 0;
-                    }
-                }
+        s = smut_step(ac, s, c);
+        ++t;
+    }
 
-                /* If we've still got a match, then break out, so we can do the
-                   censoring...*/
-                if(matched) {
-                    break;
-                }
-            }
+    /* If we stopped early on something we couldn't decode, copy the rest over
+       as it is. */
+    if(left && *in) {
+        memmove(out + o, in, left);
+        o += left;
+    }
 
-            /* Do we have something to censor? If so, do it and move on to the
-               next character after what we censored. */
-            if(matched) {
-                for(k = 0; k < len2; ++k) {
-                    /* Don't censor spaces. */
-                    if(wstr[j + k] && wstr[j + k] != L' ') {
-                        wstr[j + k] = censor_str[(k + skip) & 0x03];
-                    }
-                }
+    out[o] = '\0';
+}
 
-                j += len2 - 1;
+char *smutdata_censor_string(const char *str, int which) {
+    size_t len = strlen(str), off = 0;
+    char *rv;
 
-                if(cmp[len2 - 1] == L' ')
-                    --j;
-            }
-        }
-    }
+    if(!(rv = (char *)malloc(len + 1)))
+        return NULL;
 
-    /* Copy over the output. */
-out:
-    memset(&state, 0, sizeof(mbstate_t));
-    tmp2 = real_wstr;
-    len2 = wcsrtombs(NULL, &tmp2, 0, &state);
+    /* Sanity check... */
+    if(!smutdata_west || !(which & SMUTDATA_BOTH)) {
+        memcpy(rv, str, len + 1);
+        return rv;
+    }
 
-    if(!(rv = (char *)malloc(len2 + 1))) {
-        free(real_wstr);
-        return NULL;
+    /* Does this string start with a language marker? If so, ignore it. */
+    if(str[0] == '\t' && (str[1] == 'J' || str[1] == 'E')) {
+        rv[0] = str[0];
+        rv[1] = str[1];
+        off = 2;
     }
 
-    memset(&state, 0, sizeof(mbstate_t));
-    tmp2 = real_wstr;
-    wcsrtombs(rv, &tmp2, len2 + 1, &state);
-    free(real_wstr);
+    /* Censor against the western language list, then the eastern one on top of
+       whatever that left. */
+    if((which & SMUTDATA_WEST))
+        smut_censor(&smut_west_ac, 1, str + off, rv + off);
+    else
+        memcpy(rv + off, str + off, len + 1 - off);
+
+    if((which & SMUTDATA_EAST))
+        smut_censor(&smut_east_ac, 0, rv + off, rv + off);
 
     return rv;
 }
@@ -0,0 +1,162 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include <sylverant/debug.h>
+
+#include "startup.h"
+#include "utils.h"
+
+#define TASK_WAITING    0
+#define TASK_RUNNING    1
+#define TASK_DONE       2
+
+typedef struct startup_graph {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    startup_task_t *tasks;
+    int *state;
+    int count;
+    int left;
+    sylverant_ship_t *cfg;
+} startup_graph_t;
+
+static int task_ready(startup_graph_t *g, int i) {
+    int j, d;
+
+    if(g->state[i] != TASK_WAITING)
+        return 0;
+
+    for(j = 0; j < STARTUP_MAX_DEPS; ++j) {
+        if((d = g->tasks[i].deps[j]) < 0)
+            break;
+
+        if(g->state[d] != TASK_DONE)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void *startup_thd(void *d) {
+    startup_graph_t *g = (startup_graph_t *)d;
+    startup_task_t *t;
+    uint64_t start;
+    int i;
+
+    pthread_mutex_lock(&g->mutex);
+
+    while(g->left) {
+        for(i = 0; i < g->count; ++i) {
+            if(task_ready(g, i))
+                break;
+        }
+
+        /* Nothing can run yet, so wait for something to finish. */
+        if(i == g->count) {
+            pthread_cond_wait(&g->cond, &g->mutex);
+            continue;
+        }
+
+        t = &g->tasks[i];
+        g->state[i] = TASK_RUNNING;
+        pthread_mutex_unlock(&g->mutex);
+
+        start = get_ms_time();
+        t->result = t->run(g->cfg);
+        t->ms = get_ms_time() - start;
+
+        pthread_mutex_lock(&g->mutex);
+        g->state[i] = TASK_DONE;
+        --g->left;
+        pthread_cond_broadcast(&g->cond);
+    }
+
+    pthread_mutex_unlock(&g->mutex);
+    return NULL;
+}
+
+int startup_run(startup_task_t *tasks, int count, int threads,
+                sylverant_ship_t *cfg) {
+    startup_graph_t g;
+    pthread_t *thds;
+    int i, started = 0, rv = 0;
+    uint64_t start = get_ms_time();
+
+    g.tasks = tasks;
+    g.count = g.left = count;
+    g.cfg = cfg;
+
+    if(!(g.state = (int *)calloc(count, sizeof(int)))) {
+        debug(DBG_ERROR, "Cannot allocate startup tasks: %s\n",
+              strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_init(&g.mutex, NULL);
+    pthread_cond_init(&g.cond, NULL);
+
+    if(threads > count)
+        threads = count;
+
+    /* This thread does its share of the work too, so if any of the others
+       can't be started, everything still gets done. */
+    if(threads > 1 &&
+       (thds = (pthread_t *)malloc(sizeof(pthread_t) * (threads - 1)))) {
+        for(i = 0; i < threads - 1; ++i) {
+            if(pthread_create(&thds[i], NULL, &startup_thd, &g)) {
+                debug(DBG_WARN, "Cannot start loader thread\n");
+                break;
+            }
+
+            ++started;
+        }
+    }
+    else {
+        thds = NULL;
+    }
+
+    startup_thd(&g);
+
+    for(i = 0; i < started; ++i) {
+        pthread_join(thds[i], NULL);
+    }
+
+    free(thds);
+    free(g.state);
+    pthread_cond_destroy(&g.cond);
+    pthread_mutex_destroy(&g.mutex);
+
+    for(i = 0; i < count; ++i) {
+        debug(DBG_LOG, "Loaded %s in %" PRIu64 "ms\n", tasks[i].name,
+              tasks[i].ms);
+
+        if(tasks[i].result < 0)
+            rv = -1;
+    }
+
+    debug(DBG_LOG, "Loaded all data in %" PRIu64 "ms on %d thread(s)\n",
+          get_ms_time() - start, started + 1);
+
+    return rv;
+}
@@ -0,0 +1,47 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdint.h>
+
+#include <sylverant/config.h>
+
+#define STARTUP_MAX_DEPS    4
+
+/* One of the data loaders run when the ship starts up. Tasks are run as soon as
+   all of the tasks listed in their deps (by index, ended by a -1 or by
+   STARTUP_MAX_DEPS entries) have finished, on however many threads are given to
+   startup_run(). A task returns less than zero if the ship can't go on. */
+typedef struct startup_task {
+    const char *name;
+    int (*run)(sylverant_ship_t *cfg);
+    int deps[STARTUP_MAX_DEPS];
+
+    /* Filled in by startup_run(). */
+    int result;
+    uint64_t ms;
+} startup_task_t;
+
+/* Run all of the given tasks, and log how long each one took. Returns -1 if
+   any task failed fatally, 0 otherwise. */
+int startup_run(startup_task_t *tasks, int count, int threads,
+                sylverant_ship_t *cfg);
+
+#endif /* !STARTUP_H */
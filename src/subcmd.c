@@ -17,7 +17,6 @@
 */
 
 #include <stdio.h>
-#include <iconv.h>
 #include <string.h>
 #include <pthread.h>
 
@@ -114,7 +113,7 @@ int handle_dc_gcsend(ship_client_t *s, ship_client_t *d,
             out = 48;
             inptr = pkt->name;
             outptr = (char *)pc.name;
-            iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+            tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
 
             /* Convert the text (ISO-8859-1 or SHIFT-JIS -> UTF-16). */
             in = 88;
@@ -123,10 +122,10 @@ int handle_dc_gcsend(ship_client_t *s, ship_client_t *d,
             outptr = (char *)pc.text;
 
             if(pkt->text[1] == 'J') {
-                iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
             }
 
             /* Copy the rest over. */
@@ -163,7 +162,7 @@ int handle_dc_gcsend(ship_client_t *s, ship_client_t *d,
             out = 44;
             inptr = pkt->name;
             outptr = (char *)&bb.name[2];
-            iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+            tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
 
             /* Convert the text (ISO-8859-1 or SHIFT-JIS -> UTF-16). */
             in = 88;
@@ -172,10 +171,10 @@ int handle_dc_gcsend(ship_client_t *s, ship_client_t *d,
             outptr = (char *)bb.text;
 
             if(pkt->text[1] == 'J') {
-                iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
             }
 
             /* Copy the rest over. */
@@ -225,7 +224,7 @@ static int handle_pc_gcsend(ship_client_t *s, ship_client_t *d,
             out = 24;
             inptr = (char *)pkt->name;
             outptr = dc.name;
-            iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
+            tconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
             /* Convert the text (UTF-16 -> ISO-8859-1 or SHIFT-JIS). */
             in = 176;
@@ -234,10 +233,10 @@ static int handle_pc_gcsend(ship_client_t *s, ship_client_t *d,
             outptr = dc.text;
 
             if(pkt->text[1] == LE16('J')) {
-                iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
             }
 
             /* Copy the rest over. */
@@ -274,7 +273,7 @@ static int handle_pc_gcsend(ship_client_t *s, ship_client_t *d,
             out = 24;
             inptr = (char *)pkt->name;
             outptr = gc.name;
-            iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
+            tconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
             /* Convert the text (UTF-16 -> ISO-8859-1 or SHIFT-JIS). */
             in = 176;
@@ -283,10 +282,10 @@ static int handle_pc_gcsend(ship_client_t *s, ship_client_t *d,
             outptr = gc.text;
 
             if(pkt->text[1] == LE16('J')) {
-                iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
             }
 
             /* Copy the rest over. */
@@ -393,7 +392,7 @@ static int handle_gc_gcsend(ship_client_t *s, ship_client_t *d,
             out = 48;
             inptr = pkt->name;
             outptr = (char *)pc.name;
-            iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+            tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
 
             /* Convert the text (ISO-8859-1 or SHIFT-JIS -> UTF-16). */
             in = 88;
@@ -402,10 +401,10 @@ static int handle_gc_gcsend(ship_client_t *s, ship_client_t *d,
             outptr = (char *)pc.text;
 
             if(pkt->text[1] == 'J') {
-                iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
             }
 
             /* Copy the rest over. */
@@ -442,7 +441,7 @@ static int handle_gc_gcsend(ship_client_t *s, ship_client_t *d,
             out = 44;
             inptr = pkt->name;
             outptr = (char *)&bb.name[2];
-            iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+            tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
 
             /* Convert the text (ISO-8859-1 or SHIFT-JIS -> UTF-16). */
             in = 88;
@@ -451,10 +450,10 @@ static int handle_gc_gcsend(ship_client_t *s, ship_client_t *d,
             outptr = (char *)bb.text;
 
             if(pkt->text[1] == 'J') {
-                iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
             }
 
             /* Copy the rest over. */
@@ -496,7 +495,7 @@ static int handle_bb_gcsend(ship_client_t *s, ship_client_t *d) {
             out = 24;
             inptr = (char *)&s->pl->bb.character.name[2];
             outptr = dc.name;
-            iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
+            tconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
             /* Convert the text (UTF-16 -> ISO-8859-1 or SHIFT-JIS). */
             in = 176;
@@ -505,10 +504,10 @@ static int handle_bb_gcsend(ship_client_t *s, ship_client_t *d) {
             outptr = dc.text;
 
             if(s->bb_pl->guildcard_desc[1] == LE16('J')) {
-                iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
             }
 
             /* Copy the rest over. */
@@ -577,7 +576,7 @@ static int handle_bb_gcsend(ship_client_t *s, ship_client_t *d) {
             out = 24;
             inptr = (char *)&s->pl->bb.character.name[2];
             outptr = gc.name;
-            iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
+            tconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
             /* Convert the text (UTF-16 -> ISO-8859-1 or SHIFT-JIS). */
             in = 176;
@@ -586,10 +585,10 @@ static int handle_bb_gcsend(ship_client_t *s, ship_client_t *d) {
             outptr = gc.text;
 
             if(s->bb_pl->guildcard_desc[1] == LE16('J')) {
-                iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
             }
 
             /* Copy the rest over. */
@@ -686,10 +685,10 @@ static int handle_quest_itemreq(ship_client_t *c, subcmd_itemreq_t *req,
     lobby_t *l = c->cur_lobby;
     uint32_t qdrop = 0xFFFFFFFF;
 
-    if(pti != 0x30 && l->mids)
-        qdrop = quest_search_enemy_list(mid, l->mids, l->num_mids, 0);
-    if(qdrop == 0xFFFFFFFF && l->mtypes)
-        qdrop = quest_search_enemy_list(pti, l->mtypes, l->num_mtypes, 0);
+    if(pti != 0x30)
+        qdrop = quest_drops_by_id(l->qdrops, mid, 0);
+    if(qdrop == QUEST_DROPS_NONE)
+        qdrop = quest_drops_by_type(l->qdrops, pti, 0);
 
     /* If we found something, the version matters here. Basically, we only care
        about the none option on DC/PC, as rares do not drop in quests. On GC,
@@ -1097,6 +1096,61 @@ static int handle_bb_set_area(ship_client_t *c, subcmd_bb_set_area_t *pkt) {
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
 }
 
+/* Hold on to a movement packet from the client instead of sending it right
+   away, if the lobby is set up for that. Only the newest one is kept, and it
+   goes out when the client's move timer fires (or sooner, if the client sends
+   something else first). Returns nonzero if the packet was held. */
+static int stage_move(ship_client_t *c, lobby_t *l, void *pkt, int len) {
+    if(!l->move_ms || !c->worker || len > (int)sizeof(c->move_pkt))
+        return 0;
+
+    if(c->move_pending)
+        ++c->worker->moves_saved;
+
+    memcpy(c->move_pkt, pkt, len);
+    c->move_pending = 1;
+
+    if(!c->move_timer.queued)
+        timer_add(&c->worker->timers, &c->move_timer,
+                  get_ms_time() + (uint64_t)l->move_ms);
+
+    return 1;
+}
+
+int subcmd_flush_move(ship_client_t *c, lobby_t *l) {
+    if(!c->move_pending)
+        return 0;
+
+    c->move_pending = 0;
+
+    if(c->version == CLIENT_VERSION_BB)
+        return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)c->move_pkt, 0);
+    else
+        return subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)c->move_pkt, 0);
+}
+
+/* Get rid of (or send on) any movement being held for the client before
+   handling another subcommand from it, so that everything it sends still
+   arrives in order. A new position supersedes the old movement entirely. */
+static int settle_move(ship_client_t *c, lobby_t *l, uint8_t type) {
+    if(!c->move_pending)
+        return 0;
+
+    switch(type) {
+        case SUBCMD_MOVE_SLOW:
+        case SUBCMD_MOVE_FAST:
+            return 0;
+
+        case SUBCMD_SET_POS_3E:
+        case SUBCMD_SET_POS_3F:
+            ++c->worker->moves_saved;
+            c->move_pending = 0;
+            return 0;
+    }
+
+    return subcmd_flush_move(c, l);
+}
+
 static int handle_set_pos(ship_client_t *c, subcmd_set_pos_t *pkt) {
     lobby_t *l = c->cur_lobby;
 
@@ -1129,6 +1183,9 @@ static int handle_move(ship_client_t *c, subcmd_move_t *pkt) {
             update_qpos(c, l);
     }
 
+    if(stage_move(c, l, pkt, LE16(pkt->hdr.pkt_len)))
+        return 0;
+
     return subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)pkt, 0);
 }
 
@@ -1161,6 +1218,9 @@ static int handle_bb_move(ship_client_t *c, subcmd_bb_move_t *pkt) {
             update_qpos(c, l);
     }
 
+    if(stage_move(c, l, pkt, LE16(pkt->hdr.pkt_len)))
+        return 0;
+
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
 }
 
@@ -1722,10 +1782,10 @@ static int handle_cmode_grave(ship_client_t *c, subcmd_pkt_t *pkt) {
             outptr = (char *)pc.team;
 
             if(dc.team[1] == 'J') {
-                iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
             }
 
             /* Convert the message */
@@ -1735,10 +1795,10 @@ static int handle_cmode_grave(ship_client_t *c, subcmd_pkt_t *pkt) {
             outptr = (char *)pc.message;
 
             if(dc.message[1] == 'J') {
-                iconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_sjis_to_utf16, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
+                tconv(ic_8859_to_utf16, &inptr, &in, &outptr, &out);
             }
 
             memcpy(pc.times, dc.times, 36);
@@ -1779,10 +1839,10 @@ static int handle_cmode_grave(ship_client_t *c, subcmd_pkt_t *pkt) {
             outptr = dc.team;
 
             if(pc.team[1] == LE16('J')) {
-                iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
             }
 
             /* Convert the message */
@@ -1792,10 +1852,10 @@ static int handle_cmode_grave(ship_client_t *c, subcmd_pkt_t *pkt) {
             outptr = dc.message;
 
             if(pc.message[1] == LE16('J')) {
-                iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
             }
             else {
-                iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
+                tconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
             }
 
             memcpy(dc.times, pc.times, 36);
@@ -2289,7 +2349,8 @@ static int handle_bb_sort_inv(ship_client_t *c, subcmd_bb_sort_inv_t *pkt) {
 static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint16_t mid;
-    game_enemy_t *en;
+    game_enemy_t en;
+    uint8_t *hit;
     uint32_t flags;
 
     /* We can't get these in default lobbies without someone messing with
@@ -2330,7 +2391,7 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     }
 
     /* Make sure the enemy is in range. */
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
 #ifdef DEBUG
         debug(DBG_WARN, "Guild card %" PRIu32 " hit invalid enemy (%d -- max: "
               "%d)!\n"
@@ -2369,26 +2430,28 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
         return -1;
     }
 
+    game_enemy_get(l->map_enemies, mid, &en);
+
     /* Make sure it looks like they're in the right area for this... */
     /* XXXX: There are some issues still with Episode 2, so only spit this out
        for now on Episode 1. */
 #ifdef DEBUG
-    if(c->cur_area != l->map_enemies->enemies[mid].area && l->episode == 1 &&
+    if(c->cur_area != en.area && l->episode == 1 &&
        !(l->flags & LOBBY_FLAG_QUESTING)) {
         debug(DBG_WARN, "Guild card %" PRIu32 " hit enemy in wrong area "
               "(%d -- max: %d)!\n Episode: %d, Area: %d, Enemy Area: %d "
               "Map: (%d, %d)\n", c->guildcard, mid, l->map_enemies->count,
-              l->episode, c->cur_area, l->map_enemies->enemies[mid].area,
+              l->episode, c->cur_area, en.area,
               l->maps[c->cur_area << 1], l->maps[(c->cur_area << 1) + 1]);
     }
 #endif
 
-    if(l->logfp && c->cur_area != l->map_enemies->enemies[mid].area &&
+    if(l->logfp && c->cur_area != en.area &&
        !(l->flags & LOBBY_FLAG_QUESTING)) {
         fdebug(l->logfp, DBG_WARN, "Guild card %" PRIu32 " hit enemy in wrong "
                "area (%d -- max: %d)!\n Episode: %d, Area: %d, Enemy Area: %d "
                "Map: (%d, %d)\n", c->guildcard, mid, l->map_enemies->count,
-               l->episode, c->cur_area, l->map_enemies->enemies[mid].area,
+               l->episode, c->cur_area, en.area,
                l->maps[c->cur_area << 1], l->maps[(c->cur_area << 1) + 1]);
     }
 
@@ -2408,28 +2471,28 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     }
 
     /* Save the hit, assuming the enemy isn't already dead. */
-    en = &l->map_enemies->enemies[mid];
-    if(!(en->clients_hit & 0x80)) {
-        en->clients_hit |= (1 << c->client_id);
-        en->last_client = c->client_id;
+    hit = &l->map_enemies->clients_hit[mid];
+    if(!(*hit & 0x80)) {
+        *hit |= (1 << c->client_id);
+        l->map_enemies->last_client[mid] = c->client_id;
 
         script_execute(ScriptActionEnemyHit, c, SCRIPT_ARG_PTR, c,
-                       SCRIPT_ARG_UINT16, mid, SCRIPT_ARG_UINT32, en->bp_entry,
-                       SCRIPT_ARG_UINT8, en->rt_index, SCRIPT_ARG_UINT8,
-                       en->clients_hit, SCRIPT_ARG_END);
+                       SCRIPT_ARG_UINT16, mid, SCRIPT_ARG_UINT32, en.bp_entry,
+                       SCRIPT_ARG_UINT8, en.rt_index, SCRIPT_ARG_UINT8,
+                       *hit, SCRIPT_ARG_END);
 
         /* If the kill flag is set, mark it as dead and update the client's
            counter. */
         if(flags & 0x00000800) {
-            en->clients_hit |= 0x80;
+            *hit |= 0x80;
 
             script_execute(ScriptActionEnemyKill, c, SCRIPT_ARG_PTR, c,
                            SCRIPT_ARG_UINT16, mid, SCRIPT_ARG_UINT32,
-                           en->bp_entry, SCRIPT_ARG_UINT8, en->rt_index,
-                           SCRIPT_ARG_UINT8, en->clients_hit, SCRIPT_ARG_END);
+                           en.bp_entry, SCRIPT_ARG_UINT8, en.rt_index,
+                           SCRIPT_ARG_UINT8, *hit, SCRIPT_ARG_END);
 
-            if(en->bp_entry < 0x60 && !(l->flags & LOBBY_FLAG_HAS_NPC))
-                ++c->enemy_kills[en->bp_entry];
+            if(en.bp_entry < 0x60 && !(l->flags & LOBBY_FLAG_HAS_NPC))
+                ++c->enemy_kills[en.bp_entry];
         }
     }
 
@@ -2458,16 +2521,16 @@ static int handle_bb_mhit(ship_client_t *c, subcmd_bb_mhit_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " hit invalid enemy (%d -- max: "
               "%d)!\n", c->guildcard, mid, l->map_enemies->count);
         return -1;
     }
 
     /* Save the hit, assuming the enemy isn't already dead. */
-    if(!(l->map_enemies->enemies[mid].clients_hit & 0x80)) {
-        l->map_enemies->enemies[mid].clients_hit |= (1 << c->client_id);
-        l->map_enemies->enemies[mid].last_client = c->client_id;
+    if(!(l->map_enemies->clients_hit[mid] & 0x80)) {
+        l->map_enemies->clients_hit[mid] |= (1 << c->client_id);
+        l->map_enemies->last_client[mid] = c->client_id;
     }
 
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
@@ -2482,7 +2545,7 @@ static void handle_objhit_common(ship_client_t *c, lobby_t *l, uint16_t bid) {
         bid &= 0x0FFF;
 
         /* Make sure the object is in range. */
-        if(bid > l->map_objs->count) {
+        if(bid >= l->map_objs->count) {
             debug(DBG_WARN, "Guild card %" PRIu32 " hit invalid object "
                   "(%d -- max: %d)!\n"
                   "Episode: %d, Floor: %d, Map: (%d, %d)\n", c->guildcard,
@@ -2500,11 +2563,11 @@ static void handle_objhit_common(ship_client_t *c, lobby_t *l, uint16_t bid) {
         }
 
         /* Make sure it isn't marked as hit already. */
-        if((l->map_objs->objs[bid].flags & 0x80000000))
+        if((l->map_objs->flags[bid] & 0x80000000))
             return;
 
         /* Now, see if we care about the type of the object that was hit. */
-        obj_type = l->map_objs->objs[bid].data.skin & 0xFFFF;
+        obj_type = game_obj_get(l->map_objs, bid)->data.skin & 0xFFFF;
 
         /* We'll probably want to do a bit more with this at some point, but
            for now this will do. */
@@ -2523,7 +2586,7 @@ static void handle_objhit_common(ship_client_t *c, lobby_t *l, uint16_t bid) {
         }
 
         /* Mark it as hit. */
-        l->map_objs->objs[bid].flags |= 0x80000000;
+        l->map_objs->flags[bid] |= 0x80000000;
     }
     else if((bid & 0xF000) == 0x1000) {
         /* An enemy was hit. We don't really do anything with these here,
@@ -2739,7 +2802,8 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint16_t mid;
     uint32_t bp, exp;
-    game_enemy_t *en;
+    game_enemy_t en;
+    uint8_t *hit;
 
     /* We can't get these in default lobbies without someone messing with
        something that they shouldn't be... Disconnect anyone that tries. */
@@ -2759,7 +2823,7 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " killed invalid enemy (%d -- "
               "max: %d)!\n", c->guildcard, mid, l->map_enemies->count);
         return -1;
@@ -2767,18 +2831,19 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
 
     /* Make sure this client actually hit the enemy and that the client didn't
        already claim their experience. */
-    en = &l->map_enemies->enemies[mid];
+    hit = &l->map_enemies->clients_hit[mid];
 
-    if(!(en->clients_hit & (1 << c->client_id))) {
+    if(!(*hit & (1 << c->client_id))) {
         return 0;
     }
 
     /* Set that the client already got their experience and that the monster is
        indeed dead. */
-    en->clients_hit = (en->clients_hit & (~(1 << c->client_id))) | 0x80;
+    *hit = (*hit & (~(1 << c->client_id))) | 0x80;
 
     /* Give the client their experience! */
-    bp = en->bp_entry;
+    game_enemy_get(l->map_enemies, mid, &en);
+    bp = en.bp_entry;
     exp = l->bb_params[bp].exp;
 
     if(!pkt->last_hitter) {
@@ -2883,11 +2948,39 @@ static inline int reg_sync_index(lobby_t *l, uint8_t regnum) {
     return -1;
 }
 
+/* Answer a read or write of a short flag through the quest's flag register
+   from the quest flag cache, replying the same way the shipgate's response
+   would have been. Returns nonzero if it was taken care of. */
+static int qflag_sync_local(ship_client_t *c, lobby_t *l, uint8_t reg,
+                            uint32_t ctl, uint32_t val) {
+    uint32_t fid = (val >> 16) & 0xFF, v;
+
+    if((ctl & 0x01)) {
+        if(quest_flag_cache_set(c, l, fid, val & 0xFFFF))
+            return 0;
+
+        send_sync_register(c, reg, (val & 0xFFFF) | 0x60000000 | (fid << 16));
+        return 1;
+    }
+
+    switch(quest_flag_cache_get(c, l, fid, &v)) {
+        case 1:
+            send_sync_register(c, reg, (v & 0xFFFF) | 0x40000000 | (fid << 16));
+            return 1;
+
+        case -1:
+            send_sync_register(c, reg, ERR_QFLAG_NO_DATA | 0x80000000);
+            return 1;
+    }
+
+    return 0;
+}
+
 static int handle_sync_reg(ship_client_t *c, subcmd_sync_reg_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint32_t val = LE32(pkt->value);
     int done = 0, idx;
-    uint32_t ctl;
+    uint32_t ctl, fid;
 
     /* XXXX: Probably should do some checking here... */
     /* Run the register sync script, if one is set. If the script returns
@@ -2916,11 +3009,16 @@ static int handle_sync_reg(ship_client_t *c, subcmd_sync_reg_t *pkt) {
         }
         else if((val & 0x08000000) && !done) {
             /* Delete the flag... */
-            shipgate_send_qflag(&ship->sg, c, 1,
-                                ((val >> 16) & 0xFF) | QFLAG_DELETE_FLAG,
-                                c->cur_lobby->qid, 0);
+            fid = ((val >> 16) & 0xFF) | QFLAG_DELETE_FLAG;
+
+            if(!quest_flag_cache_set(c, l, fid, 0))
+                send_sync_register(c, pkt->reg_num,
+                                   0x60000000 | ((fid & 0xFF) << 16));
+            else
+                shipgate_send_qflag(&ship->sg, c, 1, fid, c->cur_lobby->qid,
+                                    0);
         }
-        else {
+        else if(!qflag_sync_local(c, l, pkt->reg_num, ctl, val)) {
             /* Send the request to the shipgate... */
             shipgate_send_qflag(&ship->sg, c, ctl & 0x01, (val >> 16) & 0xFF,
                                 c->cur_lobby->qid, val & 0xFFFF);
@@ -3099,7 +3197,7 @@ int subcmd_handle_one(ship_client_t *c, subcmd_pkt_t *pkt) {
             else if(l->dropfunc && (l->flags & LOBBY_FLAG_SERVER_DROPS)) {
                 rv = l->dropfunc(c, l, pkt);
             }
-            else if((l->num_mtypes || l->num_mids) &&
+            else if(l->qdrops &&
                     (l->flags & LOBBY_FLAG_QUESTING)) {
                 rv = handle_quest_itemreq(c, (subcmd_itemreq_t *)pkt, dest);
             }
@@ -3234,6 +3332,11 @@ int subcmd_handle_bcast(ship_client_t *c, subcmd_pkt_t *pkt) {
         return rv;
     }
 
+    if(settle_move(c, l, type)) {
+        pthread_mutex_unlock(&l->mutex);
+        return -1;
+    }
+
     switch(type) {
         case SUBCMD_TAKE_ITEM:
             rv = handle_take_item(c, (subcmd_take_item_t *)pkt);
@@ -3403,6 +3506,11 @@ int subcmd_bb_handle_bcast(ship_client_t *c, bb_subcmd_pkt_t *pkt) {
 
     pthread_mutex_lock(&l->mutex);
 
+    if(settle_move(c, l, type)) {
+        pthread_mutex_unlock(&l->mutex);
+        return -1;
+    }
+
     switch(type) {
         case SUBCMD_SYMBOL_CHAT:
             rv = handle_bb_symbol_chat(c, pkt);
@@ -3798,9 +3906,11 @@ int subcmd_send_bb_level(ship_client_t *c) {
 
 int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                          int igcheck) {
-    int i;
+    ship_client_t *dests[LOBBY_MAX_CLIENTS];
+    int i, count = 0;
 
-    /* Send the packet to every connected client. */
+    /* Figure out who gets the packet. NTE clients need it translated, so they
+       get theirs right away, and everyone else gets it all at once. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
             /* If we're supposed to check the ignore list, and this client is on
@@ -3811,20 +3921,22 @@ int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
 
             if(l->clients[i]->version != CLIENT_VERSION_DCV1 ||
                !(l->clients[i]->flags & CLIENT_FLAG_IS_NTE))
-                send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
+                dests[count++] = l->clients[i];
             else
                 subcmd_translate_dc_to_nte(l->clients[i], pkt);
         }
     }
 
-    return 0;
+    return send_pkt_dc_multi(dests, count, (dc_pkt_hdr_t *)pkt);
 }
 
 int subcmd_send_lobby_bb(lobby_t *l, ship_client_t *c, bb_subcmd_pkt_t *pkt,
                          int igcheck) {
-    int i;
+    ship_client_t *dests[LOBBY_MAX_CLIENTS];
+    int i, count = 0;
 
-    /* Send the packet to every connected client. */
+    /* Figure out who gets the packet. NTE clients need it translated, so they
+       get theirs right away, and everyone else gets it all at once. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
             /* If we're supposed to check the ignore list, and this client is on
@@ -3835,13 +3947,13 @@ int subcmd_send_lobby_bb(lobby_t *l, ship_client_t *c, bb_subcmd_pkt_t *pkt,
 
             if(l->clients[i]->version != CLIENT_VERSION_DCV1 ||
                !(l->clients[i]->flags & CLIENT_FLAG_IS_NTE))
-                send_pkt_bb(l->clients[i], (bb_pkt_hdr_t *)pkt);
+                dests[count++] = l->clients[i];
             else
                 subcmd_translate_bb_to_nte(l->clients[i], pkt);
         }
     }
 
-    return 0;
+    return send_pkt_bb_multi(dests, count, (bb_pkt_hdr_t *)pkt);
 }
 
 int subcmd_send_pos(ship_client_t *dst, ship_client_t *src) {
@@ -980,6 +980,10 @@ int subcmd_send_lobby_bb(lobby_t *l, ship_client_t *c, bb_subcmd_pkt_t *pkt,
 int subcmd_send_lobby_dcnte(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                             int igcheck);
 
+/* Send on any movement being held back for the client. The lobby must be
+   locked. */
+int subcmd_flush_move(ship_client_t *c, lobby_t *l);
+
 /* Stuff dealing with the Dreamcast Network Trial edition */
 int subcmd_translate_dc_to_nte(ship_client_t *c, subcmd_pkt_t *pkt);
 int subcmd_translate_nte_to_dc(ship_client_t *c, subcmd_pkt_t *pkt);
@@ -0,0 +1,205 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <limits.h>
+#include <string.h>
+
+#include "timers.h"
+
+/* How far out a timer can be scheduled, in ticks. */
+#define TIMER_WHEEL_SPAN    (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+void timer_wheel_init(timer_wheel_t *w, uint64_t now) {
+    int i, j;
+
+    memset(w, 0, sizeof(timer_wheel_t));
+    w->now = now;
+    TAILQ_INIT(&w->expired);
+
+    for(i = 0; i < TIMER_WHEEL_LEVELS; ++i) {
+        for(j = 0; j < TIMER_WHEEL_SLOTS; ++j) {
+            TAILQ_INIT(&w->slots[i][j]);
+        }
+    }
+}
+
+void timer_init(timer_entry_t *t, timer_cb_t cb, void *data) {
+    memset(t, 0, sizeof(timer_entry_t));
+    t->cb = cb;
+    t->data = data;
+}
+
+static void wheel_insert(timer_wheel_t *w, timer_entry_t *t) {
+    uint64_t delta;
+    int level;
+
+    if(t->expires < w->now)
+        t->expires = w->now;
+
+    delta = t->expires - w->now;
+
+    if(delta >= TIMER_WHEEL_SPAN) {
+        t->expires = w->now + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+    }
+
+    /* Each level covers 64 times as much time as the one below it. Timers that
+       aren't on the bottom level get moved down a level (or more) when the
+       wheel gets to the start of their slot. */
+    for(level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        if(delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    t->level = level;
+    t->slot = (int)(t->expires >> (TIMER_WHEEL_BITS * level)) &
+        TIMER_WHEEL_MASK;
+    t->queued = 1;
+
+    TAILQ_INSERT_TAIL(&w->slots[level][t->slot], t, qentry);
+    w->used[level] |= 1ULL << t->slot;
+}
+
+static void wheel_remove(timer_wheel_t *w, timer_entry_t *t) {
+    struct timer_queue *q;
+
+    if(t->level == TIMER_WHEEL_LEVELS) {
+        TAILQ_REMOVE(&w->expired, t, qentry);
+        t->queued = 0;
+        return;
+    }
+
+    q = &w->slots[t->level][t->slot];
+    TAILQ_REMOVE(q, t, qentry);
+
+    if(TAILQ_EMPTY(q))
+        w->used[t->level] &= ~(1ULL << t->slot);
+
+    t->queued = 0;
+}
+
+void timer_add(timer_wheel_t *w, timer_entry_t *t, uint64_t expires) {
+    if(t->queued)
+        wheel_remove(w, t);
+
+    t->expires = expires;
+    wheel_insert(w, t);
+}
+
+void timer_del(timer_wheel_t *w, timer_entry_t *t) {
+    if(t->queued)
+        wheel_remove(w, t);
+}
+
+uint64_t timer_wheel_next(timer_wheel_t *w) {
+    uint64_t rv = UINT64_MAX, base, used, when;
+    int level, shift, idx;
+
+    for(level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        if(!(used = w->used[level]))
+            continue;
+
+        /* Slots are handled when the wheel reaches the start of them, so if
+           we're already past the start of the current one, the first one that
+           can still need attention is the next. */
+        shift = TIMER_WHEEL_BITS * level;
+        base = w->now >> shift;
+
+        if(w->now & ((1ULL << shift) - 1))
+            ++base;
+
+        /* Rotate the bitmap so that the slot for base is in bit 0, and find the
+           first used slot from there. */
+        idx = (int)(base & TIMER_WHEEL_MASK);
+        used = (used >> idx) | (used << ((TIMER_WHEEL_SLOTS - idx) &
+                                         TIMER_WHEEL_MASK));
+        when = (base + __builtin_ctzll(used)) << shift;
+
+        if(when < rv)
+            rv = when;
+    }
+
+    return rv;
+}
+
+int timer_wheel_timeout(timer_wheel_t *w, uint64_t now) {
+    uint64_t next = timer_wheel_next(w);
+
+    if(next == UINT64_MAX)
+        return -1;
+    else if(next <= now)
+        return 0;
+    else if(next - now > INT_MAX)
+        return INT_MAX;
+
+    return (int)(next - now);
+}
+
+void timer_wheel_run(timer_wheel_t *w, uint64_t now) {
+    timer_entry_t *t;
+    struct timer_queue *q;
+    uint64_t next;
+    int level, shift, idx;
+
+    while(w->now <= now) {
+        /* Skip straight over any ticks where nothing happens. */
+        if((next = timer_wheel_next(w)) > now) {
+            w->now = now + 1;
+            break;
+        }
+
+        w->now = next;
+
+        /* Move anything from the upper levels whose slot starts now down to
+           where it belongs. Nothing ends up back in a slot we've cascaded. */
+        for(level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            shift = TIMER_WHEEL_BITS * level;
+
+            if(w->now & ((1ULL << shift) - 1))
+                break;
+
+            idx = (int)(w->now >> shift) & TIMER_WHEEL_MASK;
+            q = &w->slots[level][idx];
+
+            while((t = TAILQ_FIRST(q))) {
+                wheel_remove(w, t);
+                wheel_insert(w, t);
+            }
+        }
+
+        /* Pull everything out of the slot before firing any of it, since a
+           callback might reschedule its timer into this same slot for the next
+           time around the wheel. The wheel is moved forward first too, so that
+           anything rescheduled in the past lands on the next tick. */
+        idx = (int)(w->now & TIMER_WHEEL_MASK);
+        q = &w->slots[0][idx];
+        ++w->now;
+
+        while((t = TAILQ_FIRST(q))) {
+            TAILQ_REMOVE(q, t, qentry);
+            TAILQ_INSERT_TAIL(&w->expired, t, qentry);
+            t->level = TIMER_WHEEL_LEVELS;
+        }
+
+        w->used[0] &= ~(1ULL << idx);
+
+        while((t = TAILQ_FIRST(&w->expired))) {
+            wheel_remove(w, t);
+            t->cb(t, t->data);
+        }
+    }
+}
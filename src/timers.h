@@ -0,0 +1,86 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* The wheel is made up of a few levels of 64 slots each. With millisecond
+   ticks, the first level covers the next 64ms, the second the next ~4 seconds,
+   and so on up to about 4.6 hours out. Anything scheduled further out than that
+   is clamped to the end of the last level. */
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS  4
+
+struct timer_entry;
+
+typedef void (*timer_cb_t)(struct timer_entry *t, void *data);
+
+/* A single timer. An entry that is all zeroes is valid, and not scheduled. */
+typedef struct timer_entry {
+    TAILQ_ENTRY(timer_entry) qentry;
+    uint64_t expires;
+    timer_cb_t cb;
+    void *data;
+    int queued;
+    int level;
+    int slot;
+} timer_entry_t;
+
+TAILQ_HEAD(timer_queue, timer_entry);
+
+/* None of this is thread-safe. Each wheel should only be touched by the one
+   thread that owns it. */
+typedef struct timer_wheel {
+    uint64_t now;
+    uint64_t used[TIMER_WHEEL_LEVELS];
+    struct timer_queue slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    struct timer_queue expired;
+} timer_wheel_t;
+
+/* Initialize an empty timer wheel, with now as the current tick. */
+void timer_wheel_init(timer_wheel_t *w, uint64_t now);
+
+/* Set up the callback for a timer. This does not schedule it. */
+void timer_init(timer_entry_t *t, timer_cb_t cb, void *data);
+
+/* Schedule a timer to fire at the given tick. If the timer is already
+   scheduled, it is moved to the new time. Times in the past fire on the next
+   call to timer_wheel_run. */
+void timer_add(timer_wheel_t *w, timer_entry_t *t, uint64_t expires);
+
+/* Cancel a timer. This is safe to call on a timer that isn't scheduled. */
+void timer_del(timer_wheel_t *w, timer_entry_t *t);
+
+/* Fire every timer that has expired as of now. The callbacks are allowed to
+   add or remove any timer on the wheel, including the one that fired. */
+void timer_wheel_run(timer_wheel_t *w, uint64_t now);
+
+/* Return the first tick at which timer_wheel_run has something to do, or
+   UINT64_MAX if nothing is scheduled at all. */
+uint64_t timer_wheel_next(timer_wheel_t *w);
+
+/* Return how long to wait (in ticks) before timer_wheel_run will have
+   something to do, suitable for passing to evloop_wait. Returns -1 if nothing
+   is scheduled. */
+int timer_wheel_timeout(timer_wheel_t *w, uint64_t now);
+
+#endif /* !TIMERS_H */
@@ -0,0 +1,538 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <iconv.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sylverant/debug.h>
+
+#include "transcode.h"
+
+/* Decoders return how many bytes of input they used, 0 if the input ends in
+   the middle of a character, -1 if it isn't valid, or TC_LATE if it's a whole
+   sequence that just isn't a character. Encoders return how many bytes they
+   wrote, TC_NOROOM if there isn't room, or -1 if the character can't be
+   represented. */
+typedef int (*tc_dec_t)(const uint8_t *in, size_t len, uint32_t *cp);
+typedef int (*tc_enc_t)(uint32_t cp, uint8_t *out, size_t len);
+
+#define TC_NOROOM           -2
+
+/* iconv reads sequences like these in one step and only rejects them in the
+   next one, which checks that there's room for output first. So they run out
+   of room before they are found to be bad. */
+#define TC_LATE             -3
+
+/* Unicode tag characters, which iconv quietly drops when it can't represent
+   them, so we do too. */
+#define IS_TAG(cp)          (((cp) >> 7) == (0xE0000 >> 7))
+
+/* How runs of plain ASCII can be moved across without going through the
+   decoder and encoder one character at a time. */
+#define TC_FAST_NONE        0
+#define TC_FAST_COPY        1       /* 8-bit in, 8-bit out. */
+#define TC_FAST_WIDEN       2       /* 8-bit in, UTF-16 out. */
+#define TC_FAST_NARROW      3       /* UTF-16 in, 8-bit out. */
+
+struct transcoder {
+    tc_dec_t dec;
+    tc_enc_t enc;
+    int fast;
+    size_t min_out;                 /* Fewest bytes enc writes for anything. */
+};
+
+/* Shift-JIS tables, filled in by tconv_init(). The single byte table holds
+   SJIS_LEAD for the first byte of a two byte character and SJIS_BAD for bytes
+   that are never valid. The two byte table is indexed by the low seven bits of
+   the lead byte and the trail byte, and the encoding table by the UTF-16 code
+   unit. Both use 0 for no mapping. */
+#define SJIS_LEAD           0xFFFF
+#define SJIS_BAD            0xFFFE
+
+static uint16_t sjis_dec1[256];
+static uint16_t sjis_dec2[128 * 256];
+static uint16_t sjis_enc[65536];
+
+static int dec_8859(const uint8_t *in, size_t len, uint32_t *cp) {
+    (void)len;
+    *cp = in[0];
+    return 1;
+}
+
+static int dec_utf8(const uint8_t *in, size_t len, uint32_t *cp) {
+    uint32_t c = in[0], min;
+    size_t i, n;
+
+    if(c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+    else if(c >= 0xC2 && c < 0xE0) {
+        n = 2;
+        c &= 0x1F;
+        min = 0x80;
+    }
+    else if(c >= 0xE0 && c < 0xF0) {
+        n = 3;
+        c &= 0x0F;
+        min = 0x800;
+    }
+    else if(c >= 0xF0 && c < 0xF8) {
+        n = 4;
+        c &= 0x07;
+        min = 0x10000;
+    }
+    else if(c >= 0xF8 && c < 0xFE) {
+        /* These can't make anything valid, but iconv still waits to see the
+           whole sequence before saying so. */
+        n = c < 0xFC ? 5 : 6;
+        c &= n == 5 ? 0x03 : 0x01;
+        min = n == 5 ? 0x200000 : 0x4000000;
+    }
+    else {
+        return -1;
+    }
+
+    for(i = 1; i < n; ++i) {
+        if(i >= len)
+            return 0;
+
+        if((in[i] & 0xC0) != 0x80)
+            return -1;
+
+        c = (c << 6) | (in[i] & 0x3F);
+    }
+
+    /* No overlong forms, surrogates, or anything past the end of Unicode. */
+    if(c < min || (c >= 0xD800 && c < 0xE000))
+        return -1;
+    else if(c > 0x10FFFF)
+        return TC_LATE;
+
+    *cp = c;
+    return (int)n;
+}
+
+static int dec_utf16(const uint8_t *in, size_t len, uint32_t *cp) {
+    uint32_t c, c2;
+
+    if(len < 2)
+        return 0;
+
+    c = in[0] | (in[1] << 8);
+
+    if(c < 0xD800 || c >= 0xE000) {
+        *cp = c;
+        return 2;
+    }
+
+    /* A surrogate has to be a high one followed by a low one. */
+    if(c >= 0xDC00)
+        return -1;
+
+    if(len < 4)
+        return 0;
+
+    c2 = in[2] | (in[3] << 8);
+
+    if(c2 < 0xDC00 || c2 >= 0xE000)
+        return -1;
+
+    *cp = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+    return 4;
+}
+
+static int dec_sjis(const uint8_t *in, size_t len, uint32_t *cp) {
+    uint16_t c = sjis_dec1[in[0]];
+
+    if(c == SJIS_BAD)
+        return -1;
+
+    if(c != SJIS_LEAD) {
+        *cp = c;
+        return 1;
+    }
+
+    if(len < 2)
+        return 0;
+
+    if(!(c = sjis_dec2[((in[0] & 0x7F) << 8) | in[1]]))
+        return -1;
+
+    *cp = c;
+    return 2;
+}
+
+static int enc_ascii(uint32_t cp, uint8_t *out, size_t len) {
+    if(len < 1)
+        return TC_NOROOM;
+
+    if(cp > 0x7F)
+        return IS_TAG(cp) ? 0 : -1;
+
+    out[0] = (uint8_t)cp;
+    return 1;
+}
+
+static int enc_8859(uint32_t cp, uint8_t *out, size_t len) {
+    if(len < 1)
+        return TC_NOROOM;
+
+    if(cp > 0xFF)
+        return IS_TAG(cp) ? 0 : -1;
+
+    out[0] = (uint8_t)cp;
+    return 1;
+}
+
+static int enc_utf8(uint32_t cp, uint8_t *out, size_t len) {
+    if(cp < 0x80) {
+        if(len < 1)
+            return TC_NOROOM;
+
+        out[0] = (uint8_t)cp;
+        return 1;
+    }
+    else if(cp < 0x800) {
+        if(len < 2)
+            return TC_NOROOM;
+
+        out[0] = (uint8_t)(0xC0 | (cp >> 6));
+        out[1] = (uint8_t)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    else if(cp < 0x10000) {
+        if(len < 3)
+            return TC_NOROOM;
+
+        out[0] = (uint8_t)(0xE0 | (cp >> 12));
+        out[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (uint8_t)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+
+    if(len < 4)
+        return TC_NOROOM;
+
+    out[0] = (uint8_t)(0xF0 | (cp >> 18));
+    out[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (uint8_t)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+static int enc_utf16(uint32_t cp, uint8_t *out, size_t len) {
+    if(cp < 0x10000) {
+        if(len < 2)
+            return TC_NOROOM;
+
+        out[0] = (uint8_t)cp;
+        out[1] = (uint8_t)(cp >> 8);
+        return 2;
+    }
+
+    if(len < 4)
+        return TC_NOROOM;
+
+    cp -= 0x10000;
+    out[0] = (uint8_t)(cp >> 10);
+    out[1] = (uint8_t)(0xD8 | (cp >> 18));
+    out[2] = (uint8_t)cp;
+    out[3] = (uint8_t)(0xDC | ((cp >> 8) & 0x03));
+    return 4;
+}
+
+static int enc_sjis(uint32_t cp, uint8_t *out, size_t len) {
+    uint16_t c;
+
+    if(len < 1)
+        return TC_NOROOM;
+
+    if(cp > 0xFFFF)
+        return IS_TAG(cp) ? 0 : -1;
+
+    if(!(c = sjis_enc[cp]) && cp)
+        return -1;
+
+    if(c < 0x100) {
+        out[0] = (uint8_t)c;
+        return 1;
+    }
+
+    if(len < 2)
+        return TC_NOROOM;
+
+    out[0] = (uint8_t)(c >> 8);
+    out[1] = (uint8_t)c;
+    return 2;
+}
+
+static const struct transcoder tc_utf8_to_utf16 =
+    { dec_utf8, enc_utf16, TC_FAST_WIDEN, 2 };
+static const struct transcoder tc_utf16_to_utf8 =
+    { dec_utf16, enc_utf8, TC_FAST_NARROW, 1 };
+static const struct transcoder tc_8859_to_utf8 =
+    { dec_8859, enc_utf8, TC_FAST_COPY, 1 };
+static const struct transcoder tc_utf8_to_8859 =
+    { dec_utf8, enc_8859, TC_FAST_COPY, 1 };
+static const struct transcoder tc_sjis_to_utf8 =
+    { dec_sjis, enc_utf8, TC_FAST_NONE, 1 };
+static const struct transcoder tc_utf8_to_sjis =
+    { dec_utf8, enc_sjis, TC_FAST_NONE, 1 };
+static const struct transcoder tc_utf16_to_ascii =
+    { dec_utf16, enc_ascii, TC_FAST_NARROW, 1 };
+static const struct transcoder tc_8859_to_utf16 =
+    { dec_8859, enc_utf16, TC_FAST_WIDEN, 2 };
+static const struct transcoder tc_sjis_to_utf16 =
+    { dec_sjis, enc_utf16, TC_FAST_NONE, 2 };
+static const struct transcoder tc_utf16_to_8859 =
+    { dec_utf16, enc_8859, TC_FAST_NARROW, 1 };
+static const struct transcoder tc_utf16_to_sjis =
+    { dec_utf16, enc_sjis, TC_FAST_NONE, 1 };
+
+const tconv_t ic_utf8_to_utf16 = &tc_utf8_to_utf16;
+const tconv_t ic_utf16_to_utf8 = &tc_utf16_to_utf8;
+const tconv_t ic_8859_to_utf8 = &tc_8859_to_utf8;
+const tconv_t ic_utf8_to_8859 = &tc_utf8_to_8859;
+const tconv_t ic_sjis_to_utf8 = &tc_sjis_to_utf8;
+const tconv_t ic_utf8_to_sjis = &tc_utf8_to_sjis;
+const tconv_t ic_utf16_to_ascii = &tc_utf16_to_ascii;
+const tconv_t ic_8859_to_utf16 = &tc_8859_to_utf16;
+const tconv_t ic_sjis_to_utf16 = &tc_sjis_to_utf16;
+const tconv_t ic_utf16_to_8859 = &tc_utf16_to_8859;
+const tconv_t ic_utf16_to_sjis = &tc_utf16_to_sjis;
+
+/* How many bytes at the start of the buffer are plain ASCII. */
+static size_t ascii_run(const uint8_t *in, size_t len) {
+    size_t i = 0;
+    uint64_t w;
+
+    /* Check a word at a time, since most of what goes through here is plain
+       ASCII anyway... */
+    while(i + 8 <= len) {
+        memcpy(&w, in + i, 8);
+
+        if(w & 0x8080808080808080ULL)
+            break;
+
+        i += 8;
+    }
+
+    /* ...and finish off whatever's left a byte at a time. */
+    while(i < len && in[i] < 0x80)
+        ++i;
+
+    return i;
+}
+
+/* Move as much ASCII across as possible, returning how many characters were
+   moved. */
+static size_t fast_ascii(int fast, const uint8_t *in, size_t il, uint8_t *out,
+                         size_t ol) {
+    size_t i, n;
+
+    switch(fast) {
+        case TC_FAST_COPY:
+            n = ascii_run(in, il < ol ? il : ol);
+            memcpy(out, in, n);
+            return n;
+
+        case TC_FAST_WIDEN:
+            n = ascii_run(in, il < ol / 2 ? il : ol / 2);
+
+            for(i = 0; i < n; ++i) {
+                out[i * 2] = in[i];
+                out[i * 2 + 1] = 0;
+            }
+
+            return n;
+
+        case TC_FAST_NARROW:
+            n = il / 2 < ol ? il / 2 : ol;
+
+            for(i = 0; i < n && in[i * 2] < 0x80 && !in[i * 2 + 1]; ++i) {
+                out[i] = in[i * 2];
+            }
+
+            return i;
+    }
+
+    return 0;
+}
+
+size_t tconv(tconv_t tc, ICONV_CONST char **inbuf, size_t *inleft,
+             char **outbuf, size_t *outleft) {
+    const uint8_t *in;
+    uint8_t *out;
+    size_t il, ol, n;
+    uint32_t cp;
+    int r, w, err = 0;
+
+    /* There's no shift state to reset. */
+    if(!inbuf || !*inbuf)
+        return 0;
+
+    in = (const uint8_t *)*inbuf;
+    out = (uint8_t *)*outbuf;
+    il = *inleft;
+    ol = *outleft;
+
+    while(il) {
+        if(tc->fast != TC_FAST_NONE) {
+            n = fast_ascii(tc->fast, in, il, out, ol);
+
+            if(tc->fast == TC_FAST_NARROW) {
+                in += n * 2;
+                il -= n * 2;
+                out += n;
+                ol -= n;
+            }
+            else if(tc->fast == TC_FAST_WIDEN) {
+                in += n;
+                il -= n;
+                out += n * 2;
+                ol -= n * 2;
+            }
+            else {
+                in += n;
+                il -= n;
+                out += n;
+                ol -= n;
+            }
+
+            if(!il)
+                break;
+        }
+
+        if((r = tc->dec(in, il, &cp)) <= 0) {
+            if(r == TC_LATE && ol < tc->min_out)
+                err = E2BIG;
+            else
+                err = r ? EILSEQ : EINVAL;
+
+            break;
+        }
+
+        if((w = tc->enc(cp, out, ol)) < 0) {
+            err = w == TC_NOROOM ? E2BIG : EILSEQ;
+            break;
+        }
+
+        in += r;
+        il -= r;
+        out += w;
+        ol -= w;
+    }
+
+    *inbuf = (ICONV_CONST char *)in;
+    *outbuf = (char *)out;
+    *inleft = il;
+    *outleft = ol;
+
+    if(err) {
+        errno = err;
+        return (size_t)-1;
+    }
+
+    return 0;
+}
+
+/* Run one character through iconv, returning how many bytes came out, 0 if it
+   wanted more input, or -1 if it isn't valid. */
+static int probe(iconv_t ic, const uint8_t *in, size_t len, uint8_t out[4]) {
+    char *inptr = (char *)in, *outptr = (char *)out;
+    size_t il = len, ol = 4, rv;
+
+    rv = iconv(ic, (ICONV_CONST char **)&inptr, &il, &outptr, &ol);
+    iconv(ic, NULL, NULL, NULL, NULL);
+
+    if(rv == (size_t)-1)
+        return errno == EINVAL ? 0 : -1;
+
+    return il ? -1 : (int)(4 - ol);
+}
+
+int tconv_init(void) {
+    iconv_t dec, enc;
+    uint8_t in[2], out[4];
+    uint32_t i, j;
+    int r;
+
+    /* The Shift-JIS mapping comes from the system's iconv, so that nothing
+       changes from how it was when we used iconv directly. */
+    dec = iconv_open("UTF-16LE", "SHIFT_JIS");
+
+    if(dec == (iconv_t)-1) {
+        debug(DBG_ERROR, "Cannot convert from Shift-JIS: %s\n",
+              strerror(errno));
+        return -1;
+    }
+
+    enc = iconv_open("SHIFT_JIS", "UTF-16LE");
+
+    if(enc == (iconv_t)-1) {
+        debug(DBG_ERROR, "Cannot convert to Shift-JIS: %s\n", strerror(errno));
+        iconv_close(dec);
+        return -1;
+    }
+
+    memset(sjis_dec2, 0, sizeof(sjis_dec2));
+    memset(sjis_enc, 0, sizeof(sjis_enc));
+
+    for(i = 0; i < 256; ++i) {
+        in[0] = (uint8_t)i;
+        r = probe(dec, in, 1, out);
+
+        if(r == 2) {
+            sjis_dec1[i] = out[0] | (out[1] << 8);
+        }
+        else if(r == 0 && i >= 0x80) {
+            sjis_dec1[i] = SJIS_LEAD;
+
+            for(j = 0; j < 256; ++j) {
+                in[1] = (uint8_t)j;
+
+                if(probe(dec, in, 2, out) == 2)
+                    sjis_dec2[((i & 0x7F) << 8) | j] = out[0] | (out[1] << 8);
+            }
+        }
+        else {
+            sjis_dec1[i] = SJIS_BAD;
+        }
+    }
+
+    for(i = 1; i < 65536; ++i) {
+        if(i >= 0xD800 && i < 0xE000)
+            continue;
+
+        in[0] = (uint8_t)i;
+        in[1] = (uint8_t)(i >> 8);
+        r = probe(enc, in, 2, out);
+
+        if(r == 1)
+            sjis_enc[i] = out[0];
+        else if(r == 2)
+            sjis_enc[i] = (out[0] << 8) | out[1];
+    }
+
+    iconv_close(enc);
+    iconv_close(dec);
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2020 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <stddef.h>
+
+#ifndef ICONV_CONST
+#define ICONV_CONST
+#endif
+
+/* Conversions between the text encodings that the various clients use. These
+   don't keep any state between calls, so any number of threads can use the
+   same one at once. The Shift-JIS tables are built once by tconv_init() and
+   only read after that. */
+struct transcoder;
+typedef const struct transcoder *tconv_t;
+
+extern const tconv_t ic_utf8_to_utf16;
+extern const tconv_t ic_utf16_to_utf8;
+extern const tconv_t ic_8859_to_utf8;
+extern const tconv_t ic_utf8_to_8859;
+extern const tconv_t ic_sjis_to_utf8;
+extern const tconv_t ic_utf8_to_sjis;
+extern const tconv_t ic_utf16_to_ascii;
+extern const tconv_t ic_8859_to_utf16;
+extern const tconv_t ic_sjis_to_utf16;
+extern const tconv_t ic_utf16_to_8859;
+extern const tconv_t ic_utf16_to_sjis;
+
+/* Works just like iconv(3): converts as much of the input as it can, advancing
+   the pointers and counts as it goes. Returns (size_t)-1 with errno set to
+   E2BIG, EILSEQ or EINVAL if it has to stop short of the end of the input. */
+size_t tconv(tconv_t tc, ICONV_CONST char **inbuf, size_t *inleft,
+             char **outbuf, size_t *outleft);
+
+/* Build the Shift-JIS tables. Call this once before any threads start. */
+int tconv_init(void);
+
+#endif /* !TRANSCODE_H */
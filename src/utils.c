@@ -19,10 +19,10 @@
 #include <stdarg.h>
 #include <time.h>
 #include <sys/time.h>
-#include <iconv.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
@@ -34,20 +34,14 @@
 
 #ifdef HAVE_LIBMINI18N
 mini18n_t langs[CLIENT_LANG_COUNT];
-#endif
 
-/* iconv contexts that are used throughout the code */
-iconv_t ic_utf8_to_utf16;
-iconv_t ic_utf16_to_utf8;
-iconv_t ic_8859_to_utf8;
-iconv_t ic_utf8_to_8859;
-iconv_t ic_sjis_to_utf8;
-iconv_t ic_utf8_to_sjis;
-iconv_t ic_utf16_to_ascii;
-iconv_t ic_8859_to_utf16;
-iconv_t ic_sjis_to_utf16;
-iconv_t ic_utf16_to_8859;
-iconv_t ic_utf16_to_sjis;
+/* Strings that have been given a number by l10n_register(). Slot 0 is never
+   used, so that a call site that hasn't looked its string up yet has 0. */
+const char *l10n_strs[CLIENT_LANG_COUNT][L10N_MAX_STRINGS];
+static const char *l10n_keys[L10N_MAX_STRINGS];
+static int l10n_count = 1;
+static pthread_mutex_t l10n_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 void print_packet(const unsigned char *pkt, int len) {
     /* With NULL, this will simply grab the current output for the debug log.
@@ -210,7 +204,7 @@ int pc_bug_report(ship_client_t *c, pc_simple_mail_pkt *pkt) {
     out = 0x90;
     inptr = pkt->stuff;
     outptr = text;
-    iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+    tconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
 
     text[0x90] = '\0';
 
@@ -260,7 +254,7 @@ int bb_bug_report(ship_client_t *c, bb_simple_mail_pkt *pkt) {
     out = 0x200;
     inptr = (ICONV_CONST char *)pkt->message;
     outptr = text;
-    iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+    tconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
 
     text[0x1FF] = '\0';
 
@@ -291,12 +285,11 @@ int pkt_log_start(ship_client_t *i) {
     struct timeval rawtime;
     struct tm cooked;
     char str[128];
-    FILE *fp;
-    time_t now;
+    pktcap_t *cap;
 
     pthread_mutex_lock(&i->mutex);
 
-    if(i->logfile) {
+    if(i->capture) {
         pthread_mutex_unlock(&i->mutex);
         return -1;
     }
@@ -309,32 +302,26 @@ int pkt_log_start(ship_client_t *i) {
 
     /* Figure out the name of the file we'll be writing to */
     if(i->guildcard) {
-        sprintf(str, "logs/%u.%02u.%02u.%02u.%02u.%02u.%03u-%d",
+        sprintf(str, "logs/%u.%02u.%02u.%02u.%02u.%02u.%03u-%d.cap",
                 cooked.tm_year + 1900, cooked.tm_mon + 1, cooked.tm_mday,
                 cooked.tm_hour, cooked.tm_min, cooked.tm_sec,
                 (unsigned int)(rawtime.tv_usec / 1000), i->guildcard);
     }
     else {
-        sprintf(str, "logs/%u.%02u.%02u.%02u.%02u.%02u.%03u",
+        sprintf(str, "logs/%u.%02u.%02u.%02u.%02u.%02u.%03u.cap",
                 cooked.tm_year + 1900, cooked.tm_mon + 1, cooked.tm_mday,
                 cooked.tm_hour, cooked.tm_min, cooked.tm_sec,
                 (unsigned int)(rawtime.tv_usec / 1000));
     }
 
-    fp = fopen(str, "wt");
-
-    if(!fp) {
+    /* The capture gets written out in the background. Use --dump-capture to
+       read it back. */
+    if(!(cap = pktcap_open(str, i->guildcard, i->version))) {
         pthread_mutex_unlock(&i->mutex);
         return -2;
     }
 
-    /* Write a nice header to the log */
-    now = time(NULL);
-    ctime_r(&now, str);
-    str[strlen(str) - 1] = 0;
-
-    fprintf(fp, "[%s] Packet log started\n", str);
-    i->logfile = fp;
+    i->capture = cap;
 
     /* We're done, so clean up */
     pthread_mutex_unlock(&i->mutex);
@@ -343,24 +330,15 @@ int pkt_log_start(ship_client_t *i) {
 
 /* Stop logging the specified client's packets */
 int pkt_log_stop(ship_client_t *i) {
-    time_t now;
-    char str[64];
-
     pthread_mutex_lock(&i->mutex);
 
-    if(!i->logfile) {
+    if(!i->capture) {
         pthread_mutex_unlock(&i->mutex);
         return -1;
     }
 
-    /* Write a nice footer to the log */
-    now = time(NULL);
-    ctime_r(&now, str);
-    str[strlen(str) - 1] = 0;
-
-    fprintf(i->logfile, "[%s] Packet log ended\n", str);
-    fclose(i->logfile);
-    i->logfile = NULL;
+    pktcap_close(i->capture, PKTCAP_STOP, i->guildcard, i->version);
+    i->capture = NULL;
 
     /* We're done, so clean up */
     pthread_mutex_unlock(&i->mutex);
@@ -460,7 +438,7 @@ int team_log_write(lobby_t *l, uint32_t msg_type, const char *fmt, ...) {
     return rv;
 }
 
-char *istrncpy(iconv_t ic, char *outs, const char *ins, int out_len) {
+char *istrncpy(tconv_t ic, char *outs, const char *ins, int out_len) {
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
@@ -472,7 +450,7 @@ char *istrncpy(iconv_t ic, char *outs, const char *ins, int out_len) {
     out = out_len;
     inptr = (ICONV_CONST char *)ins;
     outptr = outs;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    tconv(ic, &inptr, &in, &outptr, &out);
 
     return outptr;
 }
@@ -484,7 +462,7 @@ size_t strlen16(const uint16_t *str) {
     return sz;
 }
 
-char *istrncpy16(iconv_t ic, char *outs, const uint16_t *ins, int out_len) {
+char *istrncpy16(tconv_t ic, char *outs, const uint16_t *ins, int out_len) {
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
@@ -496,7 +474,7 @@ char *istrncpy16(iconv_t ic, char *outs, const uint16_t *ins, int out_len) {
     out = out_len;
     inptr = (ICONV_CONST char *)ins;
     outptr = outs;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    tconv(ic, &inptr, &in, &outptr, &out);
 
     return outptr;
 }
@@ -841,111 +819,27 @@ uint64_t get_ms_time(void) {
     return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
-int init_iconv(void) {
-    ic_utf8_to_utf16 = iconv_open("UTF-16LE", "UTF-8");
-
-    if(ic_utf8_to_utf16 == (iconv_t)-1) {
-        return -1;
-    }
-
-    ic_utf16_to_utf8 = iconv_open("UTF-8", "UTF-16LE");
-
-    if(ic_utf16_to_utf8 == (iconv_t)-1) {
-        goto out1;
-    }
-
-    ic_8859_to_utf8 = iconv_open("UTF-8", "ISO-8859-1");
-
-    if(ic_8859_to_utf8 == (iconv_t)-1) {
-        goto out2;
-    }
-
-    ic_utf8_to_8859 = iconv_open("ISO-8859-1", "UTF-8");
-
-    if(ic_utf8_to_8859 == (iconv_t)-1) {
-        goto out3;
-    }
-
-    ic_sjis_to_utf8 = iconv_open("UTF-8", "SHIFT_JIS");
-
-    if(ic_sjis_to_utf8 == (iconv_t)-1) {
-        goto out4;
-    }
-
-    ic_utf8_to_sjis = iconv_open("SHIFT_JIS", "UTF-8");
-
-    if(ic_utf8_to_sjis == (iconv_t)-1) {
-        goto out5;
-    }
-
-    ic_utf16_to_ascii = iconv_open("ASCII", "UTF-16LE");
-
-    if(ic_utf16_to_ascii == (iconv_t)-1) {
-        goto out6;
-    }
-
-    ic_utf16_to_sjis = iconv_open("SHIFT_JIS", "UTF-16LE");
-
-    if(ic_utf16_to_sjis == (iconv_t)-1) {
-        goto out7;
-    }
-
-    ic_utf16_to_8859 = iconv_open("ISO-8859-1", "UTF-16LE");
-
-    if(ic_utf16_to_8859 == (iconv_t)-1) {
-        goto out8;
-    }
-
-    ic_sjis_to_utf16 = iconv_open("UTF-16LE", "SHIFT_JIS");
-
-    if(ic_sjis_to_utf16 == (iconv_t)-1) {
-        goto out9;
-    }
-
-    ic_8859_to_utf16 = iconv_open("UTF-16LE", "ISO-8859-1");
-
-    if(ic_8859_to_utf16 == (iconv_t)-1) {
-        goto out10;
+#ifdef HAVE_LIBMINI18N
+/* Fill in the translations of every string that already has a number from the
+   tables that are loaded now, or point them all back at the English string if
+   there aren't any. The numbers themselves are kept in the call sites, so they
+   have to stay the same across a /restart. */
+static void l10n_refill(int english) {
+    const char *str;
+    int id, i;
+
+    pthread_mutex_lock(&l10n_lock);
+
+    for(id = 1; id < l10n_count; ++id) {
+        for(i = 0; i < CLIENT_LANG_COUNT; ++i) {
+            str = english ? NULL : mini18n_get(langs[i], l10n_keys[id]);
+            l10n_strs[i][id] = str ? str : l10n_keys[id];
+        }
     }
 
-    return 0;
-
-out10:
-    iconv_close(ic_sjis_to_utf16);
-out9:
-    iconv_close(ic_utf16_to_8859);
-out8:
-    iconv_close(ic_utf16_to_sjis);
-out7:
-    iconv_close(ic_utf16_to_ascii);
-out6:
-    iconv_close(ic_utf8_to_sjis);
-out5:
-    iconv_close(ic_sjis_to_utf8);
-out4:
-    iconv_close(ic_utf8_to_8859);
-out3:
-    iconv_close(ic_8859_to_utf8);
-out2:
-    iconv_close(ic_utf16_to_utf8);
-out1:
-    iconv_close(ic_utf8_to_utf16);
-    return -1;
-}
-
-void cleanup_iconv(void) {
-    iconv_close(ic_8859_to_utf16);
-    iconv_close(ic_sjis_to_utf16);
-    iconv_close(ic_utf16_to_8859);
-    iconv_close(ic_utf16_to_sjis);
-    iconv_close(ic_utf16_to_ascii);
-    iconv_close(ic_utf8_to_sjis);
-    iconv_close(ic_sjis_to_utf8);
-    iconv_close(ic_utf8_to_8859);
-    iconv_close(ic_8859_to_utf8);
-    iconv_close(ic_utf16_to_utf8);
-    iconv_close(ic_utf8_to_utf16);
+    pthread_mutex_unlock(&l10n_lock);
 }
+#endif
 
 /* Initialize mini18n support. */
 void init_i18n(void) {
@@ -970,17 +864,69 @@ void init_i18n(void) {
 			}
 		}
 	}
+
+	/* Pick up the new tables for anything looked up before a /restart. */
+	l10n_refill(0);
 #endif
 }
 
+#ifdef HAVE_LIBMINI18N
+/* Give a string a number, filling in its translations for all the languages,
+   or falling back to the English string where there isn't one. The same string
+   from different call sites gets the same number. Returns -1 if the table is
+   full, in which case the caller just goes to mini18n every time. */
+int l10n_register(int *idp, const char *s) {
+    const char *str;
+    int id, i;
+
+    pthread_mutex_lock(&l10n_lock);
+
+    /* Did another thread get here first? */
+    if((id = *idp))
+        goto out;
+
+    for(id = 1; id < l10n_count; ++id) {
+        if(!strcmp(l10n_keys[id], s))
+            goto done;
+    }
+
+    if(l10n_count == L10N_MAX_STRINGS) {
+        debug(DBG_WARN, "Too many translated strings, raise "
+              "L10N_MAX_STRINGS\n");
+        id = -1;
+        goto done;
+    }
+
+    id = l10n_count;
+    l10n_keys[id] = s;
+
+    for(i = 0; i < CLIENT_LANG_COUNT; ++i) {
+        str = mini18n_get(langs[i], s);
+        l10n_strs[i][id] = str ? str : s;
+    }
+
+    ++l10n_count;
+
+done:
+    __atomic_store_n(idp, id, __ATOMIC_RELEASE);
+out:
+    pthread_mutex_unlock(&l10n_lock);
+    return id;
+}
+#endif
+
 /* Clean up when we're done with mini18n. */
 void cleanup_i18n(void) {
 #ifdef HAVE_LIBMINI18N
 	int i;
 
+	/* Stop pointing into the tables before they go away. */
+	l10n_refill(1);
+
 	/* Just call the destroy function... It'll handle null values fine. */
 	for(i = 0; i < CLIENT_LANG_COUNT; ++i) {
 		mini18n_destroy(langs[i]);
+		langs[i] = NULL;
 	}
 #endif
 }
@@ -20,9 +20,9 @@
 
 #include <stdio.h>
 #include <stdint.h>
-#include <iconv.h>
 
 #include "ship_packets.h"
+#include "transcode.h"
 
 #define BUG_REPORT_GC   1
 
@@ -40,9 +40,9 @@ int team_log_start(lobby_t *i);
 int team_log_stop(lobby_t *i);
 int team_log_write(lobby_t *l, uint32_t msg_type, const char *fmt, ...);
 
-char *istrncpy(iconv_t ic, char *outs, const char *ins, int out_len);
+char *istrncpy(tconv_t ic, char *outs, const char *ins, int out_len);
 size_t strlen16(const uint16_t *str);
-char *istrncpy16(iconv_t ic, char *outs, const uint16_t *ins, int out_len);
+char *istrncpy16(tconv_t ic, char *outs, const uint16_t *ins, int out_len);
 uint16_t *strcpy16(uint16_t *d, const uint16_t *s);
 uint16_t *strcat16(uint16_t *d, const uint16_t *s);
 
@@ -61,31 +61,45 @@ int send_player_list(ship_client_t *c, const char *params);
 
 uint64_t get_ms_time(void);
 
-/* Various iconv contexts that we'll use... */
-extern iconv_t ic_utf8_to_utf16;
-extern iconv_t ic_utf16_to_utf8;
-extern iconv_t ic_8859_to_utf8;
-extern iconv_t ic_utf8_to_8859;
-extern iconv_t ic_sjis_to_utf8;
-extern iconv_t ic_utf8_to_sjis;
-extern iconv_t ic_utf16_to_ascii;
-extern iconv_t ic_8859_to_utf16;
-extern iconv_t ic_sjis_to_utf16;
-extern iconv_t ic_utf16_to_8859;
-extern iconv_t ic_utf16_to_sjis;
-
-int init_iconv(void);
-void cleanup_iconv(void);
-
 /* Internationalization support */
 #ifdef HAVE_LIBMINI18N
 #include <mini18n-multi.h>
 #include "clients.h"
 
 extern mini18n_t langs[CLIENT_LANG_COUNT];
-#define __(c, s) mini18n_get(langs[c->language_code], s)
+
+/* Every string that gets translated is given a number the first time it's
+   looked up, and its translations for all the languages are put in the table
+   under that number. After that, each call site just remembers its number, so
+   translating a string is an array lookup. The "" makes sure that the string
+   is a literal, since the number goes with the call site and not the string.
+   Anything else has to go through __v() instead. */
+#define L10N_MAX_STRINGS    1024
+
+extern const char *l10n_strs[CLIENT_LANG_COUNT][L10N_MAX_STRINGS];
+
+int l10n_register(int *id, const char *s);
+
+static inline const char *l10n_get(int lang, int *idp, const char *s) {
+    int id = __atomic_load_n(idp, __ATOMIC_ACQUIRE);
+
+    if(!id)
+        id = l10n_register(idp, s);
+
+    if(id < 0)
+        return mini18n_get(langs[lang], s);
+
+    return l10n_strs[lang][id];
+}
+
+#define __(c, s) ({ \
+    static int l10n_id_; \
+    l10n_get((c)->language_code, &l10n_id_, "" s); \
+})
+#define __v(c, s) mini18n_get(langs[(c)->language_code], s)
 #else
 #define __(c, s) s
+#define __v(c, s) s
 #endif
 
 void init_i18n(void);